@@ -0,0 +1,206 @@
+#!/bin/sh
+#
+# Benchmarks for grootfs, comparing each scenario on the native
+# filesystem, in a groot wrapped directory and, when installed, under
+# fakeroot and pseudo.
+#
+# Each timed run prints one JSON object per line on stdout:
+#   {"scenario":"stat-walk","mode":"groot","run":1,"seconds":0.123456}
+#
+# Usage: bench/run.sh [-n RUNS] [-s SCENARIO] [-m MODE] [-d WORKDIR]
+#
+# SCENARIO and MODE can be given multiple times, and default to all
+# of them. Sizes can be changed with the environment variables below.
+
+set -eu
+
+GROOT=${GROOT:-./groot}
+BENCH_FILES=${BENCH_FILES:-10000}        # files in the stat walk and storm trees
+BENCH_DIR_ENTRIES=${BENCH_DIR_ENTRIES:-50000}
+BENCH_SYMLINKS=${BENCH_SYMLINKS:-10000}
+BENCH_IO_MB=${BENCH_IO_MB:-256}
+BENCH_STARTUPS=${BENCH_STARTUPS:-50}
+
+ALL_SCENARIOS="stat-walk install-storm seq-write seq-read readdir-huge symlink-walk startup"
+ALL_MODES="native groot fakeroot pseudo"
+
+runs=3
+scenarios=""
+modes=""
+workdir=""
+
+usage () {
+    sed -n '2,/^$/s/^# \{0,1\}//p' "$0" >&2
+    exit 1
+}
+
+while getopts "n:s:m:d:h" opt; do
+    case $opt in
+        n) runs=$OPTARG ;;
+        s) scenarios="$scenarios $OPTARG" ;;
+        m) modes="$modes $OPTARG" ;;
+        d) workdir=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+scenarios=${scenarios:-$ALL_SCENARIOS}
+modes=${modes:-$ALL_MODES}
+
+log () {
+    echo "bench: $*" >&2
+}
+
+have_mode () {
+    case $1 in
+        native) true ;;
+        groot) [ -x "$GROOT" ] ;;
+        fakeroot) command -v fakeroot > /dev/null 2>&1 ;;
+        pseudo) command -v pseudo > /dev/null 2>&1 ;;
+        *) false ;;
+    esac
+}
+
+if [ -z "$workdir" ]; then
+    workdir=$(mktemp -d "${TMPDIR:-/tmp}/grootfs-bench.XXXXXX")
+    trap 'rm -rf "$workdir"' EXIT
+fi
+if [ -x "$GROOT" ]; then
+    GROOT=$(cd "$(dirname "$GROOT")" && pwd)/$(basename "$GROOT")
+fi
+
+now_ns () {
+    date +%s%N
+}
+
+# Run a shell snippet in dir under the given mode, printing the time
+# the snippet itself took, so that the groot startup is not included.
+time_in_mode () {
+    mode=$1
+    dir=$2
+    script="cd '$dir' && s=\$(date +%s%N) && { $3 ; } > /dev/null && e=\$(date +%s%N) && echo \$((e - s))"
+
+    case $mode in
+        native) sh -c "$script" ;;
+        groot) "$GROOT" -w "$dir" sh -c "$script" ;;
+        fakeroot) fakeroot -- sh -c "$script" ;;
+        pseudo) PSEUDO_PREFIX=${PSEUDO_PREFIX:-/usr} pseudo sh -c "$script" ;;
+    esac
+}
+
+# Like time_in_mode(), but for things that are not timed from inside
+run_in_mode () {
+    mode=$1
+    dir=$2
+    shift 2
+
+    case $mode in
+        native) (cd "$dir" && "$@") ;;
+        groot) (cd "$dir" && "$GROOT" -w "$dir" "$@") ;;
+        fakeroot) (cd "$dir" && fakeroot -- "$@") ;;
+        pseudo) (cd "$dir" && PSEUDO_PREFIX=${PSEUDO_PREFIX:-/usr} pseudo "$@") ;;
+    esac
+}
+
+emit () {
+    awk -v s="$1" -v m="$2" -v r="$3" -v ns="$4" \
+        'BEGIN { printf "{\"scenario\":\"%s\",\"mode\":\"%s\",\"run\":%d,\"seconds\":%.6f}\n", s, m, r, ns / 1e9 }'
+}
+
+# Creates $BENCH_FILES files spread over 100 directories
+make_tree () {
+    mkdir -p "$1"
+    (cd "$1" &&
+         seq 1 100 | sed 's/^/d/' | xargs mkdir -p &&
+         seq 1 "$BENCH_FILES" | awk '{ print "d" ($1 % 100 + 1) "/f" $1 }' | xargs touch)
+}
+
+# The chown target, which has to be our own ids without root emulation
+owner_for () {
+    if [ "$1" = native ]; then
+        echo "$(id -u):$(id -g)"
+    else
+        echo "0:0"
+    fi
+}
+
+# Prepare the data for a scenario in a fresh dir, outside of any
+# wrapping, and print the snippet to time
+prepare () {
+    scenario=$1
+    mode=$2
+    dir=$3
+
+    case $scenario in
+        stat-walk)
+            make_tree "$dir/tree"
+            echo "ls -lR tree"
+            ;;
+        install-storm)
+            owner=$(owner_for "$mode")
+            echo "seq 1 100 | sed 's/^/d/' | xargs mkdir -p &&
+                  seq 1 $BENCH_FILES | awk '{ print \"d\" (\$1 % 100 + 1) \"/f\" \$1 }' > list &&
+                  xargs touch < list && xargs chmod 640 < list && xargs chown $owner < list"
+            ;;
+        seq-write)
+            echo "dd if=/dev/zero of=big bs=1M count=$BENCH_IO_MB conv=fsync 2> /dev/null"
+            ;;
+        seq-read)
+            dd if=/dev/zero of="$dir/big" bs=1M count="$BENCH_IO_MB" 2> /dev/null
+            echo "dd if=big of=/dev/null bs=1M 2> /dev/null"
+            ;;
+        readdir-huge)
+            mkdir -p "$dir/huge"
+            (cd "$dir/huge" && seq 1 "$BENCH_DIR_ENTRIES" | sed 's/^/entry-/' | xargs touch)
+            echo "ls -f huge | wc -l"
+            ;;
+        symlink-walk)
+            mkdir -p "$dir/links"
+            (cd "$dir/links" && seq 1 "$BENCH_SYMLINKS" | awk '{ print "target-" $1, "link-" $1 }' | xargs -n 2 ln -s)
+            echo "ls -lR links"
+            ;;
+        startup)
+            ;;
+        *)
+            log "unknown scenario $scenario"
+            exit 1
+            ;;
+    esac
+}
+
+for scenario in $scenarios; do
+    for mode in $modes; do
+        if ! have_mode "$mode"; then
+            log "skipping $mode, not available"
+            continue
+        fi
+
+        run=1
+        while [ "$run" -le "$runs" ]; do
+            dir="$workdir/$scenario-$mode-$run"
+            rm -rf "$dir"
+            mkdir -p "$dir"
+            dir=$(cd "$dir" && pwd)
+
+            if [ "$scenario" = startup ]; then
+                # The whole invocation, $BENCH_STARTUPS times in a row
+                s=$(now_ns)
+                i=0
+                while [ "$i" -lt "$BENCH_STARTUPS" ]; do
+                    run_in_mode "$mode" "$dir" true
+                    i=$((i + 1))
+                done
+                e=$(now_ns)
+                ns=$(( (e - s) / BENCH_STARTUPS ))
+            else
+                script=$(prepare "$scenario" "$mode" "$dir")
+                sync
+                ns=$(time_in_mode "$mode" "$dir" "$script")
+            fi
+
+            emit "$scenario" "$mode" "$run" "$ns"
+            rm -rf "$dir"
+            run=$((run + 1))
+        done
+    done
+done
@@ -41,6 +41,8 @@ usage (const char *progname)
            "general options:\n"
            "   -o opt,[opt...]     mount options\n"
            "   -h  --help          print help\n"
+           "\n"
+           GROOTFS_OPTIONS_HELP
            "\n", progname);
 }
 
@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "groot-idmap.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define SUBUID_FILE "/etc/subuid"
+#define SUBGID_FILE "/etc/subgid"
+
+#define CACHE_MAGIC "GRIDMAP1"
+#define CACHE_MAX_USERNAME 256
+#define CACHE_MAX_RANGES 4096
+
+/* Identifies a version of a file, all zeros if it doesn't exist */
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} CacheFileId;
+
+/* Followed by the uid and then the gid ranges */
+typedef struct {
+  char magic[8];
+  uint32_t uid;
+  uint32_t gid;
+  CacheFileId subuid;
+  CacheFileId subgid;
+  char username[CACHE_MAX_USERNAME];
+  uint32_t n_uid_ranges;
+  uint32_t n_gid_ranges;
+  uint32_t checksum;  /* Of the header with this 0, and the ranges */
+  uint32_t padding;
+} CacheHeader;
+
+void
+groot_idmap_clear (GRootIdMap *map)
+{
+  free (map->ranges);
+  map->ranges = NULL;
+  map->n_ranges = 0;
+}
+
+/* The highest id mapped in the namespace */
+long
+groot_idmap_max_id (const GRootIdMap *map)
+{
+  const GRootIdRange *last = &map->ranges[map->n_ranges - 1];
+
+  return (long) last->first + last->count - 1;
+}
+
+static void
+idmap_add (GRootIdMap *map,
+           uint32_t base,
+           uint32_t count)
+{
+  uint32_t first = map->n_ranges ? groot_idmap_max_id (map) + 1 : 0;
+
+  map->ranges = xrealloc (map->ranges, (map->n_ranges + 1) * sizeof (GRootIdRange));
+  map->ranges[map->n_ranges].first = first;
+  map->ranges[map->n_ranges].base = base;
+  map->ranges[map->n_ranges].count = count;
+  map->n_ranges++;
+}
+
+void
+groot_idmap_parse (GRootIdMap *map,
+                   const char *username,
+                   const char *filename,
+                   uint32_t own_id)
+{
+  autofree char *content = NULL;
+
+  idmap_add (map, own_id, 1);
+
+  if (username)
+    content = load_file_at (AT_FDCWD, filename);
+  if (content)
+    {
+      char *line_iterator = content;
+
+      while (line_iterator)
+        {
+          char *line = strsep (&line_iterator, "\n");
+          char *end, *colon;
+
+          if (!has_prefix (line, username) || line[strlen (username)] != ':')
+            continue;
+          line = line + strlen (username) + 1;
+
+          colon = strchr (line, ':');
+          if (colon == NULL)
+            {
+              report ("WARNING: Invalid format of %s", filename);
+              continue; // Error parsing int
+            }
+          *colon = 0;
+
+          long subid_base = strtol (line, &end, 10);
+          if (*end != 0 || subid_base < 0 || subid_base > UINT32_MAX)
+            {
+              report ("WARNING: Invalid format of %s", filename);
+              continue; // Error parsing int
+            }
+
+          long subid_count = strtol (colon + 1, &end, 10);
+          if (*end != 0 || subid_count <= 0 ||
+              subid_count > UINT32_MAX - 1 - groot_idmap_max_id (map))
+            {
+              report ("WARNING: Invalid format of %s", filename);
+              continue; // Error parsing int
+            }
+
+          idmap_add (map, subid_base, subid_count);
+        }
+    }
+
+  if (map->n_ranges == 1)
+    report ("Warning: no defined ids for user %s in %s, limited user/group support",
+            username ? username : "(unknown)", filename);
+}
+
+/* The mapping in the format of /proc/PID/uid_map */
+char *
+groot_idmap_format (const GRootIdMap *map)
+{
+  autofree char *res = xstrdup ("");
+
+  for (uint32_t i = 0; i < map->n_ranges; i++)
+    {
+      char *next = xasprintf ("%s%u %u %u\n", res, map->ranges[i].first,
+                              map->ranges[i].base, map->ranges[i].count);
+      free (res);
+      res = next;
+    }
+
+  return steal_pointer (&res);
+}
+
+static char *
+get_cache_path (uid_t uid)
+{
+  const char *runtime_dir = getenv ("XDG_RUNTIME_DIR");
+
+  if (runtime_dir != NULL && *runtime_dir != 0)
+    return xasprintf ("%s/groot-idmap", runtime_dir);
+
+  return xasprintf ("/tmp/groot-idmap-%d", (int) uid);
+}
+
+static void
+get_file_id (const char *filename,
+             CacheFileId *id)
+{
+  struct stat st;
+
+  memset (id, 0, sizeof (*id));
+  if (stat (filename, &st) != 0)
+    return;
+
+  id->dev = st.st_dev;
+  id->ino = st.st_ino;
+  id->size = st.st_size;
+  id->mtime_sec = st.st_mtim.tv_sec;
+  id->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+static uint32_t
+checksum_update (uint32_t h,
+                 const void *data,
+                 size_t size)
+{
+  const unsigned char *p = data;
+
+  for (size_t i = 0; i < size; i++)
+    h = (h ^ p[i]) * 16777619U;
+
+  return h;
+}
+
+static uint32_t
+cache_checksum (const CacheHeader *header,
+                const GRootIdRange *ranges,
+                size_t n_ranges)
+{
+  CacheHeader h = *header;
+
+  h.checksum = 0;
+  return checksum_update (checksum_update (2166136261U, &h, sizeof (h)),
+                          ranges, n_ranges * sizeof (GRootIdRange));
+}
+
+/* The ranges must follow on from each other, starting with our id */
+static bool
+valid_ranges (const GRootIdRange *ranges,
+              uint32_t n_ranges,
+              uint32_t own_id)
+{
+  uint64_t next = 1;
+
+  if (n_ranges == 0 || ranges[0].first != 0 || ranges[0].base != own_id ||
+      ranges[0].count != 1)
+    return FALSE;
+
+  for (uint32_t i = 1; i < n_ranges; i++)
+    {
+      if (ranges[i].first != next || ranges[i].count == 0)
+        return FALSE;
+      next += ranges[i].count;
+    }
+
+  return next <= UINT32_MAX;
+}
+
+static void
+set_map (GRootIdMap *map,
+         const GRootIdRange *ranges,
+         uint32_t n_ranges)
+{
+  map->n_ranges = n_ranges;
+  map->ranges = xmalloc (n_ranges * sizeof (GRootIdRange));
+  memcpy (map->ranges, ranges, n_ranges * sizeof (GRootIdRange));
+}
+
+/* Loads the maps cached for uid and gid, if the cache is still valid.
+ * If username is NULL the cached one is returned in username_out, else
+ * it must match. */
+bool
+groot_idmap_load_cached (uid_t uid,
+                         gid_t gid,
+                         const char *username,
+                         char **username_out,
+                         GRootIdMap *uid_map,
+                         GRootIdMap *gid_map)
+{
+  autofree char *path = get_cache_path (uid);
+  autofree char *data = NULL;
+  autofd int fd = -1;
+  const CacheHeader *header;
+  const GRootIdRange *ranges;
+  CacheFileId subuid, subgid;
+  struct stat st;
+  size_t size;
+
+  fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1)
+    return FALSE;
+
+  /* Don't trust a file someone else could have written */
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode) ||
+      st.st_uid != uid || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+    return FALSE;
+
+  data = load_file_data (fd, &size);
+  if (data == NULL || size < sizeof (CacheHeader))
+    return FALSE;
+
+  header = (const CacheHeader *) data;
+  ranges = (const GRootIdRange *) (data + sizeof (CacheHeader));
+  if (memcmp (header->magic, CACHE_MAGIC, sizeof (header->magic)) != 0 ||
+      header->uid != uid || header->gid != gid ||
+      header->n_uid_ranges > CACHE_MAX_RANGES || header->n_gid_ranges > CACHE_MAX_RANGES ||
+      size != sizeof (CacheHeader) + (header->n_uid_ranges + header->n_gid_ranges) * sizeof (GRootIdRange) ||
+      header->checksum != cache_checksum (header, ranges, header->n_uid_ranges + header->n_gid_ranges) ||
+      memchr (header->username, 0, sizeof (header->username)) == NULL ||
+      (username != NULL && strcmp (username, header->username) != 0))
+    return FALSE;
+
+  get_file_id (SUBUID_FILE, &subuid);
+  get_file_id (SUBGID_FILE, &subgid);
+  if (memcmp (&subuid, &header->subuid, sizeof (subuid)) != 0 ||
+      memcmp (&subgid, &header->subgid, sizeof (subgid)) != 0)
+    return FALSE;
+
+  if (!valid_ranges (ranges, header->n_uid_ranges, uid) ||
+      !valid_ranges (ranges + header->n_uid_ranges, header->n_gid_ranges, gid))
+    return FALSE;
+
+  set_map (uid_map, ranges, header->n_uid_ranges);
+  set_map (gid_map, ranges + header->n_uid_ranges, header->n_gid_ranges);
+  if (username_out && username == NULL)
+    *username_out = xstrdup (header->username);
+
+  return TRUE;
+}
+
+/* Failing to write the cache is not an error, the next start will
+ * just have to parse the files again */
+void
+groot_idmap_save_cached (uid_t uid,
+                         gid_t gid,
+                         const char *username,
+                         const GRootIdMap *uid_map,
+                         const GRootIdMap *gid_map)
+{
+  autofree char *path = get_cache_path (uid);
+  autofree char *tmp_path = xasprintf ("%s.XXXXXX", path);
+  autofree GRootIdRange *ranges = NULL;
+  uint32_t n_ranges = uid_map->n_ranges + gid_map->n_ranges;
+  CacheHeader header;
+  autofd int fd = -1;
+  size_t size;
+
+  if (username == NULL || strlen (username) >= CACHE_MAX_USERNAME)
+    return;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, CACHE_MAGIC, sizeof (header.magic));
+  header.uid = uid;
+  header.gid = gid;
+  get_file_id (SUBUID_FILE, &header.subuid);
+  get_file_id (SUBGID_FILE, &header.subgid);
+  strcpy (header.username, username);
+  header.n_uid_ranges = uid_map->n_ranges;
+  header.n_gid_ranges = gid_map->n_ranges;
+
+  ranges = xmalloc (n_ranges * sizeof (GRootIdRange));
+  memcpy (ranges, uid_map->ranges, uid_map->n_ranges * sizeof (GRootIdRange));
+  memcpy (ranges + uid_map->n_ranges, gid_map->ranges, gid_map->n_ranges * sizeof (GRootIdRange));
+  header.checksum = cache_checksum (&header, ranges, n_ranges);
+
+  fd = mkostemp (tmp_path, O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  size = n_ranges * sizeof (GRootIdRange);
+  if (write (fd, &header, sizeof (header)) != sizeof (header) ||
+      write (fd, ranges, size) != size ||
+      rename (tmp_path, path) != 0)
+    unlink (tmp_path);
+}
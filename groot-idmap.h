@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* The uid and gid mappings of the groot namespace: our own id mapped
+ * to 0, followed by the subordinate ids of the user from /etc/subuid
+ * or /etc/subgid mapped from 1 on.
+ *
+ * Parsing those files can be slow on hosts where they are large, so
+ * the result is cached in a binary file in the runtime dir, together
+ * with the username so we can also skip getpwuid(). The cache is
+ * only used while the files it was made from are unchanged, going by
+ * their mtime, size and inode.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct {
+  uint32_t first;  /* The first id in the namespace */
+  uint32_t base;   /* What it maps to outside */
+  uint32_t count;
+} GRootIdRange;
+
+typedef struct {
+  uint32_t n_ranges;
+  GRootIdRange *ranges; /* The first is always 0 to our own id */
+} GRootIdMap;
+
+void  groot_idmap_clear   (GRootIdMap *map);
+long  groot_idmap_max_id  (const GRootIdMap *map);
+void  groot_idmap_parse   (GRootIdMap *map,
+                           const char *username,
+                           const char *filename,
+                           uint32_t    own_id);
+char *groot_idmap_format  (const GRootIdMap *map);
+bool  groot_idmap_load_cached (uid_t        uid,
+                               gid_t        gid,
+                               const char  *username,
+                               char       **username_out,
+                               GRootIdMap  *uid_map,
+                               GRootIdMap  *gid_map);
+void  groot_idmap_save_cached (uid_t        uid,
+                               gid_t        gid,
+                               const char  *username,
+                               const GRootIdMap *uid_map,
+                               const GRootIdMap *gid_map);
+
+DEFINE_AUTO_CLEANUP_CLEAR_FUNC(GRootIdMap, groot_idmap_clear);
@@ -0,0 +1,1031 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Exports and imports the fake metadata of a wrapped directory by
+ * reading and writing the backing files directly, rather than going
+ * through a grootfs mount. The directory must not be in use by
+ * grootfs at the same time.
+ *
+ * The manifest format is mtree(5), with the ownership and permissions
+ * as they appear in groot, so an exported tree can be archived at
+ * native speed with e.g. "bsdtar -cf rootfs.tar @rootfs.mtree". Import
+ * accepts the keywords it needs from any mtree file, including ones
+ * written by bsdtar, and ignores the rest.
+ */
+
+#include "utils.h"
+#include "grootfs-data.h"
+#include "grootfs-store.h"
+#include "grootfs-xattr.h"
+#include "groot-walk.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+DEFINE_AUTOPTR_CLEANUP_FUNC(DIR, closedir)
+
+typedef struct {
+  char *buf;
+  size_t size;
+  FILE *out;
+} ExportBuffer;
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  bool is_symlink;
+} CheckKey;
+
+typedef struct {
+  CheckKey *keys;
+  size_t n_keys;
+  size_t size;
+} CheckKeys;
+
+typedef struct {
+  int basefd;
+  GRootFSStore *store; /* NULL if there is no .groot.metadata */
+  int n_threads;
+  bool fix;
+  atomic_int n_errors;
+
+  ExportBuffer *export_bufs; /* Per worker */
+  CheckKeys *check_keys;     /* Per worker */
+} GRootMeta;
+
+static void
+usage (const char *progname)
+{
+  fprintf (stdout,
+           "usage: %s [options] export DIR [MANIFEST]\n"
+           "       %s [options] import DIR [MANIFEST]\n"
+           "       %s [options] check DIR\n"
+           "\n"
+           "Export or import the fake ownership and permissions of the files\n"
+           "in a groot wrapped DIR as an mtree manifest, which defaults to\n"
+           "stdout and stdin respectively, or check the metadata of DIR for\n"
+           "data of files that no longer exist. DIR must not be in use by groot.\n"
+           "\n"
+           "options:\n"
+           "   -j N                use N threads (default: the number of cpus)\n"
+           "   -f                  remove the stale data found by check\n"
+           "   -h  --help          print help\n",
+           progname, progname, progname);
+}
+
+static void
+open_store (GRootMeta *meta,
+            bool create)
+{
+  if (!create && faccessat (meta->basefd, GROOTFS_STORE_FILE, F_OK, AT_SYMLINK_NOFOLLOW) != 0)
+    return;
+
+  meta->store = grootfs_store_open (meta->basefd);
+  if (meta->store == NULL)
+    {
+      if (errno == EWOULDBLOCK)
+        die ("%s is locked, is the directory in use by groot?", GROOTFS_STORE_FILE);
+      die_with_error ("Can't open %s", GROOTFS_STORE_FILE);
+    }
+}
+
+/* Reads the fake data the same way grootfs does: from the store if
+ * it has the file, else from the symlink data file or the xattr.
+ * File is a name in dirfd, or NULL for dirfd itself. */
+static int
+read_fake_data (GRootMeta *meta,
+                int dirfd,
+                const char *file,
+                const struct stat *st,
+                GRootFSData *data)
+{
+  char datafile[SYMLINK_DATAFILE_SIZE];
+  ssize_t res;
+
+  if (meta->store != NULL &&
+      grootfs_store_lookup (meta->store, st->st_dev, st->st_ino, data))
+    return 0;
+
+  if (S_ISLNK (st->st_mode))
+    res = groot_getxattrat (meta->basefd, get_symlink_datafile (st->st_dev, st->st_ino, datafile),
+                            GROOT_DATA_XATTR, data, sizeof (GRootFSData));
+  else
+    res = groot_getxattrat (dirfd, file, GROOT_DATA_XATTR, data, sizeof (GRootFSData));
+
+  if (res == -1 && (errno == ENOENT || errno == ENODATA || errno == ENOTSUP))
+    {
+      GRootFSData zero = {0};
+      *data = zero;
+      return 0;
+    }
+
+  if (res != sizeof (GRootFSData))
+    return -1;
+
+  fake_data_ntohl (data, data);
+  return 0;
+}
+
+static int
+write_fake_data (GRootMeta *meta,
+                 int dirfd,
+                 const char *file,
+                 const struct stat *st,
+                 const GRootFSData *data)
+{
+  char datafile[SYMLINK_DATAFILE_SIZE];
+  GRootFSData data2;
+  bool in_store;
+
+  in_store = meta->store != NULL &&
+    (S_ISLNK (st->st_mode) || grootfs_store_lookup (meta->store, st->st_dev, st->st_ino, &data2));
+  if (in_store)
+    return grootfs_store_set (meta->store, st->st_dev, st->st_ino, data);
+
+  fake_data_htonl (data, &data2);
+
+  if (S_ISLNK (st->st_mode))
+    {
+      autofd int fd = -1;
+
+      get_symlink_datafile (st->st_dev, st->st_ino, datafile);
+      fd = openat (meta->basefd, datafile, O_CREAT | O_WRONLY | O_CLOEXEC, 0666);
+      if (fd == -1)
+        return -1;
+
+      return groot_setxattrat (meta->basefd, datafile, GROOT_DATA_XATTR, &data2, sizeof (data2), 0);
+    }
+
+  return groot_setxattrat (dirfd, file, GROOT_DATA_XATTR, &data2, sizeof (data2), 0);
+}
+
+static const char *
+mtree_type (mode_t mode)
+{
+  switch (mode & S_IFMT)
+    {
+    case S_IFREG:
+      return "file";
+    case S_IFDIR:
+      return "dir";
+    case S_IFLNK:
+      return "link";
+    case S_IFCHR:
+      return "char";
+    case S_IFBLK:
+      return "block";
+    case S_IFIFO:
+      return "fifo";
+    case S_IFSOCK:
+      return "socket";
+    default:
+      return NULL;
+    }
+}
+
+/* mtree paths use \ooo escapes for anything that would end the path
+ * or start a comment */
+static void
+print_escaped (FILE *out,
+               const char *str)
+{
+  for (const unsigned char *p = (const unsigned char *) str; *p != 0; p++)
+    {
+      if (*p <= ' ' || *p >= 127 || *p == '\\' || *p == '#')
+        fprintf (out, "\\%03o", *p);
+      else
+        putc (*p, out);
+    }
+}
+
+static void
+export_entry (GRootMeta *meta,
+              FILE *out,
+              int dirfd,
+              const char *name,
+              const char *path,
+              const struct stat *st)
+{
+  const char *type = mtree_type (st->st_mode);
+  GRootFSData data;
+  uint32_t uid, gid, mode;
+
+  if (type == NULL)
+    return;
+
+  if (read_fake_data (meta, dirfd, name, st, &data) != 0)
+    {
+      report ("Can't read the metadata of %s: %s", path, strerror (errno));
+      meta->n_errors++;
+      return;
+    }
+
+  /* As seen in groot, where the user is root */
+  uid = (data.flags & GROOTFS_FLAGS_UID_SET) ? data.uid : 0;
+  gid = (data.flags & GROOTFS_FLAGS_GID_SET) ? data.gid : 0;
+  mode = (data.flags & GROOTFS_FLAGS_MODE_SET) ? data.mode : st->st_mode;
+
+  print_escaped (out, path);
+  fprintf (out, " type=%s uid=%u gid=%u mode=%04o time=%ld.%09ld",
+           type, uid, gid, mode & ST_MODE_PERM_MASK,
+           (long) st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+
+  if (S_ISLNK (st->st_mode))
+    {
+      char target[PATH_MAX + 1];
+      ssize_t len = readlinkat (dirfd, name, target, sizeof (target) - 1);
+
+      if (len >= 0)
+        {
+          target[len] = 0;
+          fputs (" link=", out);
+          print_escaped (out, target);
+        }
+    }
+
+  putc ('\n', out);
+}
+
+static void
+export_walk_cb (const GRootWalkEntry *entry,
+                void *user_data)
+{
+  GRootMeta *meta = user_data;
+
+  export_entry (meta, meta->export_bufs[entry->worker].out,
+                entry->dirfd, entry->name, entry->path, &entry->st);
+}
+
+static int
+compare_lines (const void *a,
+               const void *b)
+{
+  return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+/* The workers each write to their own buffer, and the lines are then
+ * sorted, which gives the same output for every run and puts dirs
+ * before their contents */
+static void
+export_tree (GRootMeta *meta,
+             FILE *out)
+{
+  autofree char **lines = NULL;
+  size_t n_lines = 0, lines_size = 0;
+
+  meta->export_bufs = xcalloc (meta->n_threads * sizeof (ExportBuffer));
+  for (int i = 0; i < meta->n_threads; i++)
+    {
+      meta->export_bufs[i].out = open_memstream (&meta->export_bufs[i].buf, &meta->export_bufs[i].size);
+      if (meta->export_bufs[i].out == NULL)
+        die_oom ();
+    }
+
+  meta->n_errors += groot_walk (meta->basefd, meta->n_threads, export_walk_cb, meta);
+
+  for (int i = 0; i < meta->n_threads; i++)
+    {
+      ExportBuffer *b = &meta->export_bufs[i];
+      char *line, *end;
+
+      if (fclose (b->out) != 0)
+        die_oom ();
+
+      for (line = b->buf; *line != 0; line = end + 1)
+        {
+          end = strchr (line, '\n');
+          *end = 0;
+
+          if (n_lines == lines_size)
+            {
+              lines_size = lines_size ? lines_size * 2 : 1024;
+              lines = xrealloc (lines, lines_size * sizeof (char *));
+            }
+          lines[n_lines++] = line;
+        }
+    }
+
+  qsort (lines, n_lines, sizeof (char *), compare_lines);
+
+  fputs ("#mtree\n", out);
+  for (size_t i = 0; i < n_lines; i++)
+    {
+      fputs (lines[i], out);
+      putc ('\n', out);
+    }
+
+  for (int i = 0; i < meta->n_threads; i++)
+    free (meta->export_bufs[i].buf);
+  free (meta->export_bufs);
+}
+
+typedef struct {
+  bool has_uid;
+  bool has_gid;
+  bool has_mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t mode;
+  mode_t type; /* S_IFMT bits, 0 if not given */
+} MtreeKeys;
+
+/* Decodes \ooo and \c escapes in place */
+static void
+unescape (char *str)
+{
+  char *dst = str;
+
+  for (char *src = str; *src != 0; src++)
+    {
+      if (*src == '\\' &&
+          src[1] >= '0' && src[1] <= '3' &&
+          src[2] >= '0' && src[2] <= '7' &&
+          src[3] >= '0' && src[3] <= '7')
+        {
+          *dst++ = ((src[1] - '0') << 6) | ((src[2] - '0') << 3) | (src[3] - '0');
+          src += 3;
+        }
+      else if (*src == '\\' && src[1] != 0)
+        *dst++ = *++src;
+      else
+        *dst++ = *src;
+    }
+  *dst = 0;
+}
+
+static mode_t
+parse_mtree_type (const char *value)
+{
+  static const struct {
+    const char *name;
+    mode_t type;
+  } types[] = {
+    { "file", S_IFREG },
+    { "dir", S_IFDIR },
+    { "link", S_IFLNK },
+    { "char", S_IFCHR },
+    { "block", S_IFBLK },
+    { "fifo", S_IFIFO },
+    { "socket", S_IFSOCK },
+  };
+
+  for (size_t i = 0; i < N_ELEMENTS (types); i++)
+    if (strcmp (value, types[i].name) == 0)
+      return types[i].type;
+
+  return 0;
+}
+
+static int
+parse_number (const char *value,
+              int base,
+              uint32_t *out)
+{
+  char *end;
+  unsigned long n;
+
+  errno = 0;
+  n = strtoul (value, &end, base);
+  if (*value == 0 || *end != 0 || errno != 0 || n > UINT32_MAX)
+    return -1;
+
+  *out = n;
+  return 0;
+}
+
+/* Applies the keywords of an entry, or of a /set line, to keys. For
+ * /unset unset is TRUE and only the names matter. */
+static int
+parse_keywords (char *saveptr,
+                MtreeKeys *keys,
+                bool unset)
+{
+  char *word;
+
+  while ((word = strtok_r (NULL, " \t", &saveptr)) != NULL)
+    {
+      char *value = strchr (word, '=');
+      int res = 0;
+
+      if (value != NULL)
+        *value++ = 0;
+      else if (!unset)
+        continue; /* Flag keywords like "nochange" */
+
+      if (strcmp (word, "uid") == 0)
+        {
+          keys->has_uid = !unset;
+          if (!unset)
+            res = parse_number (value, 10, &keys->uid);
+        }
+      else if (strcmp (word, "gid") == 0)
+        {
+          keys->has_gid = !unset;
+          if (!unset)
+            res = parse_number (value, 10, &keys->gid);
+        }
+      else if (strcmp (word, "mode") == 0)
+        {
+          keys->has_mode = !unset;
+          if (!unset)
+            res = parse_number (value, 8, &keys->mode);
+        }
+      else if (strcmp (word, "type") == 0)
+        {
+          keys->type = unset ? 0 : parse_mtree_type (value);
+          if (!unset && keys->type == 0)
+            res = -1;
+        }
+      else if (strcmp (word, "all") == 0 && unset)
+        {
+          MtreeKeys none = { 0 };
+          *keys = none;
+        }
+
+      if (res != 0)
+        return -1;
+    }
+
+  return 0;
+}
+
+static bool
+has_dotdot (const char *path)
+{
+  const char *p = path;
+
+  while (p != NULL)
+    {
+      if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == 0))
+        return TRUE;
+      p = strchr (p, '/');
+      if (p != NULL)
+        p++;
+    }
+
+  return FALSE;
+}
+
+/* Opens the directory path relative to basefd one component at a
+ * time, so that symlinks in it, which in a rootfs may well be
+ * absolute, can't lead outside the tree. Those fail with ENOTDIR. */
+static int
+open_dir_beneath (int basefd,
+                  const char *path)
+{
+  autofree char *copy = xstrdup (path);
+  autofd int fd = dup (basefd);
+  char *component, *next;
+
+  if (fd == -1)
+    return -1;
+
+  for (component = copy; component != NULL; component = next)
+    {
+      int child_fd;
+
+      next = strchr (component, '/');
+      if (next != NULL)
+        *next++ = 0;
+
+      if (*component == 0 || strcmp (component, ".") == 0)
+        continue;
+
+      child_fd = openat (fd, component, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (child_fd == -1)
+        return -1;
+
+      close (fd);
+      fd = child_fd;
+    }
+
+  return steal_fd (&fd);
+}
+
+/* Path is relative to the directory */
+static void
+import_entry (GRootMeta *meta,
+              const char *path,
+              const MtreeKeys *keys)
+{
+  autofree char *parent_path = xstrdup (path);
+  char *name = strrchr (parent_path, '/');
+  autofd int parent_fd = -1;
+  const char *file = NULL;
+  GRootFSData data;
+  struct stat st;
+
+  if (has_dotdot (path))
+    {
+      report ("Ignoring %s outside the directory", path);
+      meta->n_errors++;
+      return;
+    }
+
+  if (name != NULL)
+    {
+      *name++ = 0;
+      file = name;
+      parent_fd = open_dir_beneath (meta->basefd, parent_path);
+    }
+  else
+    {
+      file = path;
+      parent_fd = dup (meta->basefd);
+    }
+
+  if (*file == 0 || strcmp (file, ".") == 0)
+    file = NULL; /* The dir itself, or a trailing slash */
+
+  if (parent_fd == -1 ||
+      fstatat (parent_fd, file ? file : "", &st, AT_SYMLINK_NOFOLLOW | (file ? 0 : AT_EMPTY_PATH)) == -1)
+    {
+      report ("Can't find %s: %s", path, strerror (errno));
+      meta->n_errors++;
+      return;
+    }
+
+  if (keys->type != 0 && keys->type != (st.st_mode & S_IFMT))
+    {
+      report ("%s is not of type %s", path, mtree_type (keys->type));
+      meta->n_errors++;
+      return;
+    }
+
+  if (!keys->has_uid && !keys->has_gid && !keys->has_mode)
+    return;
+
+  if (read_fake_data (meta, parent_fd, file, &st, &data) != 0)
+    {
+      report ("Can't read the metadata of %s: %s", path, strerror (errno));
+      meta->n_errors++;
+      return;
+    }
+
+  if (keys->has_uid)
+    {
+      data.uid = keys->uid;
+      data.flags |= GROOTFS_FLAGS_UID_SET;
+    }
+
+  if (keys->has_gid)
+    {
+      data.gid = keys->gid;
+      data.flags |= GROOTFS_FLAGS_GID_SET;
+    }
+
+  if (keys->has_mode)
+    {
+      data.mode = keys->mode & ST_MODE_PERM_MASK;
+      data.flags |= GROOTFS_FLAGS_MODE_SET;
+
+      /* Like a chmod in grootfs, so that e.g. execute works */
+      if (!S_ISLNK (st.st_mode))
+        {
+          mode_t real_mode = get_real_mode (S_ISDIR (st.st_mode), (keys->mode & S_IXUSR) != 0);
+          char scratch_buf[64];
+          auto(Arena) scratch = ARENA_INIT (scratch_buf);
+          const char *proc_path = file ? arena_printf (&scratch, "/proc/self/fd/%d/%s", parent_fd, file)
+                                       : arena_printf (&scratch, "/proc/self/fd/%d", parent_fd);
+
+          if (chmod (proc_path, real_mode) == -1)
+            {
+              report ("Can't chmod %s: %s", path, strerror (errno));
+              meta->n_errors++;
+            }
+        }
+    }
+
+  if (write_fake_data (meta, parent_fd, file, &st, &data) != 0)
+    {
+      report ("Can't write the metadata of %s: %s", path, strerror (errno));
+      meta->n_errors++;
+    }
+}
+
+/* Reads a line, joining lines that end with a backslash */
+static char *
+read_mtree_line (FILE *in,
+                 char **buf,
+                 size_t *buf_size)
+{
+  size_t len = 0;
+
+  for (;;)
+    {
+      autofree char *line = NULL;
+      size_t line_size = 0;
+      ssize_t n = getline (&line, &line_size, in);
+
+      if (n < 0)
+        return len > 0 ? *buf : NULL;
+
+      while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+        line[--n] = 0;
+
+      if (len + n + 1 > *buf_size)
+        {
+          *buf_size = (len + n + 1) * 2;
+          *buf = xrealloc (*buf, *buf_size);
+        }
+      memcpy (*buf + len, line, n + 1);
+      len += n;
+
+      if (len == 0 || (*buf)[len - 1] != '\\')
+        return *buf;
+
+      (*buf)[--len] = ' ';
+    }
+}
+
+typedef struct {
+  char *path;
+  MtreeKeys keys;
+} ImportEntry;
+
+typedef struct {
+  GRootMeta *meta;
+  ImportEntry *entries;
+  size_t n_entries;
+  atomic_size_t next;
+} ImportJob;
+
+static void *
+import_worker (void *data)
+{
+  ImportJob *job = data;
+  size_t i;
+
+  while ((i = atomic_fetch_add (&job->next, 1)) < job->n_entries)
+    import_entry (job->meta, job->entries[i].path, &job->entries[i].keys);
+
+  return NULL;
+}
+
+/* The manifest is parsed first, as /set and the hierarchical form
+ * make entries depend on the preceding lines, and then the entries
+ * are applied in parallel. Each path is expected only once. */
+static void
+import_tree (GRootMeta *meta,
+             FILE *in)
+{
+  autofree char *buf = NULL;
+  autofree char *cwd = NULL;
+  autofree pthread_t *threads = NULL;
+  size_t buf_size = 0;
+  MtreeKeys defaults = { 0 };
+  ImportJob job = { meta };
+  size_t entries_size = 0;
+  int n_started;
+  char *line;
+
+  while ((line = read_mtree_line (in, &buf, &buf_size)) != NULL)
+    {
+      autofree char *path = NULL;
+      const char *relative;
+      MtreeKeys keys;
+      char *saveptr;
+      char *first;
+
+      line += strspn (line, " \t");
+      if (*line == 0 || *line == '#')
+        continue;
+
+      first = strtok_r (line, " \t", &saveptr);
+
+      if (strcmp (first, "/set") == 0 || strcmp (first, "/unset") == 0)
+        {
+          if (parse_keywords (saveptr, &defaults, first[1] == 'u') != 0)
+            die ("Invalid mtree line: %s", line);
+          continue;
+        }
+
+      /* The classic hierarchical form, where entries without a
+       * slash are relative to the last dir, and ".." goes up */
+      if (strcmp (first, "..") == 0)
+        {
+          char *slash = cwd ? strrchr (cwd, '/') : NULL;
+          if (slash)
+            *slash = 0;
+          else
+            {
+              free (cwd);
+              cwd = NULL;
+            }
+          continue;
+        }
+
+      keys = defaults;
+      if (parse_keywords (saveptr, &keys, FALSE) != 0)
+        die ("Invalid mtree entry for %s", first);
+
+      unescape (first);
+      if (strchr (first, '/') == NULL && cwd != NULL)
+        path = xasprintf ("%s/%s", cwd, first);
+      else
+        path = xstrdup (first);
+
+      if (strchr (first, '/') == NULL && keys.type == S_IFDIR)
+        {
+          free (cwd);
+          cwd = xstrdup (path);
+        }
+
+      relative = path;
+      while (*relative == '/')
+        relative++;
+      if (has_prefix (relative, "./"))
+        relative += 2;
+
+      if (job.n_entries == entries_size)
+        {
+          entries_size = entries_size ? entries_size * 2 : 1024;
+          job.entries = xrealloc (job.entries, entries_size * sizeof (ImportEntry));
+        }
+      job.entries[job.n_entries].path = xstrdup (*relative ? relative : ".");
+      job.entries[job.n_entries].keys = keys;
+      job.n_entries++;
+    }
+
+  if (ferror (in))
+    die_with_error ("Reading manifest");
+
+  threads = xcalloc (meta->n_threads * sizeof (pthread_t));
+  for (n_started = 1; n_started < meta->n_threads; n_started++)
+    if (pthread_create (&threads[n_started], NULL, import_worker, &job) != 0)
+      break;
+  import_worker (&job);
+  for (int i = 1; i < n_started; i++)
+    pthread_join (threads[i], NULL);
+
+  for (size_t i = 0; i < job.n_entries; i++)
+    free (job.entries[i].path);
+  free (job.entries);
+}
+
+static void
+check_walk_cb (const GRootWalkEntry *entry,
+               void *user_data)
+{
+  GRootMeta *meta = user_data;
+  CheckKeys *k = &meta->check_keys[entry->worker];
+
+  if (k->n_keys == k->size)
+    {
+      k->size = k->size ? k->size * 2 : 1024;
+      k->keys = xrealloc (k->keys, k->size * sizeof (CheckKey));
+    }
+
+  k->keys[k->n_keys].dev = entry->st.st_dev;
+  k->keys[k->n_keys].ino = entry->st.st_ino;
+  k->keys[k->n_keys].is_symlink = S_ISLNK (entry->st.st_mode);
+  k->n_keys++;
+}
+
+static int
+compare_keys (const void *a,
+              const void *b)
+{
+  const CheckKey *ka = a, *kb = b;
+
+  if (ka->dev != kb->dev)
+    return ka->dev < kb->dev ? -1 : 1;
+  if (ka->ino != kb->ino)
+    return ka->ino < kb->ino ? -1 : 1;
+  return 0;
+}
+
+static const CheckKey *
+find_key (const CheckKeys *all,
+          dev_t dev,
+          ino_t ino)
+{
+  CheckKey key = { dev, ino };
+
+  return bsearch (&key, all->keys, all->n_keys, sizeof (CheckKey), compare_keys);
+}
+
+/* Looks for symlink data files and store entries that don't belong to
+ * any file in the tree. These are left behind when files are removed
+ * while the dir is not wrapped, and would otherwise be picked up by a
+ * new file that happens to get the same inode number. */
+static void
+check_tree (GRootMeta *meta)
+{
+  autoptr(DIR) dir = NULL;
+  autofree GRootFSStoreKey *store_keys = NULL;
+  CheckKeys all = { NULL };
+  struct dirent *dent;
+  size_t n_stale = 0;
+  int fd;
+
+  meta->check_keys = xcalloc (meta->n_threads * sizeof (CheckKeys));
+  meta->n_errors += groot_walk (meta->basefd, meta->n_threads, check_walk_cb, meta);
+
+  for (int i = 0; i < meta->n_threads; i++)
+    {
+      CheckKeys *k = &meta->check_keys[i];
+
+      all.keys = xrealloc (all.keys, (all.n_keys + k->n_keys + 1) * sizeof (CheckKey));
+      memcpy (all.keys + all.n_keys, k->keys, k->n_keys * sizeof (CheckKey));
+      all.n_keys += k->n_keys;
+      free (k->keys);
+    }
+  free (meta->check_keys);
+
+  qsort (all.keys, all.n_keys, sizeof (CheckKey), compare_keys);
+
+  fd = openat (meta->basefd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1 || (dir = fdopendir (fd)) == NULL)
+    die_with_error ("Can't read directory");
+
+  while ((dent = readdir (dir)) != NULL)
+    {
+      const CheckKey *key;
+      unsigned long dev, ino;
+
+      if (sscanf (dent->d_name, ".groot.symlink.%lx_%lx", &dev, &ino) != 2)
+        continue;
+
+      key = find_key (&all, dev, ino);
+      if (key != NULL && key->is_symlink)
+        continue;
+
+      n_stale++;
+      printf ("stale symlink data file %s\n", dent->d_name);
+      if (meta->fix && unlinkat (meta->basefd, dent->d_name, 0) != 0)
+        {
+          report ("Can't remove %s: %s", dent->d_name, strerror (errno));
+          meta->n_errors++;
+        }
+    }
+
+  if (meta->store != NULL)
+    {
+      size_t n = grootfs_store_list (meta->store, &store_keys);
+
+      for (size_t i = 0; i < n; i++)
+        {
+          if (find_key (&all, store_keys[i].dev, store_keys[i].ino) != NULL)
+            continue;
+
+          n_stale++;
+          printf ("stale %s entry %lx_%lx\n", GROOTFS_STORE_FILE,
+                  (unsigned long) store_keys[i].dev, (unsigned long) store_keys[i].ino);
+          if (meta->fix &&
+              grootfs_store_remove (meta->store, store_keys[i].dev, store_keys[i].ino) != 0)
+            {
+              report ("Can't update %s", GROOTFS_STORE_FILE);
+              meta->n_errors++;
+            }
+        }
+    }
+
+  free (all.keys);
+
+  if (n_stale > 0 && !meta->fix)
+    {
+      report ("Found %zu stale entries, run with -f to remove them", n_stale);
+      meta->n_errors++;
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const struct option long_options[] = {
+    { "help", no_argument, NULL, 'h' },
+    { NULL }
+  };
+  GRootMeta meta = { -1 };
+  const char *command;
+  const char *manifest = "-";
+  FILE *file = NULL;
+  uint32_t n_threads;
+  int opt;
+
+  meta.n_threads = sysconf (_SC_NPROCESSORS_ONLN);
+
+  while ((opt = getopt_long (argc, argv, "+hfj:", long_options, NULL)) != -1)
+    {
+      switch (opt)
+        {
+        case 'h':
+          usage (argv[0]);
+          return EXIT_SUCCESS;
+
+        case 'f':
+          meta.fix = TRUE;
+          break;
+
+        case 'j':
+          if (parse_number (optarg, 10, &n_threads) != 0 || n_threads < 1 || n_threads > 1024)
+            {
+              fprintf (stderr, "Invalid number of threads %s\n", optarg);
+              return EXIT_FAILURE;
+            }
+          meta.n_threads = n_threads;
+          break;
+
+        default:
+          fprintf (stderr, "see `%s -h' for usage\n", argv[0]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  if (meta.n_threads < 1)
+    meta.n_threads = 1;
+
+  if (argc - optind < 2 || argc - optind > 3)
+    {
+      fprintf (stderr, "see `%s -h' for usage\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  command = argv[optind];
+  if (argc - optind == 3)
+    manifest = argv[optind + 2];
+
+  if (strcmp (command, "export") != 0 &&
+      strcmp (command, "import") != 0 &&
+      (strcmp (command, "check") != 0 || argc - optind == 3))
+    {
+      fprintf (stderr, "Unknown command %s\n", command);
+      fprintf (stderr, "see `%s -h' for usage\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  meta.basefd = openat (AT_FDCWD, argv[optind + 1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (meta.basefd == -1)
+    die_with_error ("Can't open %s", argv[optind + 1]);
+
+  if (strcmp (command, "export") == 0)
+    {
+      file = strcmp (manifest, "-") == 0 ? stdout : fopen (manifest, "we");
+      if (file == NULL)
+        die_with_error ("Can't open %s", manifest);
+
+      open_store (&meta, FALSE);
+      export_tree (&meta, file);
+
+      if (fflush (file) != 0 || (file != stdout && fclose (file) != 0))
+        die_with_error ("Can't write %s", manifest);
+    }
+  else if (strcmp (command, "import") == 0)
+    {
+      file = strcmp (manifest, "-") == 0 ? stdin : fopen (manifest, "re");
+      if (file == NULL)
+        die_with_error ("Can't open %s", manifest);
+
+      /* Symlinks go in the store, like grootfs does by default */
+      open_store (&meta, TRUE);
+      import_tree (&meta, file);
+
+      if (file != stdin)
+        fclose (file);
+    }
+  else
+    {
+      open_store (&meta, FALSE);
+      check_tree (&meta);
+    }
+
+  if (meta.store != NULL)
+    {
+      grootfs_store_maybe_compact (meta.store);
+      if (grootfs_store_sync (meta.store) != 0)
+        die_with_error ("Can't write %s", GROOTFS_STORE_FILE);
+      grootfs_store_close (meta.store);
+    }
+
+  if (meta.n_errors > 0)
+    {
+      report ("%d errors", meta.n_errors);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -20,8 +20,9 @@
  */
 
 #include "utils.h"
-#include "groot-ns.h"
 #include "grootfs.h"
+#include "groot-ns.h"
+#include "groot-idmap.h"
 
 #include <pwd.h>
 #include <sched.h>
@@ -31,37 +32,84 @@
 #include <sys/eventfd.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
+
+static bool timing_enabled = FALSE;
+static struct timespec timing_start;
+static struct timespec timing_last;
+
+void
+groot_enable_timing (void)
+{
+  timing_enabled = TRUE;
+}
+
+static double
+timespec_ms (const struct timespec *a,
+             const struct timespec *b)
+{
+  return (a->tv_sec - b->tv_sec) * 1000.0 + (a->tv_nsec - b->tv_nsec) / 1000000.0;
+}
 
+/* Report the time spent since the previous step if timing is enabled */
 static void
-launch_newidmap (const char *bin, char **idmapping, pid_t main_pid)
+timing_step (const char *what)
+{
+  struct timespec now;
+
+  if (!timing_enabled)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  if (what != NULL)
+    report ("timing: %-24s %8.3f ms (total %8.3f ms)", what,
+            timespec_ms (&now, &timing_last), timespec_ms (&now, &timing_start));
+  else
+    timing_start = now;
+  timing_last = now;
+}
+
+static pid_t
+spawn_newidmap (const char *bin, const GRootIdMap *idmap, pid_t main_pid)
 {
   pid_t pid = fork ();
-  int status;
 
   if (pid == -1)
     die_with_error ("fork failed");
 
   if (pid == 0)
     {
-      autofree char **argv = xmalloc ((2 + strv_length (idmapping) + 1) * sizeof (char *));
-      autofree char *pid_str = xasprintf ("%ld", main_pid);
+      autofree char **argv = xmalloc ((2 + 3 * idmap->n_ranges + 1) * sizeof (char *));
       size_t i;
 
       argv[0] = (char *)bin;
-      argv[1] = pid_str;
-      for (i = 0; idmapping[i] != NULL; i++)
-        argv[2+i] = idmapping[i];
-      argv[2+i] = NULL;
+      argv[1] = xasprintf ("%ld", (long) main_pid);
+      for (i = 0; i < idmap->n_ranges; i++)
+        {
+          argv[2 + 3 * i] = xasprintf ("%u", idmap->ranges[i].first);
+          argv[2 + 3 * i + 1] = xasprintf ("%u", idmap->ranges[i].base);
+          argv[2 + 3 * i + 2] = xasprintf ("%u", idmap->ranges[i].count);
+        }
+      argv[2 + 3 * i] = NULL;
 
       if (execvp (argv[0], argv) == -1)
-        die_with_error ("exec newuidmap failed");
+        die_with_error ("exec %s failed", bin);
 
       exit (1);
     }
 
+  return pid;
+}
+
+static void
+wait_newidmap (const char *bin, pid_t pid)
+{
+  int status;
+
   if (waitpid (pid, &status, 0) == -1)
     die_with_error ("waitpid failed");
 
@@ -112,10 +160,29 @@ double_fork_with_socket (int *socket_out)
   return 0; /* In grandchild */
 }
 
+/* A mapping of just our own uid is one we may write ourselves, as
+ * the owner of the namespace. That isn't so for gids without denying
+ * setgroups() in the namespace, so those always go via newgidmap. */
+static void
+write_own_uid_map (pid_t main_pid,
+                   const GRootIdMap *idmap)
+{
+  autofree char *path = xasprintf ("/proc/%ld/uid_map", (long) main_pid);
+  autofree char *content = groot_idmap_format (idmap);
+  autofd int fd = -1;
+
+  fd = open (path, O_WRONLY | O_CLOEXEC);
+  if (fd == -1)
+    die_with_error ("open %s", path);
+
+  if (write (fd, content, strlen (content)) != (ssize_t) strlen (content))
+    die_with_error ("write %s", path);
+}
+
 static int
 start_uidmap_process (pid_t main_pid,
-                      char **uid_mapping,
-                      char **gid_mapping)
+                      const GRootIdMap *uid_map,
+                      const GRootIdMap *gid_map)
 {
   char buf = 'x';
   ssize_t s;
@@ -131,8 +198,15 @@ start_uidmap_process (pid_t main_pid,
 
   if (s == 1)
     {
-      launch_newidmap ("newuidmap", uid_mapping, main_pid);
-      launch_newidmap ("newgidmap", gid_mapping, main_pid);
+      /* The two maps are independent, so set them up in parallel */
+      pid_t gidmap_pid = spawn_newidmap ("newgidmap", gid_map, main_pid);
+
+      if (uid_map->n_ranges == 1)
+        write_own_uid_map (main_pid, uid_map);
+      else
+        wait_newidmap ("newuidmap", spawn_newidmap ("newuidmap", uid_map, main_pid));
+
+      wait_newidmap ("newgidmap", gidmap_pid);
 
       /* Signal that uidmaps are set up */
       if (write (status_socket, &buf, 1) < 0)
@@ -142,15 +216,60 @@ start_uidmap_process (pid_t main_pid,
   exit (0);
 }
 
+/* Identifies a user namespace, as "dev:ino" of its nsfs file */
+static char *
+get_userns_id (void)
+{
+  struct stat st;
+
+  if (stat ("/proc/self/ns/user", &st) != 0)
+    return NULL;
+
+  return xasprintf ("%lx:%lx", (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+}
+
+/* Record the namespace we are in, so that processes started in it
+ * that load libgroot.so can tell that they need no setup */
+static void
+mark_groot_ns (void)
+{
+  autofree char *id = get_userns_id ();
+
+  if (id != NULL)
+    setenv ("GROOT_USERNS", id, 1);
+}
+
+/* Whether we are already in the namespace of a groot session or a
+ * groot parent process */
+bool
+groot_in_ns (void)
+{
+  const char *env_ns = getenv ("GROOT_USERNS");
+  autofree char *id = NULL;
+
+  if (env_ns == NULL)
+    return FALSE;
+
+  id = get_userns_id ();
+  return id != NULL && strcmp (id, env_ns) == 0;
+}
+
+/* Starts the fuse process for the wrapped dirs that can be opened,
+ * setting the others to NULL. The process sets up the filesystems
+ * while we unshare and mount, and then gets sent all the /dev/fuse
+ * fds at once with send_fds(). When it is ready to serve them it
+ * writes a byte to the returned socket. */
 static int
 start_fuse_process (const char **wrapdirs,
                     int num_wrapdirs,
                     long max_uid,
-                    long max_gid)
+                    long max_gid,
+                    const GRootFSOptions *options)
 {
   char buf = 'x';
   int status_socket;
   int *wrapdir_fds;
+  int n_mounts = 0;
 
   wrapdir_fds = xmalloc (sizeof (int) * num_wrapdirs);
   for (int i = 0; i < num_wrapdirs; i++)
@@ -172,23 +291,53 @@ start_fuse_process (const char **wrapdirs,
       for (int i = 0; i < num_wrapdirs; i++)
         if (wrapdir_fds[i] != -1)
           close (wrapdir_fds[i]);
+      free (wrapdir_fds);
       return status_socket;
     }
 
+  /* Only keep the mounts we will get fds for */
   for (int i = 0; i < num_wrapdirs; i++)
     {
-      const char *wrapdir = wrapdirs[i];
-      int wrapdir_fd = wrapdir_fds[i];
-
-      if (wrapdir_fd == -1)
+      if (wrapdir_fds[i] == -1)
         continue;
 
-      int dev_fuse_fd = recv_fd (status_socket);
-      if (dev_fuse_fd == -1)
-        die_with_error ("no /dev/fuse fd recieved");
+      wrapdirs[n_mounts] = wrapdirs[i];
+      wrapdir_fds[n_mounts] = wrapdir_fds[i];
+      n_mounts++;
+    }
+
+  if (n_mounts > 0)
+    {
+      if (options->shared_daemon)
+        {
+          /* Serve them all from one process, which sets up while the
+           * fds are on their way */
+          if (start_grootfs_lowlevel_multi (n_mounts, wrapdir_fds, NULL, wrapdirs,
+                                            max_uid, max_gid, options, status_socket) != 0)
+            die ("start_grootfs_lowlevel");
+        }
+      else
+        {
+          int *dev_fuse_fds = xmalloc (sizeof (int) * n_mounts);
 
-      if (start_grootfs_lowlevel (wrapdir_fd, dev_fuse_fd, wrapdir, max_uid, max_gid) != 0)
-        die ("start_grootfs_lowlevel");
+          if (recv_fds (status_socket, dev_fuse_fds, n_mounts) != 0)
+            die_with_error ("no /dev/fuse fds recieved");
+
+          for (int i = 0; i < n_mounts; i++)
+            {
+              GRootFSOptions mount_options = *options;
+
+              /* Each process needs a control socket and trace of its own */
+              if (options->control_path && n_mounts > 1)
+                mount_options.control_path = xasprintf ("%s.%d", options->control_path, i);
+              if (options->trace_path && n_mounts > 1)
+                mount_options.trace_path = xasprintf ("%s.%d", options->trace_path, i);
+
+              if (start_grootfs_lowlevel (wrapdir_fds[i], dev_fuse_fds[i], wrapdirs[i],
+                                          max_uid, max_gid, &mount_options) != 0)
+                die ("start_grootfs_lowlevel");
+            }
+        }
     }
 
   if (write (status_socket, &buf, 1) == -1)
@@ -227,107 +376,57 @@ keep_caps (void)
     }
 }
 
-static char **
-make_idmap (const char *username, const char *filename, long base_id, long *max_id)
+/* The fd has to be opened in the user namespace doing the mount */
+static int
+open_dev_fuse (void)
 {
-  autofree char *content = NULL;
-  autofreev char **mapping = NULL;
-  size_t mapping_size;
-  long next_id;
-
-  mapping_size = 3;
-  next_id = 1;
-  mapping = xmalloc ((mapping_size + 1) * sizeof (char *));
-  mapping[0] = xstrdup ("0");
-  mapping[1] = xasprintf("%ld", base_id);
-  mapping[2] = xstrdup ("1");
-  mapping[3] = NULL;
-
-  content = load_file_at (AT_FDCWD, filename);
-  if (content)
-    {
-      char *line_iterator = content;
-
-      while (line_iterator)
-        {
-          char *line = strsep (&line_iterator, "\n");
-          char *end, *colon;
-
-          if (!has_prefix (line, username) || line[strlen (username)] != ':')
-            continue;
-          line = line + strlen (username) + 1;
-
-          colon = strchr (line, ':');
-          if (colon == NULL)
-            {
-              report ("WARNING: Invalid format of %s", filename);
-              continue; // Error parsing int
-            }
-          *colon = 0;
-
-          long subid_base = strtol (line, &end, 10);
-          if (*end != 0)
-            {
-              report ("WARNING: Invalid format of %s", filename);
-              continue; // Error parsing int
-            }
-
-          long subid_count = strtol (colon + 1, &end, 10);
-          if (*end != 0)
-            {
-              report ("WARNING: Invalid format of %s", filename);
-              continue; // Error parsing int
-            }
-
-          mapping = xrealloc (mapping, (mapping_size + 3 + 1) * sizeof (char *));
-          mapping[mapping_size++] = xasprintf("%ld", next_id);
-          mapping[mapping_size++] = xasprintf("%ld", subid_base);
-          mapping[mapping_size++] = xasprintf("%ld", subid_count);
-          mapping[mapping_size] = NULL;
-          next_id += subid_count;
-        }
-    }
-
-  if (next_id == 1)
-    report ("Warning: no defined ids for user %s in %s, limited user/group support", username, filename);
-
-  *max_id = next_id - 1;
+  int dev_fuse_fd = open ("/dev/fuse", O_RDWR | O_CLOEXEC);
+  if (dev_fuse_fd == -1)
+    die_with_error ("Failed to open /dev/fuse");
 
-  return steal_pointer (&mapping);
+  return dev_fuse_fd;
 }
 
-
-static int
-mount_fuse_fd_at (const char *mountpoint)
+static void
+mount_fuse_fd_at (int dev_fuse_fd,
+                  const char *mountpoint,
+                  const GRootFSOptions *options)
 {
   autofree char *mountopts = NULL;
-  int dev_fuse_fd;
+  unsigned long flags = MS_NOSUID | MS_NODEV;
   int res;
 
-  dev_fuse_fd = open ("/dev/fuse", O_RDWR);
-  if (dev_fuse_fd == -1)
-    die_with_error ("Failed to open /dev/fuse");
-
   mountopts = xasprintf ("fd=%i,rootmode=%o,user_id=%u,group_id=%u,allow_other",
                          dev_fuse_fd, 0x4000, 0, 0);
 
-  res = mount("fuse-grootfs", mountpoint, "fuse.fuse-grootfs", MS_NOSUID|MS_NODEV, mountopts);
+  /* max_read is enforced by the kernel, not negotiated at init */
+  if (options->max_read)
+    {
+      char *with_max_read = xasprintf ("%s,max_read=%zu", mountopts, options->max_read);
+      free (mountopts);
+      mountopts = with_max_read;
+    }
+
+  if (options->frozen)
+    flags |= MS_RDONLY;
+
+  res = mount("fuse-grootfs", mountpoint, "fuse.fuse-grootfs", flags, mountopts);
   if (res != 0)
     die_with_error ("mount fuse");
-
-  return dev_fuse_fd;
 }
 
 int
-groot_setup_ns (const char **wrapdirs, int num_wrapdirs)
+groot_setup_ns (const char **wrapdirs, int num_wrapdirs, const GRootFSOptions *options)
 {
   autofd int fuse_status_socket = -1;
   autofd int uidmap_status_socket = -1;
+  autofree int *dev_fuse_fds = NULL;
+  int n_dev_fuse_fds = 0;
   ssize_t s;
   struct passwd *passwd;
-  const char *username = NULL;
-  autofreev char **uid_mapping = NULL;
-  autofreev char **gid_mapping = NULL;
+  autofree char *username = NULL;
+  auto(GRootIdMap) uid_map = { 0 };
+  auto(GRootIdMap) gid_map = { 0 };
   uid_t real_uid;
   gid_t real_gid;
   pid_t main_pid;
@@ -335,27 +434,44 @@ groot_setup_ns (const char **wrapdirs, int num_wrapdirs)
   int res;
   char buf = 'x';
 
+  if (getenv ("GROOT_TIMING"))
+    groot_enable_timing ();
+  timing_step (NULL);
+
   real_uid = getuid ();
   real_gid = getgid ();
   main_pid = getpid ();
 
 
-  /* Avoid calling getpwuid() and thus nss, etc in a preload init constructor if possible */
-  username = getenv ("GROOT_USER");
-  if (username == NULL)
+  /* Avoid calling getpwuid() and thus nss, etc in a preload init
+   * constructor if possible, the cache has the username too */
+  if (getenv ("GROOT_USER"))
+    username = xstrdup (getenv ("GROOT_USER"));
+
+  if (!groot_idmap_load_cached (real_uid, real_gid, username, &username, &uid_map, &gid_map))
     {
-      passwd = getpwuid (real_uid);
-      if (passwd != NULL)
-        username = xstrdup (passwd->pw_name);
-    }
+      if (username == NULL)
+        {
+          passwd = getpwuid (real_uid);
+          if (passwd != NULL)
+            username = xstrdup (passwd->pw_name);
+        }
 
-  uid_mapping = make_idmap (username, "/etc/subuid", real_uid, &max_uid);
-  gid_mapping = make_idmap (username, "/etc/subgid", real_gid, &max_gid);
+      groot_idmap_parse (&uid_map, username, "/etc/subuid", real_uid);
+      groot_idmap_parse (&gid_map, username, "/etc/subgid", real_gid);
+      groot_idmap_save_cached (real_uid, real_gid, username, &uid_map, &gid_map);
+    }
+  max_uid = groot_idmap_max_id (&uid_map);
+  max_gid = groot_idmap_max_id (&gid_map);
+  timing_step ("read subuid/subgid");
 
+  /* Start both helper processes first, so they do their setup while
+   * we do ours */
   if (num_wrapdirs > 0)
-    fuse_status_socket = start_fuse_process (wrapdirs, num_wrapdirs, max_uid, max_gid);
+    fuse_status_socket = start_fuse_process (wrapdirs, num_wrapdirs, max_uid, max_gid, options);
 
-  uidmap_status_socket = start_uidmap_process (main_pid, uid_mapping, gid_mapping);
+  uidmap_status_socket = start_uidmap_process (main_pid, &uid_map, &gid_map);
+  timing_step ("start helpers");
 
   /* Never gain any more privs during exec */
   if (prctl (PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
@@ -368,6 +484,13 @@ groot_setup_ns (const char **wrapdirs, int num_wrapdirs)
   s = write (uidmap_status_socket, &buf, 1);
   if (s == -1)
     die ("write to status socket");
+  timing_step ("unshare");
+
+  /* Opening /dev/fuse doesn't need the id mappings, only mounting */
+  dev_fuse_fds = xmalloc (sizeof (int) * (num_wrapdirs + 1));
+  for (int i = 0; i < num_wrapdirs; i++)
+    if (wrapdirs[i] != NULL) /* NULL if we failed to open the dir */
+      dev_fuse_fds[n_dev_fuse_fds++] = open_dev_fuse ();
 
   /* Wait on uidmap process */
   do
@@ -376,37 +499,75 @@ groot_setup_ns (const char **wrapdirs, int num_wrapdirs)
 
   if (s == 0)
     die ("Failed to setup uid/gid mappings");
+  timing_step ("uid/gid mappings");
 
   /* Then set up fuse mounts for the wraps, if needed */
 
-  if (num_wrapdirs > 0)
+  if (n_dev_fuse_fds > 0)
     {
+      int n = 0;
+
       for (int i = 0; i < num_wrapdirs; i++)
         {
-          const char *wrapdir = wrapdirs[i];
-          int dev_fuse_fd;
-
-          if (wrapdir == NULL)
-            continue; // We failed to open the dir, ignore
-
-          dev_fuse_fd = mount_fuse_fd_at (wrapdir);
+          if (wrapdirs[i] != NULL)
+            mount_fuse_fd_at (dev_fuse_fds[n++], wrapdirs[i], options);
+        }
+      timing_step ("mount");
 
-          res = send_fd (fuse_status_socket, dev_fuse_fd);
-          if (res < 0)
-            die_with_error ("send fd");
+      res = send_fds (fuse_status_socket, dev_fuse_fds, n_dev_fuse_fds);
+      if (res < 0)
+        die_with_error ("send fd");
 
-          close (dev_fuse_fd); /* Not used more on this side */
-        }
+      for (int i = 0; i < n_dev_fuse_fds; i++)
+        close (dev_fuse_fds[i]); /* Not used more on this side */
 
-      res = read (fuse_status_socket, &buf, sizeof (buf));
+      do
+        res = read (fuse_status_socket, &buf, sizeof (buf));
+      while (res == -1 && errno == EINTR);
       if (res == -1)
         die_with_error ("read fs_socket");
 
       if (res == 0)
         die ("Fuse setup failed, exiting");
+      timing_step ("wait for fuse");
+    }
+
+  keep_caps ();
+  mark_groot_ns ();
+  timing_step ("done");
+
+  return 0;
+}
+
+/* Join the namespaces set up by groot_setup_ns() in another process,
+ * keeping the current directory if it exists in there */
+int
+groot_join_ns (int userns_fd, int mntns_fd)
+{
+  autofree char *cwd = get_current_dir_name ();
+
+  if (prctl (PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
+    die_with_error ("prctl(PR_SET_NO_NEW_PRIVS) failed");
+
+  /* The user namespace first, which gives us the caps to join the
+   * mount namespace it owns */
+  if (setns (userns_fd, CLONE_NEWUSER) != 0)
+    die_with_error ("setns user namespace");
+
+  if (setns (mntns_fd, CLONE_NEWNS) != 0)
+    die_with_error ("setns mount namespace");
+
+  /* Joining a mount namespace moves us to its root, and the old cwd
+   * would be below any wrap mount anyway */
+  if (cwd == NULL || chdir (cwd) != 0)
+    {
+      report ("Can't change to current directory %s in session, using /", cwd ? cwd : "");
+      if (chdir ("/") != 0)
+        die_with_error ("chdir");
     }
 
   keep_caps ();
+  mark_groot_ns ();
 
   return 0;
 }
@@ -19,5 +19,10 @@
  * Boston, MA 02111-1307, USA.
  */
 
-int groot_setup_ns (const char **wrapdirs,
-                    int          num_wrapdirs);
+int  groot_setup_ns      (const char           **wrapdirs,
+                          int                    num_wrapdirs,
+                          const GRootFSOptions  *options);
+int  groot_join_ns       (int                    userns_fd,
+                          int                    mntns_fd);
+bool groot_in_ns         (void);
+void groot_enable_timing (void);
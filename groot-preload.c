@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include "utils.h"
+#include "grootfs.h"
 #include "groot-ns.h"
+#include "groot-session.h"
 
 /* For some reason the regular unsetenv doesn't seem to work well in an initializer... */
 static void
@@ -26,18 +28,62 @@ __unsetenv (const char *name)
     }
 }
 
+/* GROOT_PROGRAMS is an optional list of program names, separated by
+ * ':', that need groot. Others are left alone, but keep LD_PRELOAD so
+ * that any of those they start still get it. */
+static bool
+program_wants_groot (const char *progname,
+                     const char *programs)
+{
+  const char *basename;
+  size_t len;
+
+  if (programs == NULL)
+    return TRUE;
+
+  if (progname == NULL)
+    return FALSE;
+
+  basename = strrchr (progname, '/');
+  basename = basename ? basename + 1 : progname;
+  len = strlen (basename);
+
+  while (*programs != 0)
+    {
+      const char *end = strchrnul (programs, ':');
+
+      if ((size_t) (end - programs) == len && strncmp (programs, basename, len) == 0)
+        return TRUE;
+
+      programs = *end ? end + 1 : end;
+    }
+
+  return FALSE;
+}
+
 static void
 _groot_init_main (int argc, char *argv[])
 {
   const char *debug = NULL;
   const char *env_wrap = NULL;
   const char *disabled = NULL;
+  const char *env_threads = NULL;
+  const char *env_options = NULL;
+  const char *env_session = NULL;
   char **wrapdirs = NULL;
   int num_wrapdirs = 0;
+  GRootFSOptions fs_options = GROOTFS_OPTIONS_INIT;
 
   disabled = getenv ("GROOT_DISABLED");
   env_wrap = getenv ("GROOT_WRAPFS");
   debug = getenv ("GROOT_DEBUG");
+  env_threads = getenv ("GROOT_THREADS");
+  env_options = getenv ("GROOT_OPTIONS");
+  env_session = getenv ("GROOT_SESSION");
+
+  /* The cheap checks come first, as this runs in every process */
+  if (disabled == NULL && !program_wants_groot (argc > 0 ? argv[0] : NULL, getenv ("GROOT_PROGRAMS")))
+    return;
 
   /* Don't recursively enable groot */
   __unsetenv ("LD_PRELOAD");
@@ -49,6 +95,24 @@ _groot_init_main (int argc, char *argv[])
   if (disabled == NULL)
     setenv ("GROOT_DISABLED", "1", 1);
 
+  /* E.g. started by a groot process with a scrubbed environment */
+  if (groot_in_ns ())
+    return;
+
+  if (debug)
+    enable_debuglog ();
+
+  /* Joining a session is only a connect and two setns() calls */
+  if (env_session != NULL)
+    {
+      if (groot_session_join (env_session) == 0)
+        {
+          __debug__(("Joined groot session %s for %s", env_session, argv[0]));
+          return;
+        }
+      __debug__(("No groot session at %s, setting up a new namespace", env_session));
+    }
+
   if (env_wrap)
     {
       autofree char *data = xstrdup (env_wrap);
@@ -63,12 +127,15 @@ _groot_init_main (int argc, char *argv[])
         }
     }
 
-  if (debug)
-    enable_debuglog ();
+  if (env_threads && grootfs_parse_threads (env_threads, &fs_options.n_threads) != 0)
+    report ("Ignoring invalid GROOT_THREADS: %s", env_threads);
+
+  if (env_options && grootfs_parse_options (env_options, &fs_options) != 0)
+    report ("Ignoring invalid GROOT_OPTIONS: %s", env_options);
 
   __debug__(("Enabling grootfs for %s - wrap %s", argv[0], env_wrap));
 
-  groot_setup_ns ((const char **)wrapdirs, num_wrapdirs);
+  groot_setup_ns ((const char **)wrapdirs, num_wrapdirs, &fs_options);
   strfreev (wrapdirs);
 }
 
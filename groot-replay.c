@@ -0,0 +1,790 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Replays a trace written by grootfs with -o trace=PATH against a
+ * directory, normally a groot wrapped one, by making the syscalls
+ * that lead to the same fuse operations, and compares how long they
+ * take with what was recorded.
+ *
+ * Node ids are resolved to paths with the entry records, so only
+ * operations on files looked up while tracing can be replayed, and
+ * file handles to the fds opened for them. Neither the data written
+ * nor the xattr values are in the trace, zeros are written instead.
+ * The operations are replayed one at a time, in the order they were
+ * started.
+ */
+
+#include "utils.h"
+#include "grootfs-stats.h"
+#include "grootfs-trace.h"
+
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <time.h>
+
+/* From fuse_lowlevel.h, which we don't otherwise need */
+#define ROOT_NODEID 1
+#define SET_ATTR_MODE (1 << 0)
+#define SET_ATTR_UID (1 << 1)
+#define SET_ATTR_GID (1 << 2)
+#define SET_ATTR_SIZE (1 << 3)
+#define SET_ATTR_ATIME (1 << 4)
+#define SET_ATTR_MTIME (1 << 5)
+#define SET_ATTR_ATIME_NOW (1 << 7)
+#define SET_ATTR_MTIME_NOW (1 << 8)
+
+typedef struct {
+  const GRootTraceRecord *record;
+  size_t index;         /* In the file, to sort stably */
+  char *name;
+  char *name2;
+} ReplayOp;
+
+/* Maps node ids to paths and file handles to fds */
+typedef struct {
+  uint64_t key;
+  bool used;
+  char *path;
+  int fd;
+} IdMapEntry;
+
+typedef struct {
+  IdMapEntry *entries;
+  size_t size;          /* A power of 2 */
+  size_t n_entries;
+} IdMap;
+
+typedef struct {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t skipped;
+  uint64_t recorded_ns;
+  uint64_t replayed_ns;
+} ReplayStats;
+
+typedef struct {
+  IdMap nodes;
+  IdMap handles;
+  char *buf;            /* For reads and writes */
+  size_t buf_size;
+  ReplayStats stats[GROOTFS_N_OPS];
+} Replay;
+
+static void
+usage (const char *progname)
+{
+  fprintf (stdout,
+           "usage: %s [options] TRACE DIR\n"
+           "\n"
+           "Replay the operations in TRACE, as written by grootfs -o trace=PATH,\n"
+           "on DIR, which normally is the same groot wrapped directory, and compare\n"
+           "how long they take with the recorded times.\n"
+           "\n"
+           "options:\n"
+           "   -t  --realtime      keep the recorded time between the operations\n"
+           "   -h  --help          print help\n",
+           progname);
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+id_map_bucket (const IdMap *map,
+               uint64_t key)
+{
+  return (key * 0x9E3779B97F4A7C15ULL >> 32) & (map->size - 1);
+}
+
+static IdMapEntry *
+id_map_lookup (IdMap *map,
+               uint64_t key)
+{
+  if (map->size == 0)
+    return NULL;
+
+  for (size_t i = id_map_bucket (map, key);; i = (i + 1) & (map->size - 1))
+    {
+      IdMapEntry *entry = &map->entries[i];
+
+      if (!entry->used)
+        return NULL;
+      if (entry->key == key)
+        return entry;
+    }
+}
+
+static void id_map_insert (IdMap *map, uint64_t key, char *path, int fd);
+
+static void
+id_map_grow (IdMap *map)
+{
+  IdMapEntry *old = map->entries;
+  size_t old_size = map->size;
+
+  map->size = old_size ? old_size * 2 : 64;
+  map->entries = xcalloc (map->size * sizeof (IdMapEntry));
+  map->n_entries = 0;
+
+  for (size_t i = 0; i < old_size; i++)
+    if (old[i].used)
+      id_map_insert (map, old[i].key, old[i].path, old[i].fd);
+  free (old);
+}
+
+/* Takes path, replacing any entry for key */
+static void
+id_map_insert (IdMap *map,
+               uint64_t key,
+               char *path,
+               int fd)
+{
+  IdMapEntry *entry = id_map_lookup (map, key);
+  size_t i;
+
+  if (entry != NULL)
+    {
+      free (entry->path);
+      if (entry->fd != -1)
+        close (entry->fd);
+      entry->path = path;
+      entry->fd = fd;
+      return;
+    }
+
+  if ((map->n_entries + 1) * 4 > map->size * 3)
+    id_map_grow (map);
+
+  for (i = id_map_bucket (map, key); map->entries[i].used; i = (i + 1) & (map->size - 1))
+    ;
+  map->entries[i] = (IdMapEntry) { key, TRUE, path, fd };
+  map->n_entries++;
+}
+
+/* Frees the entry's path and closes its fd */
+static void
+id_map_remove (IdMap *map,
+               IdMapEntry *entry)
+{
+  size_t hole = entry - map->entries;
+
+  free (entry->path);
+  if (entry->fd != -1)
+    close (entry->fd);
+
+  /* Move back the entries after it that are not in their bucket */
+  for (size_t i = (hole + 1) & (map->size - 1);
+       map->entries[i].used;
+       i = (i + 1) & (map->size - 1))
+    {
+      size_t bucket = id_map_bucket (map, map->entries[i].key);
+
+      if (((i - bucket) & (map->size - 1)) >= ((i - hole) & (map->size - 1)))
+        {
+          map->entries[hole] = map->entries[i];
+          hole = i;
+        }
+    }
+
+  map->entries[hole].used = FALSE;
+  map->n_entries--;
+}
+
+static void
+id_map_clear (IdMap *map)
+{
+  for (size_t i = 0; i < map->size; i++)
+    if (map->entries[i].used)
+      {
+        free (map->entries[i].path);
+        if (map->entries[i].fd != -1)
+          close (map->entries[i].fd);
+      }
+  free (map->entries);
+  *map = (IdMap) { NULL };
+}
+
+static const char *
+node_path (Replay *replay,
+           uint64_t nodeid)
+{
+  IdMapEntry *entry = id_map_lookup (&replay->nodes, nodeid);
+
+  return entry ? entry->path : NULL;
+}
+
+static char *
+child_path (Replay *replay,
+            uint64_t parent,
+            const char *name)
+{
+  const char *parent_path = node_path (replay, parent);
+
+  if (parent_path == NULL || name == NULL)
+    return NULL;
+
+  return xasprintf ("%s/%s", parent_path, name);
+}
+
+static int
+handle_fd (Replay *replay,
+           uint64_t fh)
+{
+  IdMapEntry *entry = id_map_lookup (&replay->handles, fh);
+
+  return entry ? entry->fd : -1;
+}
+
+/* The files below a renamed dir keep their node ids */
+static void
+rename_paths (Replay *replay,
+              const char *old_path,
+              const char *new_path)
+{
+  size_t len = strlen (old_path);
+
+  for (size_t i = 0; i < replay->nodes.size; i++)
+    {
+      IdMapEntry *entry = &replay->nodes.entries[i];
+
+      if (entry->used && strncmp (entry->path, old_path, len) == 0 &&
+          (entry->path[len] == 0 || entry->path[len] == '/'))
+        {
+          char *path = xasprintf ("%s%s", new_path, entry->path + len);
+
+          free (entry->path);
+          entry->path = path;
+        }
+    }
+}
+
+static char *
+get_buf (Replay *replay,
+         size_t size)
+{
+  if (size > replay->buf_size)
+    {
+      free (replay->buf);
+      replay->buf = xcalloc (size);
+      replay->buf_size = size;
+    }
+
+  return replay->buf;
+}
+
+static int
+open_handle (Replay *replay,
+             uint64_t fh,
+             const char *path,
+             int flags,
+             mode_t mode)
+{
+  int fd;
+
+  if (path == NULL)
+    return -1;
+
+  fd = open (path, flags | O_CLOEXEC | O_NOFOLLOW, mode);
+  if (fd == -1)
+    return 1;
+
+  id_map_insert (&replay->handles, fh, NULL, fd);
+  return 0;
+}
+
+static int
+close_handle (Replay *replay,
+              uint64_t fh)
+{
+  IdMapEntry *entry = id_map_lookup (&replay->handles, fh);
+
+  if (entry == NULL)
+    return -1;
+
+  id_map_remove (&replay->handles, entry);
+  return 0;
+}
+
+static int
+setattr_path (const char *path,
+              const GRootTraceRecord *record)
+{
+  uint32_t to_set = record->args[0];
+  mode_t mode = record->args[0] >> 32;
+  uid_t uid = record->args[2] >> 32;
+  gid_t gid = record->args[2];
+  int res = 0;
+
+  if (to_set & SET_ATTR_MODE)
+    res |= chmod (path, mode);
+
+  if (to_set & (SET_ATTR_UID | SET_ATTR_GID))
+    res |= lchown (path, to_set & SET_ATTR_UID ? uid : (uid_t) -1,
+                   to_set & SET_ATTR_GID ? gid : (gid_t) -1);
+
+  if (to_set & SET_ATTR_SIZE)
+    res |= truncate (path, record->args[1]);
+
+  /* The times are not recorded */
+  if (to_set & (SET_ATTR_ATIME | SET_ATTR_MTIME | SET_ATTR_ATIME_NOW | SET_ATTR_MTIME_NOW))
+    {
+      struct timespec times[2] = {
+        { 0, to_set & (SET_ATTR_ATIME | SET_ATTR_ATIME_NOW) ? UTIME_NOW : UTIME_OMIT },
+        { 0, to_set & (SET_ATTR_MTIME | SET_ATTR_MTIME_NOW) ? UTIME_NOW : UTIME_OMIT },
+      };
+
+      res |= utimensat (AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+    }
+
+  return res != 0;
+}
+
+/* Returns 0 on success, 1 if the syscall failed, or -1 if the op
+ * can't be replayed */
+static int
+replay_op (Replay *replay,
+           const ReplayOp *op)
+{
+  const GRootTraceRecord *record = op->record;
+  const uint64_t *args = record->args;
+  autofree char *path = NULL;
+  autofree char *path2 = NULL;
+  const char *node;
+  struct statvfs stvfs;
+  struct stat st;
+  loff_t off_in = 0, off_out = 0;
+  int fd, fd2;
+
+  switch (record->op)
+    {
+    case GROOTFS_OP_LOOKUP:
+      path = child_path (replay, record->nodeid, op->name);
+      if (path == NULL)
+        return -1;
+      return lstat (path, &st) != 0;
+
+    case GROOTFS_OP_FORGET:
+      return -1;
+
+    case GROOTFS_OP_GETATTR:
+      node = node_path (replay, record->nodeid);
+      if (node == NULL)
+        return -1;
+      return lstat (node, &st) != 0;
+
+    case GROOTFS_OP_SETATTR:
+      node = node_path (replay, record->nodeid);
+      if (node == NULL)
+        return -1;
+      return setattr_path (node, record);
+
+    case GROOTFS_OP_READLINK:
+      node = node_path (replay, record->nodeid);
+      if (node == NULL)
+        return -1;
+      return readlink (node, get_buf (replay, PATH_MAX), PATH_MAX) < 0;
+
+    case GROOTFS_OP_OPENDIR:
+      return open_handle (replay, args[0], node_path (replay, record->nodeid),
+                          O_RDONLY | O_DIRECTORY, 0);
+
+    case GROOTFS_OP_READDIR:
+    case GROOTFS_OP_READDIRPLUS:
+      /* The offsets are our own, so only restarts can be replayed */
+      fd = handle_fd (replay, args[0]);
+      if (fd == -1)
+        return -1;
+      if (args[2] == 0 && lseek (fd, 0, SEEK_SET) != 0)
+        return 1;
+      return syscall (SYS_getdents64, fd, get_buf (replay, args[1]), args[1]) < 0;
+
+    case GROOTFS_OP_RELEASEDIR:
+    case GROOTFS_OP_RELEASE:
+      return close_handle (replay, args[0]);
+
+    case GROOTFS_OP_MKNOD:
+      path = child_path (replay, record->nodeid, op->name);
+      if (path == NULL)
+        return -1;
+      return mknod (path, args[0], args[1]) != 0;
+
+    case GROOTFS_OP_MKDIR:
+      path = child_path (replay, record->nodeid, op->name);
+      if (path == NULL)
+        return -1;
+      return mkdir (path, args[0]) != 0;
+
+    case GROOTFS_OP_SYMLINK:
+      path = child_path (replay, record->nodeid, op->name);
+      if (path == NULL || op->name2 == NULL)
+        return -1;
+      return symlink (op->name2, path) != 0;
+
+    case GROOTFS_OP_UNLINK:
+      path = child_path (replay, record->nodeid, op->name);
+      if (path == NULL)
+        return -1;
+      return unlink (path) != 0;
+
+    case GROOTFS_OP_RMDIR:
+      path = child_path (replay, record->nodeid, op->name);
+      if (path == NULL)
+        return -1;
+      return rmdir (path) != 0;
+
+    case GROOTFS_OP_RENAME:
+      path = child_path (replay, record->nodeid, op->name);
+      path2 = child_path (replay, args[0], op->name2);
+      if (path == NULL || path2 == NULL)
+        return -1;
+      if (rename (path, path2) != 0)
+        return 1;
+      rename_paths (replay, path, path2);
+      return 0;
+
+    case GROOTFS_OP_LINK:
+      node = node_path (replay, record->nodeid);
+      path2 = child_path (replay, args[0], op->name);
+      if (node == NULL || path2 == NULL)
+        return -1;
+      return link (node, path2) != 0;
+
+    case GROOTFS_OP_CREATE:
+      path = child_path (replay, record->nodeid, op->name);
+      if (path == NULL)
+        return -1;
+      return open_handle (replay, args[0], path, args[2] | O_CREAT, args[1]);
+
+    case GROOTFS_OP_OPEN:
+      return open_handle (replay, args[0], node_path (replay, record->nodeid),
+                          args[2] & ~(O_CREAT | O_EXCL), 0);
+
+    case GROOTFS_OP_READ:
+      fd = handle_fd (replay, args[0]);
+      if (fd == -1)
+        return -1;
+      return pread (fd, get_buf (replay, args[1]), args[1], args[2]) < 0;
+
+    case GROOTFS_OP_WRITE:
+      fd = handle_fd (replay, args[0]);
+      if (fd == -1)
+        return -1;
+      memset (get_buf (replay, args[1]), 0, args[1]);
+      return pwrite (fd, replay->buf, args[1], args[2]) < 0;
+
+    case GROOTFS_OP_STATFS:
+      node = node_path (replay, record->nodeid);
+      if (node == NULL)
+        return -1;
+      return statvfs (node, &stvfs) != 0;
+
+    case GROOTFS_OP_FSYNC:
+      fd = handle_fd (replay, args[0]);
+      if (fd == -1)
+        return -1;
+      return (args[1] ? fdatasync (fd) : fsync (fd)) != 0;
+
+    case GROOTFS_OP_ACCESS:
+      node = node_path (replay, record->nodeid);
+      if (node == NULL)
+        return -1;
+      return access (node, args[1]) != 0;
+
+    case GROOTFS_OP_SETXATTR:
+      node = node_path (replay, record->nodeid);
+      if (node == NULL || op->name == NULL)
+        return -1;
+      memset (get_buf (replay, args[1]), 0, args[1]);
+      return lsetxattr (node, op->name, replay->buf, args[1], args[2]) != 0;
+
+    case GROOTFS_OP_GETXATTR:
+      node = node_path (replay, record->nodeid);
+      if (node == NULL || op->name == NULL)
+        return -1;
+      return lgetxattr (node, op->name, get_buf (replay, args[1]), args[1]) < 0;
+
+    case GROOTFS_OP_LISTXATTR:
+      node = node_path (replay, record->nodeid);
+      if (node == NULL)
+        return -1;
+      return llistxattr (node, get_buf (replay, args[1]), args[1]) < 0;
+
+    case GROOTFS_OP_REMOVEXATTR:
+      node = node_path (replay, record->nodeid);
+      if (node == NULL || op->name == NULL)
+        return -1;
+      return lremovexattr (node, op->name) != 0;
+
+    case GROOTFS_OP_COPY_FILE_RANGE:
+      /* The offsets are not recorded */
+      fd = handle_fd (replay, args[0]);
+      fd2 = handle_fd (replay, args[2]);
+      if (fd == -1 || fd2 == -1)
+        return -1;
+      return copy_file_range (fd, &off_in, fd2, &off_out, args[1], 0) < 0;
+
+    default:
+      return -1;
+    }
+}
+
+static int
+compare_ops (const void *a,
+             const void *b)
+{
+  const ReplayOp *op_a = a;
+  const ReplayOp *op_b = b;
+
+  if (op_a->record->start_ns != op_b->record->start_ns)
+    return op_a->record->start_ns < op_b->record->start_ns ? -1 : 1;
+
+  return op_a->index < op_b->index ? -1 : op_a->index > op_b->index;
+}
+
+/* Returns the ops in data, in the order they were started */
+static ReplayOp *
+parse_trace (const char *trace,
+             const char *data,
+             size_t size,
+             size_t *n_ops_out)
+{
+  const GRootTraceHeader *header = (const GRootTraceHeader *) data;
+  ReplayOp *ops = NULL;
+  size_t n_ops = 0, n_alloc = 0;
+  size_t pos;
+
+  if (size < sizeof (*header) ||
+      memcmp (header->magic, GROOTFS_TRACE_MAGIC, sizeof (header->magic)) != 0)
+    die ("%s is not a grootfs trace", trace);
+
+  if (header->version != GROOTFS_TRACE_VERSION || header->n_ops != GROOTFS_N_OPS)
+    die ("%s was written by a different version of grootfs", trace);
+
+  for (pos = sizeof (*header); pos + sizeof (GRootTraceRecord) <= size;)
+    {
+      const GRootTraceRecord *record = (const GRootTraceRecord *) (data + pos);
+      const char *names = (const char *) (record + 1);
+      size_t record_size = (sizeof (*record) + record->name_len + 7) & ~(size_t) 7;
+      ReplayOp *op;
+
+      if (pos + record_size > size || record->op > GROOTFS_TRACE_ENTRY)
+        die ("%s is corrupt at offset %zu", trace, pos);
+
+      if (n_ops == n_alloc)
+        {
+          n_alloc = n_alloc ? n_alloc * 2 : 1024;
+          ops = xrealloc (ops, n_alloc * sizeof (ReplayOp));
+        }
+
+      op = &ops[n_ops];
+      op->record = record;
+      op->index = n_ops++;
+      op->name = NULL;
+      op->name2 = NULL;
+
+      if (record->name_len > 0)
+        {
+          const char *end = memchr (names, 0, record->name_len);
+
+          op->name = strndup (names, record->name_len);
+          if (op->name == NULL)
+            die_oom ();
+          if (end != NULL)
+            {
+              op->name2 = strndup (end + 1, names + record->name_len - end - 1);
+              if (op->name2 == NULL)
+                die_oom ();
+            }
+        }
+
+      pos += record_size;
+    }
+
+  /* An interrupted writer can leave a partial record */
+  if (pos != size)
+    report ("Ignoring %zu trailing bytes in %s", size - pos, trace);
+
+  qsort (ops, n_ops, sizeof (ReplayOp), compare_ops);
+
+  *n_ops_out = n_ops;
+  return ops;
+}
+
+static void
+replay_ops (Replay *replay,
+            const ReplayOp *ops,
+            size_t n_ops,
+            bool realtime)
+{
+  uint64_t replay_start = now_ns ();
+
+  for (size_t i = 0; i < n_ops; i++)
+    {
+      const GRootTraceRecord *record = ops[i].record;
+      ReplayStats *stats;
+      uint64_t start;
+      int res;
+
+      if (record->op == GROOTFS_TRACE_ENTRY)
+        {
+          char *path = child_path (replay, record->nodeid, ops[i].name);
+
+          if (path != NULL)
+            id_map_insert (&replay->nodes, record->args[0], path, -1);
+          continue;
+        }
+
+      if (realtime)
+        {
+          uint64_t elapsed = now_ns () - replay_start;
+
+          if (record->start_ns > elapsed)
+            {
+              uint64_t delay = record->start_ns - elapsed;
+              struct timespec ts = { delay / 1000000000, delay % 1000000000 };
+
+              nanosleep (&ts, NULL);
+            }
+        }
+
+      stats = &replay->stats[record->op];
+      start = now_ns ();
+      res = replay_op (replay, &ops[i]);
+      if (res < 0)
+        {
+          stats->skipped++;
+          continue;
+        }
+
+      stats->replayed_ns += now_ns () - start;
+      stats->recorded_ns += record->duration_ns;
+      stats->count++;
+      if (res > 0)
+        stats->errors++;
+    }
+}
+
+static void
+print_stats (Replay *replay,
+             FILE *out)
+{
+  fprintf (out, "%-15s %10s %10s %10s %12s %12s\n",
+           "op", "count", "errors", "skipped", "recorded us", "replayed us");
+  for (int op = 0; op < GROOTFS_N_OPS; op++)
+    {
+      ReplayStats *stats = &replay->stats[op];
+
+      if (stats->count == 0 && stats->skipped == 0)
+        continue;
+
+      fprintf (out, "%-15s %10lu %10lu %10lu %12.1f %12.1f\n", grootfs_stats_op_name (op),
+               (unsigned long) stats->count, (unsigned long) stats->errors,
+               (unsigned long) stats->skipped,
+               stats->count ? stats->recorded_ns / 1000.0 / stats->count : 0.0,
+               stats->count ? stats->replayed_ns / 1000.0 / stats->count : 0.0);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const struct option long_options[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "realtime", no_argument, NULL, 't' },
+    { NULL }
+  };
+  Replay replay = { { NULL } };
+  const char *trace, *dir;
+  autofree char *data = NULL;
+  autofd int fd = -1;
+  ReplayOp *ops;
+  size_t size, n_ops;
+  bool realtime = FALSE;
+  struct stat st;
+  int opt;
+
+  while ((opt = getopt_long (argc, argv, "+ht", long_options, NULL)) != -1)
+    {
+      switch (opt)
+        {
+        case 'h':
+          usage (argv[0]);
+          return EXIT_SUCCESS;
+
+        case 't':
+          realtime = TRUE;
+          break;
+
+        default:
+          fprintf (stderr, "see `%s -h' for usage\n", argv[0]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  if (argc - optind != 2)
+    {
+      fprintf (stderr, "see `%s -h' for usage\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  trace = argv[optind];
+  dir = argv[optind + 1];
+
+  fd = open (trace, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    die_with_error ("Can't open %s", trace);
+
+  data = load_file_data (fd, &size);
+  if (data == NULL)
+    die_with_error ("Can't read %s", trace);
+
+  if (stat (dir, &st) != 0 || !S_ISDIR (st.st_mode))
+    die ("%s is not a directory", dir);
+
+  ops = parse_trace (trace, data, size, &n_ops);
+
+  id_map_insert (&replay.nodes, ROOT_NODEID, xstrdup (dir), -1);
+  replay_ops (&replay, ops, n_ops, realtime);
+  print_stats (&replay, stdout);
+
+  for (size_t i = 0; i < n_ops; i++)
+    {
+      free (ops[i].name);
+      free (ops[i].name2);
+    }
+  free (ops);
+  id_map_clear (&replay.nodes);
+  id_map_clear (&replay.handles);
+  free (replay.buf);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "grootfs.h"
+#include "groot-ns.h"
+#include "groot-session.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Requests are a single byte */
+#define SESSION_REQ_JOIN 'j'
+#define SESSION_REQ_STOP 's'
+#define SESSION_REPLY_OK 'x'
+
+char *
+groot_session_get_path (void)
+{
+  const char *env_session = getenv ("GROOT_SESSION");
+  const char *runtime_dir;
+
+  if (env_session != NULL && *env_session != 0)
+    return xstrdup (env_session);
+
+  runtime_dir = getenv ("XDG_RUNTIME_DIR");
+  if (runtime_dir != NULL && *runtime_dir != 0)
+    return xasprintf ("%s/groot-session", runtime_dir);
+
+  return xasprintf ("/tmp/groot-session-%d", (int) getuid ());
+}
+
+static int
+session_init_addr (const char *path,
+                   struct sockaddr_un *addr)
+{
+  memset (addr, 0, sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+
+  if (strlen (path) >= sizeof (addr->sun_path))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+  strcpy (addr->sun_path, path);
+  return 0;
+}
+
+static int
+session_connect (const char *path)
+{
+  struct sockaddr_un addr;
+  autofd int fd = -1;
+
+  if (session_init_addr (path, &addr) != 0)
+    return -1;
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+    return -1;
+
+  return steal_fd (&fd);
+}
+
+/* Send a request and wait for the one byte reply, and for joins the
+ * namespace fds. Returns -1 if there is no session. */
+static int
+session_request (const char *path,
+                 char req,
+                 int *fds,
+                 int n_fds)
+{
+  autofd int fd = -1;
+  char reply;
+  ssize_t s;
+
+  fd = session_connect (path);
+  if (fd == -1)
+    return -1;
+
+  if (write (fd, &req, 1) != 1)
+    die_with_error ("Write to groot session");
+
+  if (n_fds > 0)
+    {
+      if (recv_fds (fd, fds, n_fds) != 0)
+        die_with_error ("Receive namespaces from groot session");
+      return 0;
+    }
+
+  do
+    s = read (fd, &reply, 1);
+  while (s == -1 && errno == EINTR);
+
+  if (s != 1 || reply != SESSION_REPLY_OK)
+    die ("Unexpected reply from groot session");
+
+  return 0;
+}
+
+static void
+session_serve (int listen_fd,
+               const char *path)
+{
+  int ns_fds[2];
+
+  /* Opened once and handed out to every client */
+  ns_fds[0] = open ("/proc/self/ns/user", O_RDONLY | O_CLOEXEC);
+  ns_fds[1] = open ("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+  if (ns_fds[0] == -1 || ns_fds[1] == -1)
+    die_with_error ("Can't open session namespaces");
+
+  while (TRUE)
+    {
+      autofd int fd = -1;
+      struct ucred cred;
+      socklen_t cred_len = sizeof (cred);
+      char req;
+      char reply = SESSION_REPLY_OK;
+
+      fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd == -1)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          die_with_error ("accept");
+        }
+
+      /* The socket is private to the user, but double check. The
+       * peer uid is mapped into our namespace, just like ours. */
+      if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+          cred.uid != getuid ())
+        continue;
+
+      if (read (fd, &req, 1) != 1)
+        continue;
+
+      switch (req)
+        {
+        case SESSION_REQ_JOIN:
+          if (send_fds (fd, ns_fds, N_ELEMENTS (ns_fds)) < 0)
+            report ("Failed to send namespaces: %s", strerror (errno));
+          break;
+
+        case SESSION_REQ_STOP:
+          __debug__ (("Stopping groot session %s", path));
+          if (write (fd, &reply, 1) < 0)
+            report ("Failed to reply to stop request");
+          /* The fuse processes exit when the last process in the
+           * namespace does and the mounts go away */
+          exit (0);
+
+        default:
+          report ("Unknown groot session request %d", req);
+          break;
+        }
+    }
+}
+
+/* Sets up the namespace like groot_setup_ns() and forks off a holder
+ * process that keeps it alive, returning in the parent once it is
+ * ready to be joined. */
+int
+groot_session_start (const char *path,
+                     const char **wrapdirs,
+                     int num_wrapdirs,
+                     const GRootFSOptions *options)
+{
+  struct sockaddr_un addr;
+  autofd int listen_fd = -1;
+  int existing_fd;
+  mode_t old_umask;
+  pid_t pid;
+
+  if (session_init_addr (path, &addr) != 0)
+    die_with_error ("Invalid session path %s", path);
+
+  existing_fd = session_connect (path);
+  if (existing_fd != -1)
+    {
+      close (existing_fd);
+      die ("A groot session is already running at %s", path);
+    }
+
+  /* Bind before unsharing, so the socket is reachable from outside */
+  listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1)
+    die_with_error ("socket");
+
+  unlink (path); /* A stale socket of an old session */
+  old_umask = umask (0077);
+  if (bind (listen_fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+    die_with_error ("Can't bind session socket %s", path);
+  umask (old_umask);
+
+  if (listen (listen_fd, 64) != 0)
+    die_with_error ("listen");
+
+  groot_setup_ns (wrapdirs, num_wrapdirs, options);
+
+  pid = fork ();
+  if (pid == -1)
+    die_with_error ("fork failed");
+
+  if (pid != 0)
+    return 0; /* The socket is listening, so clients can already connect */
+
+  if (setsid () == -1)
+    die_with_error ("setsid");
+
+  /* Don't keep the terminal or any pipes of the caller open */
+  {
+    int null_fd = open ("/dev/null", O_RDWR | O_CLOEXEC);
+    if (null_fd != -1)
+      {
+        dup2 (null_fd, 0);
+        dup2 (null_fd, 1);
+        dup2 (null_fd, 2);
+        close (null_fd);
+      }
+  }
+
+  signal (SIGPIPE, SIG_IGN);
+  session_serve (listen_fd, path);
+  exit (0);
+}
+
+/* Join a running session, after which the caller can exec. Returns
+ * -1 if there is no session at path. */
+int
+groot_session_join (const char *path)
+{
+  int ns_fds[2];
+
+  if (session_request (path, SESSION_REQ_JOIN, ns_fds, N_ELEMENTS (ns_fds)) != 0)
+    return -1;
+
+  groot_join_ns (ns_fds[0], ns_fds[1]);
+
+  close (ns_fds[0]);
+  close (ns_fds[1]);
+
+  return 0;
+}
+
+int
+groot_session_stop (const char *path)
+{
+  if (session_request (path, SESSION_REQ_STOP, NULL, 0) != 0)
+    return -1;
+
+  /* The holder can't reliably do this, as it is in another mount
+   * namespace */
+  unlink (path);
+
+  return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A session keeps a groot namespace with its fuse mounts alive in a
+ * holder process, so that later commands can join it with setns()
+ * instead of setting up everything again. The holder listens on a
+ * unix socket, by default $XDG_RUNTIME_DIR/groot-session, and hands
+ * out fds for its namespaces to processes of the same user. */
+
+char *groot_session_get_path (void);
+int   groot_session_start    (const char            *path,
+                              const char           **wrapdirs,
+                              int                    num_wrapdirs,
+                              const GRootFSOptions  *options);
+int   groot_session_join     (const char            *path);
+int   groot_session_stop     (const char            *path);
@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "groot-walk.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* An open directory, kept open while there are queued jobs for its
+ * subdirectories so they can be opened relative to it */
+typedef struct {
+  int fd;
+  atomic_int refcount;
+} WalkDir;
+
+typedef struct {
+  WalkDir *parent; /* NULL for the root */
+  char *name;
+  char *path;
+} WalkJob;
+
+/* The owner pushes and pops at the end, thieves take from the start */
+typedef struct {
+  pthread_mutex_t lock;
+  WalkJob *jobs;
+  size_t start;
+  size_t len;
+  size_t size;
+} WalkQueue;
+
+typedef struct {
+  int basefd;
+  int n_workers;
+  GRootWalkFunc func;
+  void *user_data;
+
+  WalkQueue *queues;
+  atomic_size_t n_pending; /* Jobs queued or being worked on */
+  atomic_size_t n_queued;
+  atomic_int n_idle;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+
+  atomic_int n_errors;
+} GRootWalk;
+
+typedef struct {
+  GRootWalk *walk;
+  int index;
+} WalkWorker;
+
+static void
+walk_dir_unref (WalkDir *dir)
+{
+  if (dir != NULL && atomic_fetch_sub (&dir->refcount, 1) == 1)
+    {
+      close (dir->fd);
+      free (dir);
+    }
+}
+
+static void
+queue_push (GRootWalk *walk,
+            int index,
+            WalkJob *job)
+{
+  WalkQueue *q = &walk->queues[index];
+
+  atomic_fetch_add (&walk->n_pending, 1);
+
+  pthread_mutex_lock (&q->lock);
+  if (q->start + q->len == q->size)
+    {
+      if (q->start > 0)
+        {
+          memmove (q->jobs, q->jobs + q->start, q->len * sizeof (WalkJob));
+          q->start = 0;
+        }
+      else
+        {
+          q->size = q->size ? q->size * 2 : 64;
+          q->jobs = xrealloc (q->jobs, q->size * sizeof (WalkJob));
+        }
+    }
+  q->jobs[q->start + q->len++] = *job;
+  pthread_mutex_unlock (&q->lock);
+
+  /* Either we see the idle worker, or it sees the queued job */
+  atomic_fetch_add (&walk->n_queued, 1);
+  if (atomic_load (&walk->n_idle) > 0)
+    {
+      pthread_mutex_lock (&walk->idle_lock);
+      pthread_cond_signal (&walk->idle_cond);
+      pthread_mutex_unlock (&walk->idle_lock);
+    }
+}
+
+static bool
+queue_take (GRootWalk *walk,
+            int index,
+            bool steal,
+            WalkJob *job_out)
+{
+  WalkQueue *q = &walk->queues[index];
+  bool found = FALSE;
+
+  pthread_mutex_lock (&q->lock);
+  if (q->len > 0)
+    {
+      if (steal)
+        *job_out = q->jobs[q->start++];
+      else
+        *job_out = q->jobs[q->start + q->len - 1];
+      q->len--;
+      found = TRUE;
+    }
+  pthread_mutex_unlock (&q->lock);
+
+  if (found)
+    atomic_fetch_sub (&walk->n_queued, 1);
+
+  return found;
+}
+
+/* Waits for a job, returns FALSE when the walk is done */
+static bool
+walk_next_job (GRootWalk *walk,
+               int index,
+               WalkJob *job_out)
+{
+  for (;;)
+    {
+      if (queue_take (walk, index, FALSE, job_out))
+        return TRUE;
+
+      for (int i = 1; i < walk->n_workers; i++)
+        if (queue_take (walk, (index + i) % walk->n_workers, TRUE, job_out))
+          return TRUE;
+
+      pthread_mutex_lock (&walk->idle_lock);
+      atomic_fetch_add (&walk->n_idle, 1);
+      while (atomic_load (&walk->n_pending) > 0 && atomic_load (&walk->n_queued) == 0)
+        pthread_cond_wait (&walk->idle_cond, &walk->idle_lock);
+      atomic_fetch_sub (&walk->n_idle, 1);
+      pthread_mutex_unlock (&walk->idle_lock);
+
+      if (atomic_load (&walk->n_pending) == 0)
+        return FALSE;
+    }
+}
+
+static void
+walk_error (GRootWalk *walk,
+            const char *what,
+            const char *path)
+{
+  report ("Can't %s %s: %s", what, path, strerror (errno));
+  atomic_fetch_add (&walk->n_errors, 1);
+}
+
+static void
+walk_job (GRootWalk *walk,
+          int index,
+          WalkJob *job)
+{
+  WalkDir *dir;
+  DIR *dp;
+  struct dirent *dent;
+  int fd;
+
+  fd = openat (job->parent ? job->parent->fd : walk->basefd, job->name,
+               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  /* Too many directories waiting, go the long way from the root */
+  if (fd == -1 && errno == EMFILE)
+    fd = openat (walk->basefd, job->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1)
+    {
+      walk_error (walk, "open", job->path);
+      return;
+    }
+
+  dir = xcalloc (sizeof (WalkDir));
+  dir->fd = fd;
+  dir->refcount = 1;
+
+  /* The stream gets its own fd, so it can be closed while the
+   * subdirectories are still waiting for dir->fd */
+  fd = dup (dir->fd);
+  dp = fd != -1 ? fdopendir (fd) : NULL;
+  if (dp == NULL)
+    {
+      walk_error (walk, "read", job->path);
+      if (fd != -1)
+        close (fd);
+      walk_dir_unref (dir);
+      return;
+    }
+
+  while ((errno = 0, dent = readdir (dp)) != NULL)
+    {
+      GRootWalkEntry entry = { dir->fd, dent->d_name };
+      char *path;
+
+      if (strcmp (dent->d_name, ".") == 0 ||
+          strcmp (dent->d_name, "..") == 0 ||
+          has_prefix (dent->d_name, ".groot."))
+        continue;
+
+      path = xasprintf ("%s/%s", job->path, dent->d_name);
+
+      if (fstatat (dir->fd, dent->d_name, &entry.st, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          walk_error (walk, "stat", path);
+          free (path);
+          continue;
+        }
+
+      entry.path = path;
+      entry.worker = index;
+      walk->func (&entry, walk->user_data);
+
+      if (S_ISDIR (entry.st.st_mode))
+        {
+          WalkJob child = { dir, xstrdup (dent->d_name), path };
+
+          atomic_fetch_add (&dir->refcount, 1);
+          queue_push (walk, index, &child);
+        }
+      else
+        free (path);
+    }
+
+  if (errno != 0)
+    walk_error (walk, "read", job->path);
+
+  closedir (dp);
+  walk_dir_unref (dir);
+}
+
+static void *
+walk_worker (void *data)
+{
+  WalkWorker *worker = data;
+  GRootWalk *walk = worker->walk;
+  WalkJob job;
+
+  while (walk_next_job (walk, worker->index, &job))
+    {
+      walk_job (walk, worker->index, &job);
+
+      walk_dir_unref (job.parent);
+      free (job.name);
+      free (job.path);
+
+      /* The last job wakes everyone up to exit */
+      if (atomic_fetch_sub (&walk->n_pending, 1) == 1)
+        {
+          pthread_mutex_lock (&walk->idle_lock);
+          pthread_cond_broadcast (&walk->idle_cond);
+          pthread_mutex_unlock (&walk->idle_lock);
+        }
+    }
+
+  return NULL;
+}
+
+int
+groot_walk (int basefd,
+            int n_threads,
+            GRootWalkFunc func,
+            void *user_data)
+{
+  GRootWalk walk = { basefd, n_threads < 1 ? 1 : n_threads, func, user_data };
+  GRootWalkEntry root = { basefd, NULL, "." };
+  WalkJob root_job = { NULL, xstrdup ("."), xstrdup (".") };
+  autofree WalkWorker *workers = NULL;
+  autofree pthread_t *threads = NULL;
+  int n_started;
+
+  if (fstat (basefd, &root.st) == -1)
+    {
+      report ("Can't stat .: %s", strerror (errno));
+      return 1;
+    }
+  func (&root, user_data);
+
+  pthread_mutex_init (&walk.idle_lock, NULL);
+  pthread_cond_init (&walk.idle_cond, NULL);
+  walk.queues = xcalloc (walk.n_workers * sizeof (WalkQueue));
+  for (int i = 0; i < walk.n_workers; i++)
+    pthread_mutex_init (&walk.queues[i].lock, NULL);
+
+  queue_push (&walk, 0, &root_job);
+
+  /* The calling thread is worker 0 */
+  workers = xcalloc (walk.n_workers * sizeof (WalkWorker));
+  threads = xcalloc (walk.n_workers * sizeof (pthread_t));
+  for (n_started = 1; n_started < walk.n_workers; n_started++)
+    {
+      workers[n_started].walk = &walk;
+      workers[n_started].index = n_started;
+      if (pthread_create (&threads[n_started], NULL, walk_worker, &workers[n_started]) != 0)
+        break;
+    }
+
+  /* With fewer threads the others' queues just get stolen from */
+  workers[0].walk = &walk;
+  walk_worker (&workers[0]);
+
+  for (int i = 1; i < n_started; i++)
+    pthread_join (threads[i], NULL);
+
+  for (int i = 0; i < walk.n_workers; i++)
+    {
+      free (walk.queues[i].jobs);
+      pthread_mutex_destroy (&walk.queues[i].lock);
+    }
+  free (walk.queues);
+  pthread_mutex_destroy (&walk.idle_lock);
+  pthread_cond_destroy (&walk.idle_cond);
+
+  return walk.n_errors;
+}
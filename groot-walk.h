@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A parallel walk of a directory tree, for tools that work on the
+ * backing files of a wrapped directory.
+ *
+ * Each worker thread has a queue of directories to read. It pushes
+ * the subdirectories it finds onto its own queue and takes the most
+ * recent one next, so it works depth first and keeps few directories
+ * open. When its queue is empty it steals the oldest directory of
+ * another worker, which is the one likely to have the most work
+ * below it.
+ *
+ * All access is relative to fds of the parent directories, like in
+ * grootfs, and like there the .groot.* files are skipped.
+ */
+
+#include <sys/stat.h>
+
+typedef struct {
+  int dirfd;        /* The directory containing the entry */
+  const char *name; /* Name in dirfd, NULL for the root, which dirfd then is */
+  const char *path; /* Path relative to the root, "." for the root */
+  struct stat st;   /* Not following symlinks */
+  int worker;       /* Index of the worker thread, below n_threads */
+} GRootWalkEntry;
+
+/* Called in the worker threads, for each entry in some order where
+ * directories come before their contents */
+typedef void (*GRootWalkFunc) (const GRootWalkEntry *entry,
+                               void                 *user_data);
+
+/* Returns the number of entries or directories that couldn't be read,
+ * which are also reported */
+int groot_walk (int           basefd,
+                int           n_threads,
+                GRootWalkFunc func,
+                void         *user_data);
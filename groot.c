@@ -22,21 +22,35 @@
 #define FUSE_USE_VERSION 26
 
 #include "utils.h"
+#include "grootfs.h"
 #include "groot-ns.h"
+#include "groot-session.h"
 
 #include <fuse.h>
 
 enum {
   KEY_HELP,
   KEY_WRAP,
-  KEY_DEBUG
+  KEY_THREADS,
+  KEY_DEBUG,
+  KEY_TIMING,
+  KEY_SESSION
 };
 
+typedef enum {
+  SESSION_NONE,
+  SESSION_START,
+  SESSION_EXEC,
+  SESSION_STOP,
+} SessionAction;
+
 
 struct groot_config {
   char **wrapdirs;
   int num_wrapdirs;
+  GRootFSOptions fs_options;
   bool debug;
+  SessionAction session;
 };
 
 static void
@@ -44,12 +58,22 @@ usage (const char *progname)
 {
   fprintf (stdout,
            "usage: %s [options] command [args..]\n"
+           "       %s [options] --session start|stop\n"
+           "       %s --session exec command [args..]\n"
            "\n"
            "options:\n"
            "   -h  --help          print help\n"
            "   -w DIR              wrap directory\n"
+           "   -j N                serve each wrapped directory with N threads (0 = one per cpu)\n"
+           "   -o opt,[opt...]     options for the wrapped directories\n"
            "   -d                  log debug info\n"
-           "\n", progname);
+           "   --timing            report where the startup time goes\n"
+           "   --session ACTION    start or stop a persistent namespace with the\n"
+           "                       wrapped directories, or exec a command in it\n"
+           "                       (socket in $GROOT_SESSION if set)\n"
+           "\n"
+           GROOTFS_OPTIONS_HELP
+           "\n", progname, progname, progname);
 }
 
 int opt_got_command = FALSE;
@@ -89,10 +113,41 @@ groot_opt_proc (void *data,
       add_wrap_dir (conf, arg + 2);
       return 0;
 
+    case KEY_THREADS:
+      if (grootfs_parse_threads (arg + 2, &conf->fs_options.n_threads) != 0)
+        die ("Invalid number of threads: %s", arg + 2);
+      return 0;
+
     case KEY_DEBUG:
       conf->debug = TRUE;
       return 0;
 
+    case KEY_TIMING:
+      groot_enable_timing ();
+      return 0;
+
+    case KEY_SESSION:
+      arg += strlen ("--session");
+      if (strcmp (arg, "start") == 0)
+        conf->session = SESSION_START;
+      else if (strcmp (arg, "exec") == 0)
+        conf->session = SESSION_EXEC;
+      else if (strcmp (arg, "stop") == 0)
+        conf->session = SESSION_STOP;
+      else
+        die ("Invalid session action: %s", arg);
+      return 0;
+
+    case FUSE_OPT_KEY_OPT:
+      /* fuse_opt splits -o lists, so this is a single option */
+      if (arg[0] != '-')
+        {
+          if (grootfs_parse_options (arg, &conf->fs_options) != 0)
+            exit (EXIT_FAILURE);
+          return 0;
+        }
+      /* Fall through */
+
     default:
       fprintf (stderr, "see `%s -h' for usage\n", outargs->argv[0]);
       exit (EXIT_FAILURE);
@@ -109,7 +164,10 @@ static struct fuse_opt groot_opts[] = {
   FUSE_OPT_KEY ("-h", KEY_HELP),
   FUSE_OPT_KEY ("--help", KEY_HELP),
   FUSE_OPT_KEY ("-w ", KEY_WRAP),
+  FUSE_OPT_KEY ("-j ", KEY_THREADS),
   FUSE_OPT_KEY ("-d", KEY_DEBUG),
+  FUSE_OPT_KEY ("--timing", KEY_TIMING),
+  FUSE_OPT_KEY ("--session ", KEY_SESSION),
   FUSE_OPT_END
 };
 
@@ -121,6 +179,20 @@ main (int argc, char *argv[])
   struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
   struct groot_config conf = { 0 };
   const char *env_wrap = NULL;
+  const char *env_threads = NULL;
+  const char *env_options = NULL;
+  GRootFSOptions default_fs_options = GROOTFS_OPTIONS_INIT;
+
+  conf.fs_options = default_fs_options;
+
+  /* Command line options override the environment */
+  env_threads = getenv ("GROOT_THREADS");
+  if (env_threads && grootfs_parse_threads (env_threads, &conf.fs_options.n_threads) != 0)
+    die ("Invalid GROOT_THREADS: %s", env_threads);
+
+  env_options = getenv ("GROOT_OPTIONS");
+  if (env_options && grootfs_parse_options (env_options, &conf.fs_options) != 0)
+    die ("Invalid GROOT_OPTIONS: %s", env_options);
 
   res = fuse_opt_parse (&args, &conf, groot_opts, groot_opt_proc);
   if (res != 0)
@@ -130,7 +202,16 @@ main (int argc, char *argv[])
       exit (EXIT_FAILURE);
     }
 
-  if (!opt_got_command)
+  if (conf.session == SESSION_START || conf.session == SESSION_STOP)
+    {
+      if (opt_got_command)
+        {
+          fprintf (stderr, "No command allowed with --session start or stop\n");
+          fprintf (stderr, "see `%s -h' for usage\n", argv[0]);
+          exit (EXIT_FAILURE);
+        }
+    }
+  else if (!opt_got_command)
     {
       fprintf (stderr, "No command specified\n");
       fprintf (stderr, "see `%s -h' for usage\n", argv[0]);
@@ -153,7 +234,31 @@ main (int argc, char *argv[])
   if (conf.debug)
     enable_debuglog ();
 
-  groot_setup_ns ((const char **)conf.wrapdirs, conf.num_wrapdirs);
+  if (conf.session != SESSION_NONE)
+    {
+      autofree char *session_path = groot_session_get_path ();
+
+      switch (conf.session)
+        {
+        case SESSION_START:
+          groot_session_start (session_path, (const char **)conf.wrapdirs, conf.num_wrapdirs, &conf.fs_options);
+          exit (EXIT_SUCCESS);
+
+        case SESSION_STOP:
+          if (groot_session_stop (session_path) != 0)
+            die_with_error ("No groot session at %s", session_path);
+          exit (EXIT_SUCCESS);
+
+        case SESSION_EXEC:
+        default:
+          /* The wrapped dirs and options are those of the session */
+          if (groot_session_join (session_path) != 0)
+            die_with_error ("No groot session at %s", session_path);
+          break;
+        }
+    }
+  else
+    groot_setup_ns ((const char **)conf.wrapdirs, conf.num_wrapdirs, &conf.fs_options);
 
   argv_clone = xmalloc (sizeof(char *) * args.argc);
   for (int i = 1; i < args.argc; i++)
@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "grootfs-data.h"
+#include "grootfs-cache.h"
+
+#include <pthread.h>
+
+/* The cache is split on the hash into shards with separate locks, so
+ * that multiple fuse threads don't contend much */
+#define N_SHARDS 16
+#define NO_ENTRY UINT32_MAX
+
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  GRootFSData data;
+  uint32_t hash_next;
+  uint32_t referenced;
+} CacheEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  uint32_t *buckets;
+  uint32_t n_buckets;  /* Power of 2 */
+  CacheEntry *entries;
+  uint32_t n_entries;
+  uint32_t max_entries;
+  uint32_t clock_hand;
+  uint64_t seq;  /* Bumped on every insert and remove */
+} CacheShard;
+
+struct _GRootFSCache {
+  CacheShard shards[N_SHARDS];
+};
+
+static uint64_t
+cache_hash (dev_t dev,
+            ino_t ino)
+{
+  uint64_t h = ((uint64_t) ino * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) dev;
+  return h ^ (h >> 29);
+}
+
+static CacheShard *
+get_shard (GRootFSCache *cache,
+           uint64_t hash)
+{
+  /* Use the top bits for the shard, the low bits for the bucket */
+  return &cache->shards[hash >> 60 & (N_SHARDS - 1)];
+}
+
+/* Entries per shard to stay within max_size */
+static size_t
+max_shard_entries (size_t max_size)
+{
+  /* Account for the worst case bucket array too, which is less than
+   * two buckets per entry */
+  size_t max_entries = max_size / N_SHARDS / (sizeof (CacheEntry) + 2 * sizeof (uint32_t));
+
+  if (max_entries > NO_ENTRY / 2)
+    max_entries = NO_ENTRY / 2;
+
+  return max_entries;
+}
+
+GRootFSCache *
+grootfs_cache_new (size_t max_size)
+{
+  GRootFSCache *cache;
+  size_t max_entries = max_shard_entries (max_size);
+
+  if (max_entries == 0)
+    return NULL;
+
+  cache = xcalloc (sizeof (GRootFSCache));
+  for (int i = 0; i < N_SHARDS; i++)
+    {
+      CacheShard *shard = &cache->shards[i];
+
+      pthread_mutex_init (&shard->lock, NULL);
+      shard->max_entries = max_entries;
+
+      shard->n_buckets = 1;
+      while (shard->n_buckets < max_entries)
+        shard->n_buckets *= 2;
+      shard->buckets = xmalloc (shard->n_buckets * sizeof (uint32_t));
+      memset (shard->buckets, 0xff, shard->n_buckets * sizeof (uint32_t));
+
+      /* Entries are allocated lazily as the cache fills up */
+      shard->entries = NULL;
+    }
+
+  return cache;
+}
+
+void
+grootfs_cache_free (GRootFSCache *cache)
+{
+  if (cache == NULL)
+    return;
+
+  for (int i = 0; i < N_SHARDS; i++)
+    {
+      CacheShard *shard = &cache->shards[i];
+
+      pthread_mutex_destroy (&shard->lock);
+      free (shard->buckets);
+      free (shard->entries);
+    }
+
+  free (cache);
+}
+
+/* Returns a pointer to the link (bucket head or hash_next) which
+ * points to the entry for dev/ino, or to the terminating NO_ENTRY. */
+static uint32_t *
+shard_find_link (CacheShard *shard,
+                 uint64_t hash,
+                 dev_t dev,
+                 ino_t ino)
+{
+  uint32_t *link = &shard->buckets[hash & (shard->n_buckets - 1)];
+
+  while (*link != NO_ENTRY)
+    {
+      CacheEntry *entry = &shard->entries[*link];
+      if (entry->ino == ino && entry->dev == dev)
+        break;
+      link = &entry->hash_next;
+    }
+
+  return link;
+}
+
+static uint32_t
+shard_evict (CacheShard *shard)
+{
+  while (TRUE)
+    {
+      uint32_t index = shard->clock_hand;
+      CacheEntry *entry = &shard->entries[index];
+
+      shard->clock_hand = (shard->clock_hand + 1) % shard->n_entries;
+
+      if (entry->referenced)
+        entry->referenced = FALSE; /* Second chance */
+      else
+        {
+          uint32_t *link = shard_find_link (shard, cache_hash (entry->dev, entry->ino),
+                                            entry->dev, entry->ino);
+          *link = entry->hash_next;
+          return index;
+        }
+    }
+}
+
+/* On a miss *seq_out is set for passing to grootfs_cache_fill() */
+bool
+grootfs_cache_lookup (GRootFSCache *cache,
+                      dev_t dev,
+                      ino_t ino,
+                      GRootFSData *data_out,
+                      uint64_t *seq_out)
+{
+  uint64_t hash = cache_hash (dev, ino);
+  CacheShard *shard = get_shard (cache, hash);
+  uint32_t index;
+
+  pthread_mutex_lock (&shard->lock);
+
+  index = *shard_find_link (shard, hash, dev, ino);
+  if (index != NO_ENTRY)
+    {
+      CacheEntry *entry = &shard->entries[index];
+      entry->referenced = TRUE;
+      *data_out = entry->data;
+    }
+  else if (seq_out)
+    *seq_out = shard->seq;
+
+  pthread_mutex_unlock (&shard->lock);
+
+  return index != NO_ENTRY;
+}
+
+/* Adds a new entry for dev/ino, which must not be in the shard, at
+ * *link as returned by shard_find_link() */
+static void
+shard_add (CacheShard *shard,
+           uint64_t hash,
+           uint32_t *link,
+           dev_t dev,
+           ino_t ino,
+           const GRootFSData *data)
+{
+  uint32_t index;
+  CacheEntry *entry;
+
+  if (shard->n_entries < shard->max_entries)
+    {
+      if (shard->entries == NULL)
+        shard->entries = xmalloc (shard->max_entries * sizeof (CacheEntry));
+      index = shard->n_entries++;
+    }
+  else
+    {
+      index = shard_evict (shard);
+      /* Eviction may have unlinked the entry before ours in the chain */
+      link = shard_find_link (shard, hash, dev, ino);
+    }
+
+  entry = &shard->entries[index];
+  entry->dev = dev;
+  entry->ino = ino;
+  entry->data = *data;
+  entry->referenced = FALSE;
+  entry->hash_next = NO_ENTRY;
+  *link = index;
+}
+
+/* Sets the data of dev/ino after it changed */
+void
+grootfs_cache_insert (GRootFSCache *cache,
+                      dev_t dev,
+                      ino_t ino,
+                      const GRootFSData *data)
+{
+  uint64_t hash = cache_hash (dev, ino);
+  CacheShard *shard = get_shard (cache, hash);
+  uint32_t *link;
+
+  pthread_mutex_lock (&shard->lock);
+
+  shard->seq++;
+  link = shard_find_link (shard, hash, dev, ino);
+  if (*link != NO_ENTRY)
+    {
+      CacheEntry *entry = &shard->entries[*link];
+      entry->data = *data;
+      entry->referenced = TRUE;
+    }
+  else
+    shard_add (shard, hash, link, dev, ino, data);
+
+  pthread_mutex_unlock (&shard->lock);
+}
+
+/* Adds the data of dev/ino read after a miss in grootfs_cache_lookup()
+ * which returned seq. Unless nothing in the shard was inserted or
+ * removed since then, the data may be older than what a concurrent
+ * change wrote through, so it's dropped. */
+void
+grootfs_cache_fill (GRootFSCache *cache,
+                    dev_t dev,
+                    ino_t ino,
+                    const GRootFSData *data,
+                    uint64_t seq)
+{
+  uint64_t hash = cache_hash (dev, ino);
+  CacheShard *shard = get_shard (cache, hash);
+  uint32_t *link;
+
+  pthread_mutex_lock (&shard->lock);
+
+  if (shard->seq == seq)
+    {
+      /* Another fill may have won, with the same data */
+      link = shard_find_link (shard, hash, dev, ino);
+      if (*link == NO_ENTRY)
+        shard_add (shard, hash, link, dev, ino, data);
+    }
+
+  pthread_mutex_unlock (&shard->lock);
+}
+
+void
+grootfs_cache_remove (GRootFSCache *cache,
+                      dev_t dev,
+                      ino_t ino)
+{
+  uint64_t hash = cache_hash (dev, ino);
+  CacheShard *shard = get_shard (cache, hash);
+  uint32_t *link;
+
+  pthread_mutex_lock (&shard->lock);
+
+  shard->seq++;
+  link = shard_find_link (shard, hash, dev, ino);
+  if (*link != NO_ENTRY)
+    {
+      CacheEntry *entry = &shard->entries[*link];
+      uint32_t index = *link;
+      uint32_t last = shard->n_entries - 1;
+
+      *link = entry->hash_next;
+
+      /* Keep the entries dense by moving the last one into the hole */
+      if (index != last)
+        {
+          CacheEntry *last_entry = &shard->entries[last];
+          uint32_t *last_link = shard_find_link (shard, cache_hash (last_entry->dev, last_entry->ino),
+                                                 last_entry->dev, last_entry->ino);
+          *last_link = index;
+          *entry = *last_entry;
+        }
+
+      shard->n_entries--;
+      if (shard->clock_hand >= shard->n_entries)
+        shard->clock_hand = 0;
+    }
+
+  pthread_mutex_unlock (&shard->lock);
+}
+
+/* Whether max_size is enough for any entries, i.e. if
+ * grootfs_cache_new() and grootfs_cache_resize() would succeed */
+bool
+grootfs_cache_size_valid (size_t max_size)
+{
+  return max_shard_entries (max_size) > 0;
+}
+
+/* Changes the memory use of a cache made with a non-zero size. When
+ * shrinking, the entries past the new size are simply dropped.
+ * Returns -1 if max_size is too small for any entries. */
+int
+grootfs_cache_resize (GRootFSCache *cache,
+                      size_t max_size)
+{
+  size_t max_entries = max_shard_entries (max_size);
+
+  if (max_entries == 0)
+    return -1;
+
+  for (int i = 0; i < N_SHARDS; i++)
+    {
+      CacheShard *shard = &cache->shards[i];
+
+      pthread_mutex_lock (&shard->lock);
+
+      shard->max_entries = max_entries;
+      if (shard->n_entries > max_entries)
+        shard->n_entries = max_entries;
+      if (shard->entries != NULL)
+        shard->entries = xrealloc (shard->entries, max_entries * sizeof (CacheEntry));
+      shard->clock_hand = 0;
+
+      /* Rehash what's left into the new bucket array */
+      free (shard->buckets);
+      shard->n_buckets = 1;
+      while (shard->n_buckets < max_entries)
+        shard->n_buckets *= 2;
+      shard->buckets = xmalloc (shard->n_buckets * sizeof (uint32_t));
+      memset (shard->buckets, 0xff, shard->n_buckets * sizeof (uint32_t));
+
+      for (uint32_t index = 0; index < shard->n_entries; index++)
+        {
+          CacheEntry *entry = &shard->entries[index];
+          uint32_t *link = &shard->buckets[cache_hash (entry->dev, entry->ino) & (shard->n_buckets - 1)];
+
+          entry->hash_next = *link;
+          *link = index;
+        }
+
+      pthread_mutex_unlock (&shard->lock);
+    }
+
+  return 0;
+}
+
+void
+grootfs_cache_clear (GRootFSCache *cache)
+{
+  for (int i = 0; i < N_SHARDS; i++)
+    {
+      CacheShard *shard = &cache->shards[i];
+
+      pthread_mutex_lock (&shard->lock);
+      memset (shard->buckets, 0xff, shard->n_buckets * sizeof (uint32_t));
+      shard->n_entries = 0;
+      shard->clock_hand = 0;
+      pthread_mutex_unlock (&shard->lock);
+    }
+}
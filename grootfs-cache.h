@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A bounded cache of the fake metadata, keyed by (dev, ino).
+ *
+ * grootfs is the only writer of the metadata while the filesystem
+ * is mounted, so entries are written through on every change with
+ * grootfs_cache_insert() and never need to be revalidated against
+ * the xattrs. On a miss the cache is filled with grootfs_cache_fill(),
+ * which never replaces a value written through meanwhile.
+ *
+ * The memory use is fixed when creating the cache, and when full
+ * entries are evicted using the CLOCK algorithm, i.e. an
+ * approximation of LRU where each hit sets a referenced bit which is
+ * cleared as the eviction hand sweeps over the entries.
+ */
+
+typedef struct _GRootFSCache GRootFSCache;
+
+GRootFSCache *grootfs_cache_new    (size_t             max_size);
+void          grootfs_cache_free   (GRootFSCache      *cache);
+bool          grootfs_cache_lookup (GRootFSCache      *cache,
+                                    dev_t              dev,
+                                    ino_t              ino,
+                                    GRootFSData       *data_out,
+                                    uint64_t          *seq_out);
+void          grootfs_cache_insert (GRootFSCache      *cache,
+                                    dev_t              dev,
+                                    ino_t              ino,
+                                    const GRootFSData *data);
+void          grootfs_cache_fill   (GRootFSCache      *cache,
+                                    dev_t              dev,
+                                    ino_t              ino,
+                                    const GRootFSData *data,
+                                    uint64_t           seq);
+void          grootfs_cache_remove (GRootFSCache      *cache,
+                                    dev_t              dev,
+                                    ino_t              ino);
+bool          grootfs_cache_size_valid (size_t         max_size);
+int           grootfs_cache_resize (GRootFSCache      *cache,
+                                    size_t             max_size);
+void          grootfs_cache_clear  (GRootFSCache      *cache);
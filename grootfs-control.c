@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "grootfs-control.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Longest command line */
+#define CONTROL_LINE_MAX 4096
+
+struct _GRootControl {
+  char *path;
+  int listen_fd;
+  int quit_fd; /* An eventfd, written to stop the thread */
+  GRootControlFunc func;
+  void *user_data;
+  pthread_t thread;
+};
+
+static int
+send_all (int fd,
+          const char *buf,
+          size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t res = send (fd, buf, len, MSG_NOSIGNAL);
+
+      if (res == -1 && errno == EINTR)
+        continue;
+      if (res == -1)
+        return -1;
+
+      buf += res;
+      len -= res;
+    }
+
+  return 0;
+}
+
+static int
+run_command (GRootControl *control,
+             int fd,
+             const char *command)
+{
+  autofree char *out_buf = NULL;
+  size_t out_size = 0;
+  const char *error;
+  FILE *out;
+
+  out = open_memstream (&out_buf, &out_size);
+  if (out == NULL)
+    die_oom ();
+
+  __debug__ (("control command %s", command));
+
+  error = control->func (command, out, control->user_data);
+  if (error)
+    fprintf (out, "error: %s\n", error);
+  else
+    fprintf (out, "ok\n");
+
+  if (fclose (out) != 0)
+    die_oom ();
+
+  return send_all (fd, out_buf, out_size);
+}
+
+/* Runs the commands of one client until it disconnects, or we are
+ * stopped. Returns FALSE in the latter case. */
+static bool
+serve_client (GRootControl *control,
+              int fd)
+{
+  char buf[CONTROL_LINE_MAX];
+  size_t len = 0;
+
+  while (TRUE)
+    {
+      struct pollfd fds[2] = { { fd, POLLIN }, { control->quit_fd, POLLIN } };
+      char *nl;
+      ssize_t res;
+
+      if (poll (fds, 2, -1) == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return TRUE;
+        }
+
+      if (fds[1].revents)
+        return FALSE;
+
+      res = recv (fd, buf + len, sizeof (buf) - len, 0);
+      if (res == -1 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        return TRUE;
+      len += res;
+
+      while ((nl = memchr (buf, '\n', len)) != NULL)
+        {
+          size_t line_len = nl - buf;
+
+          *nl = 0;
+          if (line_len > 0 && buf[line_len - 1] == '\r')
+            buf[line_len - 1] = 0;
+
+          if (run_command (control, fd, buf) != 0)
+            return TRUE;
+
+          len -= line_len + 1;
+          memmove (buf, nl + 1, len);
+        }
+
+      if (len == sizeof (buf))
+        {
+          static const char too_long[] = "error: command too long\n";
+          send_all (fd, too_long, strlen (too_long));
+          return TRUE;
+        }
+    }
+}
+
+static void *
+control_thread (void *data)
+{
+  GRootControl *control = data;
+
+  while (TRUE)
+    {
+      struct pollfd fds[2] = { { control->listen_fd, POLLIN }, { control->quit_fd, POLLIN } };
+      bool keep_going;
+      int fd;
+
+      if (poll (fds, 2, -1) == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          report ("Control socket poll failed: %s", strerror (errno));
+          break;
+        }
+
+      if (fds[1].revents)
+        break;
+
+      fd = accept4 (control->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd == -1)
+        continue;
+
+      keep_going = serve_client (control, fd);
+      close (fd);
+      if (!keep_going)
+        break;
+    }
+
+  return NULL;
+}
+
+/* A stale socket left by a daemon that died is removed, but one that
+ * a live daemon is listening on is not */
+static int
+remove_stale_socket (const struct sockaddr_un *addr)
+{
+  struct stat st;
+  autofd int fd = -1;
+
+  if (lstat (addr->sun_path, &st) == -1)
+    return errno == ENOENT ? 0 : -1;
+
+  if (!S_ISSOCK (st.st_mode))
+    {
+      errno = EEXIST;
+      return -1;
+    }
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+
+  if (connect (fd, (const struct sockaddr *) addr, sizeof (*addr)) == 0)
+    {
+      errno = EADDRINUSE;
+      return -1;
+    }
+
+  return unlink (addr->sun_path);
+}
+
+/* Listens on a socket at path, which only the user can connect to.
+ * Returns NULL, with the error reported, if that fails. */
+GRootControl *
+grootfs_control_start (const char *path,
+                       GRootControlFunc func,
+                       void *user_data)
+{
+  struct sockaddr_un addr = { AF_UNIX };
+  GRootControl *control;
+  mode_t old_umask;
+  int res;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+      report ("Control socket path %s is too long", path);
+      return NULL;
+    }
+  strcpy (addr.sun_path, path);
+
+  if (remove_stale_socket (&addr) != 0)
+    {
+      report ("Can't use control socket %s: %s", path, strerror (errno));
+      return NULL;
+    }
+
+  control = xcalloc (sizeof (GRootControl));
+  control->func = func;
+  control->user_data = user_data;
+  control->quit_fd = -1;
+
+  control->listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (control->listen_fd == -1)
+    goto fail;
+
+  old_umask = umask (0077);
+  res = bind (control->listen_fd, (const struct sockaddr *) &addr, sizeof (addr));
+  umask (old_umask);
+  if (res == -1)
+    goto fail;
+  control->path = xstrdup (path);
+
+  if (listen (control->listen_fd, 8) == -1)
+    goto fail;
+
+  control->quit_fd = eventfd (0, EFD_CLOEXEC);
+  if (control->quit_fd == -1)
+    goto fail;
+
+  res = pthread_create (&control->thread, NULL, control_thread, control);
+  if (res != 0)
+    {
+      errno = res;
+      goto fail;
+    }
+
+  return control;
+
+ fail:
+  report ("Can't create control socket %s: %s", path, strerror (errno));
+  if (control->path)
+    unlink (control->path);
+  free (control->path);
+  if (control->quit_fd != -1)
+    close (control->quit_fd);
+  if (control->listen_fd != -1)
+    close (control->listen_fd);
+  free (control);
+  return NULL;
+}
+
+/* Waits for the command being run, if any, and removes the socket */
+void
+grootfs_control_stop (GRootControl *control)
+{
+  uint64_t one = 1;
+
+  if (control == NULL)
+    return;
+
+  if (write (control->quit_fd, &one, sizeof (one)) != sizeof (one))
+    report ("Failed to stop control thread: %s", strerror (errno));
+  else
+    pthread_join (control->thread, NULL);
+
+  unlink (control->path);
+  free (control->path);
+  close (control->quit_fd);
+  close (control->listen_fd);
+  free (control);
+}
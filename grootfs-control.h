@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A Unix socket for controlling a running grootfs daemon.
+ *
+ * Each line a client sends is a command, answered with the lines of
+ * its output and then "ok" or "error: MESSAGE". The commands are run
+ * one at a time in a thread of their own, and one client at a time
+ * is served, so e.g. "socat - UNIX-CONNECT:PATH" works as a client.
+ */
+
+#include <stdio.h>
+
+typedef struct _GRootControl GRootControl;
+
+/* Writes the output of command to out. Returns NULL on success, or
+ * an error message, which need not be freed. */
+typedef const char *(*GRootControlFunc) (const char *command,
+                                         FILE       *out,
+                                         void       *user_data);
+
+GRootControl *grootfs_control_start (const char      *path,
+                                     GRootControlFunc func,
+                                     void            *user_data);
+void          grootfs_control_stop  (GRootControl    *control);
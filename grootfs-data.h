@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2021 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* The fake metadata grootfs stores for each file */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define GROOT_DATA_XATTR "user.grootfs"
+
+#define ST_MODE_PERM_MASK (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID | S_ISVTX)
+
+typedef enum {
+  GROOTFS_FLAGS_UID_SET = 1<<0,
+  GROOTFS_FLAGS_GID_SET = 1<<1,
+  GROOTFS_FLAGS_MODE_SET = 1<<2,
+} GrootFSFlags;
+
+typedef struct {
+  uint32_t flags;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t mode;
+} GRootFSData;
+
+static inline void
+fake_data_htonl (const GRootFSData *data,
+                 GRootFSData *data_dst)
+{
+  data_dst->flags = htonl (data->flags);
+  data_dst->mode = htonl (data->mode);
+  data_dst->uid = htonl (data->uid);
+  data_dst->gid = htonl (data->gid);
+}
+
+static inline void
+fake_data_ntohl (const GRootFSData *data,
+                 GRootFSData *data_dst)
+{
+  data_dst->flags = ntohl (data->flags);
+  data_dst->mode = ntohl (data->mode);
+  data_dst->uid = ntohl (data->uid);
+  data_dst->gid = ntohl (data->gid);
+}
+
+/* Computes the real file pemissions for a a faked file.
+ * In order to correctly do things like set permissions and
+ * execute/search the files we set everything to rw for the user,
+ * r-only for rest. For dirs we always set x, and mirror the user x
+ * bit for other files. */
+static inline mode_t
+get_real_mode (int is_dir,
+               int executable_default)
+{
+  mode_t real_mode = S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR;
+  if (is_dir || executable_default)
+    real_mode |= S_IXUSR | S_IXGRP | S_IXOTH;
+  return real_mode;
+}
+
+/* Symlinks can't have user xattrs, so unless they are in the store
+ * their data is kept in the xattr of a file at the top of the wrapped
+ * dir, named after the inode */
+
+/* ".groot.symlink.%lx_%lx" with 64-bit values */
+#define SYMLINK_DATAFILE_SIZE (sizeof (".groot.symlink._") + 2 * 16)
+
+static inline char *
+get_symlink_datafile (dev_t dev,
+                      ino_t ino,
+                      char buf[SYMLINK_DATAFILE_SIZE])
+{
+  snprintf (buf, SYMLINK_DATAFILE_SIZE, ".groot.symlink.%lx_%lx", dev, ino);
+  return buf;
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "grootfs-pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+struct _GRootPoolJob {
+  uint64_t id;
+  GRootPoolFunc func;
+  GRootPoolFunc cancel;
+  void *data;
+  atomic_bool interrupted;
+  GRootPoolJob *next;
+  GRootPoolJob **prev;
+};
+
+struct _GRootPool {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  GRootPoolJob *queue;       /* Oldest first */
+  GRootPoolJob **queue_tail;
+  GRootPoolJob *running;
+  int n_queued;
+  int max_queued;
+  bool quit;
+  int want_threads;          /* Threads from this index up exit */
+  int n_threads;             /* Started and not yet joined */
+  pthread_t *threads;
+};
+
+typedef struct {
+  GRootPool *pool;
+  int index;
+} PoolThreadArg;
+
+static void
+job_list_remove (GRootPool *pool,
+                 GRootPoolJob *job)
+{
+  if (job->next)
+    job->next->prev = job->prev;
+  else if (pool->queue_tail == &job->next)
+    pool->queue_tail = job->prev;
+  *job->prev = job->next;
+}
+
+static void
+job_list_prepend (GRootPoolJob **list,
+                  GRootPoolJob *job)
+{
+  job->next = *list;
+  if (job->next)
+    job->next->prev = &job->next;
+  job->prev = list;
+  *list = job;
+}
+
+static void *
+pool_thread (void *data)
+{
+  PoolThreadArg *arg = data;
+  GRootPool *pool = arg->pool;
+  int index = arg->index;
+
+  free (arg);
+
+  pthread_mutex_lock (&pool->lock);
+  while (TRUE)
+    {
+      GRootPoolJob *job;
+
+      while (pool->queue == NULL && !pool->quit && index < pool->want_threads)
+        pthread_cond_wait (&pool->cond, &pool->lock);
+      if (pool->quit || index >= pool->want_threads)
+        break;
+
+      job = pool->queue;
+      job_list_remove (pool, job);
+      pool->n_queued--;
+      job_list_prepend (&pool->running, job);
+      pthread_mutex_unlock (&pool->lock);
+
+      job->func (job, job->data);
+
+      pthread_mutex_lock (&pool->lock);
+      job_list_remove (pool, job);
+      free (job);
+    }
+  pthread_mutex_unlock (&pool->lock);
+
+  return NULL;
+}
+
+/* At most max_queued jobs wait for a thread, after which
+ * grootfs_pool_push() fails so the caller runs the job itself. Returns
+ * NULL if no threads could be started. */
+GRootPool *
+grootfs_pool_new (int n_threads,
+                  int max_queued)
+{
+  GRootPool *pool = xcalloc (sizeof (GRootPool));
+
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->cond, NULL);
+  pool->queue_tail = &pool->queue;
+  pool->max_queued = max_queued;
+
+  if (grootfs_pool_set_threads (pool, n_threads) != 0)
+    {
+      grootfs_pool_free (pool);
+      return NULL;
+    }
+
+  return pool;
+}
+
+/* Starts or stops threads to have n_threads, which must be at least
+ * one. The stopped threads finish their current job first. Must not
+ * be called concurrently with itself or grootfs_pool_free(). Returns
+ * -1 if no thread could be started. */
+int
+grootfs_pool_set_threads (GRootPool *pool,
+                          int n_threads)
+{
+  int old_n_threads = pool->n_threads;
+
+  if (n_threads < 1)
+    return -1;
+
+  if (n_threads < old_n_threads)
+    {
+      pthread_mutex_lock (&pool->lock);
+      pool->want_threads = n_threads;
+      pthread_cond_broadcast (&pool->cond);
+      pthread_mutex_unlock (&pool->lock);
+
+      for (int i = n_threads; i < old_n_threads; i++)
+        pthread_join (pool->threads[i], NULL);
+
+      pthread_mutex_lock (&pool->lock);
+      pool->n_threads = n_threads;
+      pthread_mutex_unlock (&pool->lock);
+
+      return 0;
+    }
+
+  pool->threads = xrealloc (pool->threads, n_threads * sizeof (pthread_t));
+
+  pthread_mutex_lock (&pool->lock);
+  pool->want_threads = n_threads;
+  for (int i = old_n_threads; i < n_threads; i++)
+    {
+      PoolThreadArg *arg = xmalloc (sizeof (PoolThreadArg));
+      int res;
+
+      arg->pool = pool;
+      arg->index = i;
+      res = pthread_create (&pool->threads[i], NULL, pool_thread, arg);
+      if (res != 0)
+        {
+          report ("Failed to create slow request thread: %s", strerror (res));
+          free (arg);
+          break;
+        }
+      pool->n_threads++;
+    }
+  pool->want_threads = pool->n_threads;
+  pthread_mutex_unlock (&pool->lock);
+
+  return pool->n_threads > 0 ? 0 : -1;
+}
+
+/* Waits for the running jobs, and cancels the queued ones */
+void
+grootfs_pool_free (GRootPool *pool)
+{
+  GRootPoolJob *job;
+
+  pthread_mutex_lock (&pool->lock);
+  pool->quit = TRUE;
+  pthread_cond_broadcast (&pool->cond);
+  pthread_mutex_unlock (&pool->lock);
+
+  for (int i = 0; i < pool->n_threads; i++)
+    pthread_join (pool->threads[i], NULL);
+
+  while ((job = pool->queue) != NULL)
+    {
+      job_list_remove (pool, job);
+      job->cancel (job, job->data);
+      free (job);
+    }
+
+  pthread_cond_destroy (&pool->cond);
+  pthread_mutex_destroy (&pool->lock);
+  free (pool->threads);
+  free (pool);
+}
+
+/* Returns FALSE if the queue is full, and then the caller keeps the
+ * data */
+bool
+grootfs_pool_push (GRootPool *pool,
+                   uint64_t id,
+                   GRootPoolFunc func,
+                   GRootPoolFunc cancel,
+                   void *data)
+{
+  GRootPoolJob *job;
+
+  pthread_mutex_lock (&pool->lock);
+  if (pool->n_queued >= pool->max_queued || pool->quit)
+    {
+      pthread_mutex_unlock (&pool->lock);
+      return FALSE;
+    }
+
+  job = xcalloc (sizeof (GRootPoolJob));
+  job->id = id;
+  job->func = func;
+  job->cancel = cancel;
+  job->data = data;
+  job->prev = pool->queue_tail;
+  *pool->queue_tail = job;
+  pool->queue_tail = &job->next;
+  pool->n_queued++;
+
+  pthread_cond_signal (&pool->cond);
+  pthread_mutex_unlock (&pool->lock);
+
+  return TRUE;
+}
+
+/* Cancels the job with the given id if it hasn't started, and returns
+ * TRUE if so. If it's running it's only marked as interrupted. */
+bool
+grootfs_pool_interrupt (GRootPool *pool,
+                        uint64_t id)
+{
+  GRootPoolJob *job;
+
+  pthread_mutex_lock (&pool->lock);
+  for (job = pool->queue; job != NULL; job = job->next)
+    if (job->id == id)
+      break;
+
+  if (job != NULL)
+    {
+      job_list_remove (pool, job);
+      pool->n_queued--;
+      pthread_mutex_unlock (&pool->lock);
+
+      job->cancel (job, job->data);
+      free (job);
+      return TRUE;
+    }
+
+  for (job = pool->running; job != NULL; job = job->next)
+    if (job->id == id)
+      {
+        atomic_store_explicit (&job->interrupted, TRUE, memory_order_relaxed);
+        break;
+      }
+  pthread_mutex_unlock (&pool->lock);
+
+  return FALSE;
+}
+
+bool
+grootfs_pool_job_interrupted (GRootPoolJob *job)
+{
+  return atomic_load_explicit (&job->interrupted, memory_order_relaxed);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A pool of threads for running the slow requests handed off by the
+ * fuse workers, so that a long fsync or a big read doesn't hold up
+ * the quick metadata requests queued behind it.
+ *
+ * Each job has an id, the fuse unique of its request, by which it can
+ * be interrupted. A job that hasn't started yet is then cancelled,
+ * and one that is running can check grootfs_pool_job_interrupted()
+ * to stop early.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct _GRootPool GRootPool;
+typedef struct _GRootPoolJob GRootPoolJob;
+
+/* Called with the job's data to run it, or to cancel it instead. The
+ * job is freed when it returns. */
+typedef void (*GRootPoolFunc) (GRootPoolJob *job,
+                               void         *data);
+
+GRootPool *grootfs_pool_new              (int           n_threads,
+                                          int           max_queued);
+void       grootfs_pool_free             (GRootPool    *pool);
+int        grootfs_pool_set_threads      (GRootPool    *pool,
+                                          int           n_threads);
+bool       grootfs_pool_push             (GRootPool    *pool,
+                                          uint64_t      id,
+                                          GRootPoolFunc func,
+                                          GRootPoolFunc cancel,
+                                          void         *data);
+bool       grootfs_pool_interrupt        (GRootPool    *pool,
+                                          uint64_t      id);
+bool       grootfs_pool_job_interrupted  (GRootPoolJob *job);
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "grootfs-data.h"
+#include "grootfs-xattr.h"
+#include "grootfs-store.h"
+#include "grootfs-snapshot.h"
+#include "groot-walk.h"
+
+#include <errno.h>
+#include <string.h>
+
+typedef struct {
+  uint64_t dev;
+  uint64_t ino; /* 0 for an empty slot, no file has that */
+  GRootFSData data;
+} SnapshotEntry;
+
+struct _GRootFSSnapshot {
+  SnapshotEntry *entries;
+  size_t n_slots; /* Power of 2 */
+  size_t n_entries;
+};
+
+/* The entries found by one walker thread, merged into the table at
+ * the end */
+typedef struct {
+  SnapshotEntry *entries;
+  size_t n_entries;
+  size_t size;
+  int n_errors;
+} SnapshotWorker;
+
+typedef struct {
+  int basefd;
+  GRootFSStore *store;
+  SnapshotWorker *workers;
+} SnapshotLoader;
+
+static uint64_t
+snapshot_hash (uint64_t dev,
+               uint64_t ino)
+{
+  uint64_t h = (ino * 0x9E3779B97F4A7C15ULL) ^ dev;
+  return h ^ (h >> 29);
+}
+
+static SnapshotEntry *
+snapshot_find_slot (GRootFSSnapshot *snapshot,
+                    uint64_t dev,
+                    uint64_t ino)
+{
+  size_t mask = snapshot->n_slots - 1;
+  size_t i = snapshot_hash (dev, ino) & mask;
+
+  while (snapshot->entries[i].ino != 0 &&
+         (snapshot->entries[i].ino != ino || snapshot->entries[i].dev != dev))
+    i = (i + 1) & mask;
+
+  return &snapshot->entries[i];
+}
+
+/* Same order as grootfs: the store if it has the file, else the
+ * symlink data file or the xattr */
+static int
+read_fake_data (SnapshotLoader *loader,
+                const GRootWalkEntry *entry,
+                GRootFSData *data)
+{
+  char datafile[SYMLINK_DATAFILE_SIZE];
+  ssize_t res;
+
+  if (loader->store != NULL &&
+      grootfs_store_lookup (loader->store, entry->st.st_dev, entry->st.st_ino, data))
+    return 0;
+
+  if (S_ISLNK (entry->st.st_mode))
+    res = groot_getxattrat (loader->basefd,
+                            get_symlink_datafile (entry->st.st_dev, entry->st.st_ino, datafile),
+                            GROOT_DATA_XATTR, data, sizeof (GRootFSData));
+  else
+    res = groot_getxattrat (entry->dirfd, entry->name, GROOT_DATA_XATTR, data, sizeof (GRootFSData));
+
+  if (res == -1 && (errno == ENOENT || errno == ENODATA || errno == ENOTSUP))
+    {
+      GRootFSData zero = {0};
+      *data = zero;
+      return 0;
+    }
+
+  if (res != sizeof (GRootFSData))
+    {
+      report ("Can't read the fake metadata of %s: %s", entry->path,
+              res == -1 ? strerror (errno) : "Wrong xattr size");
+      return -1;
+    }
+
+  fake_data_ntohl (data, data);
+  return 0;
+}
+
+static void
+snapshot_walk_cb (const GRootWalkEntry *entry,
+                  void *user_data)
+{
+  SnapshotLoader *loader = user_data;
+  SnapshotWorker *worker = &loader->workers[entry->worker];
+  GRootFSData zero = {0};
+  GRootFSData data;
+
+  if (read_fake_data (loader, entry, &data) != 0)
+    {
+      worker->n_errors++;
+      return;
+    }
+
+  if (memcmp (&data, &zero, sizeof (GRootFSData)) == 0)
+    return;
+
+  if (worker->n_entries == worker->size)
+    {
+      worker->size = worker->size ? worker->size * 2 : 256;
+      worker->entries = xrealloc (worker->entries, worker->size * sizeof (SnapshotEntry));
+    }
+
+  worker->entries[worker->n_entries].dev = entry->st.st_dev;
+  worker->entries[worker->n_entries].ino = entry->st.st_ino;
+  worker->entries[worker->n_entries].data = data;
+  worker->n_entries++;
+}
+
+/* Returns NULL if some entry couldn't be read, which is reported,
+ * as the snapshot would then give the wrong data for it */
+GRootFSSnapshot *
+grootfs_snapshot_load (int basefd,
+                       GRootFSStore *store,
+                       int n_threads)
+{
+  SnapshotLoader loader = { basefd, store, NULL };
+  GRootFSSnapshot *snapshot;
+  size_t n_found = 0;
+  int n_errors;
+
+  loader.workers = xcalloc (n_threads * sizeof (SnapshotWorker));
+
+  n_errors = groot_walk (basefd, n_threads, snapshot_walk_cb, &loader);
+  for (int i = 0; i < n_threads; i++)
+    {
+      n_errors += loader.workers[i].n_errors;
+      n_found += loader.workers[i].n_entries;
+    }
+
+  if (n_errors > 0)
+    {
+      for (int i = 0; i < n_threads; i++)
+        free (loader.workers[i].entries);
+      free (loader.workers);
+      return NULL;
+    }
+
+  snapshot = xcalloc (sizeof (GRootFSSnapshot));
+  snapshot->n_slots = 16;
+  while (snapshot->n_slots < n_found * 2)
+    snapshot->n_slots *= 2;
+  snapshot->entries = xcalloc (snapshot->n_slots * sizeof (SnapshotEntry));
+
+  /* Hardlinks are found once per name */
+  for (int i = 0; i < n_threads; i++)
+    {
+      SnapshotWorker *worker = &loader.workers[i];
+
+      for (size_t j = 0; j < worker->n_entries; j++)
+        {
+          SnapshotEntry *e = snapshot_find_slot (snapshot, worker->entries[j].dev, worker->entries[j].ino);
+
+          if (e->ino == 0)
+            snapshot->n_entries++;
+          *e = worker->entries[j];
+        }
+
+      free (worker->entries);
+    }
+  free (loader.workers);
+
+  return snapshot;
+}
+
+void
+grootfs_snapshot_free (GRootFSSnapshot *snapshot)
+{
+  if (snapshot == NULL)
+    return;
+
+  free (snapshot->entries);
+  free (snapshot);
+}
+
+size_t
+grootfs_snapshot_size (GRootFSSnapshot *snapshot)
+{
+  return snapshot->n_entries;
+}
+
+/* Bytes used by the table */
+size_t
+grootfs_snapshot_memory (GRootFSSnapshot *snapshot)
+{
+  return snapshot->n_slots * sizeof (SnapshotEntry);
+}
+
+/* Files without fake data, or that didn't exist when the snapshot was
+ * taken, get all zeros */
+void
+grootfs_snapshot_lookup (GRootFSSnapshot *snapshot,
+                         dev_t dev,
+                         ino_t ino,
+                         GRootFSData *data_out)
+{
+  SnapshotEntry *e = snapshot_find_slot (snapshot, dev, ino);
+
+  if (e->ino != 0)
+    *data_out = e->data;
+  else
+    {
+      GRootFSData zero = {0};
+      *data_out = zero;
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A read-only snapshot of all the fake metadata of a wrapped
+ * directory, keyed by (dev, ino), for the frozen mode.
+ *
+ * It is loaded once at startup with a parallel walk of the tree and
+ * never changes afterwards, so lookups need no locks. Only files
+ * with some fake data are kept, a file that isn't in the snapshot
+ * has none. That makes each entry 32 bytes and the table at most
+ * twice that per file.
+ */
+
+typedef struct _GRootFSSnapshot GRootFSSnapshot;
+
+GRootFSSnapshot *grootfs_snapshot_load   (int              basefd,
+                                          GRootFSStore    *store,
+                                          int              n_threads);
+void             grootfs_snapshot_free   (GRootFSSnapshot *snapshot);
+size_t           grootfs_snapshot_size   (GRootFSSnapshot *snapshot);
+size_t           grootfs_snapshot_memory (GRootFSSnapshot *snapshot);
+void             grootfs_snapshot_lookup (GRootFSSnapshot *snapshot,
+                                          dev_t            dev,
+                                          ino_t            ino,
+                                          GRootFSData     *data_out);
@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "grootfs-stats.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+/* Bucket i counts latencies in [2^i, 2^(i+1)) microseconds, with the
+ * first one also taking everything below 1us and the last everything
+ * above. */
+#define N_BUCKETS 24
+
+typedef struct {
+  _Atomic uint64_t count;
+  _Atomic uint64_t total_ns;
+  _Atomic uint64_t max_ns;
+  _Atomic uint64_t syscalls;
+  _Atomic uint64_t buckets[N_BUCKETS];
+} OpStats;
+
+bool grootfs_stats_enabled = FALSE;
+_Atomic uint64_t grootfs_stats_syscalls[GROOTFS_N_SYSCALLS];
+_Atomic uint64_t grootfs_stats_cache_hits;
+_Atomic uint64_t grootfs_stats_cache_misses;
+__thread uint64_t grootfs_stats_thread_syscalls;
+
+static OpStats op_stats[GROOTFS_N_OPS];
+static uint64_t start_time_ns;
+
+static const char *op_names[GROOTFS_N_OPS] = {
+  [GROOTFS_OP_LOOKUP] = "lookup",
+  [GROOTFS_OP_FORGET] = "forget",
+  [GROOTFS_OP_GETATTR] = "getattr",
+  [GROOTFS_OP_SETATTR] = "setattr",
+  [GROOTFS_OP_READLINK] = "readlink",
+  [GROOTFS_OP_OPENDIR] = "opendir",
+  [GROOTFS_OP_READDIR] = "readdir",
+  [GROOTFS_OP_READDIRPLUS] = "readdirplus",
+  [GROOTFS_OP_RELEASEDIR] = "releasedir",
+  [GROOTFS_OP_MKNOD] = "mknod",
+  [GROOTFS_OP_MKDIR] = "mkdir",
+  [GROOTFS_OP_SYMLINK] = "symlink",
+  [GROOTFS_OP_UNLINK] = "unlink",
+  [GROOTFS_OP_RMDIR] = "rmdir",
+  [GROOTFS_OP_RENAME] = "rename",
+  [GROOTFS_OP_LINK] = "link",
+  [GROOTFS_OP_CREATE] = "create",
+  [GROOTFS_OP_OPEN] = "open",
+  [GROOTFS_OP_READ] = "read",
+  [GROOTFS_OP_WRITE] = "write",
+  [GROOTFS_OP_STATFS] = "statfs",
+  [GROOTFS_OP_RELEASE] = "release",
+  [GROOTFS_OP_FSYNC] = "fsync",
+  [GROOTFS_OP_ACCESS] = "access",
+  [GROOTFS_OP_SETXATTR] = "setxattr",
+  [GROOTFS_OP_GETXATTR] = "getxattr",
+  [GROOTFS_OP_LISTXATTR] = "listxattr",
+  [GROOTFS_OP_REMOVEXATTR] = "removexattr",
+  [GROOTFS_OP_COPY_FILE_RANGE] = "copy_file_range",
+};
+
+static const char *syscall_names[GROOTFS_N_SYSCALLS] = {
+  [GROOTFS_SYSCALL_OPENAT] = "openat",
+  [GROOTFS_SYSCALL_FSTATAT] = "fstatat",
+  [GROOTFS_SYSCALL_GETXATTR] = "getxattr",
+  [GROOTFS_SYSCALL_SETXATTR] = "setxattr",
+  [GROOTFS_SYSCALL_LISTXATTR] = "listxattr",
+  [GROOTFS_SYSCALL_REMOVEXATTR] = "removexattr",
+  [GROOTFS_SYSCALL_READLINKAT] = "readlinkat",
+  [GROOTFS_SYSCALL_GETDENTS] = "getdents64",
+  [GROOTFS_SYSCALL_URING_ENTER] = "io_uring_enter",
+};
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+grootfs_stats_enable (void)
+{
+  start_time_ns = now_ns ();
+  grootfs_stats_enabled = TRUE;
+}
+
+/* The counters are kept, and continue if enabled again */
+void
+grootfs_stats_disable (void)
+{
+  grootfs_stats_enabled = FALSE;
+}
+
+/* Returns the start time to pass to grootfs_stats_op_end() */
+uint64_t
+grootfs_stats_op_begin (void)
+{
+  if (!grootfs_stats_enabled)
+    return 0;
+
+  grootfs_stats_thread_syscalls = 0;
+  return now_ns ();
+}
+
+void
+grootfs_stats_op_end (GRootFSOp op,
+                      uint64_t start)
+{
+  OpStats *stats = &op_stats[op];
+  uint64_t ns, us, max;
+  int bucket;
+
+  if (!grootfs_stats_enabled)
+    return;
+
+  ns = now_ns () - start;
+  us = ns / 1000;
+  bucket = us == 0 ? 0 : 63 - __builtin_clzll (us);
+  if (bucket >= N_BUCKETS)
+    bucket = N_BUCKETS - 1;
+
+  atomic_fetch_add_explicit (&stats->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&stats->total_ns, ns, memory_order_relaxed);
+  atomic_fetch_add_explicit (&stats->syscalls, grootfs_stats_thread_syscalls, memory_order_relaxed);
+  atomic_fetch_add_explicit (&stats->buckets[bucket], 1, memory_order_relaxed);
+
+  max = atomic_load_explicit (&stats->max_ns, memory_order_relaxed);
+  while (ns > max &&
+         !atomic_compare_exchange_weak_explicit (&stats->max_ns, &max, ns,
+                                                 memory_order_relaxed, memory_order_relaxed))
+    ;
+}
+
+const char *
+grootfs_stats_op_name (GRootFSOp op)
+{
+  return op_names[op];
+}
+
+void
+grootfs_stats_dump (FILE *out)
+{
+  uint64_t hits, misses;
+
+  if (!grootfs_stats_enabled)
+    {
+      fprintf (out, "grootfs stats are disabled, use -o stats\n");
+      return;
+    }
+
+  fprintf (out, "grootfs stats, pid %d, %.3f s\n\n", (int) getpid (),
+           (now_ns () - start_time_ns) / 1e9);
+
+  fprintf (out, "%-12s %10s %10s %10s %10s  %s\n",
+           "op", "count", "avg us", "max us", "syscalls", "latency histogram (us: count)");
+  for (int op = 0; op < GROOTFS_N_OPS; op++)
+    {
+      OpStats *stats = &op_stats[op];
+      uint64_t count = atomic_load_explicit (&stats->count, memory_order_relaxed);
+
+      if (count == 0)
+        continue;
+
+      fprintf (out, "%-12s %10lu %10.1f %10.1f %10.2f ", op_names[op],
+               (unsigned long) count,
+               atomic_load_explicit (&stats->total_ns, memory_order_relaxed) / 1000.0 / count,
+               atomic_load_explicit (&stats->max_ns, memory_order_relaxed) / 1000.0,
+               (double) atomic_load_explicit (&stats->syscalls, memory_order_relaxed) / count);
+
+      for (int i = 0; i < N_BUCKETS; i++)
+        {
+          uint64_t n = atomic_load_explicit (&stats->buckets[i], memory_order_relaxed);
+          if (n != 0)
+            fprintf (out, " %s%lu:%lu", i == 0 ? "<" : "", i == 0 ? 2UL : 1UL << i, (unsigned long) n);
+        }
+      fprintf (out, "\n");
+    }
+
+  fprintf (out, "\nsyscalls:");
+  for (int i = 0; i < GROOTFS_N_SYSCALLS; i++)
+    fprintf (out, " %s %lu", syscall_names[i],
+             (unsigned long) atomic_load_explicit (&grootfs_stats_syscalls[i], memory_order_relaxed));
+  fprintf (out, "\n");
+
+  hits = atomic_load_explicit (&grootfs_stats_cache_hits, memory_order_relaxed);
+  misses = atomic_load_explicit (&grootfs_stats_cache_misses, memory_order_relaxed);
+  fprintf (out, "metadata cache: %lu hits, %lu misses (%.1f%% hits)\n",
+           (unsigned long) hits, (unsigned long) misses,
+           hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+}
+
+/* Writes to path, or stderr if NULL */
+int
+grootfs_stats_dump_file (const char *path)
+{
+  FILE *out = stderr;
+
+  if (path != NULL)
+    {
+      out = fopen (path, "we");
+      if (out == NULL)
+        {
+          report ("Can't write stats to %s: %s", path, strerror (errno));
+          return -1;
+        }
+    }
+
+  grootfs_stats_dump (out);
+
+  if (path != NULL)
+    fclose (out);
+  else
+    fflush (out);
+
+  return 0;
+}
+
+static void *
+dumper_thread (void *data)
+{
+  const char *path = data;
+  sigset_t set;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR1);
+
+  while (TRUE)
+    {
+      int sig;
+
+      if (sigwait (&set, &sig) == 0)
+        grootfs_stats_dump_file (path);
+    }
+
+  return NULL;
+}
+
+/* Dump the stats to path (or stderr) on SIGUSR1. This has to be
+ * called before starting any other threads, as they must all have
+ * the signal blocked for the dumper to get it. */
+int
+grootfs_stats_start_dumper (const char *path)
+{
+  pthread_t thread;
+  sigset_t set;
+  int res;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR1);
+  res = pthread_sigmask (SIG_BLOCK, &set, NULL);
+  if (res == 0)
+    res = pthread_create (&thread, NULL, dumper_thread, (void *) path);
+  if (res != 0)
+    {
+      report ("Failed to start stats thread: %s", strerror (res));
+      return -1;
+    }
+
+  pthread_detach (thread);
+  return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Process wide counters and latency histograms for the fuse
+ * operations, the backing syscalls they make and the metadata cache.
+ *
+ * Everything is a relaxed atomic add, and nothing is done unless
+ * grootfs_stats_enable() was called, so the checks can be left in the
+ * hot paths. */
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+typedef enum {
+  GROOTFS_OP_LOOKUP,
+  GROOTFS_OP_FORGET,
+  GROOTFS_OP_GETATTR,
+  GROOTFS_OP_SETATTR,
+  GROOTFS_OP_READLINK,
+  GROOTFS_OP_OPENDIR,
+  GROOTFS_OP_READDIR,
+  GROOTFS_OP_READDIRPLUS,
+  GROOTFS_OP_RELEASEDIR,
+  GROOTFS_OP_MKNOD,
+  GROOTFS_OP_MKDIR,
+  GROOTFS_OP_SYMLINK,
+  GROOTFS_OP_UNLINK,
+  GROOTFS_OP_RMDIR,
+  GROOTFS_OP_RENAME,
+  GROOTFS_OP_LINK,
+  GROOTFS_OP_CREATE,
+  GROOTFS_OP_OPEN,
+  GROOTFS_OP_READ,
+  GROOTFS_OP_WRITE,
+  GROOTFS_OP_STATFS,
+  GROOTFS_OP_RELEASE,
+  GROOTFS_OP_FSYNC,
+  GROOTFS_OP_ACCESS,
+  GROOTFS_OP_SETXATTR,
+  GROOTFS_OP_GETXATTR,
+  GROOTFS_OP_LISTXATTR,
+  GROOTFS_OP_REMOVEXATTR,
+  GROOTFS_OP_COPY_FILE_RANGE,
+  GROOTFS_N_OPS
+} GRootFSOp;
+
+typedef enum {
+  GROOTFS_SYSCALL_OPENAT,
+  GROOTFS_SYSCALL_FSTATAT,
+  GROOTFS_SYSCALL_GETXATTR,
+  GROOTFS_SYSCALL_SETXATTR,
+  GROOTFS_SYSCALL_LISTXATTR,
+  GROOTFS_SYSCALL_REMOVEXATTR,
+  GROOTFS_SYSCALL_READLINKAT,
+  GROOTFS_SYSCALL_GETDENTS,
+  GROOTFS_SYSCALL_URING_ENTER,
+  GROOTFS_N_SYSCALLS
+} GRootFSSyscall;
+
+extern bool grootfs_stats_enabled;
+extern _Atomic uint64_t grootfs_stats_syscalls[GROOTFS_N_SYSCALLS];
+extern _Atomic uint64_t grootfs_stats_cache_hits;
+extern _Atomic uint64_t grootfs_stats_cache_misses;
+/* Syscalls made by the current thread, see grootfs_stats_op_end() */
+extern __thread uint64_t grootfs_stats_thread_syscalls;
+
+void     grootfs_stats_enable      (void);
+void     grootfs_stats_disable     (void);
+uint64_t grootfs_stats_op_begin    (void);
+void     grootfs_stats_op_end      (GRootFSOp    op,
+                                    uint64_t     start);
+const char *grootfs_stats_op_name (GRootFSOp op);
+void     grootfs_stats_dump        (FILE        *out);
+int      grootfs_stats_dump_file   (const char  *path);
+int      grootfs_stats_start_dumper (const char *path);
+
+static inline void
+grootfs_stats_syscall (GRootFSSyscall syscall)
+{
+  if (grootfs_stats_enabled)
+    {
+      atomic_fetch_add_explicit (&grootfs_stats_syscalls[syscall], 1, memory_order_relaxed);
+      grootfs_stats_thread_syscalls++;
+    }
+}
+
+static inline void
+grootfs_stats_cache (bool hit)
+{
+  if (grootfs_stats_enabled)
+    atomic_fetch_add_explicit (hit ? &grootfs_stats_cache_hits : &grootfs_stats_cache_misses,
+                               1, memory_order_relaxed);
+}
@@ -0,0 +1,669 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "grootfs-data.h"
+#include "grootfs-store.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STORE_TMP_FILE GROOTFS_STORE_FILE ".tmp"
+#define STORE_MAGIC "GROOTMD\0"
+#define STORE_VERSION 1
+
+/* Don't bother compacting until there is at least this many superseded
+ * records in the log */
+#define STORE_MIN_GARBAGE 4096
+
+typedef enum {
+  STORE_OP_SET = 1,
+  STORE_OP_REMOVE = 2,
+} StoreOp;
+
+/* All fields are big-endian on disk */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+} StoreHeader;
+
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  GRootFSData data;
+  uint32_t op;
+  uint32_t crc;  /* Of all the preceding fields */
+} StoreRecord;
+
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  GRootFSData data;
+  uint32_t used;
+} StoreEntry;
+
+struct _GRootFSStore {
+  pthread_mutex_t lock;
+  int basefd;
+  int fd;
+  bool readonly;
+  off_t log_end;
+  uint64_t n_records;  /* In the log, including superseded ones */
+  StoreEntry *entries; /* Open addressing, linear probing */
+  uint32_t n_slots;    /* Power of 2 */
+  uint32_t n_entries;
+};
+
+static uint32_t
+store_crc32 (const void *buf,
+             size_t len)
+{
+  const unsigned char *p = buf;
+  uint32_t crc = 0xFFFFFFFF;
+
+  while (len--)
+    {
+      crc ^= *p++;
+      for (int i = 0; i < 8; i++)
+        crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+
+  return ~crc;
+}
+
+static uint32_t
+store_hash (uint64_t dev,
+            uint64_t ino)
+{
+  uint64_t h = (ino * 0x9E3779B97F4A7C15ULL) ^ dev;
+  h ^= h >> 29;
+  return (uint32_t) (h ^ (h >> 32));
+}
+
+static StoreEntry *
+store_find_slot (StoreEntry *entries,
+                 uint32_t n_slots,
+                 uint64_t dev,
+                 uint64_t ino)
+{
+  uint32_t mask = n_slots - 1;
+  uint32_t i = store_hash (dev, ino) & mask;
+
+  while (entries[i].used &&
+         (entries[i].dev != dev || entries[i].ino != ino))
+    i = (i + 1) & mask;
+
+  return &entries[i];
+}
+
+static void
+store_index_grow (GRootFSStore *store)
+{
+  uint32_t n_slots = store->n_slots * 2;
+  StoreEntry *entries = xcalloc (n_slots * sizeof (StoreEntry));
+
+  for (uint32_t i = 0; i < store->n_slots; i++)
+    {
+      StoreEntry *old = &store->entries[i];
+      if (old->used)
+        *store_find_slot (entries, n_slots, old->dev, old->ino) = *old;
+    }
+
+  free (store->entries);
+  store->entries = entries;
+  store->n_slots = n_slots;
+}
+
+static void
+store_index_set (GRootFSStore *store,
+                 uint64_t dev,
+                 uint64_t ino,
+                 const GRootFSData *data)
+{
+  StoreEntry *e;
+
+  /* Keep the load factor below 3/4 */
+  if ((store->n_entries + 1) * 4 > store->n_slots * 3)
+    store_index_grow (store);
+
+  e = store_find_slot (store->entries, store->n_slots, dev, ino);
+  if (!e->used)
+    {
+      e->used = TRUE;
+      e->dev = dev;
+      e->ino = ino;
+      store->n_entries++;
+    }
+  e->data = *data;
+}
+
+static void
+store_index_remove (GRootFSStore *store,
+                    uint64_t dev,
+                    uint64_t ino)
+{
+  uint32_t mask = store->n_slots - 1;
+  StoreEntry *e = store_find_slot (store->entries, store->n_slots, dev, ino);
+  uint32_t hole, i;
+
+  if (!e->used)
+    return;
+
+  /* Backward shift deletion, so that lookups never need tombstones */
+  hole = e - store->entries;
+  i = hole;
+  while (TRUE)
+    {
+      uint32_t home;
+
+      i = (i + 1) & mask;
+      if (!store->entries[i].used)
+        break;
+
+      home = store_hash (store->entries[i].dev, store->entries[i].ino) & mask;
+      /* Move the entry into the hole unless its home slot is
+       * cyclically in (hole, i] */
+      if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+          store->entries[hole] = store->entries[i];
+          hole = i;
+        }
+    }
+
+  store->entries[hole].used = FALSE;
+  store->n_entries--;
+}
+
+static void
+store_record_init (StoreRecord *rec,
+                   StoreOp op,
+                   uint64_t dev,
+                   uint64_t ino,
+                   const GRootFSData *data)
+{
+  memset (rec, 0, sizeof (StoreRecord));
+  rec->dev = htobe64 (dev);
+  rec->ino = htobe64 (ino);
+  if (data)
+    fake_data_htonl (data, &rec->data);
+  rec->op = htobe32 (op);
+  rec->crc = htobe32 (store_crc32 (rec, offsetof (StoreRecord, crc)));
+}
+
+static bool
+store_record_valid (const StoreRecord *rec)
+{
+  uint32_t op = be32toh (rec->op);
+
+  return
+    be32toh (rec->crc) == store_crc32 (rec, offsetof (StoreRecord, crc)) &&
+    (op == STORE_OP_SET || op == STORE_OP_REMOVE);
+}
+
+static void
+store_header_init (StoreHeader *header)
+{
+  memcpy (header->magic, STORE_MAGIC, sizeof (header->magic));
+  header->version = htobe32 (STORE_VERSION);
+  header->record_size = htobe32 (sizeof (StoreRecord));
+}
+
+static int
+write_all_at (int fd,
+              const void *buf,
+              size_t len,
+              off_t offset)
+{
+  const char *p = buf;
+
+  while (len > 0)
+    {
+      ssize_t res = pwrite (fd, p, len, offset);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      p += res;
+      len -= res;
+      offset += res;
+    }
+
+  return 0;
+}
+
+static int
+store_load (GRootFSStore *store)
+{
+  StoreHeader header;
+  StoreRecord recs[256];
+  off_t offset;
+  ssize_t res;
+
+  res = pread (store->fd, &header, sizeof (header), 0);
+  if (res < 0)
+    return -1;
+
+  if (res == 0 && store->readonly)
+    {
+      store->log_end = 0;
+      return 0;
+    }
+
+  if (res == 0)
+    {
+      /* New store */
+      store_header_init (&header);
+      if (write_all_at (store->fd, &header, sizeof (header), 0) < 0)
+        return -1;
+      store->log_end = sizeof (header);
+      return 0;
+    }
+
+  if (res != sizeof (header) ||
+      memcmp (header.magic, STORE_MAGIC, sizeof (header.magic)) != 0 ||
+      be32toh (header.version) != STORE_VERSION ||
+      be32toh (header.record_size) != sizeof (StoreRecord))
+    {
+      report ("Unsupported format of %s", GROOTFS_STORE_FILE);
+      errno = EINVAL;
+      return -1;
+    }
+
+  offset = sizeof (header);
+  while ((res = pread (store->fd, recs, sizeof (recs), offset)) != 0)
+    {
+      size_t n;
+
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+
+      n = res / sizeof (StoreRecord);
+      for (size_t i = 0; i < n; i++)
+        {
+          StoreRecord *rec = &recs[i];
+          GRootFSData data;
+
+          if (!store_record_valid (rec))
+            {
+              n = i;
+              res = 0;
+              break;
+            }
+
+          if (be32toh (rec->op) == STORE_OP_SET)
+            {
+              fake_data_ntohl (&rec->data, &data);
+              store_index_set (store, be64toh (rec->dev), be64toh (rec->ino), &data);
+            }
+          else
+            store_index_remove (store, be64toh (rec->dev), be64toh (rec->ino));
+        }
+
+      offset += n * sizeof (StoreRecord);
+      store->n_records += n;
+
+      /* A short or corrupt record can only be the result of an
+       * interrupted append, and nothing after it is trustworthy */
+      if (n * sizeof (StoreRecord) != (size_t) res)
+        {
+          if (store->readonly)
+            break;
+
+          report ("Dropping incomplete records at the end of %s", GROOTFS_STORE_FILE);
+          if (ftruncate (store->fd, offset) < 0)
+            return -1;
+          break;
+        }
+    }
+
+  store->log_end = offset;
+  return 0;
+}
+
+/* Writes the live records to a new file and renames it over the log.
+ * The lock is only held to copy the index, and at the end to copy the
+ * records appended meanwhile and swap in the new file, so the writing
+ * and fdatasync don't stall the callers. */
+static int
+store_compact (GRootFSStore *store)
+{
+  autofd int fd = -1;
+  autofree StoreEntry *entries = NULL;
+  autofree StoreRecord *recs = NULL;
+  StoreRecord tail[256];
+  StoreHeader header;
+  uint32_t n_slots;
+  size_t n = 0;
+  off_t copied, new_end;
+  uint64_t n_tail = 0;
+
+  pthread_mutex_lock (&store->lock);
+  n_slots = store->n_slots;
+  entries = xmalloc (n_slots * sizeof (StoreEntry));
+  memcpy (entries, store->entries, n_slots * sizeof (StoreEntry));
+  copied = store->log_end;
+  pthread_mutex_unlock (&store->lock);
+
+  recs = xmalloc ((n_slots + 1) * sizeof (StoreRecord));
+  for (uint32_t i = 0; i < n_slots; i++)
+    {
+      StoreEntry *e = &entries[i];
+      if (e->used)
+        store_record_init (&recs[n++], STORE_OP_SET, e->dev, e->ino, &e->data);
+    }
+
+  fd = openat (store->basefd, STORE_TMP_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return -1;
+
+  /* Lock the new file before it becomes visible, so that another
+   * instance can't open it in between */
+  if (flock (fd, LOCK_EX | LOCK_NB) < 0)
+    goto fail;
+
+  store_header_init (&header);
+  if (write_all_at (fd, &header, sizeof (header), 0) < 0 ||
+      write_all_at (fd, recs, n * sizeof (StoreRecord), sizeof (header)) < 0 ||
+      fdatasync (fd) < 0)
+    goto fail;
+
+  new_end = sizeof (header) + n * sizeof (StoreRecord);
+
+  pthread_mutex_lock (&store->lock);
+
+  /* Replaying the appends on top of the copy gives the same index.
+   * The log only has whole records up to log_end. */
+  while (copied < store->log_end)
+    {
+      size_t len = store->log_end - copied;
+      ssize_t res;
+
+      if (len > sizeof (tail))
+        len = sizeof (tail);
+
+      res = pread (store->fd, tail, len, copied);
+
+      if (res <= 0 || res % sizeof (StoreRecord) != 0 ||
+          write_all_at (fd, tail, res, new_end) < 0)
+        {
+          if (res == 0)
+            errno = EIO;
+          pthread_mutex_unlock (&store->lock);
+          goto fail;
+        }
+
+      copied += res;
+      new_end += res;
+      n_tail += res / sizeof (StoreRecord);
+    }
+
+  if (renameat (store->basefd, STORE_TMP_FILE, store->basefd, GROOTFS_STORE_FILE) < 0)
+    {
+      pthread_mutex_unlock (&store->lock);
+      goto fail;
+    }
+
+  close (store->fd);
+  store->fd = steal_fd (&fd);
+  store->log_end = new_end;
+  store->n_records = n + n_tail;
+
+  pthread_mutex_unlock (&store->lock);
+
+  __debug__(("Compacted %s to %zu records", GROOTFS_STORE_FILE, n));
+  return 0;
+
+ fail:
+  {
+    int errsv = errno;
+    unlinkat (store->basefd, STORE_TMP_FILE, 0);
+    errno = errsv;
+    return -1;
+  }
+}
+
+/* Compacts the log if enough of it is superseded. This may take a
+ * while, so it's meant to be called from a background thread, and
+ * only one at a time. */
+void
+grootfs_store_maybe_compact (GRootFSStore *store)
+{
+  bool needed;
+
+  pthread_mutex_lock (&store->lock);
+  needed = !store->readonly &&
+    store->n_records >= 2 * (uint64_t) store->n_entries + STORE_MIN_GARBAGE;
+  pthread_mutex_unlock (&store->lock);
+
+  /* The log is still valid if this fails, just bigger than needed */
+  if (needed && store_compact (store) < 0)
+    report ("Failed to compact %s: %s", GROOTFS_STORE_FILE, strerror (errno));
+}
+
+static GRootFSStore *
+store_open (int basefd,
+            bool readonly)
+{
+  GRootFSStore *store;
+  autofd int fd = -1;
+
+  if (readonly)
+    fd = openat (basefd, GROOTFS_STORE_FILE, O_RDONLY | O_CLOEXEC);
+  else
+    fd = openat (basefd, GROOTFS_STORE_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return NULL;
+
+  /* Readers can share it, but not with a writer */
+  if (flock (fd, (readonly ? LOCK_SH : LOCK_EX) | LOCK_NB) < 0)
+    return NULL;
+
+  store = xcalloc (sizeof (GRootFSStore));
+  pthread_mutex_init (&store->lock, NULL);
+  store->basefd = basefd;
+  store->fd = steal_fd (&fd);
+  store->readonly = readonly;
+  store->n_slots = 64;
+  store->entries = xcalloc (store->n_slots * sizeof (StoreEntry));
+
+  if (store_load (store) < 0)
+    {
+      int errsv = errno;
+      grootfs_store_close (store);
+      errno = errsv;
+      return NULL;
+    }
+
+  return store;
+}
+
+GRootFSStore *
+grootfs_store_open (int basefd)
+{
+  return store_open (basefd, FALSE);
+}
+
+/* Never writes to the directory. A missing store fails with ENOENT,
+ * and grootfs_store_set() and grootfs_store_remove() with EROFS. */
+GRootFSStore *
+grootfs_store_open_readonly (int basefd)
+{
+  return store_open (basefd, TRUE);
+}
+
+void
+grootfs_store_close (GRootFSStore *store)
+{
+  if (store == NULL)
+    return;
+
+  if (!store->readonly)
+    fdatasync (store->fd);
+  close (store->fd);
+  pthread_mutex_destroy (&store->lock);
+  free (store->entries);
+  free (store);
+}
+
+bool
+grootfs_store_lookup (GRootFSStore *store,
+                      dev_t dev,
+                      ino_t ino,
+                      GRootFSData *data_out)
+{
+  StoreEntry *e;
+  bool found;
+
+  pthread_mutex_lock (&store->lock);
+
+  e = store_find_slot (store->entries, store->n_slots, dev, ino);
+  found = e->used;
+  if (found)
+    *data_out = e->data;
+
+  pthread_mutex_unlock (&store->lock);
+
+  return found;
+}
+
+/* Called with the lock held */
+static int
+store_append (GRootFSStore *store,
+              StoreOp op,
+              uint64_t dev,
+              uint64_t ino,
+              const GRootFSData *data)
+{
+  StoreRecord rec;
+
+  if (store->readonly)
+    return -EROFS;
+
+  store_record_init (&rec, op, dev, ino, data);
+
+  /* Each record is written with a single pwrite, and a torn write is
+   * caught by the crc on the next load.  On failure, overwrite any
+   * partial record on the next append. */
+  if (write_all_at (store->fd, &rec, sizeof (rec), store->log_end) < 0)
+    return -errno;
+
+  store->log_end += sizeof (rec);
+  store->n_records++;
+
+  return 0;
+}
+
+int
+grootfs_store_set (GRootFSStore *store,
+                   dev_t dev,
+                   ino_t ino,
+                   const GRootFSData *data)
+{
+  int res;
+
+  pthread_mutex_lock (&store->lock);
+
+  res = store_append (store, STORE_OP_SET, dev, ino, data);
+  if (res == 0)
+    store_index_set (store, dev, ino, data);
+
+  pthread_mutex_unlock (&store->lock);
+
+  return res;
+}
+
+int
+grootfs_store_remove (GRootFSStore *store,
+                      dev_t dev,
+                      ino_t ino)
+{
+  StoreEntry *e;
+  int res = 0;
+
+  pthread_mutex_lock (&store->lock);
+
+  e = store_find_slot (store->entries, store->n_slots, dev, ino);
+  if (e->used)
+    {
+      res = store_append (store, STORE_OP_REMOVE, dev, ino, NULL);
+      if (res == 0)
+        store_index_remove (store, dev, ino);
+    }
+
+  pthread_mutex_unlock (&store->lock);
+
+  return res;
+}
+
+int
+grootfs_store_sync (GRootFSStore *store)
+{
+  int res;
+
+  pthread_mutex_lock (&store->lock);
+  res = fdatasync (store->fd) < 0 ? -errno : 0;
+  pthread_mutex_unlock (&store->lock);
+
+  return res;
+}
+
+/* Returns the number of files in the store, and their keys in a newly
+ * allocated array */
+size_t
+grootfs_store_list (GRootFSStore *store,
+                    GRootFSStoreKey **keys_out)
+{
+  GRootFSStoreKey *keys;
+  size_t n = 0;
+
+  pthread_mutex_lock (&store->lock);
+
+  keys = xmalloc ((store->n_entries + 1) * sizeof (GRootFSStoreKey));
+  for (uint32_t i = 0; i < store->n_slots; i++)
+    {
+      if (store->entries[i].used)
+        {
+          keys[n].dev = store->entries[i].dev;
+          keys[n].ino = store->entries[i].ino;
+          n++;
+        }
+    }
+
+  pthread_mutex_unlock (&store->lock);
+
+  *keys_out = keys;
+  return n;
+}
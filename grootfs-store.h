@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A store of fake metadata in a single file at the root of the
+ * wrapped directory, used for the files that can't have xattrs, i.e.
+ * symlinks, and optionally for everything.
+ *
+ * The file is an append-only log of fixed size records, each with a
+ * checksum, which is loaded into an in-memory index at startup. A
+ * crash can at worst leave a partially written record at the end,
+ * which is detected and dropped when loading. The log is compacted by
+ * writing the live records to a new file and renaming it over the
+ * old one once enough of it is superseded, which is done whenever
+ * grootfs_store_maybe_compact() is called. Until then the mtime of the
+ * file is that of the last change.
+ *
+ * Only one process at a time can have the store open for writing,
+ * which is enforced with flock(). If it is already in use the open
+ * fails with EWOULDBLOCK. Data moved into the store is not kept
+ * anywhere else, so the caller must not fall back to another way of
+ * storing it then.
+ */
+
+#define GROOTFS_STORE_FILE ".groot.metadata"
+
+typedef struct _GRootFSStore GRootFSStore;
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+} GRootFSStoreKey;
+
+GRootFSStore *grootfs_store_open   (int                basefd);
+GRootFSStore *grootfs_store_open_readonly (int          basefd);
+void          grootfs_store_close  (GRootFSStore      *store);
+bool          grootfs_store_lookup (GRootFSStore      *store,
+                                    dev_t              dev,
+                                    ino_t              ino,
+                                    GRootFSData       *data_out);
+int           grootfs_store_set    (GRootFSStore      *store,
+                                    dev_t              dev,
+                                    ino_t              ino,
+                                    const GRootFSData *data);
+int           grootfs_store_remove (GRootFSStore      *store,
+                                    dev_t              dev,
+                                    ino_t              ino);
+int           grootfs_store_sync   (GRootFSStore      *store);
+void          grootfs_store_maybe_compact (GRootFSStore *store);
+size_t        grootfs_store_list   (GRootFSStore      *store,
+                                    GRootFSStoreKey  **keys_out);
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "grootfs-stats.h"
+#include "grootfs-trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+
+/* Per thread, a power of 2 */
+#define RING_SIZE (256 * 1024)
+
+/* How often the writer drains the rings */
+#define DRAIN_INTERVAL_MS 100
+
+typedef struct _TraceRing TraceRing;
+
+/* Written only by its thread at head, and by the writer at tail */
+struct _TraceRing {
+  TraceRing *next;      /* Protected by rings_lock */
+  uint32_t thread;
+  atomic_size_t head;
+  atomic_size_t tail;
+  atomic_bool dead;     /* Its thread exited, freed once drained */
+  char buf[RING_SIZE];
+};
+
+bool grootfs_trace_enabled = FALSE;
+
+static uint64_t start_time_ns;
+static FILE *trace_file;
+static pthread_t writer_thread;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static TraceRing *rings;      /* Protected by rings_lock */
+static bool writer_quit;      /* Protected by rings_lock */
+static uint32_t n_threads;    /* Protected by rings_lock */
+static atomic_uint_fast64_t n_dropped;
+static pthread_key_t ring_key;
+static __thread TraceRing *thread_ring;
+
+uint64_t
+grootfs_trace_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+ring_thread_exited (void *data)
+{
+  TraceRing *ring = data;
+
+  atomic_store_explicit (&ring->dead, TRUE, memory_order_release);
+}
+
+static TraceRing *
+get_thread_ring (void)
+{
+  TraceRing *ring = thread_ring;
+
+  if (ring != NULL)
+    return ring;
+
+  ring = xcalloc (sizeof (TraceRing));
+  pthread_mutex_lock (&rings_lock);
+  ring->thread = n_threads++;
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock (&rings_lock);
+
+  pthread_setspecific (ring_key, ring);
+  thread_ring = ring;
+
+  return ring;
+}
+
+static void
+ring_copy_in (TraceRing *ring,
+              size_t pos,
+              const void *data,
+              size_t len)
+{
+  size_t offset = pos & (RING_SIZE - 1);
+  size_t first = MIN (len, RING_SIZE - offset);
+
+  if (len == 0)
+    return;
+
+  memcpy (ring->buf + offset, data, first);
+  memcpy (ring->buf, (const char *) data + first, len - first);
+}
+
+void
+grootfs_trace_record (uint16_t op,
+                      uint64_t start_ns,
+                      uint64_t nodeid,
+                      uint64_t arg0,
+                      uint64_t arg1,
+                      uint64_t arg2,
+                      const char *name,
+                      const char *name2)
+{
+  static const char padding[8] = { 0 };
+  TraceRing *ring = get_thread_ring ();
+  uint64_t now = grootfs_trace_now ();
+  size_t name_size = name ? strlen (name) : 0;
+  size_t name2_size = name2 ? strlen (name2) + 1 : 0; /* With the separator */
+  GRootTraceRecord record;
+  size_t head, tail, len, size;
+
+  len = name_size + name2_size;
+  if (len > UINT16_MAX)
+    len = name_size = name2_size = 0;
+  size = (sizeof (record) + len + 7) & ~(size_t) 7;
+
+  head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+  if (RING_SIZE - (head - tail) < size)
+    {
+      atomic_fetch_add_explicit (&n_dropped, 1, memory_order_relaxed);
+      return;
+    }
+
+  record.start_ns = start_ns - start_time_ns;
+  record.duration_ns = now - start_ns;
+  record.nodeid = nodeid;
+  record.args[0] = arg0;
+  record.args[1] = arg1;
+  record.args[2] = arg2;
+  record.thread = ring->thread;
+  record.op = op;
+  record.name_len = len;
+
+  ring_copy_in (ring, head, &record, sizeof (record));
+  ring_copy_in (ring, head + sizeof (record), name, name_size);
+  if (name2_size > 0)
+    {
+      ring_copy_in (ring, head + sizeof (record) + name_size, "", 1);
+      ring_copy_in (ring, head + sizeof (record) + name_size + 1, name2, name2_size - 1);
+    }
+  ring_copy_in (ring, head + sizeof (record) + len, padding, size - sizeof (record) - len);
+
+  atomic_store_explicit (&ring->head, head + size, memory_order_release);
+
+  /* Don't wait for the next drain if filling up fast. Without taking
+   * the lock the wakeup may be missed, but then it's just late. */
+  if (head - tail < RING_SIZE / 2 && head + size - tail >= RING_SIZE / 2)
+    pthread_cond_signal (&writer_cond);
+}
+
+/* Called with rings_lock held */
+static void
+drain_rings (void)
+{
+  TraceRing **l = &rings;
+
+  while (*l != NULL)
+    {
+      TraceRing *ring = *l;
+      bool dead = atomic_load_explicit (&ring->dead, memory_order_acquire);
+      size_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+      size_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+
+      while (tail != head)
+        {
+          size_t offset = tail & (RING_SIZE - 1);
+          size_t len = MIN (head - tail, RING_SIZE - offset);
+
+          if (fwrite (ring->buf + offset, 1, len, trace_file) != len)
+            report ("Failed to write trace: %s", strerror (errno));
+          tail += len;
+        }
+      atomic_store_explicit (&ring->tail, tail, memory_order_release);
+
+      if (dead)
+        {
+          *l = ring->next;
+          free (ring);
+        }
+      else
+        l = &ring->next;
+    }
+
+  fflush (trace_file);
+}
+
+static void *
+trace_writer_thread (void *data)
+{
+  pthread_mutex_lock (&rings_lock);
+  while (!writer_quit)
+    {
+      struct timespec deadline;
+
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += DRAIN_INTERVAL_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000)
+        {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+
+      pthread_cond_timedwait (&writer_cond, &rings_lock, &deadline);
+      drain_rings ();
+    }
+  pthread_mutex_unlock (&rings_lock);
+
+  return NULL;
+}
+
+/* Starts tracing to path, once per process. This has to be called
+ * after daemonizing, as the writer is a thread. */
+int
+grootfs_trace_start (const char *path)
+{
+  GRootTraceHeader header = { GROOTFS_TRACE_MAGIC, GROOTFS_TRACE_VERSION, GROOTFS_N_OPS };
+  int res;
+
+  if (grootfs_trace_enabled)
+    return 0;
+
+  trace_file = fopen (path, "we");
+  if (trace_file == NULL)
+    {
+      report ("Can't open trace file %s: %s", path, strerror (errno));
+      return -1;
+    }
+
+  if (fwrite (&header, sizeof (header), 1, trace_file) != 1)
+    {
+      report ("Can't write trace file %s: %s", path, strerror (errno));
+      fclose (trace_file);
+      return -1;
+    }
+
+  pthread_key_create (&ring_key, ring_thread_exited);
+  start_time_ns = grootfs_trace_now ();
+
+  res = pthread_create (&writer_thread, NULL, trace_writer_thread, NULL);
+  if (res != 0)
+    {
+      report ("Failed to start trace thread: %s", strerror (res));
+      fclose (trace_file);
+      return -1;
+    }
+
+  grootfs_trace_enabled = TRUE;
+  return 0;
+}
+
+/* Writes what was recorded so far and closes the file. Records of ops
+ * still running are lost. */
+void
+grootfs_trace_stop (void)
+{
+  uint64_t dropped;
+
+  if (!grootfs_trace_enabled)
+    return;
+
+  grootfs_trace_enabled = FALSE;
+
+  pthread_mutex_lock (&rings_lock);
+  writer_quit = TRUE;
+  pthread_cond_signal (&writer_cond);
+  pthread_mutex_unlock (&rings_lock);
+  pthread_join (writer_thread, NULL);
+
+  pthread_mutex_lock (&rings_lock);
+  drain_rings ();
+  pthread_mutex_unlock (&rings_lock);
+
+  if (fclose (trace_file) != 0)
+    report ("Failed to write trace: %s", strerror (errno));
+
+  dropped = atomic_load_explicit (&n_dropped, memory_order_relaxed);
+  if (dropped > 0)
+    report ("%lu trace records were dropped", (unsigned long) dropped);
+}
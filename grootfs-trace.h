@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A compact binary trace of the fuse operations, for reproducing a
+ * workload later with groot-replay.
+ *
+ * Each thread appends fixed size records to a ring buffer of its own,
+ * which a writer thread drains to the trace file, so recording takes
+ * no locks. If a ring is full, because the writer can't keep up, the
+ * record is dropped and counted instead.
+ *
+ * Besides one record per operation there is a GROOTFS_TRACE_ENTRY
+ * record for each name the kernel is given a node id for, by lookups
+ * as well as by readdirplus, so that the node ids of the other
+ * records can be resolved to paths.
+ *
+ * The file is a GRootTraceHeader followed by the records, each
+ * followed by name_len bytes of names padded to a multiple of 8. The
+ * records are in order per thread, not overall.
+ */
+
+#include <stdint.h>
+
+#define GROOTFS_TRACE_MAGIC "GRTRACE1"
+#define GROOTFS_TRACE_VERSION 1
+
+/* The op of the records for names given to the kernel. nodeid is the
+ * parent, args[0] the node id of the name. */
+#define GROOTFS_TRACE_ENTRY GROOTFS_N_OPS
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_ops;       /* GROOTFS_N_OPS, to catch a changed op list */
+} GRootTraceHeader;
+
+/* What the args are depends on the op, see the recording in grootfs.c.
+ * Two names, such as the old and new name of a rename, are separated
+ * by a nul, and name_len counts both. */
+typedef struct {
+  uint64_t start_ns;    /* Since the trace was started */
+  uint64_t duration_ns;
+  uint64_t nodeid;
+  uint64_t args[3];
+  uint32_t thread;      /* Index of the recording thread */
+  uint16_t op;          /* A GRootFSOp, or GROOTFS_TRACE_ENTRY */
+  uint16_t name_len;
+} GRootTraceRecord;
+
+extern bool grootfs_trace_enabled;
+
+int      grootfs_trace_start  (const char *path);
+void     grootfs_trace_stop   (void);
+uint64_t grootfs_trace_now    (void);
+void     grootfs_trace_record (uint16_t    op,
+                               uint64_t    start_ns,
+                               uint64_t    nodeid,
+                               uint64_t    arg0,
+                               uint64_t    arg1,
+                               uint64_t    arg2,
+                               const char *name,
+                               const char *name2);
+
+/* Returns the start time to pass to grootfs_trace_record(), or 0 if
+ * not tracing */
+static inline uint64_t
+grootfs_trace_begin (void)
+{
+  return grootfs_trace_enabled ? grootfs_trace_now () : 0;
+}
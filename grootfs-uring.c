@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "grootfs-uring.h"
+#include "grootfs-stats.h"
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+/* Batches larger than this are split over several io_uring_enter()s */
+#define RING_ENTRIES 64
+
+typedef struct {
+  int fd;
+  void *ring;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  _Atomic unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  _Atomic unsigned *cq_head;
+  _Atomic unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+} GRootUring;
+
+static bool uring_usable = FALSE;
+static pthread_key_t ring_key;
+static __thread GRootUring *thread_ring;
+static __thread bool thread_ring_failed;
+
+static void
+ring_free (GRootUring *ring)
+{
+  if (ring->sqes)
+    munmap (ring->sqes, ring->sqes_size);
+  if (ring->ring)
+    munmap (ring->ring, ring->ring_size);
+  if (ring->fd != -1)
+    close (ring->fd);
+  free (ring);
+}
+
+static void
+ring_key_destroy (void *data)
+{
+  ring_free (data);
+}
+
+/* SUBMIT_ALL keeps one invalid op from failing the rest of a batch */
+static GRootUring *
+ring_new (void)
+{
+  struct io_uring_params p;
+  GRootUring *ring = xcalloc (sizeof (GRootUring));
+  size_t sq_size, cq_size;
+
+  memset (&p, 0, sizeof (p));
+  p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+
+  ring->fd = syscall (__NR_io_uring_setup, RING_ENTRIES, &p);
+  if (ring->fd == -1)
+    goto fail;
+
+  /* Every kernel with the xattr ops has a single ring mapping */
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0)
+    {
+      errno = ENOSYS;
+      goto fail;
+    }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  ring->ring_size = MAX (sq_size, cq_size);
+  ring->ring = mmap (NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->ring == MAP_FAILED)
+    {
+      ring->ring = NULL;
+      goto fail;
+    }
+
+  ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    {
+      ring->sqes = NULL;
+      goto fail;
+    }
+
+  ring->sq_tail = (_Atomic unsigned *) ((char *) ring->ring + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) ((char *) ring->ring + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) ((char *) ring->ring + p.sq_off.array);
+  ring->cq_head = (_Atomic unsigned *) ((char *) ring->ring + p.cq_off.head);
+  ring->cq_tail = (_Atomic unsigned *) ((char *) ring->ring + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) ring->ring + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->ring + p.cq_off.cqes);
+
+  return ring;
+
+ fail:
+  {
+    int errsv = errno;
+    ring_free (ring);
+    errno = errsv;
+    return NULL;
+  }
+}
+
+static bool
+probe_ops (GRootUring *ring)
+{
+  static const int needed[] = {
+    IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_GETXATTR, IORING_OP_SETXATTR
+  };
+  size_t size = sizeof (struct io_uring_probe) + 256 * sizeof (struct io_uring_probe_op);
+  autofree struct io_uring_probe *probe = xcalloc (size);
+
+  if (syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+    return FALSE;
+
+  for (size_t i = 0; i < N_ELEMENTS (needed); i++)
+    if (needed[i] > probe->last_op ||
+        (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Returns FALSE if io_uring can't be used, e.g. because the kernel is
+ * too old, or it's disabled by sysctl or seccomp. The ring used for
+ * the check is kept as the ring of the calling thread. */
+bool
+grootfs_uring_init (void)
+{
+  GRootUring *ring;
+
+  if (uring_usable)
+    return TRUE;
+
+  ring = ring_new ();
+  if (ring == NULL)
+    return FALSE;
+
+  if (!probe_ops (ring))
+    {
+      ring_free (ring);
+      return FALSE;
+    }
+
+  if (pthread_key_create (&ring_key, ring_key_destroy) != 0)
+    {
+      ring_free (ring);
+      return FALSE;
+    }
+
+  thread_ring = ring;
+  pthread_setspecific (ring_key, ring);
+  uring_usable = TRUE;
+
+  return TRUE;
+}
+
+static GRootUring *
+get_thread_ring (void)
+{
+  if (thread_ring == NULL && !thread_ring_failed)
+    {
+      thread_ring = ring_new ();
+      if (thread_ring == NULL)
+        {
+          report ("Can't create an io_uring for this thread: %s", strerror (errno));
+          thread_ring_failed = TRUE;
+          return NULL;
+        }
+      pthread_setspecific (ring_key, thread_ring);
+    }
+
+  return thread_ring;
+}
+
+static void
+prep_op (struct io_uring_sqe *sqe,
+         GRootUringOp *op)
+{
+  memset (sqe, 0, sizeof (*sqe));
+
+  switch (op->kind)
+    {
+    case GROOTFS_URING_OPENAT:
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = op->dirfd;
+      sqe->addr = (uintptr_t) op->path;
+      sqe->open_flags = op->flags;
+      break;
+
+    case GROOTFS_URING_STATX:
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = op->dirfd;
+      sqe->addr = (uintptr_t) op->path;
+      sqe->len = STATX_BASIC_STATS;
+      sqe->off = (uintptr_t) op->buf;
+      sqe->statx_flags = op->flags;
+      break;
+
+    case GROOTFS_URING_GETXATTR:
+    case GROOTFS_URING_SETXATTR:
+      sqe->opcode = op->kind == GROOTFS_URING_GETXATTR ? IORING_OP_GETXATTR : IORING_OP_SETXATTR;
+      sqe->addr = (uintptr_t) op->name;
+      sqe->off = (uintptr_t) op->buf;
+      sqe->len = op->size;
+      sqe->addr3 = (uintptr_t) op->path;
+      sqe->xattr_flags = op->kind == GROOTFS_URING_SETXATTR ? op->flags : 0;
+      break;
+    }
+}
+
+/* Runs n_ops ops, at most RING_ENTRIES, and waits for all of them */
+static int
+ring_run (GRootUring *ring,
+          GRootUringOp *ops,
+          unsigned n_ops)
+{
+  unsigned tail = atomic_load_explicit (ring->sq_tail, memory_order_relaxed);
+  unsigned submitted = 0, completed = 0;
+
+  for (unsigned i = 0; i < n_ops; i++)
+    {
+      unsigned idx = (tail + i) & *ring->sq_mask;
+
+      prep_op (&ring->sqes[idx], &ops[i]);
+      ring->sqes[idx].user_data = i;
+      ring->sq_array[idx] = idx;
+    }
+  atomic_store_explicit (ring->sq_tail, tail + n_ops, memory_order_release);
+
+  while (completed < n_ops)
+    {
+      unsigned head, cq_tail;
+      long res;
+
+      grootfs_stats_syscall (GROOTFS_SYSCALL_URING_ENTER);
+      res = syscall (__NR_io_uring_enter, ring->fd, n_ops - submitted,
+                     n_ops - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (res == -1)
+        {
+          if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            continue;
+
+          /* The kernel still has pointers to ops, we can't return */
+          if (submitted > 0)
+            die_with_error ("io_uring_enter");
+
+          atomic_store_explicit (ring->sq_tail, tail, memory_order_relaxed);
+          return -errno;
+        }
+      submitted += res;
+
+      head = atomic_load_explicit (ring->cq_head, memory_order_relaxed);
+      cq_tail = atomic_load_explicit (ring->cq_tail, memory_order_acquire);
+      for (; head != cq_tail; head++)
+        {
+          struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+          ops[cqe->user_data].res = cqe->res;
+          completed++;
+        }
+      atomic_store_explicit (ring->cq_head, head, memory_order_release);
+    }
+
+  return 0;
+}
+
+/* Runs all the ops, in no particular order. Returns 0 once they have
+ * all finished, with their results in their res fields, or a negative
+ * errno if the ring couldn't be used, in which case none of them ran
+ * and the caller should fall back to the plain syscalls. */
+int
+grootfs_uring_submit (GRootUringOp *ops,
+                      size_t n_ops)
+{
+  GRootUring *ring;
+
+  if (!uring_usable)
+    return -ENOSYS;
+
+  ring = get_thread_ring ();
+  if (ring == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < n_ops; i += RING_ENTRIES)
+    {
+      int res = ring_run (ring, ops + i, MIN (n_ops - i, RING_ENTRIES));
+      if (res != 0)
+        {
+          if (i > 0)
+            {
+              /* Those that ran are done, fail the rest */
+              for (size_t j = i; j < n_ops; j++)
+                ops[j].res = res;
+              return 0;
+            }
+          return res;
+        }
+    }
+
+  return 0;
+}
+
+void
+grootfs_statx_to_stat (const struct statx *stx,
+                       struct stat *st)
+{
+  memset (st, 0, sizeof (*st));
+  st->st_dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev (stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_blksize = stx->stx_blksize;
+  st->st_blocks = stx->stx_blocks;
+  st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
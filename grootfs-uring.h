@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Running batches of metadata syscalls with io_uring, so that the
+ * opens, stats and xattr calls for many files cost a single
+ * io_uring_enter() instead of a syscall each. This uses the raw
+ * syscalls rather than liburing, as we only need a tiny part of it.
+ *
+ * Each thread gets its own ring on first use, so nothing is shared
+ * or locked. The xattr ops need Linux 5.19, so grootfs_uring_init()
+ * checks that the kernel has everything and only if so can
+ * grootfs_uring_submit() be used.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+typedef enum {
+  GROOTFS_URING_OPENAT,   /* openat (dirfd, path, flags) */
+  GROOTFS_URING_STATX,    /* statx (dirfd, path, flags, STATX_BASIC_STATS, buf) */
+  GROOTFS_URING_GETXATTR, /* getxattr (path, name, buf, size) */
+  GROOTFS_URING_SETXATTR, /* setxattr (path, name, buf, size, flags) */
+} GRootUringOpKind;
+
+typedef struct {
+  GRootUringOpKind kind;
+  int dirfd;
+  const char *path;  /* For the xattr ops absolute, and symlinks are followed */
+  const char *name;
+  void *buf;         /* A struct statx for GROOTFS_URING_STATX */
+  size_t size;
+  int flags;
+  long res;          /* Set to the result or a negative errno */
+} GRootUringOp;
+
+bool grootfs_uring_init     (void);
+int  grootfs_uring_submit   (GRootUringOp       *ops,
+                             size_t              n_ops);
+void grootfs_statx_to_stat  (const struct statx *stx,
+                             struct stat        *st);
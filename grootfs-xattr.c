@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "utils.h"
+#include "grootfs-xattr.h"
+#include "grootfs-stats.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+
+/* These have the same numbers on all architectures using the common
+ * syscall table, which is all but alpha */
+#ifndef __NR_setxattrat
+#define __NR_setxattrat 463
+#endif
+#ifndef __NR_getxattrat
+#define __NR_getxattrat 464
+#endif
+#ifndef __NR_listxattrat
+#define __NR_listxattrat 465
+#endif
+#ifndef __NR_removexattrat
+#define __NR_removexattrat 466
+#endif
+
+/* From linux/xattr.h, which is not always available */
+struct groot_xattr_args {
+  uint64_t value;
+  uint32_t size;
+  uint32_t flags;
+};
+
+/* Set to FALSE once we know the syscalls don't work, after which we
+ * always use procfs */
+static volatile int have_xattrat = TRUE;
+
+/* The syscalls don't take O_PATH fds with AT_EMPTY_PATH, failing with
+ * EBADF, so once that happens the procfs path is used for calls on an
+ * fd alone, whatever the fallback then returns */
+static volatile int have_empty_path_xattrat = TRUE;
+
+static bool
+use_xattrat (const char *path)
+{
+  return have_xattrat && (path != NULL || have_empty_path_xattrat);
+}
+
+static int
+at_flags (const char *path)
+{
+  return path ? AT_SYMLINK_NOFOLLOW : AT_EMPTY_PATH;
+}
+
+/* Returns FALSE if the syscall result means to try the fallback.
+ * Apart from ENOSYS, seccomp filters that don't know the syscalls
+ * often make them fail with EPERM, which can also be a real error. */
+static bool
+xattrat_worked (long res,
+                const char *path,
+                int *errno_out)
+{
+  if (res == -1 &&
+      (errno == ENOSYS || errno == EPERM || (path == NULL && errno == EBADF)))
+    {
+      *errno_out = errno;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Called with the result of the fallback */
+static long
+fallback_done (long res,
+               int xattrat_errno)
+{
+  if (xattrat_errno == ENOSYS || (xattrat_errno == EPERM && res != -1))
+    have_xattrat = FALSE;
+  else if (xattrat_errno == EBADF)
+    have_empty_path_xattrat = FALSE;
+
+  return res;
+}
+
+/* Without an allocation, as this is on the hot path */
+static bool
+format_proc_path (char *buf,
+                  size_t buf_size,
+                  int dirfd,
+                  const char *path)
+{
+  int len;
+
+  if (path)
+    len = snprintf (buf, buf_size, "/proc/self/fd/%d/%s", dirfd, path);
+  else
+    len = snprintf (buf, buf_size, "/proc/self/fd/%d", dirfd);
+
+  if (len < 0 || len >= buf_size)
+    {
+      errno = ENAMETOOLONG;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+ssize_t
+groot_getxattrat (int dirfd,
+                  const char *path,
+                  const char *name,
+                  void *value,
+                  size_t size)
+{
+  char proc_path[PATH_MAX];
+  int xattrat_errno = 0;
+
+  grootfs_stats_syscall (GROOTFS_SYSCALL_GETXATTR);
+
+  if (use_xattrat (path))
+    {
+      struct groot_xattr_args args = { (uintptr_t) value, size, 0 };
+      long res = syscall (__NR_getxattrat, dirfd, path ? path : "", at_flags (path),
+                          name, &args, sizeof (args));
+      if (xattrat_worked (res, path, &xattrat_errno))
+        return res;
+    }
+
+  if (!format_proc_path (proc_path, sizeof (proc_path), dirfd, path))
+    return -1;
+
+  if (path)
+    return fallback_done (lgetxattr (proc_path, name, value, size), xattrat_errno);
+  else
+    return fallback_done (getxattr (proc_path, name, value, size), xattrat_errno);
+}
+
+int
+groot_setxattrat (int dirfd,
+                  const char *path,
+                  const char *name,
+                  const void *value,
+                  size_t size,
+                  int flags)
+{
+  char proc_path[PATH_MAX];
+  int xattrat_errno = 0;
+
+  grootfs_stats_syscall (GROOTFS_SYSCALL_SETXATTR);
+
+  if (use_xattrat (path))
+    {
+      struct groot_xattr_args args = { (uintptr_t) value, size, flags };
+      long res = syscall (__NR_setxattrat, dirfd, path ? path : "", at_flags (path),
+                          name, &args, sizeof (args));
+      if (xattrat_worked (res, path, &xattrat_errno))
+        return res;
+    }
+
+  if (!format_proc_path (proc_path, sizeof (proc_path), dirfd, path))
+    return -1;
+
+  if (path)
+    return fallback_done (lsetxattr (proc_path, name, value, size, flags), xattrat_errno);
+  else
+    return fallback_done (setxattr (proc_path, name, value, size, flags), xattrat_errno);
+}
+
+ssize_t
+groot_listxattrat (int dirfd,
+                   const char *path,
+                   char *list,
+                   size_t size)
+{
+  char proc_path[PATH_MAX];
+  int xattrat_errno = 0;
+
+  grootfs_stats_syscall (GROOTFS_SYSCALL_LISTXATTR);
+
+  if (use_xattrat (path))
+    {
+      long res = syscall (__NR_listxattrat, dirfd, path ? path : "", at_flags (path),
+                          list, size);
+      if (xattrat_worked (res, path, &xattrat_errno))
+        return res;
+    }
+
+  if (!format_proc_path (proc_path, sizeof (proc_path), dirfd, path))
+    return -1;
+
+  if (path)
+    return fallback_done (llistxattr (proc_path, list, size), xattrat_errno);
+  else
+    return fallback_done (listxattr (proc_path, list, size), xattrat_errno);
+}
+
+int
+groot_removexattrat (int dirfd,
+                     const char *path,
+                     const char *name)
+{
+  char proc_path[PATH_MAX];
+  int xattrat_errno = 0;
+
+  grootfs_stats_syscall (GROOTFS_SYSCALL_REMOVEXATTR);
+
+  if (use_xattrat (path))
+    {
+      long res = syscall (__NR_removexattrat, dirfd, path ? path : "", at_flags (path),
+                          name);
+      if (xattrat_worked (res, path, &xattrat_errno))
+        return res;
+    }
+
+  if (!format_proc_path (proc_path, sizeof (proc_path), dirfd, path))
+    return -1;
+
+  if (path)
+    return fallback_done (lremovexattr (proc_path, name), xattrat_errno);
+  else
+    return fallback_done (removexattr (proc_path, name), xattrat_errno);
+}
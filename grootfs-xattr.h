@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2020 Alexander Larsson <alexl@redhat.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Xattr calls on files given as a dirfd and a path relative to it,
+ * without having to build /proc/self/fd paths.
+ *
+ * If path is NULL the call is on the file dirfd refers to, which may
+ * be an O_PATH fd. Otherwise path is a name in the directory dirfd,
+ * and symlinks are not followed.
+ *
+ * These use the *xattrat() syscalls from Linux 6.13 when available,
+ * and otherwise the /proc/self/fd magic links. Those syscalls don't
+ * accept O_PATH fds with a NULL path, so such calls always use the
+ * magic link, which resolves to the target for an O_PATH fd to a
+ * symlink. Where the caller knows a name for the file, or can pass
+ * "." for a directory, that is cheaper, and it's the only way for
+ * symlinks.
+ *
+ * Like the normal xattr calls they return -1 and set errno on error.
+ */
+
+ssize_t groot_getxattrat     (int         dirfd,
+                              const char *path,
+                              const char *name,
+                              void       *value,
+                              size_t      size);
+int     groot_setxattrat     (int         dirfd,
+                              const char *path,
+                              const char *name,
+                              const void *value,
+                              size_t      size,
+                              int         flags);
+ssize_t groot_listxattrat    (int         dirfd,
+                              const char *path,
+                              char       *list,
+                              size_t      size);
+int     groot_removexattrat  (int         dirfd,
+                              const char *path,
+                              const char *name);
@@ -23,162 +23,679 @@
 
 #include "utils.h"
 #include "grootfs.h"
+#include "grootfs-data.h"
+#include "grootfs-cache.h"
+#include "grootfs-xattr.h"
+#include "grootfs-store.h"
+#include "grootfs-stats.h"
+#include "grootfs-uring.h"
+#include "grootfs-pool.h"
+#include "grootfs-snapshot.h"
+#include "grootfs-control.h"
+#include "grootfs-trace.h"
 
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <err.h>
 #include <fcntl.h>
-#include <fuse.h>
 #include <fuse_lowlevel.h>
 #include <limits.h>
+#include <linux/fuse.h>
+
+/* Passthrough is from protocol 7.40, newer than some kernel headers */
+#ifndef FUSE_INIT_EXT
+#define FUSE_INIT_EXT (1 << 30)
+#endif
+#ifndef FUSE_PASSTHROUGH
+#define FUSE_PASSTHROUGH (1ULL << 37)
+#define FOPEN_PASSTHROUGH (1 << 7)
+struct fuse_backing_map {
+  int32_t fd;
+  uint32_t flags;
+  uint64_t padding;
+};
+#define FUSE_DEV_IOC_BACKING_OPEN _IOW(FUSE_DEV_IOC_MAGIC, 1, struct fuse_backing_map)
+#define FUSE_DEV_IOC_BACKING_CLOSE _IOW(FUSE_DEV_IOC_MAGIC, 2, uint32_t)
+#endif
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 
+typedef struct _GRootInode GRootInode;
+
+/* An inode that the kernel has looked up, identified to the kernel
+ * by its address (except the root, which is FUSE_ROOT_ID). We keep
+ * an O_PATH fd to it for as long as the kernel references it, so all
+ * operations on it are relative to the fd and never need to resolve
+ * a path. */
+struct _GRootInode {
+  GRootInode *hash_next;
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  bool is_symlink;
+  bool is_dir;
+  uint64_t refcount; /* Kernel lookups plus child symlink references, protected by inodes_lock */
+  atomic_bool referenced; /* Used since the last reclaim sweep, also set without inodes_lock */
+
+  /* For symlinks we also remember where we found it. This is needed
+   * for the operations that can't be done via an O_PATH fd to a symlink,
+   * such as setting the timestamps. */
+  GRootInode *parent;
+  char *name;
+
+  /* Fake data not yet written to the file, see grootfs_inode_update_data().
+   * While dirty the inode is in the dirty list, except while a
+   * flush_dirty_inodes() holding flush_lock is writing it. Once freed
+   * while dirty it is in the dead list until written. Protected by
+   * inodes_lock. */
+  bool dirty;
+  GRootFSData dirty_data;
+  GRootInode *dirty_next;
+  GRootInode **dirty_prev;
+
+  /* The name the inode was last looked up by, see dentry_table_find().
+   * The parent is only compared, never dereferenced, so it holds no
+   * reference. Protected by inodes_lock. */
+  GRootInode *dentry_next;
+  GRootInode *dentry_parent;
+  char *dentry_name;
+};
+
+/* State for our own /dev/fuse channel, see dev_fuse_chan_new() */
+typedef struct {
+  int fd;
+  uint64_t init_unique;    /* Request id of FUSE_INIT until replied to */
+  bool kernel_passthrough; /* The kernel offered FUSE_PASSTHROUGH */
+  bool passthrough;        /* We asked for passthrough, later whether we got it */
+  bool readdirplus;        /* Handled in grootfs_worker() */
+
+  pthread_mutex_t backing_lock;
+  uint32_t *backing_ids;   /* Indexed by the fh (an fd) of open files, 0 for none */
+  size_t n_backing_ids;
+} DevFuseChan;
+
 typedef struct {
   int basefd;
   long max_uid;
   long max_gid;
+
+  GRootInode root;
+  pthread_mutex_t inodes_lock;
+  GRootInode **inodes;
+  size_t n_inode_buckets;
+  size_t n_inodes;
+
+  GRootInode **dentries;      /* Protected by inodes_lock */
+  size_t n_dentry_buckets;
+  size_t n_dentries;
+
+  GRootInode *dirty_inodes;   /* Protected by inodes_lock */
+  GRootInode *dead_inodes;    /* Freed while dirty, linked by dirty_next, protected by inodes_lock */
+  atomic_size_t n_dirty;      /* Cheap check for any dirty inodes */
+  pthread_mutex_t flush_lock; /* Serializes the writes of dirty data, taken before inodes_lock */
+  pthread_cond_t flush_cond;
+  pthread_t flush_thread;
+  bool flush_thread_running;
+  bool flush_quit;            /* Protected by flush_lock */
+
+  GRootFSCache *cache; /* NULL if disabled */
+  bool cache_shared;   /* cache is owned by another mount */
+  GRootFSStore *store; /* NULL if using .groot.symlink.* files */
+  GRootFSSnapshot *snapshot; /* All the fake data, if frozen */
+  GRootFSOptions options;
+  DevFuseChan *chan;   /* NULL if not using our own channel */
+  GRootPool *slow_pool; /* NULL if slow requests run in the fuse workers */
+  struct fuse_chan *notify_ch; /* For telling the kernel to drop entries */
+
+  pthread_mutex_t reclaim_lock; /* Only for reclaim_cond */
+  pthread_cond_t reclaim_cond;
+  pthread_t reclaim_thread;
+  bool reclaim_thread_running;
+  bool reclaim_quit;            /* Protected by reclaim_lock */
+  size_t reclaim_hand;          /* Next inode bucket to sweep, protected by inodes_lock */
 } GRootFS;
 
-#define ST_MODE_PERM_MASK (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID | S_ISVTX)
+/* Bytes used by the inodes and caches of all the mounts of the
+ * process, kept below max_memory by reclaim_inodes(). This counts
+ * what grows with the tree, not the fixed overhead of the daemon. */
+static atomic_size_t memory_used;
+
+/* Charged per inode, besides its names: the struct and its share of
+ * the inode and name table buckets */
+#define INODE_MEMORY (sizeof (GRootInode) + 2 * sizeof (GRootInode *))
+
+static void
+memory_charge (size_t bytes)
+{
+  atomic_fetch_add_explicit (&memory_used, bytes, memory_order_relaxed);
+}
+
+static void
+memory_uncharge (size_t bytes)
+{
+  atomic_fetch_sub_explicit (&memory_used, bytes, memory_order_relaxed);
+}
+
+static bool
+memory_over_limit (GRootFS *fs,
+                   double fraction)
+{
+  return fs->options.max_memory > 0 &&
+    atomic_load_explicit (&memory_used, memory_order_relaxed) > fs->options.max_memory * fraction;
+}
+
+/* The kernel format of getdents64(), which glibc only recently wraps */
+struct groot_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* Many kernel readdir requests are served from one getdents64() */
+#define GROOT_DIRENT_BUF_SIZE (64 * 1024)
+
+typedef struct {
+  int fd;
+  char *buf;      /* GROOT_DIRENT_BUF_SIZE, allocated on the first readdir */
+  size_t buf_len; /* Bytes of entries in buf */
+  size_t buf_pos; /* Next entry to return */
+  off_t offset;   /* The directory offset of the entry at buf_pos */
+} GRootDirHandle;
+
 #define GROOT_CUSTOM_XATTR_PREFIX "user.grootfs."
-#define GROOT_DATA_XATTR "user.grootfs"
+#define GROOTFS_MAX_THREADS 256
+#define GROOTFS_MAX_WRITE (16 * 1024 * 1024)
+
+/* Least kernel cache timeout when frozen, a day */
+#define GROOTFS_FROZEN_TIMEOUT 86400.0
 
 static GRootFS *
-get_grootfs (void)
+get_grootfs (fuse_req_t req)
 {
-  struct fuse_context *ctx = fuse_get_context ();
-  return (GRootFS * )ctx->private_data;
+  return (GRootFS *) fuse_req_userdata (req);
 }
 
-static inline const char *
-ensure_relpath (const char *path)
+static size_t
+inode_hash (dev_t dev,
+            ino_t ino)
 {
-  path = path + strspn (path, "/");
-  if (*path == 0)
-    return ".";
-  return path;
+  uint64_t h = ((uint64_t) ino * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) dev;
+  return (size_t) (h ^ (h >> 29));
 }
 
-static int
-open_dirfd (const char *path)
+static GRootInode *
+inode_table_lookup (GRootFS *fs,
+                    dev_t dev,
+                    ino_t ino)
 {
-  GRootFS *fs = get_grootfs ();
-  path = ensure_relpath (path);
-  int dirfd = openat (fs->basefd, path, O_DIRECTORY | O_RDONLY, 0);
-  if (dirfd == -1)
-    return -errno;
-  return dirfd;
+  GRootInode *inode;
+
+  if (fs->n_inode_buckets == 0)
+    return NULL;
+
+  inode = fs->inodes[inode_hash (dev, ino) & (fs->n_inode_buckets - 1)];
+  while (inode != NULL && (inode->dev != dev || inode->ino != ino))
+    inode = inode->hash_next;
+
+  return inode;
 }
 
-static int
-open_parent_dirfd (const char *path,
-                   char **out_basename)
+static void
+inode_table_insert (GRootFS *fs,
+                    GRootInode *inode)
 {
-  int dirfd = -1;
-  autofree char *dirpath = xstrdup (ensure_relpath (path));
-  char *end = dirpath + strlen (dirpath);
-  const char *dir;
-  const char *base;
+  size_t bucket;
 
-  /* Remove any slashes at the end */
-  while (*end == '/' && end > dirpath)
+  if (fs->n_inodes >= fs->n_inode_buckets)
     {
-      *end = 0;
-      end--;
+      size_t new_n_buckets = fs->n_inode_buckets ? fs->n_inode_buckets * 2 : 1024;
+      GRootInode **new_inodes = xcalloc (new_n_buckets * sizeof (GRootInode *));
+
+      for (size_t i = 0; i < fs->n_inode_buckets; i++)
+        {
+          GRootInode *next;
+          for (GRootInode *l = fs->inodes[i]; l != NULL; l = next)
+            {
+              next = l->hash_next;
+              bucket = inode_hash (l->dev, l->ino) & (new_n_buckets - 1);
+              l->hash_next = new_inodes[bucket];
+              new_inodes[bucket] = l;
+            }
+        }
+
+      free (fs->inodes);
+      fs->inodes = new_inodes;
+      fs->n_inode_buckets = new_n_buckets;
     }
 
-  /* Find first slash (not at end), if any */
-  while (*end != '/' && end > dirpath)
-    end--;
+  bucket = inode_hash (inode->dev, inode->ino) & (fs->n_inode_buckets - 1);
+  inode->hash_next = fs->inodes[bucket];
+  fs->inodes[bucket] = inode;
+  fs->n_inodes++;
+}
+
+static void
+inode_table_remove (GRootFS *fs,
+                    GRootInode *inode)
+{
+  GRootInode **l = &fs->inodes[inode_hash (inode->dev, inode->ino) & (fs->n_inode_buckets - 1)];
+
+  while (*l != inode)
+    l = &(*l)->hash_next;
+
+  *l = inode->hash_next;
+  fs->n_inodes--;
+}
+
+/* A cache of names to inodes, so that repeated lookups of a name only
+ * need an fstatat() to check it's still the same file, instead of
+ * opening a new O_PATH fd to it. As entries are keyed by the parent
+ * inode rather than by path, renaming a dir leaves all the entries
+ * below it valid, and renames, unlinks and rmdirs only update the
+ * entry of the name involved. Checking the hits also makes the cache
+ * safe against changes to the backing dir we don't see. All of these
+ * are called with inodes_lock held. */
+static size_t
+dentry_hash (GRootInode *parent,
+             const char *name)
+{
+  uint64_t h = (uint64_t) (uintptr_t) parent * 0x9E3779B97F4A7C15ULL;
+
+  for (const unsigned char *p = (const unsigned char *) name; *p != 0; p++)
+    h = (h ^ *p) * 0x100000001B3ULL;
+
+  return (size_t) (h ^ (h >> 29));
+}
+
+static GRootInode *
+dentry_table_find (GRootFS *fs,
+                   GRootInode *parent,
+                   const char *name)
+{
+  GRootInode *inode;
+
+  if (fs->n_dentry_buckets == 0)
+    return NULL;
+
+  inode = fs->dentries[dentry_hash (parent, name) & (fs->n_dentry_buckets - 1)];
+  while (inode != NULL &&
+         (inode->dentry_parent != parent || strcmp (inode->dentry_name, name) != 0))
+    inode = inode->dentry_next;
+
+  return inode;
+}
+
+static void
+dentry_table_remove (GRootFS *fs,
+                     GRootInode *inode)
+{
+  GRootInode **l;
+
+  if (inode->dentry_name == NULL)
+    return;
+
+  l = &fs->dentries[dentry_hash (inode->dentry_parent, inode->dentry_name) & (fs->n_dentry_buckets - 1)];
+  while (*l != inode)
+    l = &(*l)->dentry_next;
+  *l = inode->dentry_next;
+
+  memory_uncharge (strlen (inode->dentry_name) + 1);
+  free (inode->dentry_name);
+  inode->dentry_name = NULL;
+  inode->dentry_parent = NULL;
+  inode->dentry_next = NULL;
+  fs->n_dentries--;
+}
+
+static void
+dentry_table_set (GRootFS *fs,
+                  GRootInode *inode,
+                  GRootInode *parent,
+                  const char *name)
+{
+  GRootInode *old;
+  size_t bucket;
+
+  if (inode->dentry_name != NULL &&
+      inode->dentry_parent == parent && strcmp (inode->dentry_name, name) == 0)
+    return;
 
-  if (end == dirpath)
+  dentry_table_remove (fs, inode);
+
+  /* Whatever had the name before has been replaced */
+  old = dentry_table_find (fs, parent, name);
+  if (old != NULL)
+    dentry_table_remove (fs, old);
+
+  if (fs->n_dentries >= fs->n_dentry_buckets)
     {
-      base = dirpath;
-      dir = ".";
+      size_t new_n_buckets = fs->n_dentry_buckets ? fs->n_dentry_buckets * 2 : 1024;
+      GRootInode **new_dentries = xcalloc (new_n_buckets * sizeof (GRootInode *));
+
+      for (size_t i = 0; i < fs->n_dentry_buckets; i++)
+        {
+          GRootInode *next;
+          for (GRootInode *l = fs->dentries[i]; l != NULL; l = next)
+            {
+              next = l->dentry_next;
+              bucket = dentry_hash (l->dentry_parent, l->dentry_name) & (new_n_buckets - 1);
+              l->dentry_next = new_dentries[bucket];
+              new_dentries[bucket] = l;
+            }
+        }
+
+      free (fs->dentries);
+      fs->dentries = new_dentries;
+      fs->n_dentry_buckets = new_n_buckets;
     }
-  else
+
+  inode->dentry_parent = parent;
+  inode->dentry_name = xstrdup (name);
+  memory_charge (strlen (name) + 1);
+  bucket = dentry_hash (parent, name) & (fs->n_dentry_buckets - 1);
+  inode->dentry_next = fs->dentries[bucket];
+  fs->dentries[bucket] = inode;
+  fs->n_dentries++;
+}
+
+/* Called when parent/name was unlinked or removed */
+static void
+grootfs_dentry_forget (GRootFS *fs,
+                       GRootInode *parent,
+                       const char *name)
+{
+  GRootInode *inode;
+
+  pthread_mutex_lock (&fs->inodes_lock);
+  inode = dentry_table_find (fs, parent, name);
+  if (inode != NULL)
+    dentry_table_remove (fs, inode);
+  pthread_mutex_unlock (&fs->inodes_lock);
+}
+
+/* Called when parent/name was renamed to newparent/newname */
+static void
+grootfs_dentry_move (GRootFS *fs,
+                     GRootInode *parent,
+                     const char *name,
+                     GRootInode *newparent,
+                     const char *newname)
+{
+  GRootInode *inode, *replaced;
+
+  pthread_mutex_lock (&fs->inodes_lock);
+  inode = dentry_table_find (fs, parent, name);
+  replaced = dentry_table_find (fs, newparent, newname);
+  if (replaced != NULL && replaced != inode)
+    dentry_table_remove (fs, replaced);
+  if (inode != NULL)
+    dentry_table_set (fs, inode, newparent, newname);
+  pthread_mutex_unlock (&fs->inodes_lock);
+}
+
+/* Drops all the entries, for the drop_caches control command */
+static void
+grootfs_dentry_clear (GRootFS *fs)
+{
+  pthread_mutex_lock (&fs->inodes_lock);
+  for (size_t i = 0; i < fs->n_dentry_buckets; i++)
     {
-      base = end + 1;
-      *end = 0;
-      dir = dirpath;
+      GRootInode *next;
+      for (GRootInode *inode = fs->dentries[i]; inode != NULL; inode = next)
+        {
+          next = inode->dentry_next;
+          memory_uncharge (strlen (inode->dentry_name) + 1);
+          free (inode->dentry_name);
+          inode->dentry_name = NULL;
+          inode->dentry_parent = NULL;
+          inode->dentry_next = NULL;
+        }
+      fs->dentries[i] = NULL;
     }
+  fs->n_dentries = 0;
+  pthread_mutex_unlock (&fs->inodes_lock);
+}
 
-  dirfd = open_dirfd (dir);
-  if (dirfd >= 0)
-    *out_basename = xstrdup (base);
-  return dirfd;
+/* Called with inodes_lock held */
+static void
+dirty_list_add (GRootFS *fs,
+                GRootInode *inode)
+{
+  inode->dirty_next = fs->dirty_inodes;
+  inode->dirty_prev = &fs->dirty_inodes;
+  if (fs->dirty_inodes)
+    fs->dirty_inodes->dirty_prev = &inode->dirty_next;
+  fs->dirty_inodes = inode;
 }
 
-static char *
-get_proc_fd_path (int dirfd,
-                  const char *opt_file)
+/* Called with inodes_lock held */
+static void
+dirty_list_remove (GRootFS *fs,
+                   GRootInode *inode)
 {
-  if (opt_file)
-    return xasprintf ("/proc/self/fd/%d/%s", dirfd, opt_file);
-  else
-    return xasprintf ("/proc/self/fd/%d", dirfd);
+  *inode->dirty_prev = inode->dirty_next;
+  if (inode->dirty_next)
+    inode->dirty_next->dirty_prev = inode->dirty_prev;
+  inode->dirty_next = NULL;
+  inode->dirty_prev = NULL;
 }
 
-/* Computes the real file pemissions for a a faked file.
- * In order to correctly do things like set permissions and
- * execute/search the files we set everything to rw for the user,
- * r-only for rest. For dirs we always set x, and mirror the user x
- * bit for other files. */
-static mode_t
-get_real_mode (int is_dir,
-               int executable_default)
+/* Called with inodes_lock held, when the inode is no longer dirty */
+static void
+grootfs_inode_clear_dirty (GRootFS *fs,
+                           GRootInode *inode)
 {
-  mode_t real_mode = S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR;
-  if (is_dir || executable_default)
-    real_mode |= S_IXUSR | S_IXGRP | S_IXOTH;
-  return real_mode;
+  inode->dirty = FALSE;
+  atomic_fetch_sub_explicit (&fs->n_dirty, 1, memory_order_relaxed);
 }
 
-typedef enum {
-  GROOTFS_FLAGS_UID_SET = 1<<0,
-  GROOTFS_FLAGS_GID_SET = 1<<1,
-  GROOTFS_FLAGS_MODE_SET = 1<<2,
-} GrootFSFlags;
+static int write_inode_data (GRootFS *fs,
+                             GRootInode *inode,
+                             const GRootFSData *data);
 
-typedef struct {
-  uint32_t flags;
-  uint32_t uid;
-  uint32_t gid;
-  uint32_t mode;
-} GRootFSData;
+static void
+grootfs_inode_free (GRootInode *inode)
+{
+  close (inode->fd);
+  memory_uncharge (INODE_MEMORY + (inode->name ? strlen (inode->name) + 1 : 0));
+  free (inode->name);
+  free (inode);
+}
 
+/* Called with inodes_lock held */
 static void
-fake_data_htonl (const GRootFSData *data,
-                 GRootFSData *data_dst)
+grootfs_inode_unref_locked (GRootFS *fs,
+                            GRootInode *inode,
+                            uint64_t n)
 {
-  data_dst->flags = htonl (data->flags);
-  data_dst->mode = htonl (data->mode);
-  data_dst->uid = htonl (data->uid);
-  data_dst->gid = htonl (data->gid);
+  while (inode != NULL && inode != &fs->root)
+    {
+      GRootInode *parent;
+
+      assert (inode->refcount >= n);
+      inode->refcount -= n;
+      if (inode->refcount > 0)
+        break;
+
+      inode_table_remove (fs, inode);
+      dentry_table_remove (fs, inode);
+      parent = inode->parent;
+
+      /* Flushes take a reference, so it must still be in the list.
+       * The data is written by the next flush, not here with the lock
+       * held, and until then fake_data_dirty_lookup() finds it. */
+      if (inode->dirty)
+        {
+          dirty_list_remove (fs, inode);
+          inode->parent = NULL;
+          inode->dirty_next = fs->dead_inodes;
+          fs->dead_inodes = inode;
+        }
+      else
+        grootfs_inode_free (inode);
+
+      /* Drop the reference the symlink held on its parent */
+      inode = parent;
+      n = 1;
+    }
 }
 
 static void
-fake_data_ntohl (const GRootFSData *data,
-                 GRootFSData *data_dst)
+grootfs_inode_unref (GRootFS *fs,
+                     GRootInode *inode,
+                     uint64_t n)
 {
-  data_dst->flags = ntohl (data->flags);
-  data_dst->mode = ntohl (data->mode);
-  data_dst->uid = ntohl (data->uid);
-  data_dst->gid = ntohl (data->gid);
+  pthread_mutex_lock (&fs->inodes_lock);
+  grootfs_inode_unref_locked (fs, inode, n);
+  pthread_mutex_unlock (&fs->inodes_lock);
 }
 
+/* For the reclaim sweep. Only written when needed, so that the hot
+ * inodes don't keep bouncing the cache line between threads. */
 static void
-apply_fake_data (struct stat *st_data,
-                 const GRootFSData *data)
+inode_mark_referenced (GRootInode *inode)
+{
+  if (!atomic_load_explicit (&inode->referenced, memory_order_relaxed))
+    atomic_store_explicit (&inode->referenced, TRUE, memory_order_relaxed);
+}
+
+/* Returns the inode for the file, adding a reference, or creating it.
+ * If created, this steals the O_PATH fd from fdp. */
+static GRootInode *
+grootfs_inode_ref_or_new (GRootFS *fs,
+                          int *fdp,
+                          const struct stat *st,
+                          GRootInode *parent,
+                          const char *name)
+{
+  GRootInode *inode;
+
+  pthread_mutex_lock (&fs->inodes_lock);
+
+  inode = inode_table_lookup (fs, st->st_dev, st->st_ino);
+  if (inode)
+    {
+      inode->refcount++;
+      inode_mark_referenced (inode);
+    }
+  else
+    {
+      inode = xcalloc (sizeof (GRootInode));
+      inode->fd = steal_fd (fdp);
+      inode->dev = st->st_dev;
+      inode->ino = st->st_ino;
+      inode->is_symlink = S_ISLNK (st->st_mode);
+      inode->is_dir = S_ISDIR (st->st_mode);
+      inode->refcount = 1;
+
+      if (inode->is_symlink)
+        {
+          if (parent != &fs->root)
+            parent->refcount++;
+          inode->parent = parent;
+          inode->name = xstrdup (name);
+        }
+
+      inode_table_insert (fs, inode);
+      memory_charge (INODE_MEMORY + (inode->name ? strlen (inode->name) + 1 : 0));
+    }
+
+  dentry_table_set (fs, inode, parent, name);
+
+  pthread_mutex_unlock (&fs->inodes_lock);
+
+  /* The reclaim thread also checks regularly, so a missed wakeup
+   * only delays it */
+  if (memory_over_limit (fs, 1.0))
+    pthread_cond_signal (&fs->reclaim_cond);
+
+  return inode;
+}
+
+/* Update the remembered location of a symlink after it was moved */
+static void
+grootfs_inode_set_location (GRootFS *fs,
+                            GRootInode *inode,
+                            GRootInode *parent,
+                            const char *name)
+{
+  GRootInode *old_parent;
+  char *old_name;
+
+  pthread_mutex_lock (&fs->inodes_lock);
+
+  if (parent != &fs->root)
+    parent->refcount++;
+
+  old_parent = inode->parent;
+  old_name = inode->name;
+  inode->parent = parent;
+  inode->name = xstrdup (name);
+  memory_charge (strlen (name) + 1);
+
+  memory_uncharge (strlen (old_name) + 1);
+  free (old_name);
+  grootfs_inode_unref_locked (fs, old_parent, 1);
+
+  pthread_mutex_unlock (&fs->inodes_lock);
+}
+
+static GRootInode *
+grootfs_inode_from_ino (GRootFS *fs,
+                        fuse_ino_t ino)
+{
+  if (ino == FUSE_ROOT_ID)
+    return &fs->root;
+  return (GRootInode *) (uintptr_t) ino;
+}
+
+static fuse_ino_t
+grootfs_inode_to_ino (GRootFS *fs,
+                      GRootInode *inode)
+{
+  if (inode == &fs->root)
+    return FUSE_ROOT_ID;
+  return (fuse_ino_t) (uintptr_t) inode;
+}
+
+static GRootInode *
+get_inode (fuse_req_t req,
+           fuse_ino_t ino)
+{
+  return grootfs_inode_from_ino (get_grootfs (req), ino);
+}
+
+static char *
+get_proc_fd_path (Arena *scratch,
+                  int dirfd,
+                  const char *opt_file)
 {
-  GRootFS *fs = get_grootfs ();
+  if (opt_file)
+    return arena_printf (scratch, "/proc/self/fd/%d/%s", dirfd, opt_file);
+  else
+    return arena_printf (scratch, "/proc/self/fd/%d", dirfd);
+}
 
+static void
+apply_fake_data (GRootFS *fs,
+                 struct stat *st_data,
+                 const GRootFSData *data)
+{
   if (data->flags & GROOTFS_FLAGS_UID_SET)
     st_data->st_uid = data->uid;
 
@@ -197,16 +714,18 @@ apply_fake_data (struct stat *st_data,
     st_data->st_gid = 0;
 }
 
+/* If file is NULL, dirfd is an O_PATH fd for the file itself, and we
+ * follow the /proc magic link to it. Otherwise file is looked up in
+ * dirfd without following symlinks. */
 static int
 get_fake_data (int dirfd,
                const char *file,
                int allow_noent,
                GRootFSData *data)
 {
-  autofree char *proc_file = get_proc_fd_path (dirfd, file);
   ssize_t res;
 
-  res = lgetxattr (proc_file, "user.grootfs", data, sizeof (GRootFSData));
+  res = groot_getxattrat (dirfd, file, GROOT_DATA_XATTR, data, sizeof (GRootFSData));
   if (res == -1)
     {
       int errsv = errno;
@@ -222,16 +741,16 @@ get_fake_data (int dirfd,
         }
 
       if (errsv == ERANGE)
-        report ("Internal error: Wrong xattr size for file %s", file);
+        report ("Internal error: Wrong xattr size for file %d/%s", dirfd, file ? file : "");
       else
-        report ("Internal error: lgetxattr %s returned %s", file, strerror (errsv));
+        report ("Internal error: getxattr %d/%s returned %s", dirfd, file ? file : "", strerror (errsv));
 
       return -errsv;
     }
 
   if (res != sizeof (GRootFSData))
     {
-      report ("Internal error: Wrong xattr size for file %s", file);
+      report ("Internal error: Wrong xattr size for file %d/%s", dirfd, file ? file : "");
       return -ERANGE;
     }
 
@@ -246,7 +765,8 @@ get_fake_dataf (int fd,
 {
   ssize_t res;
 
-  res = fgetxattr (fd, "user.grootfs", data, sizeof(GRootFSData));
+  grootfs_stats_syscall (GROOTFS_SYSCALL_GETXATTR);
+  res = fgetxattr (fd, GROOT_DATA_XATTR, data, sizeof(GRootFSData));
   if (res == -1)
     {
       int errsv = errno;
@@ -279,13 +799,13 @@ get_fake_dataf (int fd,
   return 0;
 }
 
+/* See get_fake_data() for the meaning of dirfd and file */
 static int
 set_fake_data (int dirfd,
                const char *file,
                int ensure_exist,
                const GRootFSData *data)
 {
-  autofree char *proc_file = get_proc_fd_path (dirfd, file);
   ssize_t res;
   GRootFSData data2;
 
@@ -293,21 +813,24 @@ set_fake_data (int dirfd,
 
   if (ensure_exist)
     {
-      int fd = openat (dirfd, file, O_CREAT | O_EXCL | O_WRONLY, 0666);
+      int fd;
+
+      grootfs_stats_syscall (GROOTFS_SYSCALL_OPENAT);
+      fd = openat (dirfd, file, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
       if (fd == -1)
         {
           if (errno != EEXIST)
             return -errno;
         }
-
-      close (fd);
+      else
+        close (fd);
     }
 
-  res = lsetxattr (proc_file, "user.grootfs", &data2, sizeof(GRootFSData), 0);
+  res = groot_setxattrat (dirfd, file, GROOT_DATA_XATTR, &data2, sizeof(GRootFSData), 0);
   if (res == -1)
     {
       int errsv = errno;
-      report ("Internal error: lsetxattr %s returned %s", file, strerror (errsv));
+      report ("Internal error: setxattr %d/%s returned %s", dirfd, file ? file : "", strerror (errsv));
       return -errsv;
     }
 
@@ -323,7 +846,8 @@ set_fake_dataf (int fd,
 
   fake_data_htonl (data, &data2);
 
-  res = fsetxattr (fd, "user.grootfs", &data2, sizeof(GRootFSData), 0);
+  grootfs_stats_syscall (GROOTFS_SYSCALL_SETXATTR);
+  res = fsetxattr (fd, GROOT_DATA_XATTR, &data2, sizeof(GRootFSData), 0);
   if (res == -1)
     {
       int errsv = errno;
@@ -334,916 +858,4185 @@ set_fake_dataf (int fd,
   return 0;
 }
 
+static void
+init_fake_data_for_new (fuse_req_t req,
+                        mode_t mode,
+                        GRootFSData *data)
+{
+  const struct fuse_ctx *ctx = fuse_req_ctx (req);
+
+  data->mode = mode & ST_MODE_PERM_MASK;
+  data->uid = ctx->uid;
+  data->gid = ctx->gid;
+  data->flags = GROOTFS_FLAGS_MODE_SET | GROOTFS_FLAGS_UID_SET | GROOTFS_FLAGS_GID_SET;
+}
+
+/* Stack space for the allocations of a request, which are usually
+ * a few paths or names */
+#define SCRATCH_SIZE 1024
+
 typedef struct {
-  const char *path;
-  int fd;
-  int dirfd;
-  char *basename;
-  char *datafile;
-  bool exists;
+  int fd;             /* O_PATH or regular fd to the file, not owned */
+  bool fd_is_path;    /* fd is O_PATH, so no f*xattr() calls */
+  int dirfd;          /* With name, where fd was just looked up, if known */
+  const char *name;
+  char *datafile;     /* Points to datafile_buf for symlinks, else NULL */
+  char datafile_buf[SYMLINK_DATAFILE_SIZE];
   struct stat st_data;
   GRootFSData fake_data;
 } GRootPathInfo;
 
-#define GROOT_PATH_INFO_INIT { NULL, -1, -1 }
+#define GROOT_PATH_INFO_INIT { -1 }
+
+/* Only grootfs writes the fake data while mounted, so the cache is
+ * kept in sync by writing through on every change, and the entries
+ * are dropped when the inode goes away and the number may be reused.
+ * On a miss *seq is set for fake_data_cache_fill(). */
+static bool
+fake_data_cache_lookup (GRootFS *fs,
+                        const struct stat *st,
+                        GRootFSData *data,
+                        uint64_t *seq)
+{
+  bool hit;
+
+  if (fs->cache == NULL)
+    return FALSE;
 
+  hit = grootfs_cache_lookup (fs->cache, st->st_dev, st->st_ino, data, seq);
+  grootfs_stats_cache (hit);
+
+  return hit;
+}
+
+/* Caches data read after a miss, unless it changed meanwhile */
 static void
-groot_path_info_cleanup (GRootPathInfo *info)
+fake_data_cache_fill (GRootFS *fs,
+                      const struct stat *st,
+                      const GRootFSData *data,
+                      uint64_t seq)
 {
-  if (info->dirfd != -1)
-    close (info->dirfd);
+  if (fs->cache != NULL)
+    grootfs_cache_fill (fs->cache, st->st_dev, st->st_ino, data, seq);
+}
 
-  if (info->basename)
-    free (info->basename);
+static void
+fake_data_cache_insert (GRootFS *fs,
+                        const struct stat *st,
+                        const GRootFSData *data)
+{
+  if (fs->cache != NULL)
+    grootfs_cache_insert (fs->cache, st->st_dev, st->st_ino, data);
+}
 
-  if (info->datafile)
-    free (info->datafile);
+static void
+fake_data_cache_remove (GRootFS *fs,
+                        const struct stat *st)
+{
+  if (fs->cache != NULL)
+    grootfs_cache_remove (fs->cache, st->st_dev, st->st_ino);
 }
 
-DEFINE_AUTO_CLEANUP_CLEAR_FUNC(GRootPathInfo, groot_path_info_cleanup);
+/* Whether the fake data for st is kept in fs->store rather than in
+ * an xattr or symlink data file */
+static bool
+fake_data_in_store (GRootFS *fs,
+                    const struct stat *st)
+{
+  return fs->store != NULL &&
+    (S_ISLNK (st->st_mode) || fs->options.metadata_store == GROOTFS_STORE_ALL);
+}
 
-static int
-_groot_path_info_init_base (GRootPathInfo *info, bool allow_noent)
+/* The not yet written data of a dirty inode for st, if any. This is
+ * checked after a cache miss, as the cache may have evicted it. */
+static bool
+fake_data_dirty_lookup (GRootFS *fs,
+                        const struct stat *st,
+                        GRootFSData *data)
 {
-  info->exists = TRUE;
+  GRootInode *inode;
+  bool found = FALSE;
 
-  if (S_ISLNK (info->st_data.st_mode))
+  if (atomic_load_explicit (&fs->n_dirty, memory_order_relaxed) == 0)
+    return FALSE;
+
+  pthread_mutex_lock (&fs->inodes_lock);
+  inode = inode_table_lookup (fs, st->st_dev, st->st_ino);
+  if (inode == NULL || !inode->dirty)
     {
-      GRootFS *fs = get_grootfs ();
-      info->datafile = xasprintf (".groot.symlink.%lx_%lx",
-                                  info->st_data.st_dev, info->st_data.st_ino);
+      /* The newest are first */
+      for (inode = fs->dead_inodes; inode != NULL; inode = inode->dirty_next)
+        if (inode->dirty && inode->dev == st->st_dev && inode->ino == st->st_ino)
+          break;
+    }
 
-      if (get_fake_data (fs->basefd, info->datafile, TRUE, &info->fake_data) != 0)
-        return -EIO;
+  if (inode != NULL && inode->dirty)
+    {
+      *data = inode->dirty_data;
+      found = TRUE;
     }
-  else if (info->fd != -1)
+  pthread_mutex_unlock (&fs->inodes_lock);
+
+  return found;
+}
+
+/* The dirfd and file for get_fake_data() and set_fake_data() on the
+ * O_PATH fd of info. Unless it's a directory, or it was just looked up
+ * by name, this has to go through /proc. */
+static int
+groot_path_info_xattr_location (GRootPathInfo *info,
+                                const char **file_out)
+{
+  if (info->name)
     {
-      if (get_fake_dataf (info->fd, &info->fake_data) != 0)
-        return -EIO;
+      *file_out = info->name;
+      return info->dirfd;
     }
-  else
+
+  *file_out = S_ISDIR (info->st_data.st_mode) ? "." : NULL;
+  return info->fd;
+}
+
+/* Fills in the rest of info once info->st_data is set. If known_data
+ * is non-NULL it is the fake data of a newly created file, which the
+ * caller writes with grootfs_inode_update_data(). Otherwise it's read
+ * from the dirty inode, the cache, the store or the file. */
+static int
+_groot_path_info_init_data (GRootFS *fs, GRootPathInfo *info,
+                            const GRootFSData *known_data)
+{
+  uint64_t seq = 0;
+  bool in_store;
+  const char *file;
+  int dirfd;
+  int res;
+
+  in_store = fake_data_in_store (fs, &info->st_data);
+  if (S_ISLNK (info->st_data.st_mode) && !in_store)
+    info->datafile = get_symlink_datafile (info->st_data.st_dev, info->st_data.st_ino,
+                                           info->datafile_buf);
+
+  if (known_data)
+    info->fake_data = *known_data;
+  else if (fs->snapshot)
+    grootfs_snapshot_lookup (fs->snapshot, info->st_data.st_dev, info->st_data.st_ino,
+                             &info->fake_data);
+  /* Updates write through to the cache, so a hit is never older
+   * than the dirty data. Looking in the cache first means the miss
+   * is seen before any update that could race with the read below. */
+  else if (!fake_data_cache_lookup (fs, &info->st_data, &info->fake_data, &seq) &&
+           !fake_data_dirty_lookup (fs, &info->st_data, &info->fake_data))
     {
-      if (get_fake_data (info->dirfd, info->basename, allow_noent, &info->fake_data) != 0)
+      GRootFSData zero = {0};
+
+      /* Files not yet in the store may still have an older xattr */
+      if (in_store &&
+          grootfs_store_lookup (fs->store, info->st_data.st_dev, info->st_data.st_ino, &info->fake_data))
+        res = 0;
+      else if (S_ISLNK (info->st_data.st_mode) && in_store)
+        {
+          info->fake_data = zero;
+          res = 0;
+        }
+      else if (info->datafile)
+        res = get_fake_data (fs->basefd, info->datafile, TRUE, &info->fake_data);
+      else if (info->fd_is_path)
+        {
+          dirfd = groot_path_info_xattr_location (info, &file);
+          res = get_fake_data (dirfd, file, FALSE, &info->fake_data);
+        }
+      else
+        res = get_fake_dataf (info->fd, &info->fake_data);
+
+      if (res != 0)
         return -EIO;
+
+      fake_data_cache_fill (fs, &info->st_data, &info->fake_data, seq);
     }
 
-  apply_fake_data (&info->st_data, &info->fake_data);
+  apply_fake_data (fs, &info->st_data, &info->fake_data);
 
   return 0;
 }
 
+/* Info for info->fd, see _groot_path_info_init_data() for known_data */
 static int
-groot_path_info_init_path (GRootPathInfo *info, const char *path, bool allow_noent)
+_groot_path_info_init_base (GRootFS *fs, GRootPathInfo *info,
+                            const GRootFSData *known_data)
 {
-  info->path = ensure_relpath (path);
-  info->dirfd = open_parent_dirfd (info->path, &info->basename);
-  if (info->dirfd < 0)
+  grootfs_stats_syscall (GROOTFS_SYSCALL_FSTATAT);
+  if (fstatat (info->fd, "", &info->st_data, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
     return -errno;
 
-  if (fstatat (info->dirfd, info->basename, &info->st_data, AT_SYMLINK_NOFOLLOW) == -1)
-    {
-      if (allow_noent)
-        return 0;
+  return _groot_path_info_init_data (fs, info, known_data);
+}
 
-      return -errno;
-    }
+/* Info for an O_PATH fd, such as the one in a GRootInode */
+static int
+groot_path_info_init_path (GRootFS *fs, GRootPathInfo *info, int path_fd)
+{
+  info->fd = path_fd;
+  info->fd_is_path = TRUE;
 
-  return _groot_path_info_init_base (info, allow_noent);
+  return _groot_path_info_init_base (fs, info, NULL);
 }
 
+/* Info for a regularly opened fd */
 static int
-groot_path_info_init_fd (GRootPathInfo *info, int fd)
+groot_path_info_init_fd (GRootFS *fs, GRootPathInfo *info, int fd)
 {
   info->fd = fd;
+  info->fd_is_path = FALSE;
 
-  if (fstat (info->fd, &info->st_data) == -1)
-    return -errno;
-
-  return _groot_path_info_init_base (info, FALSE);
+  return _groot_path_info_init_base (fs, info, NULL);
 }
 
 static int
-groot_path_info_update_data (GRootPathInfo *info)
+groot_path_info_update_data (GRootFS *fs, GRootPathInfo *info)
 {
-  assert (info->exists); // TODO: Later handle non-exist for e.g. symlinks
+  const char *file;
+  int dirfd;
 
-  if (info->datafile) /* A symlink with separate data file, could be path *or* fd backed */
+  if (fake_data_in_store (fs, &info->st_data))
+    {
+      if (grootfs_store_set (fs->store, info->st_data.st_dev, info->st_data.st_ino,
+                             &info->fake_data) != 0)
+        return -EIO;
+    }
+  else if (info->datafile) /* A symlink with separate data file */
     {
-      GRootFS *fs = get_grootfs ();
       if (set_fake_data (fs->basefd, info->datafile, TRUE, &info->fake_data) != 0)
         return -EIO;
     }
-  else if (info->fd != -1)
+  else if (info->fd_is_path)
     {
-      if (set_fake_dataf (info->fd, &info->fake_data) != 0)
+      dirfd = groot_path_info_xattr_location (info, &file);
+      if (set_fake_data (dirfd, file, FALSE, &info->fake_data) != 0)
         return -EIO;
     }
   else
     {
-      if (set_fake_data (info->dirfd, info->basename, FALSE, &info->fake_data) != 0)
+      if (set_fake_dataf (info->fd, &info->fake_data) != 0)
         return -EIO;
     }
 
+  fake_data_cache_insert (fs, &info->st_data, &info->fake_data);
+
   return 0;
 }
 
+/* Writes the fake data of the real file of inode, which is not in the
+ * store. Errors are reported by set_fake_data(). */
 static int
-grootfs_getattr (const char *path, struct stat *st_data)
+write_inode_data (GRootFS *fs,
+                  GRootInode *inode,
+                  const GRootFSData *data)
 {
-  __debug__ (("getattr %s", path));
-
-  int res;
-  auto(GRootPathInfo) info = GROOT_PATH_INFO_INIT;
-  res = groot_path_info_init_path (&info, path, FALSE);
-  if (res != 0)
-    return res;
-
-  *st_data = info.st_data;
+  if (inode->is_symlink)
+    {
+      char datafile[SYMLINK_DATAFILE_SIZE];
+      return set_fake_data (fs->basefd, get_symlink_datafile (inode->dev, inode->ino, datafile),
+                            TRUE, data);
+    }
 
-  return 0;
+  return set_fake_data (inode->fd, inode->is_dir ? "." : NULL, FALSE, data);
 }
 
+/* Sets the fake data of inode to that in info. Unless it's kept in
+ * the store, which is cheap to update, the write is deferred for up
+ * to metadata_flush seconds, so that the create, chown and chmod of
+ * a typical install is a single write. */
 static int
-grootfs_fgetattr (const char *path, struct stat *st_data, struct fuse_file_info *fi)
+grootfs_inode_update_data (GRootFS *fs,
+                           GRootInode *inode,
+                           GRootPathInfo *info)
 {
-  __debug__ (("fgetattr %s", path));
+  if (fs->options.metadata_flush <= 0 || inode == &fs->root ||
+      fake_data_in_store (fs, &info->st_data))
+    return groot_path_info_update_data (fs, info);
 
-  int res;
-  auto(GRootPathInfo) info = GROOT_PATH_INFO_INIT;
-  res = groot_path_info_init_fd (&info, fi->fh);
-  if (res != 0)
-    return res;
+  pthread_mutex_lock (&fs->inodes_lock);
+  if (!inode->dirty)
+    {
+      inode->dirty = TRUE;
+      atomic_fetch_add_explicit (&fs->n_dirty, 1, memory_order_relaxed);
+      dirty_list_add (fs, inode);
+    }
+  inode->dirty_data = info->fake_data;
+  pthread_mutex_unlock (&fs->inodes_lock);
 
-  *st_data = info.st_data;
+  fake_data_cache_insert (fs, &info->st_data, &info->fake_data);
 
   return 0;
 }
 
+/* Writes the deferred fake data of inode, if any. The caller must
+ * hold a reference to the inode. */
 static int
-grootfs_chmod (const char *path, mode_t mode)
+grootfs_inode_flush (GRootFS *fs,
+                     GRootInode *inode)
 {
-  __debug__ (("chmod %s %x", path, mode));
+  GRootFSData data;
+  int res = 0;
 
-  int res;
-  auto(GRootPathInfo) info = GROOT_PATH_INFO_INIT;
-  res = groot_path_info_init_path (&info, path, FALSE);
-  if (res != 0)
-    return res;
+  if (atomic_load_explicit (&fs->n_dirty, memory_order_relaxed) == 0)
+    return 0;
 
-  mode_t real_mode = get_real_mode (S_ISDIR (info.st_data.st_mode), (mode & S_IXUSR) != 0);
+  pthread_mutex_lock (&fs->flush_lock);
+  pthread_mutex_lock (&fs->inodes_lock);
+  if (inode->dirty)
+    {
+      data = inode->dirty_data;
+      pthread_mutex_unlock (&fs->inodes_lock);
 
-  /* For permissions like execute to work for others, we set all the
-     permissions, to the users perms and strip out any extra perms. */
+      if (write_inode_data (fs, inode, &data) != 0)
+        res = -EIO;
 
-  /* Note we can't use AT_SYMLINK_NOFOLLOW yet;
-   * https://marc.info/?l=linux-kernel&m=148830147803162&w=2
-   * https://marc.info/?l=linux-fsdevel&m=149193779929561&w=2
-   * Fuse always resolves the symlink and calls us on the target
-   */
-  if (fchmodat (info.dirfd, info.basename, real_mode, 0) != 0)
-    return -errno;
-
-  info.fake_data.mode = mode & ST_MODE_PERM_MASK;
-  info.fake_data.flags |= GROOTFS_FLAGS_MODE_SET;
-
-  res = groot_path_info_update_data (&info);
-  if (res != 0)
-    return res;
+      /* Unless it changed again meanwhile. Failed writes are dropped,
+       * they would most likely fail again. */
+      pthread_mutex_lock (&fs->inodes_lock);
+      if (inode->dirty && memcmp (&inode->dirty_data, &data, sizeof (data)) == 0)
+        {
+          dirty_list_remove (fs, inode);
+          grootfs_inode_clear_dirty (fs, inode);
+        }
+    }
+  pthread_mutex_unlock (&fs->inodes_lock);
+  pthread_mutex_unlock (&fs->flush_lock);
 
-  return 0;
+  return res;
 }
 
-static int
-grootfs_chown (const char *path, uid_t uid, gid_t gid)
-{
-  __debug__ (("chown %s to %d %d", path, uid, gid));
+/* How many dirty inodes are written in one batch */
+#define FLUSH_BATCH 64
 
-  int res;
-  auto(GRootPathInfo) info = GROOT_PATH_INFO_INIT;
-  res = groot_path_info_init_path (&info, path, FALSE);
-  if (res != 0)
-    return res;
+/* Like write_inode_data() for n inodes. With io_uring the xattrs of
+ * all but the symlinks, whose datafiles may need creating, are set in
+ * a single io_uring_enter(). */
+static void
+write_inodes_data (GRootFS *fs,
+                   GRootInode **inodes,
+                   const GRootFSData *data,
+                   size_t n)
+{
+  GRootUringOp ops[FLUSH_BATCH];
+  GRootFSData net_data[FLUSH_BATCH];
+  char proc_paths[FLUSH_BATCH][32];
+  size_t n_ops = 0;
 
-  if (uid != -1)
+  for (size_t i = 0; i < n; i++)
     {
-      info.fake_data.uid = uid;
-      info.fake_data.flags |= GROOTFS_FLAGS_UID_SET;
+      if (!fs->options.uring || inodes[i]->is_symlink)
+        {
+          write_inode_data (fs, inodes[i], &data[i]);
+          continue;
+        }
+
+      fake_data_htonl (&data[i], &net_data[n_ops]);
+      snprintf (proc_paths[n_ops], sizeof (proc_paths[n_ops]), "/proc/self/fd/%d", inodes[i]->fd);
+      memset (&ops[n_ops], 0, sizeof (ops[n_ops]));
+      ops[n_ops].kind = GROOTFS_URING_SETXATTR;
+      ops[n_ops].path = proc_paths[n_ops];
+      ops[n_ops].name = GROOT_DATA_XATTR;
+      ops[n_ops].buf = &net_data[n_ops];
+      ops[n_ops].size = sizeof (GRootFSData);
+      ops[n_ops].res = i; /* Which inode, until it has run */
+      n_ops++;
     }
 
-  if (gid != -1)
+  if (n_ops == 0)
+    return;
+
+  if (grootfs_uring_submit (ops, n_ops) != 0)
     {
-      info.fake_data.gid = gid;
-      info.fake_data.flags |= GROOTFS_FLAGS_GID_SET;
+      for (size_t i = 0; i < n_ops; i++)
+        write_inode_data (fs, inodes[ops[i].res], &data[ops[i].res]);
+      return;
     }
 
-  res = groot_path_info_update_data (&info);
-  if (res != 0)
-    return res;
-
-  return 0;
+  for (size_t i = 0; i < n_ops; i++)
+    if (ops[i].res < 0)
+      report ("Internal error: setxattr %s returned %s", ops[i].path, strerror (-ops[i].res));
 }
 
-static int
-grootfs_readlink (const char *path, char *buf, size_t size)
+/* Writes and frees the dead inodes. Called with flush_lock and
+ * inodes_lock held, which is dropped while writing. Inodes that die
+ * meanwhile are added in front of the ones written here, and nothing
+ * else removes any while we hold flush_lock. */
+static void
+flush_dead_inodes (GRootFS *fs)
 {
-  GRootFS *fs = get_grootfs ();
-  int r;
-
-  __debug__ (("readlink %s", path));
-
-  path = ensure_relpath (path);
-
-  /* Note FUSE wants the string to be always nul-terminated, even if
-   * truncated.
-   */
-  r = readlinkat (fs->basefd, path, buf, size - 1);
-  if (r == -1)
-    return -errno;
-  buf[r] = '\0';
-  return 0;
-}
+  GRootInode *batch[FLUSH_BATCH];
+  GRootFSData data[FLUSH_BATCH];
+  GRootInode *dead = fs->dead_inodes;
+  GRootInode **l;
 
-static int
-grootfs_readdir (const char *path, void *buf, fuse_fill_dir_t filler,
-                  off_t offset, struct fuse_file_info *fi)
-{
-  GRootFS *fs = get_grootfs ();
-  DIR *dp;
-  struct dirent *de;
-  int dfd;
+  for (GRootInode *inode = dead; inode != NULL;)
+    {
+      size_t n = 0;
 
-  __debug__ (("readdir %s", path));
+      for (; inode != NULL && n < FLUSH_BATCH; inode = inode->dirty_next)
+        if (inode->dirty)
+          {
+            batch[n] = inode;
+            data[n++] = inode->dirty_data;
+          }
+      pthread_mutex_unlock (&fs->inodes_lock);
 
-  path = ensure_relpath (path);
+      write_inodes_data (fs, batch, data, n);
 
-  if (!*path)
-    {
-      dfd = fcntl (fs->basefd, F_DUPFD_CLOEXEC, 3);
-      if (dfd < 0)
-        return -errno;
-      lseek (dfd, 0, SEEK_SET);
-    }
-  else
-    {
-      dfd = openat (fs->basefd, path, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOCTTY);
-      if (dfd == -1)
-        return -errno;
+      pthread_mutex_lock (&fs->inodes_lock);
     }
 
-  /* Transfers ownership of fd */
-  dp = fdopendir (dfd);
-  if (dp == NULL)
-    return -errno;
+  for (l = &fs->dead_inodes; *l != dead; l = &(*l)->dirty_next)
+    ;
+  *l = NULL;
 
-  while ((de = readdir (dp)) != NULL)
+  while (dead != NULL)
     {
-      struct stat st;
-
-      if (has_prefix (de->d_name, ".groot."))
-        continue;
+      GRootInode *next = dead->dirty_next;
 
-      memset (&st, 0, sizeof (st));
-      st.st_ino = de->d_ino;
-      // TODO: Ensure right mode if fake devnode/socket
-      st.st_mode = de->d_type << 12;
-      if (filler (buf, de->d_name, &st, 0))
-        break;
+      if (dead->dirty)
+        grootfs_inode_clear_dirty (fs, dead);
+      grootfs_inode_free (dead);
+      dead = next;
     }
-
-  (void) closedir (dp);
-  return 0;
 }
 
-static int
-grootfs_mknod (const char *path, mode_t mode, dev_t rdev)
-{
-  __debug__ (("mknod %s %ld %ld", path, (long)mode, (long)rdev));
-  // TODO: Implement
-  return -EROFS;
-}
-
-static int
-grootfs_mkdir (const char *path, mode_t mode)
+/* Writes the data of all dirty inodes. Called with flush_lock held,
+ * so the inodes taken off the list here are still dirty to readers
+ * but nobody else writes them. The dead inodes go first, so that the
+ * data of a live inode for the same file wins. */
+static void
+flush_dirty_inodes (GRootFS *fs)
 {
-  __debug__ (("mkdir %s %x", path, mode));
-
-  int res;
-  autofree char *basename = NULL;
-  autofd int dirfd = open_parent_dirfd (path, &basename);
-  if (dirfd < 0)
-    return dirfd;
-
-  mode_t real_mode = get_real_mode (TRUE, FALSE);
-
-  if (mkdirat (dirfd, basename, real_mode) == -1)
-    return -errno;
-
-  /* mkdir succeeded, so its guaranteed to be a not-previously
-     existing dir, just set the fake data */
-  GRootFSData data = { 0 };
-  struct fuse_context *ctx = fuse_get_context ();
+  GRootInode *batch[FLUSH_BATCH];
+  GRootFSData data[FLUSH_BATCH];
+  GRootInode *inode;
+
+  pthread_mutex_lock (&fs->inodes_lock);
+  flush_dead_inodes (fs);
+  inode = fs->dirty_inodes;
+  fs->dirty_inodes = NULL;
+  for (GRootInode *l = inode; l != NULL; l = l->dirty_next)
+    l->refcount++;
+
+  while (inode != NULL)
+    {
+      size_t n;
 
-  data.mode = mode & ST_MODE_PERM_MASK;
-  data.uid = ctx->uid;
-  data.gid = ctx->gid;
-  data.flags = GROOTFS_FLAGS_MODE_SET | GROOTFS_FLAGS_UID_SET | GROOTFS_FLAGS_GID_SET;
+      /* The rest stays linked from inode, re-adding doesn't touch it */
+      for (n = 0; inode != NULL && n < FLUSH_BATCH; inode = inode->dirty_next, n++)
+        {
+          batch[n] = inode;
+          data[n] = inode->dirty_data;
+        }
+      pthread_mutex_unlock (&fs->inodes_lock);
 
-  res = set_fake_data (dirfd, basename, FALSE, &data);
-  if (res != 0)
-    return res;
+      write_inodes_data (fs, batch, data, n);
 
-  return 0;
+      pthread_mutex_lock (&fs->inodes_lock);
+      for (size_t i = 0; i < n; i++)
+        {
+          if (memcmp (&batch[i]->dirty_data, &data[i], sizeof (data[i])) == 0)
+            {
+              batch[i]->dirty_next = NULL;
+              batch[i]->dirty_prev = NULL;
+              grootfs_inode_clear_dirty (fs, batch[i]);
+            }
+          else
+            dirty_list_add (fs, batch[i]);
+          grootfs_inode_unref_locked (fs, batch[i], 1);
+        }
+    }
+  pthread_mutex_unlock (&fs->inodes_lock);
 }
 
-static int
-grootfs_unlink (const char *path)
+/* Drops the deferred data of an unlinked file, so a flush doesn't
+ * recreate the datafile of a symlink */
+static void
+forget_dirty_data (GRootFS *fs,
+                   const struct stat *st)
 {
-  __debug__ (("unlink %s", path));
+  GRootInode *inode;
 
-  int res;
-  auto(GRootPathInfo) info = GROOT_PATH_INFO_INIT;
-  res = groot_path_info_init_path (&info, path, FALSE);
-  if (res != 0)
-    return res;
-
-  if (unlinkat (info.dirfd, info.basename, 0) == -1)
-    return -errno;
+  if (atomic_load_explicit (&fs->n_dirty, memory_order_relaxed) == 0)
+    return;
 
-  /* When unlinking a symlink, also unlink symlink datafile.
-   * This should be fine because we can't hardlink symlinks, so its the last reference. */
-  if (info.datafile)
+  pthread_mutex_lock (&fs->flush_lock);
+  pthread_mutex_lock (&fs->inodes_lock);
+  inode = inode_table_lookup (fs, st->st_dev, st->st_ino);
+  if (inode != NULL && inode->dirty)
     {
-      GRootFS *fs = get_grootfs ();
-      unlinkat (fs->basefd, info.datafile, 0);
+      dirty_list_remove (fs, inode);
+      grootfs_inode_clear_dirty (fs, inode);
     }
 
-  return 0;
+  /* Freed by the next flush */
+  for (inode = fs->dead_inodes; inode != NULL; inode = inode->dirty_next)
+    if (inode->dirty && inode->dev == st->st_dev && inode->ino == st->st_ino)
+      grootfs_inode_clear_dirty (fs, inode);
+  pthread_mutex_unlock (&fs->inodes_lock);
+  pthread_mutex_unlock (&fs->flush_lock);
 }
 
-static int
-grootfs_rmdir (const char *path)
+static void
+deadline_after (struct timespec *deadline,
+                double secs)
 {
-  GRootFS *fs = get_grootfs ();
+  clock_gettime (CLOCK_REALTIME, deadline);
+  deadline->tv_sec += (time_t) secs;
+  deadline->tv_nsec += (long) ((secs - (time_t) secs) * 1e9);
+  if (deadline->tv_nsec >= 1000000000)
+    {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000;
+    }
+}
 
-  __debug__ (("rmdir %s", path));
-  path = ensure_relpath (path);
+static void *
+grootfs_flush_thread (void *data)
+{
+  GRootFS *fs = data;
 
-  if (unlinkat (fs->basefd, path, AT_REMOVEDIR) == -1)
-    return -errno;
+  pthread_mutex_lock (&fs->flush_lock);
+  while (!fs->flush_quit)
+    {
+      /* The interval can be changed through the control socket, and
+       * when set to 0 there may still be some dirty inodes left */
+      double secs = fs->options.metadata_flush > 0 ? fs->options.metadata_flush : 1.0;
+      struct timespec deadline;
+
+      deadline_after (&deadline, secs);
+      pthread_cond_timedwait (&fs->flush_cond, &fs->flush_lock, &deadline);
+      flush_dirty_inodes (fs);
+
+      /* Compacting writes and syncs the whole store, so it's done here
+       * rather than by the request that appends the last record, and
+       * without flush_lock */
+      if (fs->store != NULL)
+        {
+          pthread_mutex_unlock (&fs->flush_lock);
+          grootfs_store_maybe_compact (fs->store);
+          pthread_mutex_lock (&fs->flush_lock);
+        }
+    }
+  pthread_mutex_unlock (&fs->flush_lock);
 
-  return 0;
+  return NULL;
 }
 
-static int
-grootfs_symlink (const char *from, const char *to)
-{
-  GRootFS *fs = get_grootfs ();
+/* Most names the kernel is asked to drop per sweep, and most inode
+ * buckets looked at, which bounds the time inodes_lock is held */
+#define RECLAIM_BATCH 256
+#define RECLAIM_MAX_BUCKETS 4096
 
-  __debug__ (("symlink  %s %s", from, to));
-  to = ensure_relpath (to);
+/* Once over max_memory, reclaiming goes on until below this part of it */
+#define RECLAIM_LOW_WATERMARK 0.9
 
-  if (symlinkat (from, fs->basefd, to) == -1)
-    return -errno;
+typedef struct {
+  fuse_ino_t parent;
+  char *name;
+} ReclaimEntry;
+
+/* Asks the kernel to drop the names of inodes it hasn't looked up
+ * since the last sweep, in CLOCK order. Once it no longer has a name
+ * for an inode it sends a forget, and the inode is freed as usual.
+ * The kernel keeps the names that are in use, e.g. by open files.
+ * This can't be done from the fuse workers, as the kernel may hold
+ * the directory locked while waiting on a request. */
+static void
+reclaim_inodes (GRootFS *fs)
+{
+  ReclaimEntry victims[RECLAIM_BATCH];
+  size_t n_victims = 0;
 
-  /* We created a new symlink file, set default ownership */
-  auto(GRootPathInfo) info = GROOT_PATH_INFO_INIT;
-  if (groot_path_info_init_path (&info, to, FALSE) == 0)
+  pthread_mutex_lock (&fs->inodes_lock);
+  for (size_t n_swept = 0;
+       n_swept < fs->n_inode_buckets && n_swept < RECLAIM_MAX_BUCKETS && n_victims < RECLAIM_BATCH;
+       n_swept++)
     {
-      struct fuse_context *ctx = fuse_get_context ();
+      size_t bucket = fs->reclaim_hand++ & (fs->n_inode_buckets - 1);
 
-      info.fake_data.uid = ctx->uid;
-      info.fake_data.gid = ctx->gid;
-      info.fake_data.flags = GROOTFS_FLAGS_UID_SET | GROOTFS_FLAGS_GID_SET;
+      for (GRootInode *inode = fs->inodes[bucket];
+           inode != NULL && n_victims < RECLAIM_BATCH;
+           inode = inode->hash_next)
+        {
+          if (atomic_load_explicit (&inode->referenced, memory_order_relaxed))
+            atomic_store_explicit (&inode->referenced, FALSE, memory_order_relaxed); /* Second chance */
+          else if (inode->dentry_name != NULL)
+            {
+              /* The parent may be gone, but then so is the name in
+               * the kernel and it ignores the request */
+              victims[n_victims].parent = grootfs_inode_to_ino (fs, inode->dentry_parent);
+              victims[n_victims].name = xstrdup (inode->dentry_name);
+              n_victims++;
+            }
+        }
+    }
+  pthread_mutex_unlock (&fs->inodes_lock);
 
-      groot_path_info_update_data (&info);
+  for (size_t i = 0; i < n_victims; i++)
+    {
+      fuse_lowlevel_notify_inval_entry (fs->notify_ch, victims[i].parent,
+                                        victims[i].name, strlen (victims[i].name));
+      free (victims[i].name);
     }
 
-  return 0;
+  __debug__ (("reclaim asked the kernel to drop %zu names", n_victims));
 }
 
-static int
-grootfs_rename (const char *from, const char *to)
+static void *
+grootfs_reclaim_thread (void *data)
 {
-  GRootFS *fs = get_grootfs ();
-
-  __debug__ (("rename %s %s", from, to));
-  from = ensure_relpath (from);
-  to = ensure_relpath (to);
+  GRootFS *fs = data;
+  bool reclaiming = FALSE;
 
-  if (renameat (fs->basefd, from, fs->basefd, to) == -1)
-    return -errno;
-
-  return 0;
-}
+  pthread_mutex_lock (&fs->reclaim_lock);
+  while (!fs->reclaim_quit)
+    {
+      struct timespec deadline;
 
-static int
-grootfs_link (const char *from, const char *to)
-{
-  GRootFS *fs = get_grootfs ();
+      /* Give the forgets of the last sweep time to arrive */
+      deadline_after (&deadline, reclaiming ? 0.1 : 1.0);
+      pthread_cond_timedwait (&fs->reclaim_cond, &fs->reclaim_lock, &deadline);
+      if (fs->reclaim_quit)
+        break;
 
-  __debug__ (("link %s %s", from, to));
-  from = ensure_relpath (from);
-  to = ensure_relpath (to);
+      if (memory_over_limit (fs, 1.0))
+        reclaiming = TRUE;
+      else if (!memory_over_limit (fs, RECLAIM_LOW_WATERMARK))
+        reclaiming = FALSE;
 
-  if (linkat (fs->basefd, from, fs->basefd, to, 0) == -1)
-    return -errno;
+      if (reclaiming)
+        {
+          pthread_mutex_unlock (&fs->reclaim_lock);
+          reclaim_inodes (fs);
+          pthread_mutex_lock (&fs->reclaim_lock);
+        }
+    }
+  pthread_mutex_unlock (&fs->reclaim_lock);
 
-  return 0;
+  return NULL;
 }
 
-static int
-grootfs_truncate (const char *path, off_t size)
+/* Path to use for the real file of an inode with the non-fd
+ * syscalls. For regular inodes this is the /proc magic link to the
+ * O_PATH fd, which must be followed. Symlinks can't be reached that
+ * way, so for those we go via the parent dir and must not follow. */
+static char *
+get_inode_proc_path (GRootFS *fs,
+                     GRootInode *inode,
+                     Arena *scratch)
 {
-  GRootFS *fs = get_grootfs ();
-
-  __debug__ (("truncate %s", path));
-  path = ensure_relpath (path);
+  char *path;
 
-  autofd int fd = openat (fs->basefd, path, O_NOFOLLOW|O_WRONLY);
-  if (fd == -1)
-    return -errno;
+  if (!inode->is_symlink)
+    return get_proc_fd_path (scratch, inode->fd, NULL);
 
-  if (ftruncate (fd, size) == -1)
-    return -errno;
+  pthread_mutex_lock (&fs->inodes_lock);
+  path = get_proc_fd_path (scratch, inode->parent->fd, inode->name);
+  pthread_mutex_unlock (&fs->inodes_lock);
 
-  return 0;
+  return path;
 }
 
+/* The dirfd and path to use for groot_*xattrat() calls on the real
+ * file of an inode. Symlinks can't be used through their own O_PATH
+ * fd, so for them we go via the parent dir, and then *path_out is set
+ * to a copy of the name. Directories are used as "." in their fd,
+ * which avoids /proc, and other files through the fd alone. */
 static int
-grootfs_ftruncate (const char *path, off_t size, struct fuse_file_info *fi)
+get_inode_xattr_location (GRootFS *fs,
+                          GRootInode *inode,
+                          Arena *scratch,
+                          const char **path_out)
 {
-  __debug__ (("ftruncate %s", path));
+  int dirfd;
 
-  if (ftruncate (fi->fh, size) == -1)
-    return -errno;
+  if (!inode->is_symlink)
+    {
+      *path_out = inode->is_dir ? "." : NULL;
+      return inode->fd;
+    }
 
-  return 0;
+  pthread_mutex_lock (&fs->inodes_lock);
+  dirfd = inode->parent->fd;
+  *path_out = arena_strdup (scratch, inode->name);
+  pthread_mutex_unlock (&fs->inodes_lock);
+
+  return dirfd;
 }
 
+/* The result of looking up a dir entry ahead of time, see
+ * prefetch_lookups() */
+typedef struct {
+  bool valid;         /* FALSE if not prefetched or that failed */
+  int fd;             /* O_PATH fd to the file, owned, -1 if not opened */
+  struct stat st;
+} GRootLookupPrefetch;
+
+/* known_data is the fake data to set for a file we just created, or
+ * NULL. If pre is non-NULL its results are used instead of redoing
+ * the syscalls, and its fd is taken. */
 static int
-grootfs_utimens (const char *path, const struct timespec tv[2])
+grootfs_do_lookup (GRootFS *fs,
+                   GRootInode *parent,
+                   const char *name,
+                   const GRootFSData *known_data,
+                   GRootLookupPrefetch *pre,
+                   struct fuse_entry_param *e)
 {
-  GRootFS *fs = get_grootfs ();
-
-  __debug__ (("utimens %s", path));
-  path = ensure_relpath (path);
+  GRootPathInfo info = GROOT_PATH_INFO_INIT;
+  autofd int fd = -1;
+  GRootInode *inode;
+  int res;
 
-  if (utimensat (fs->basefd, path, tv, AT_SYMLINK_NOFOLLOW) == -1)
-    return -errno;
+  if (pre != NULL && !pre->valid)
+    pre = NULL;
 
-  return 0;
-}
+  /* The kernel has the dir locked against renames while looking up or
+   * creating name in it, so the xattrs can be used by name rather than
+   * through /proc for the O_PATH fd */
+  info.dirfd = parent->fd;
+  info.name = name;
 
-static int
-do_open (const char *path, mode_t mode, struct fuse_file_info *finfo)
-{
-  GRootFS *fs = get_grootfs ();
-  int fd;
-  mode_t real_mode;
-  int o_creat = (O_CREAT & finfo->flags) != 0;
-  int o_excl = (O_EXCL & finfo->flags) != 0;
-  int created_file = o_creat;
-  int flags;
+  pthread_mutex_lock (&fs->inodes_lock);
+  inode = dentry_table_find (fs, parent, name);
+  if (inode != NULL)
+    {
+      inode->refcount++;
+      inode_mark_referenced (inode);
+    }
+  pthread_mutex_unlock (&fs->inodes_lock);
 
-  // TODO: Rewrite path for fake devnodes, etc
+  /* If the name still refers to the same file we can use its fd */
+  if (inode != NULL)
+    {
+      if (pre != NULL)
+        {
+          info.st_data = pre->st;
+          res = 0;
+        }
+      else
+        {
+          grootfs_stats_syscall (GROOTFS_SYSCALL_FSTATAT);
+          res = fstatat (parent->fd, name, &info.st_data, AT_SYMLINK_NOFOLLOW);
+        }
 
-  path = ensure_relpath (path);
+      if (res == 0 &&
+          info.st_data.st_dev == inode->dev && info.st_data.st_ino == inode->ino)
+        {
+          info.fd = inode->fd;
+          info.fd_is_path = TRUE;
+          res = _groot_path_info_init_data (fs, &info, known_data);
+          if (res != 0)
+            {
+              grootfs_inode_unref (fs, inode, 1);
+              return res;
+            }
+          goto found;
+        }
 
-  real_mode = get_real_mode (FALSE, (mode & S_IXUSR) != 0);
+      grootfs_inode_unref (fs, inode, 1);
+    }
 
-  flags = finfo->flags;
-  if (o_creat && !o_excl)
+  if (pre != NULL && pre->fd != -1)
     {
-      flags |= O_EXCL; /* We really need to know if the file was created or not, so we try EXCL first */
+      fd = pre->fd;
+      pre->fd = -1;
+      info.fd = fd;
+      info.fd_is_path = TRUE;
+      info.st_data = pre->st;
+      res = _groot_path_info_init_data (fs, &info, known_data);
     }
-
-  fd = openat (fs->basefd, path, flags, real_mode);
-  if (fd == -1 && o_creat && !o_excl && errno == EEXIST)
+  else
     {
-      created_file = FALSE; /* We know the file existed */
-      /* We faked the o_excl, and it exists, retry again witout forced o_excl */
-      fd = openat (fs->basefd, path, finfo->flags, real_mode);
+      grootfs_stats_syscall (GROOTFS_SYSCALL_OPENAT);
+      fd = openat (parent->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+      if (fd == -1)
+        return -errno;
+
+      info.fd = fd;
+      info.fd_is_path = TRUE;
+      res = _groot_path_info_init_base (fs, &info, known_data);
     }
+  if (res != 0)
+    return res;
 
-  if (fd == -1)
-    return -errno;
+  inode = grootfs_inode_ref_or_new (fs, &fd, &info.st_data, parent, name);
 
-  if (created_file)
+ found:
+  if (known_data)
     {
-      GRootFSData data = { 0 };
-      int res;
-      struct fuse_context *ctx = fuse_get_context ();
-
-      data.mode = mode & ST_MODE_PERM_MASK;
-      data.uid = ctx->uid;
-      data.gid = ctx->gid;
-      data.flags = GROOTFS_FLAGS_MODE_SET | GROOTFS_FLAGS_UID_SET | GROOTFS_FLAGS_GID_SET;
-
-      res = set_fake_dataf (fd, &data);
+      res = grootfs_inode_update_data (fs, inode, &info);
       if (res != 0)
         {
-          close (fd);
+          grootfs_inode_unref (fs, inode, 1);
           return res;
         }
     }
 
+  memset (e, 0, sizeof (*e));
+  e->ino = grootfs_inode_to_ino (fs, inode);
+  e->attr = info.st_data;
+  e->attr_timeout = fs->options.attr_timeout;
+  e->entry_timeout = fs->options.entry_timeout;
 
-  finfo->fh = fd;
+  if (grootfs_trace_enabled)
+    grootfs_trace_record (GROOTFS_TRACE_ENTRY, grootfs_trace_now (),
+                          grootfs_inode_to_ino (fs, parent), e->ino, 0, 0, name, NULL);
 
   return 0;
 }
 
-static int
-grootfs_open (const char *path, struct fuse_file_info *finfo)
+static void
+grootfs_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-  __debug__ (("open %s", path));
-  return do_open (path, 0, finfo);
+  GRootFS *fs = get_grootfs (req);
+  struct fuse_entry_param e;
+  int res;
+
+  __debug__ (("lookup %s", name));
+
+  res = grootfs_do_lookup (fs, get_inode (req, parent), name, NULL, NULL, &e);
+  if (res == -ENOENT && fs->options.negative_timeout > 0)
+    {
+      /* A zero ino makes the kernel cache the negative lookup */
+      memset (&e, 0, sizeof (e));
+      e.entry_timeout = fs->options.negative_timeout;
+      fuse_reply_entry (req, &e);
+    }
+  else if (res != 0)
+    fuse_reply_err (req, -res);
+  else
+    fuse_reply_entry (req, &e);
 }
 
-static int
-grootfs_create(const char *path, mode_t mode, struct fuse_file_info *finfo)
+static void
+grootfs_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
 {
-  __debug__ (("create %s", path));
-  return do_open (path, mode, finfo);
+  grootfs_inode_unref (get_grootfs (req), get_inode (req, ino), nlookup);
+  fuse_reply_none (req);
 }
 
-static int
-grootfs_read (const char *path, char *buf, size_t size, off_t offset,
-               struct fuse_file_info *finfo)
+static void
+grootfs_forget_multi (fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
 {
-  int r;
+  GRootFS *fs = get_grootfs (req);
 
-  r = pread (finfo->fh, buf, size, offset);
-  if (r == -1)
-    return -errno;
-  return r;
+  pthread_mutex_lock (&fs->inodes_lock);
+  for (size_t i = 0; i < count; i++)
+    grootfs_inode_unref_locked (fs, grootfs_inode_from_ino (fs, forgets[i].ino), forgets[i].nlookup);
+  pthread_mutex_unlock (&fs->inodes_lock);
+
+  fuse_reply_none (req);
 }
 
-static int
-grootfs_write (const char *path, const char *buf, size_t size, off_t offset,
-                struct fuse_file_info *finfo)
+static void
+grootfs_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  int r;
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *inode = get_inode (req, ino);
+  GRootPathInfo info = GROOT_PATH_INFO_INIT;
+  int res;
 
-  r = pwrite (finfo->fh, buf, size, offset);
-  if (r == -1)
-    return -errno;
+  __debug__ (("getattr %lx", ino));
+
+  inode_mark_referenced (inode);
+
+  /* The kernel only passes the fh of regular files */
+  if (fi)
+    res = groot_path_info_init_fd (fs, &info, fi->fh);
+  else
+    res = groot_path_info_init_path (fs, &info, inode->fd);
+  if (res != 0)
+    {
+      fuse_reply_err (req, -res);
+      return;
+    }
 
-  return r;
+  fuse_reply_attr (req, &info.st_data, fs->options.attr_timeout);
 }
 
 static int
-grootfs_statfs (const char *path, struct statvfs *st_buf)
+grootfs_do_chmod (GRootFS *fs, GRootInode *inode, GRootPathInfo *info,
+                  mode_t mode, struct fuse_file_info *fi)
 {
-  GRootFS *fs = get_grootfs ();
+  char scratch_buf[SCRATCH_SIZE];
+  auto(Arena) scratch = ARENA_INIT (scratch_buf);
+  __debug__ (("chmod %lx %x", (long)inode->ino, mode));
+
+  /* Fuse always resolves the symlink and calls us on the target, so
+   * this only happens for e.g. fchmodat(AT_SYMLINK_NOFOLLOW), which
+   * we just fake. */
+  if (!inode->is_symlink)
+    {
+      mode_t real_mode = get_real_mode (S_ISDIR (info->st_data.st_mode), (mode & S_IXUSR) != 0);
+      int res;
 
-  if (fstatvfs (fs->basefd, st_buf) == -1)
-    return -errno;
+      /* For permissions like execute to work for others, we set all the
+         permissions, to the users perms and strip out any extra perms. */
+      if (fi)
+        res = fchmod (fi->fh, real_mode);
+      else
+        {
+          char *proc_file = get_proc_fd_path (&scratch, inode->fd, NULL);
+          res = chmod (proc_file, real_mode);
+        }
+      if (res != 0)
+        return -errno;
+    }
+
+  info->fake_data.mode = mode & ST_MODE_PERM_MASK;
+  info->fake_data.flags |= GROOTFS_FLAGS_MODE_SET;
 
   return 0;
 }
 
-static int
-grootfs_release (const char *path, struct fuse_file_info *finfo)
+static void
+grootfs_do_chown (GRootFS *fs, GRootInode *inode, GRootPathInfo *info,
+                  int to_set, uid_t uid, gid_t gid)
 {
-  (void) close (finfo->fh);
-  return 0;
+  __debug__ (("chown %lx to %d %d", (long)inode->ino, uid, gid));
+
+  if (to_set & FUSE_SET_ATTR_UID)
+    {
+      info->fake_data.uid = uid;
+      info->fake_data.flags |= GROOTFS_FLAGS_UID_SET;
+    }
+
+  if (to_set & FUSE_SET_ATTR_GID)
+    {
+      info->fake_data.gid = gid;
+      info->fake_data.flags |= GROOTFS_FLAGS_GID_SET;
+    }
 }
 
 static int
-grootfs_fsync (const char *path, int crap, struct fuse_file_info *finfo)
+grootfs_do_truncate (GRootFS *fs, GRootInode *inode, off_t size,
+                     struct fuse_file_info *fi)
 {
-  if (fsync (finfo->fh) == -1)
+  char scratch_buf[SCRATCH_SIZE];
+  auto(Arena) scratch = ARENA_INIT (scratch_buf);
+  int res;
+
+  __debug__ (("truncate %lx", (long)inode->ino));
+
+  if (fi)
+    res = ftruncate (fi->fh, size);
+  else
+    {
+      char *proc_file = get_proc_fd_path (&scratch, inode->fd, NULL);
+      res = truncate (proc_file, size);
+    }
+
+  if (res == -1)
     return -errno;
+
   return 0;
 }
 
 static int
-grootfs_access (const char *path, int mode)
+grootfs_do_utimens (GRootFS *fs, GRootInode *inode, const struct stat *attr,
+                    int to_set, struct fuse_file_info *fi)
 {
-  GRootFS *fs = get_grootfs ();
+  char scratch_buf[SCRATCH_SIZE];
+  auto(Arena) scratch = ARENA_INIT (scratch_buf);
+  struct timespec tv[2];
+  int res;
 
-  __debug__ (("access %s", path));
-  path = ensure_relpath (path);
+  __debug__ (("utimens %lx", (long)inode->ino));
 
-  // TODO: Rewrite path for fake devnodes, etc
+  tv[0].tv_sec = 0;
+  tv[0].tv_nsec = UTIME_OMIT;
+  tv[1].tv_sec = 0;
+  tv[1].tv_nsec = UTIME_OMIT;
 
-  /* Apparently at least GNU coreutils rm calls `faccessat(W_OK)`
-   * before trying to do an unlink.  So...we'll just lie about
-   * writable access here.
-   */
-  if (faccessat (fs->basefd, path, mode, AT_SYMLINK_NOFOLLOW) == -1)
-    return -errno;
+  if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+    tv[0].tv_nsec = UTIME_NOW;
+  else if (to_set & FUSE_SET_ATTR_ATIME)
+    tv[0] = attr->st_atim;
+
+  if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+    tv[1].tv_nsec = UTIME_NOW;
+  else if (to_set & FUSE_SET_ATTR_MTIME)
+    tv[1] = attr->st_mtim;
+
+  if (fi)
+    res = futimens (fi->fh, tv);
+  else
+    {
+      char *proc_file = get_inode_proc_path (fs, inode, &scratch);
+      res = utimensat (AT_FDCWD, proc_file, tv, inode->is_symlink ? AT_SYMLINK_NOFOLLOW : 0);
+    }
+
+  if (res == -1)
+    return -errno;
+
+  return 0;
+}
+
+static void
+grootfs_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                 int to_set, struct fuse_file_info *fi)
+{
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *inode = get_inode (req, ino);
+  GRootPathInfo info = GROOT_PATH_INFO_INIT;
+  bool update_data = FALSE;
+  int res;
+
+  if (fi)
+    res = groot_path_info_init_fd (fs, &info, fi->fh);
+  else
+    res = groot_path_info_init_path (fs, &info, inode->fd);
+  if (res != 0)
+    goto out;
+
+  if (to_set & FUSE_SET_ATTR_MODE)
+    {
+      res = grootfs_do_chmod (fs, inode, &info, attr->st_mode, fi);
+      if (res != 0)
+        goto out;
+      update_data = TRUE;
+    }
+
+  if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+    {
+      grootfs_do_chown (fs, inode, &info, to_set, attr->st_uid, attr->st_gid);
+      update_data = TRUE;
+    }
+
+  /* Do all the metadata changes in one write */
+  if (update_data)
+    {
+      res = grootfs_inode_update_data (fs, inode, &info);
+      if (res != 0)
+        goto out;
+    }
+
+  if (to_set & FUSE_SET_ATTR_SIZE)
+    {
+      res = grootfs_do_truncate (fs, inode, attr->st_size, fi);
+      if (res != 0)
+        goto out;
+    }
+
+  if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))
+    {
+      res = grootfs_do_utimens (fs, inode, attr, to_set, fi);
+      if (res != 0)
+        goto out;
+    }
+
+ out:
+  if (res != 0)
+    fuse_reply_err (req, -res);
+  else
+    grootfs_getattr (req, ino, fi);
+}
+
+static void
+grootfs_readlink (fuse_req_t req, fuse_ino_t ino)
+{
+  GRootInode *inode = get_inode (req, ino);
+  char buf[PATH_MAX + 1];
+  ssize_t r;
+
+  __debug__ (("readlink %lx", ino));
+
+  grootfs_stats_syscall (GROOTFS_SYSCALL_READLINKAT);
+  r = readlinkat (inode->fd, "", buf, sizeof (buf));
+  if (r == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  if (r == sizeof (buf))
+    {
+      fuse_reply_err (req, ENAMETOOLONG);
+      return;
+    }
+
+  buf[r] = '\0';
+  fuse_reply_readlink (req, buf);
+}
+
+static void
+grootfs_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  GRootInode *inode = get_inode (req, ino);
+  GRootDirHandle *d;
+  int dfd;
+
+  __debug__ (("opendir %lx", ino));
+
+  /* Always open a new fd, so each handle has its own directory offset */
+  grootfs_stats_syscall (GROOTFS_SYSCALL_OPENAT);
+  dfd = openat (inode->fd, ".", O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOCTTY);
+  if (dfd == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  d = xcalloc (sizeof (GRootDirHandle));
+  d->fd = dfd;
+
+  fi->fh = (uintptr_t) d;
+  fuse_reply_open (req, fi);
+}
+
+static void
+fill_fuse_attr (struct fuse_attr *attr,
+                const struct stat *st)
+{
+  attr->ino = st->st_ino;
+  attr->size = st->st_size;
+  attr->blocks = st->st_blocks;
+  attr->atime = st->st_atim.tv_sec;
+  attr->mtime = st->st_mtim.tv_sec;
+  attr->ctime = st->st_ctim.tv_sec;
+  attr->atimensec = st->st_atim.tv_nsec;
+  attr->mtimensec = st->st_mtim.tv_nsec;
+  attr->ctimensec = st->st_ctim.tv_nsec;
+  attr->mode = st->st_mode;
+  attr->nlink = st->st_nlink;
+  attr->uid = st->st_uid;
+  attr->gid = st->st_gid;
+  attr->rdev = st->st_rdev;
+  attr->blksize = st->st_blksize;
+}
+
+static void
+timeout_to_kernel (double t,
+                   uint64_t *sec_out,
+                   uint32_t *nsec_out)
+{
+  if (t > (double) UINT64_MAX)
+    t = (double) UINT64_MAX;
+  *sec_out = (uint64_t) t;
+  *nsec_out = (uint32_t) ((t - (double) *sec_out) * 1.0e9);
+}
+
+/* Encode an entry for a READDIRPLUS reply, which libfuse 2 doesn't
+ * support, so we produce the kernel format directly. Like
+ * fuse_add_direntry() returns the needed size even if it doesn't fit. */
+static size_t
+add_direntry_plus (GRootFS *fs,
+                   GRootInode *dir,
+                   char *buf,
+                   size_t bufsize,
+                   const struct groot_dirent64 *entry,
+                   GRootLookupPrefetch *pre)
+{
+  size_t namelen = strlen (entry->d_name);
+  size_t entsize = FUSE_DIRENT_ALIGN (FUSE_NAME_OFFSET_DIRENTPLUS + namelen);
+  struct fuse_direntplus *dp = (struct fuse_direntplus *) buf;
+  struct fuse_entry_param e;
+
+  if (entsize > bufsize)
+    return entsize;
+
+  memset (buf, 0, entsize);
+
+  /* A zero nodeid means no attributes.  The kernel doesn't count
+   * those as lookups, nor . and .., so we must not either. */
+  if (strcmp (entry->d_name, ".") != 0 && strcmp (entry->d_name, "..") != 0 &&
+      grootfs_do_lookup (fs, dir, entry->d_name, NULL, pre, &e) == 0)
+    {
+      dp->entry_out.nodeid = e.ino;
+      dp->entry_out.generation = e.generation;
+      timeout_to_kernel (e.entry_timeout, &dp->entry_out.entry_valid, &dp->entry_out.entry_valid_nsec);
+      timeout_to_kernel (e.attr_timeout, &dp->entry_out.attr_valid, &dp->entry_out.attr_valid_nsec);
+      fill_fuse_attr (&dp->entry_out.attr, &e.attr);
+    }
+
+  dp->dirent.ino = entry->d_ino;
+  dp->dirent.off = entry->d_off;
+  dp->dirent.namelen = namelen;
+  dp->dirent.type = entry->d_type;
+  memcpy (dp->dirent.name, entry->d_name, namelen);
+
+  return entsize;
+}
+
+/* Our own files, such as the symlink data files, which are hidden.
+ * Checking the first char first makes this a single compare for
+ * almost all names. */
+static inline bool
+is_groot_file (const char *name)
+{
+  return name[0] == '.' && memcmp (name, ".groot.", strlen (".groot.")) == 0;
+}
+
+/* How many entries of a readdirplus are looked up in one batch */
+#define PREFETCH_MAX 32
+
+/* Does the syscalls for looking up the next entries in the dirent
+ * buffer of d with io_uring, in a few batches rather than several
+ * syscalls per entry. Names we have an inode for only need a statx,
+ * which is what grootfs_do_lookup() checks them with. Others are
+ * opened first and then statted through the new fd, as a statx by
+ * name could see a different file if it's renamed over meanwhile.
+ * The xattrs of those that are not in the fake data cache are then
+ * read into it. Returns the number of entries filled in pre, which
+ * are not valid if the syscalls failed or io_uring can't be used. */
+static size_t
+prefetch_lookups (GRootFS *fs,
+                  GRootInode *dir,
+                  GRootDirHandle *d,
+                  GRootLookupPrefetch *pre)
+{
+  GRootUringOp ops[PREFETCH_MAX];
+  size_t op_entry[PREFETCH_MAX];
+  struct statx stx[PREFETCH_MAX];
+  GRootFSData xattr_data[PREFETCH_MAX];
+  uint64_t fill_seq[PREFETCH_MAX];
+  char proc_paths[PREFETCH_MAX][32];
+  size_t n = 0, n_ops = 0, n_next, pos = d->buf_pos;
+
+  pthread_mutex_lock (&fs->inodes_lock);
+  for (; n < PREFETCH_MAX && pos < d->buf_len; n++)
+    {
+      struct groot_dirent64 *entry = (struct groot_dirent64 *) (d->buf + pos);
+      GRootUringOp *op = &ops[n_ops];
+
+      pos += entry->d_reclen;
+      pre[n].valid = FALSE;
+      pre[n].fd = -1;
+
+      if (is_groot_file (entry->d_name) ||
+          strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0)
+        continue;
+
+      memset (op, 0, sizeof (*op));
+      op->dirfd = dir->fd;
+      op->path = entry->d_name;
+      if (dentry_table_find (fs, dir, entry->d_name) != NULL)
+        {
+          op->kind = GROOTFS_URING_STATX;
+          op->flags = AT_SYMLINK_NOFOLLOW;
+          op->buf = &stx[n];
+        }
+      else
+        {
+          op->kind = GROOTFS_URING_OPENAT;
+          op->flags = O_PATH | O_NOFOLLOW | O_CLOEXEC;
+        }
+      op_entry[n_ops++] = n;
+    }
+  pthread_mutex_unlock (&fs->inodes_lock);
+
+  if (n_ops == 0 || grootfs_uring_submit (ops, n_ops) != 0)
+    return n;
+
+  /* Stat the files we opened, reusing the ops in place */
+  n_next = 0;
+  for (size_t i = 0; i < n_ops; i++)
+    {
+      GRootLookupPrefetch *p = &pre[op_entry[i]];
+
+      if (ops[i].res < 0)
+        continue;
+
+      if (ops[i].kind == GROOTFS_URING_STATX)
+        {
+          grootfs_statx_to_stat (&stx[op_entry[i]], &p->st);
+          p->valid = TRUE;
+          continue;
+        }
+
+      p->fd = ops[i].res;
+      memset (&ops[n_next], 0, sizeof (ops[n_next]));
+      ops[n_next].kind = GROOTFS_URING_STATX;
+      ops[n_next].dirfd = p->fd;
+      ops[n_next].path = "";
+      ops[n_next].flags = AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW;
+      ops[n_next].buf = &stx[op_entry[i]];
+      op_entry[n_next++] = op_entry[i];
+    }
+  n_ops = n_next;
+
+  if (n_ops == 0 || grootfs_uring_submit (ops, n_ops) != 0)
+    return n;
+
+  /* Read the fake data of those where it's in the xattr, and not
+   * already known */
+  n_next = 0;
+  for (size_t i = 0; i < n_ops; i++)
+    {
+      GRootLookupPrefetch *p = &pre[op_entry[i]];
+      GRootFSData data;
+
+      if (ops[i].res < 0)
+        continue;
+
+      grootfs_statx_to_stat (&stx[op_entry[i]], &p->st);
+      p->valid = TRUE;
+
+      /* Without a cache there is nowhere to keep it. The cache goes
+       * first, as in _groot_path_info_init_data(). */
+      if (fs->cache == NULL || fs->snapshot != NULL ||
+          S_ISLNK (p->st.st_mode) || fake_data_in_store (fs, &p->st) ||
+          grootfs_cache_lookup (fs->cache, p->st.st_dev, p->st.st_ino, &data, &fill_seq[n_next]) ||
+          fake_data_dirty_lookup (fs, &p->st, &data))
+        continue;
+
+      snprintf (proc_paths[n_next], sizeof (proc_paths[n_next]), "/proc/self/fd/%d", p->fd);
+      memset (&ops[n_next], 0, sizeof (ops[n_next]));
+      ops[n_next].kind = GROOTFS_URING_GETXATTR;
+      ops[n_next].path = proc_paths[n_next];
+      ops[n_next].name = GROOT_DATA_XATTR;
+      ops[n_next].buf = &xattr_data[n_next];
+      ops[n_next].size = sizeof (GRootFSData);
+      op_entry[n_next++] = op_entry[i];
+    }
+  n_ops = n_next;
+
+  if (n_ops == 0 || grootfs_uring_submit (ops, n_ops) != 0)
+    return n;
+
+  /* Anything odd is left for the lookup to report */
+  for (size_t i = 0; i < n_ops; i++)
+    {
+      GRootLookupPrefetch *p = &pre[op_entry[i]];
+      GRootFSData zero = {0};
+
+      if (ops[i].res == sizeof (GRootFSData))
+        {
+          fake_data_ntohl (&xattr_data[i], &xattr_data[i]);
+          fake_data_cache_fill (fs, &p->st, &xattr_data[i], fill_seq[i]);
+        }
+      else if (ops[i].res == -ENODATA || ops[i].res == -ENOTSUP)
+        fake_data_cache_fill (fs, &p->st, &zero, fill_seq[i]);
+    }
+
+  return n;
+}
+
+static void
+prefetch_clear (GRootLookupPrefetch *pre,
+                size_t n_pre)
+{
+  for (size_t i = 0; i < n_pre; i++)
+    if (pre[i].fd != -1)
+      close (pre[i].fd);
+}
+
+/* Fills buf with entries from the directory, returns the size used
+ * or a negative errno. */
+static ssize_t
+grootfs_do_readdir (fuse_req_t req, GRootFS *fs, GRootInode *dir,
+                    GRootDirHandle *d, off_t offset, char *buf, size_t size,
+                    bool plus, GRootPoolJob *job)
+{
+  GRootLookupPrefetch pre[PREFETCH_MAX];
+  size_t n_pre = 0, pre_i = 0;
+  char *p = buf;
+  size_t rem = size;
+
+  if (d->buf == NULL)
+    d->buf = xmalloc (GROOT_DIRENT_BUF_SIZE);
+
+  if (offset != d->offset)
+    {
+      if (lseek (d->fd, offset, SEEK_SET) == -1)
+        return -errno;
+      d->buf_len = 0;
+      d->buf_pos = 0;
+      d->offset = offset;
+    }
+
+  while (1)
+    {
+      struct groot_dirent64 *entry;
+      struct stat st;
+      size_t entsize;
+
+      if (d->buf_pos >= d->buf_len)
+        {
+          ssize_t n;
+
+          /* What we have so far is a valid reply */
+          if ((req != NULL && fuse_req_interrupted (req)) ||
+              (job != NULL && grootfs_pool_job_interrupted (job)))
+            {
+              if (rem == size)
+                {
+                  prefetch_clear (pre, n_pre);
+                  return -EINTR;
+                }
+              break;
+            }
+
+          grootfs_stats_syscall (GROOTFS_SYSCALL_GETDENTS);
+          n = syscall (SYS_getdents64, d->fd, d->buf, GROOT_DIRENT_BUF_SIZE);
+          if (n < 0 && rem == size)
+            {
+              prefetch_clear (pre, n_pre);
+              return -errno;
+            }
+          if (n <= 0)
+            break;
+
+          d->buf_len = n;
+          d->buf_pos = 0;
+        }
+
+      entry = (struct groot_dirent64 *) (d->buf + d->buf_pos);
+
+      /* The batches never span a refill of the dirent buffer, so
+       * pre[pre_i] is always for this entry */
+      if (plus && fs->options.uring && pre_i == n_pre)
+        {
+          prefetch_clear (pre, n_pre);
+          n_pre = prefetch_lookups (fs, dir, d, pre);
+          pre_i = 0;
+        }
+
+      if (is_groot_file (entry->d_name))
+        entsize = 0;
+      else if (plus)
+        entsize = add_direntry_plus (fs, dir, p, rem, entry,
+                                     pre_i < n_pre ? &pre[pre_i] : NULL);
+      else
+        {
+          memset (&st, 0, sizeof (st));
+          st.st_ino = entry->d_ino;
+          // TODO: Ensure right mode if fake devnode/socket
+          st.st_mode = entry->d_type << 12;
+
+          entsize = fuse_add_direntry (req, p, rem, entry->d_name, &st, entry->d_off);
+        }
+      if (entsize > rem)
+        break; /* Keep the entry for the next call */
+
+      p += entsize;
+      rem -= entsize;
+
+      d->buf_pos += entry->d_reclen;
+      d->offset = entry->d_off;
+      if (pre_i < n_pre)
+        pre_i++;
+    }
+
+  prefetch_clear (pre, n_pre);
+
+  return size - rem;
+}
+
+static void
+grootfs_readdir (fuse_req_t req, fuse_ino_t ino, size_t size,
+                 off_t offset, struct fuse_file_info *fi)
+{
+  GRootDirHandle *d = (GRootDirHandle *) (uintptr_t) fi->fh;
+  autofree char *buf = xmalloc (size);
+  ssize_t res;
+
+  __debug__ (("readdir %lx", ino));
+
+  res = grootfs_do_readdir (req, get_grootfs (req), get_inode (req, ino),
+                            d, offset, buf, size, FALSE, NULL);
+  if (res < 0)
+    fuse_reply_err (req, -res);
+  else
+    fuse_reply_buf (req, buf, res);
+}
+
+/* Handles a raw READDIRPLUS request, replying directly on the channel */
+static void
+grootfs_readdirplus (GRootFS *fs, struct fuse_chan *ch,
+                     const struct fuse_in_header *in,
+                     const struct fuse_read_in *arg,
+                     GRootPoolJob *job)
+{
+  GRootDirHandle *d = (GRootDirHandle *) (uintptr_t) arg->fh;
+  autofree char *buf = xmalloc (arg->size);
+  struct fuse_out_header out = { sizeof (out), 0, in->unique };
+  struct iovec iov[2] = { { &out, sizeof (out) }, { buf, 0 } };
+  ssize_t res;
+
+  __debug__ (("readdirplus %lx", (unsigned long) in->nodeid));
+
+  res = grootfs_do_readdir (NULL, fs, grootfs_inode_from_ino (fs, in->nodeid),
+                            d, arg->offset, buf, arg->size, TRUE, job);
+  if (res < 0)
+    out.error = res;
+  else
+    {
+      iov[1].iov_len = res;
+      out.len += res;
+    }
+
+  fuse_chan_send (ch, iov, res > 0 ? 2 : 1);
+}
+
+/* Handles a raw COPY_FILE_RANGE request, which libfuse 2 doesn't
+ * know about. The kernel turns the copy between the backing files
+ * into a reflink on filesystems like btrfs and XFS, and otherwise
+ * copies in the kernel, so the data never passes through us. FICLONE
+ * can't be passed on, as fuse has no remap_file_range. */
+static void
+grootfs_copy_file_range (GRootFS *fs, struct fuse_chan *ch,
+                         const struct fuse_in_header *in,
+                         const struct fuse_copy_file_range_in *arg)
+{
+  struct fuse_out_header out = { sizeof (out), 0, in->unique };
+  struct fuse_write_out write_out = { 0 };
+  struct iovec iov[2] = { { &out, sizeof (out) }, { &write_out, sizeof (write_out) } };
+  loff_t off_in = arg->off_in;
+  loff_t off_out = arg->off_out;
+  size_t len = arg->len;
+  ssize_t res;
+
+  __debug__ (("copy_file_range %lx", (unsigned long) arg->nodeid_out));
+
+  /* The reply can only hold 32 bits */
+  if (len > (UINT32_MAX & ~4095U))
+    len = UINT32_MAX & ~4095U;
+
+  res = copy_file_range (arg->fh_in, &off_in, arg->fh_out, &off_out, len, arg->flags);
+  if (res == -1)
+    out.error = -errno;
+  else
+    {
+      write_out.size = res;
+      out.len += sizeof (write_out);
+    }
+
+  fuse_chan_send (ch, iov, res == -1 ? 1 : 2);
+}
+
+static void
+grootfs_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  GRootDirHandle *d = (GRootDirHandle *) (uintptr_t) fi->fh;
+
+  close (d->fd);
+  free (d->buf);
+  free (d);
+
+  fuse_reply_err (req, 0);
+}
+
+static void
+grootfs_mknod (fuse_req_t req, fuse_ino_t parent, const char *name,
+               mode_t mode, dev_t rdev)
+{
+  __debug__ (("mknod %s %ld %ld", name, (long)mode, (long)rdev));
+  // TODO: Implement
+  fuse_reply_err (req, EROFS);
+}
+
+static void
+grootfs_mkdir (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *parent_inode = get_inode (req, parent);
+  struct fuse_entry_param e;
+  GRootFSData data = { 0 };
+  int res;
+
+  __debug__ (("mkdir %s %x", name, mode));
+
+  mode_t real_mode = get_real_mode (TRUE, FALSE);
+
+  if (mkdirat (parent_inode->fd, name, real_mode) == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  /* mkdir succeeded, so its guaranteed to be a not-previously
+     existing dir, just set the fake data */
+  init_fake_data_for_new (req, mode, &data);
+
+  res = grootfs_do_lookup (fs, parent_inode, name, &data, NULL, &e);
+
+  if (res != 0)
+    fuse_reply_err (req, -res);
+  else
+    fuse_reply_entry (req, &e);
+}
+
+/* Called when st was unlinked, to drop the data of the last link */
+static void
+forget_unlinked (GRootFS *fs,
+                 const struct stat *st)
+{
+  /* Files can be hardlinked, so only for the last reference. */
+  if (!S_ISDIR (st->st_mode) && st->st_nlink > 1)
+    return;
+
+  /* The inode number may be reused by a new file */
+  forget_dirty_data (fs, st);
+  fake_data_cache_remove (fs, st);
+
+  if (fake_data_in_store (fs, st))
+    grootfs_store_remove (fs->store, st->st_dev, st->st_ino);
+  /* When unlinking a symlink, also unlink symlink datafile. */
+  else if (S_ISLNK (st->st_mode))
+    {
+      char datafile[SYMLINK_DATAFILE_SIZE];
+      unlinkat (fs->basefd, get_symlink_datafile (st->st_dev, st->st_ino, datafile), 0);
+    }
+}
+
+static void
+grootfs_unlink (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *parent_inode = get_inode (req, parent);
+  struct stat st;
+
+  __debug__ (("unlink %s", name));
+
+  grootfs_stats_syscall (GROOTFS_SYSCALL_FSTATAT);
+  if (fstatat (parent_inode->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  if (unlinkat (parent_inode->fd, name, 0) == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  grootfs_dentry_forget (fs, parent_inode, name);
+  forget_unlinked (fs, &st);
+
+  fuse_reply_err (req, 0);
+}
+
+static void
+grootfs_rmdir (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *parent_inode = get_inode (req, parent);
+  struct stat st;
+
+  __debug__ (("rmdir %s", name));
+
+  grootfs_stats_syscall (GROOTFS_SYSCALL_FSTATAT);
+  if (fstatat (parent_inode->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  if (unlinkat (parent_inode->fd, name, AT_REMOVEDIR) == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  grootfs_dentry_forget (fs, parent_inode, name);
+  forget_unlinked (fs, &st);
+
+  fuse_reply_err (req, 0);
+}
+
+static void
+grootfs_symlink (fuse_req_t req, const char *link, fuse_ino_t parent,
+                 const char *name)
+{
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *parent_inode = get_inode (req, parent);
+  const struct fuse_ctx *ctx = fuse_req_ctx (req);
+  struct fuse_entry_param e;
+  GRootFSData data = { 0 };
+  int res;
+
+  __debug__ (("symlink  %s %s", link, name));
+
+  if (symlinkat (link, parent_inode->fd, name) == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  /* We created a new symlink file, set default ownership */
+  data.uid = ctx->uid;
+  data.gid = ctx->gid;
+  data.flags = GROOTFS_FLAGS_UID_SET | GROOTFS_FLAGS_GID_SET;
+
+  res = grootfs_do_lookup (fs, parent_inode, name, &data, NULL, &e);
+  if (res != 0)
+    fuse_reply_err (req, -res);
+  else
+    fuse_reply_entry (req, &e);
+}
+
+static void
+grootfs_rename (fuse_req_t req, fuse_ino_t parent, const char *name,
+                fuse_ino_t newparent, const char *newname)
+{
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *parent_inode = get_inode (req, parent);
+  GRootInode *newparent_inode = get_inode (req, newparent);
+  GRootInode *inode;
+  struct stat st, target_st;
+  bool replaced;
+
+  __debug__ (("rename %s %s", name, newname));
+
+  grootfs_stats_syscall (GROOTFS_SYSCALL_FSTATAT);
+  if (fstatat (parent_inode->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  grootfs_stats_syscall (GROOTFS_SYSCALL_FSTATAT);
+  replaced = fstatat (newparent_inode->fd, newname, &target_st, AT_SYMLINK_NOFOLLOW) == 0 &&
+    (target_st.st_dev != st.st_dev || target_st.st_ino != st.st_ino);
+
+  if (renameat (parent_inode->fd, name, newparent_inode->fd, newname) == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  /* Only the renamed name changes, the entries below a renamed dir
+   * are keyed on its inode and stay valid */
+  grootfs_dentry_move (fs, parent_inode, name, newparent_inode, newname);
+
+  if (replaced)
+    forget_unlinked (fs, &target_st);
+
+  /* Symlink data is keyed on the inode so follows the rename
+   * automatically, but we need to update the remembered location. */
+  if (S_ISLNK (st.st_mode))
+    {
+      pthread_mutex_lock (&fs->inodes_lock);
+      inode = inode_table_lookup (fs, st.st_dev, st.st_ino);
+      if (inode)
+        inode->refcount++;
+      pthread_mutex_unlock (&fs->inodes_lock);
+
+      if (inode)
+        {
+          grootfs_inode_set_location (fs, inode, newparent_inode, newname);
+          grootfs_inode_unref (fs, inode, 1);
+        }
+    }
+
+  fuse_reply_err (req, 0);
+}
+
+static void
+grootfs_link (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+              const char *newname)
+{
+  char scratch_buf[SCRATCH_SIZE];
+  auto(Arena) scratch = ARENA_INIT (scratch_buf);
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *inode = get_inode (req, ino);
+  GRootInode *newparent_inode = get_inode (req, newparent);
+  char *proc_file = get_inode_proc_path (fs, inode, &scratch);
+  struct fuse_entry_param e;
+  int res;
+
+  __debug__ (("link %lx %s", ino, newname));
+
+  /* Linking an O_PATH fd with AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH,
+   * but following the /proc magic link does not. */
+  if (linkat (AT_FDCWD, proc_file, newparent_inode->fd, newname,
+              inode->is_symlink ? 0 : AT_SYMLINK_FOLLOW) == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  res = grootfs_do_lookup (fs, newparent_inode, newname, NULL, NULL, &e);
+  if (res != 0)
+    fuse_reply_err (req, -res);
+  else
+    fuse_reply_entry (req, &e);
+}
+
+/* With passthrough the kernel does the reads and writes of an open
+ * file directly on the backing file we register here. The open reply
+ * is then marked so in dev_fuse_chan_send(), as libfuse 2 can't. */
+static void
+grootfs_open_backing (GRootFS *fs,
+                      int fd)
+{
+  DevFuseChan *chan = fs->chan;
+  struct fuse_backing_map map = { fd };
+  int backing_id;
+
+  if (chan == NULL || !chan->passthrough)
+    return;
+
+  backing_id = ioctl (chan->fd, FUSE_DEV_IOC_BACKING_OPEN, &map);
+  if (backing_id <= 0)
+    {
+      if (errno == EPERM)
+        {
+          /* This needs CAP_SYS_ADMIN in the initial user namespace */
+          report ("No permission for fuse passthrough, falling back to splice");
+          chan->passthrough = FALSE;
+        }
+      return;
+    }
+
+  pthread_mutex_lock (&chan->backing_lock);
+  if (fd >= chan->n_backing_ids)
+    {
+      size_t n = chan->n_backing_ids * 2;
+      if (n < fd + 1)
+        n = fd + 1;
+      chan->backing_ids = xrealloc (chan->backing_ids, n * sizeof (uint32_t));
+      memset (chan->backing_ids + chan->n_backing_ids, 0,
+              (n - chan->n_backing_ids) * sizeof (uint32_t));
+      chan->n_backing_ids = n;
+    }
+  chan->backing_ids[fd] = backing_id;
+  pthread_mutex_unlock (&chan->backing_lock);
+}
+
+static void
+grootfs_close_backing (GRootFS *fs,
+                       int fd)
+{
+  DevFuseChan *chan = fs->chan;
+  uint32_t backing_id = 0;
+
+  if (chan == NULL)
+    return;
+
+  pthread_mutex_lock (&chan->backing_lock);
+  if (fd < chan->n_backing_ids)
+    {
+      backing_id = chan->backing_ids[fd];
+      chan->backing_ids[fd] = 0;
+    }
+  pthread_mutex_unlock (&chan->backing_lock);
+
+  if (backing_id != 0)
+    ioctl (chan->fd, FUSE_DEV_IOC_BACKING_CLOSE, &backing_id);
+}
+
+static void
+grootfs_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  char scratch_buf[SCRATCH_SIZE];
+  auto(Arena) scratch = ARENA_INIT (scratch_buf);
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *inode = get_inode (req, ino);
+  char *proc_file = get_proc_fd_path (&scratch, inode->fd, NULL);
+  int fd;
+
+  __debug__ (("open %lx", ino));
+
+  inode_mark_referenced (inode);
+
+  // TODO: Rewrite path for fake devnodes, etc
+
+  grootfs_stats_syscall (GROOTFS_SYSCALL_OPENAT);
+  fd = open (proc_file, (fi->flags & ~O_NOFOLLOW) | O_CLOEXEC);
+  if (fd == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  fi->fh = fd;
+  fi->keep_cache = fs->options.kernel_cache;
+  grootfs_open_backing (fs, fd);
+  fuse_reply_open (req, fi);
+}
+
+static void
+grootfs_create (fuse_req_t req, fuse_ino_t parent, const char *name,
+                mode_t mode, struct fuse_file_info *fi)
+{
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *parent_inode = get_inode (req, parent);
+  struct fuse_entry_param e;
+  int fd;
+  mode_t real_mode;
+  int o_excl = (O_EXCL & fi->flags) != 0;
+  int created_file = TRUE;
+  GRootFSData data = { 0 };
+  int res;
+
+  __debug__ (("create %s", name));
+
+  real_mode = get_real_mode (FALSE, (mode & S_IXUSR) != 0);
+
+  /* We really need to know if the file was created or not, so we try EXCL first */
+  grootfs_stats_syscall (GROOTFS_SYSCALL_OPENAT);
+  fd = openat (parent_inode->fd, name, fi->flags | O_CREAT | O_EXCL | O_CLOEXEC, real_mode);
+  if (fd == -1 && !o_excl && errno == EEXIST)
+    {
+      created_file = FALSE; /* We know the file existed */
+      /* We faked the o_excl, and it exists, retry again witout forced o_excl */
+      grootfs_stats_syscall (GROOTFS_SYSCALL_OPENAT);
+      fd = openat (parent_inode->fd, name, fi->flags | O_CLOEXEC, real_mode);
+    }
+
+  if (fd == -1)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  if (created_file)
+    init_fake_data_for_new (req, mode, &data);
+
+  res = grootfs_do_lookup (fs, parent_inode, name, created_file ? &data : NULL, NULL, &e);
+  if (res != 0)
+    {
+      close (fd);
+      fuse_reply_err (req, -res);
+      return;
+    }
+
+  fi->fh = fd;
+  fi->keep_cache = fs->options.kernel_cache;
+  grootfs_open_backing (fs, fd);
+  fuse_reply_create (req, &e, fi);
+}
+
+/* The data is passed as fd buffers, so if the kernel supports it fuse
+ * splices it directly between the backing file and /dev/fuse,
+ * otherwise it falls back to copying via memory. */
+static void
+grootfs_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+              struct fuse_file_info *fi)
+{
+  struct fuse_bufvec buf = FUSE_BUFVEC_INIT (size);
+
+  buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  buf.buf[0].fd = fi->fh;
+  buf.buf[0].pos = offset;
+
+  fuse_reply_data (req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void
+grootfs_write_buf (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+                   off_t offset, struct fuse_file_info *fi)
+{
+  struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT (fuse_buf_size (in_buf));
+  ssize_t r;
+
+  out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  out_buf.buf[0].fd = fi->fh;
+  out_buf.buf[0].pos = offset;
+
+  r = fuse_buf_copy (&out_buf, in_buf, 0);
+  if (r < 0)
+    fuse_reply_err (req, -r);
+  else
+    fuse_reply_write (req, r);
+}
+
+static void
+grootfs_statfs (fuse_req_t req, fuse_ino_t ino)
+{
+  GRootFS *fs = get_grootfs (req);
+  struct statvfs st_buf;
+
+  if (fstatvfs (fs->basefd, &st_buf) == -1)
+    fuse_reply_err (req, errno);
+  else
+    fuse_reply_statfs (req, &st_buf);
+}
+
+static void
+grootfs_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  GRootFS *fs = get_grootfs (req);
+
+  grootfs_inode_flush (fs, get_inode (req, ino));
+  grootfs_close_backing (fs, fi->fh);
+  (void) close (fi->fh);
+  fuse_reply_err (req, 0);
+}
+
+static void
+grootfs_fsync (fuse_req_t req, fuse_ino_t ino, int datasync,
+               struct fuse_file_info *fi)
+{
+  int res;
+
+  res = grootfs_inode_flush (get_grootfs (req), get_inode (req, ino));
+  if (res != 0)
+    {
+      fuse_reply_err (req, -res);
+      return;
+    }
+
+  if (datasync)
+    res = fdatasync (fi->fh);
+  else
+    res = fsync (fi->fh);
+
+  fuse_reply_err (req, res == -1 ? errno : 0);
+}
+
+static void
+grootfs_access (fuse_req_t req, fuse_ino_t ino, int mask)
+{
+  char scratch_buf[SCRATCH_SIZE];
+  auto(Arena) scratch = ARENA_INIT (scratch_buf);
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *inode = get_inode (req, ino);
+  char *proc_file = get_inode_proc_path (fs, inode, &scratch);
+
+  __debug__ (("access %lx", ino));
+
+  // TODO: Rewrite path for fake devnodes, etc
+
+  /* Apparently at least GNU coreutils rm calls `faccessat(W_OK)`
+   * before trying to do an unlink.  So...we'll just lie about
+   * writable access here.
+   */
+  if (faccessat (AT_FDCWD, proc_file, mask, inode->is_symlink ? AT_SYMLINK_NOFOLLOW : 0) == -1)
+    fuse_reply_err (req, errno);
+  else
+    fuse_reply_err (req, 0);
+}
+
+static void
+grootfs_setxattr (fuse_req_t req, fuse_ino_t ino, const char *name,
+                  const char *value, size_t size, int flags)
+{
+  char scratch_buf[SCRATCH_SIZE];
+  auto(Arena) scratch = ARENA_INIT (scratch_buf);
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *inode = get_inode (req, ino);
+  const char *path;
+  int dirfd = get_inode_xattr_location (fs, inode, &scratch, &path);
+  char *fake_name = arena_printf (&scratch, GROOT_CUSTOM_XATTR_PREFIX"%s", name);
+  int res;
+
+  __debug__ (("setxattr %lx %s", ino, name));
+
+  res = groot_setxattrat (dirfd, path, fake_name, value, size, flags);
+
+  fuse_reply_err (req, res != 0 ? errno : 0);
+}
+
+static void
+grootfs_getxattr (fuse_req_t req, fuse_ino_t ino, const char *name,
+                  size_t size)
+{
+  char scratch_buf[SCRATCH_SIZE];
+  auto(Arena) scratch = ARENA_INIT (scratch_buf);
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *inode = get_inode (req, ino);
+  const char *path;
+  int dirfd = get_inode_xattr_location (fs, inode, &scratch, &path);
+  char *fake_name = arena_printf (&scratch, GROOT_CUSTOM_XATTR_PREFIX"%s", name);
+  char *value = NULL;
+  ssize_t res;
+
+  __debug__ (("getxattr %lx %s", ino, name));
+
+  if (size > 0)
+    value = arena_alloc (&scratch, size);
+
+  res = groot_getxattrat (dirfd, path, fake_name, value, size);
+
+  if (res == -1)
+    fuse_reply_err (req, errno);
+  else if (size == 0)
+    fuse_reply_xattr (req, res);
+  else
+    fuse_reply_buf (req, value, res);
+}
+
+/*
+ * List the supported extended attributes.
+ */
+static void
+grootfs_listxattr (fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+  char scratch_buf[SCRATCH_SIZE];
+  auto(Arena) scratch = ARENA_INIT (scratch_buf);
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *inode = get_inode (req, ino);
+  const char *path;
+  int dirfd = get_inode_xattr_location (fs, inode, &scratch, &path);
+  char buf_data[4096];
+  char *list = NULL;
+  char *buf = buf_data;
+  size_t buf_size = sizeof(buf_data);
+  char *real_list, *real_list_end, *l;
+  ssize_t res;
+  size_t fake_size;
+
+  __debug__ (("listxattr %lx", ino));
+
+  while (1)
+    {
+      res = groot_listxattrat (dirfd, path, buf, buf_size);
+      if (res < 0)
+        {
+          int errsv = errno;
+
+          if (errsv == ERANGE)
+            {
+              buf_size *= 2;
+              buf = arena_alloc (&scratch, buf_size);
+              continue;
+            }
+
+          fuse_reply_err (req, errsv);
+          return;
+        }
+
+      break;
+    }
+
+  fake_size = 0;
+  real_list = buf;
+  real_list_end = real_list + res;
+
+  while (real_list < real_list_end)
+    {
+      const char *name = real_list;
+      real_list = real_list + strlen (name) + 1;
+
+      if (has_prefix (name, GROOT_CUSTOM_XATTR_PREFIX))
+        {
+          name = name + strlen (GROOT_CUSTOM_XATTR_PREFIX);
+          fake_size += strlen (name) + 1;
+        }
+    }
+
+  if (size == 0)
+    {
+      fuse_reply_xattr (req, fake_size);
+      return;
+    }
+
+  if (size < fake_size)
+    {
+      fuse_reply_err (req, ERANGE);
+      return;
+    }
+
+  list = arena_alloc (&scratch, fake_size + 1);
+  l = list;
+
+  real_list = buf;
+  while (real_list < real_list_end)
+    {
+      const char *name = real_list;
+      real_list = real_list + strlen (name) + 1;
+
+      if (has_prefix (name, GROOT_CUSTOM_XATTR_PREFIX))
+        {
+          name = name + strlen (GROOT_CUSTOM_XATTR_PREFIX);
+          memcpy (l, name, strlen (name) + 1);
+          l += strlen (name) + 1;
+        }
+    }
+
+  fuse_reply_buf (req, list, fake_size);
+}
+
+/*
+ * Remove an extended attribute.
+ */
+static void
+grootfs_removexattr (fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+  char scratch_buf[SCRATCH_SIZE];
+  auto(Arena) scratch = ARENA_INIT (scratch_buf);
+  GRootFS *fs = get_grootfs (req);
+  GRootInode *inode = get_inode (req, ino);
+  const char *path;
+  int dirfd = get_inode_xattr_location (fs, inode, &scratch, &path);
+  char *fake_name = arena_printf (&scratch, GROOT_CUSTOM_XATTR_PREFIX"%s", name);
+  int res;
+
+  __debug__ (("removexattr %lx %s", ino, name));
+
+  res = groot_removexattrat (dirfd, path, fake_name);
+
+  fuse_reply_err (req, res != 0 ? errno : 0);
+}
+
+/* Also called from the control thread when metadata_flush is set */
+static void
+start_flush_thread (GRootFS *fs)
+{
+  pthread_mutex_lock (&fs->flush_lock);
+  if (!fs->flush_thread_running)
+    {
+      if (pthread_create (&fs->flush_thread, NULL, grootfs_flush_thread, fs) == 0)
+        fs->flush_thread_running = TRUE;
+      else
+        {
+          report ("Can't start metadata flush thread, writing metadata immediately");
+          fs->options.metadata_flush = 0;
+        }
+    }
+  pthread_mutex_unlock (&fs->flush_lock);
+}
+
+static void
+grootfs_init (void *userdata, struct fuse_conn_info *conn)
+{
+  GRootFS *fs = userdata;
+
+  /* libfuse sets these to what fits in the channel buffer and to the
+   * kernel max respectively, so we can only lower them */
+  if (fs->options.max_write && fs->options.max_write < conn->max_write)
+    conn->max_write = fs->options.max_write;
+
+  if (fs->options.max_readahead && fs->options.max_readahead < conn->max_readahead)
+    conn->max_readahead = fs->options.max_readahead;
+
+  if (!fs->options.async_read)
+    {
+      conn->async_read = 0;
+      conn->want &= ~FUSE_CAP_ASYNC_READ;
+    }
+
+  if (fs->options.splice)
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                                   FUSE_CAP_SPLICE_WRITE |
+                                   FUSE_CAP_SPLICE_MOVE);
+
+  if (fs->options.uring && !grootfs_uring_init ())
+    {
+      report ("io_uring is not available (needs Linux 5.19), not using it");
+      fs->options.uring = 0;
+    }
+
+  /* Started here rather than in new_grootfs(), which runs before
+   * start_grootfs() daemonizes. It also compacts the store. */
+  if (fs->options.metadata_flush > 0 || fs->store != NULL)
+    start_flush_thread (fs);
+
+  if (fs->options.max_memory > 0)
+    {
+      if (pthread_create (&fs->reclaim_thread, NULL, grootfs_reclaim_thread, fs) == 0)
+        fs->reclaim_thread_running = TRUE;
+      else
+        report ("Can't start the inode reclaim thread, max_memory only limits the cache");
+    }
+}
+
+static void
+grootfs_destroy (void *userdata)
+{
+  GRootFS *fs = userdata;
+
+  pthread_mutex_lock (&fs->reclaim_lock);
+  fs->reclaim_quit = TRUE;
+  pthread_cond_signal (&fs->reclaim_cond);
+  pthread_mutex_unlock (&fs->reclaim_lock);
+  if (fs->reclaim_thread_running)
+    pthread_join (fs->reclaim_thread, NULL);
+
+  pthread_mutex_lock (&fs->flush_lock);
+  fs->flush_quit = TRUE;
+  pthread_cond_signal (&fs->flush_cond);
+  pthread_mutex_unlock (&fs->flush_lock);
+  if (fs->flush_thread_running)
+    pthread_join (fs->flush_thread, NULL);
+
+  pthread_mutex_lock (&fs->flush_lock);
+  flush_dirty_inodes (fs);
+  pthread_mutex_unlock (&fs->flush_lock);
+
+  for (size_t i = 0; i < fs->n_inode_buckets; i++)
+    {
+      GRootInode *next;
+      for (GRootInode *inode = fs->inodes[i]; inode != NULL; inode = next)
+        {
+          next = inode->hash_next;
+          close (inode->fd);
+          free (inode->name);
+          free (inode->dentry_name);
+          free (inode);
+        }
+    }
+  free (fs->inodes);
+  free (fs->dentries);
+
+  close (fs->root.fd);
+  close (fs->basefd);
+  pthread_mutex_destroy (&fs->inodes_lock);
+  pthread_mutex_destroy (&fs->flush_lock);
+  pthread_cond_destroy (&fs->flush_cond);
+  pthread_mutex_destroy (&fs->reclaim_lock);
+  pthread_cond_destroy (&fs->reclaim_cond);
+  if (!fs->cache_shared)
+    grootfs_cache_free (fs->cache);
+  grootfs_store_close (fs->store);
+  grootfs_snapshot_free (fs->snapshot);
+  free (fs);
+}
+
+static struct fuse_lowlevel_ops grootfs_oper = {
+  .init = grootfs_init,
+  .destroy = grootfs_destroy,
+  .lookup = grootfs_lookup,
+  .forget = grootfs_forget,
+  .forget_multi = grootfs_forget_multi,
+  .getattr = grootfs_getattr,
+  .setattr = grootfs_setattr,
+  .readlink = grootfs_readlink,
+  .opendir = grootfs_opendir,
+  .readdir = grootfs_readdir,
+  .releasedir = grootfs_releasedir,
+  .mknod = grootfs_mknod,
+  .mkdir = grootfs_mkdir,
+  .symlink = grootfs_symlink,
+  .unlink = grootfs_unlink,
+  .rmdir = grootfs_rmdir,
+  .rename = grootfs_rename,
+  .link = grootfs_link,
+  .create = grootfs_create,
+  .open = grootfs_open,
+  .read = grootfs_read,
+  .write_buf = grootfs_write_buf,
+  .statfs = grootfs_statfs,
+  .release = grootfs_release,
+  .fsync = grootfs_fsync,
+  .access = grootfs_access,
+  .setxattr = grootfs_setxattr,
+  .getxattr = grootfs_getxattr,
+  .listxattr = grootfs_listxattr,
+  .removexattr = grootfs_removexattr,
+};
+
+/* With stats enabled, the ops are wrapped to time them. All of them
+ * reply before returning, so this covers all the work. The trace
+ * arguments are those of grootfs_trace_record() after the start time,
+ * evaluated after the op so that they include the file handles opened. */
+#define TRACE_ARGS(...) __VA_ARGS__
+#define STATS_WRAPPER(name, op, params, args, trace)            \
+  static void                                                   \
+  grootfs_stats_##name params                                   \
+  {                                                             \
+    uint64_t start = grootfs_stats_op_begin ();                 \
+    uint64_t trace_start = grootfs_trace_begin ();              \
+    grootfs_##name args;                                        \
+    grootfs_stats_op_end (op, start);                           \
+    if (trace_start != 0)                                       \
+      grootfs_trace_record (op, trace_start, TRACE_ARGS trace); \
+  }
+
+STATS_WRAPPER (lookup, GROOTFS_OP_LOOKUP,
+               (fuse_req_t req, fuse_ino_t parent, const char *name),
+               (req, parent, name),
+               (parent, 0, 0, 0, name, NULL))
+STATS_WRAPPER (forget, GROOTFS_OP_FORGET,
+               (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup),
+               (req, ino, nlookup),
+               (ino, nlookup, 0, 0, NULL, NULL))
+STATS_WRAPPER (forget_multi, GROOTFS_OP_FORGET,
+               (fuse_req_t req, size_t count, struct fuse_forget_data *forgets),
+               (req, count, forgets),
+               (0, count, 0, 0, NULL, NULL))
+STATS_WRAPPER (getattr, GROOTFS_OP_GETATTR,
+               (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+               (req, ino, fi),
+               (ino, 0, 0, 0, NULL, NULL))
+STATS_WRAPPER (setattr, GROOTFS_OP_SETATTR,
+               (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi),
+               (req, ino, attr, to_set, fi),
+               (ino, (uint64_t) attr->st_mode << 32 | (uint32_t) to_set, attr->st_size,
+                (uint64_t) attr->st_uid << 32 | attr->st_gid, NULL, NULL))
+STATS_WRAPPER (readlink, GROOTFS_OP_READLINK,
+               (fuse_req_t req, fuse_ino_t ino),
+               (req, ino),
+               (ino, 0, 0, 0, NULL, NULL))
+STATS_WRAPPER (opendir, GROOTFS_OP_OPENDIR,
+               (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+               (req, ino, fi),
+               (ino, fi->fh, 0, fi->flags, NULL, NULL))
+STATS_WRAPPER (readdir, GROOTFS_OP_READDIR,
+               (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+               (req, ino, size, offset, fi),
+               (ino, fi->fh, size, offset, NULL, NULL))
+STATS_WRAPPER (releasedir, GROOTFS_OP_RELEASEDIR,
+               (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+               (req, ino, fi),
+               (ino, fi->fh, 0, 0, NULL, NULL))
+STATS_WRAPPER (mknod, GROOTFS_OP_MKNOD,
+               (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev),
+               (req, parent, name, mode, rdev),
+               (parent, mode, rdev, 0, name, NULL))
+STATS_WRAPPER (mkdir, GROOTFS_OP_MKDIR,
+               (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode),
+               (req, parent, name, mode),
+               (parent, mode, 0, 0, name, NULL))
+STATS_WRAPPER (symlink, GROOTFS_OP_SYMLINK,
+               (fuse_req_t req, const char *link, fuse_ino_t parent, const char *name),
+               (req, link, parent, name),
+               (parent, 0, 0, 0, name, link))
+STATS_WRAPPER (unlink, GROOTFS_OP_UNLINK,
+               (fuse_req_t req, fuse_ino_t parent, const char *name),
+               (req, parent, name),
+               (parent, 0, 0, 0, name, NULL))
+STATS_WRAPPER (rmdir, GROOTFS_OP_RMDIR,
+               (fuse_req_t req, fuse_ino_t parent, const char *name),
+               (req, parent, name),
+               (parent, 0, 0, 0, name, NULL))
+STATS_WRAPPER (rename, GROOTFS_OP_RENAME,
+               (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname),
+               (req, parent, name, newparent, newname),
+               (parent, newparent, 0, 0, name, newname))
+STATS_WRAPPER (link, GROOTFS_OP_LINK,
+               (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname),
+               (req, ino, newparent, newname),
+               (ino, newparent, 0, 0, newname, NULL))
+STATS_WRAPPER (create, GROOTFS_OP_CREATE,
+               (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi),
+               (req, parent, name, mode, fi),
+               (parent, fi->fh, mode, fi->flags, name, NULL))
+STATS_WRAPPER (open, GROOTFS_OP_OPEN,
+               (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+               (req, ino, fi),
+               (ino, fi->fh, 0, fi->flags, NULL, NULL))
+STATS_WRAPPER (read, GROOTFS_OP_READ,
+               (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+               (req, ino, size, offset, fi),
+               (ino, fi->fh, size, offset, NULL, NULL))
+STATS_WRAPPER (write_buf, GROOTFS_OP_WRITE,
+               (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf, off_t offset, struct fuse_file_info *fi),
+               (req, ino, in_buf, offset, fi),
+               (ino, fi->fh, fuse_buf_size (in_buf), offset, NULL, NULL))
+STATS_WRAPPER (statfs, GROOTFS_OP_STATFS,
+               (fuse_req_t req, fuse_ino_t ino),
+               (req, ino),
+               (ino, 0, 0, 0, NULL, NULL))
+STATS_WRAPPER (release, GROOTFS_OP_RELEASE,
+               (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+               (req, ino, fi),
+               (ino, fi->fh, 0, 0, NULL, NULL))
+STATS_WRAPPER (fsync, GROOTFS_OP_FSYNC,
+               (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+               (req, ino, datasync, fi),
+               (ino, fi->fh, datasync, 0, NULL, NULL))
+STATS_WRAPPER (access, GROOTFS_OP_ACCESS,
+               (fuse_req_t req, fuse_ino_t ino, int mask),
+               (req, ino, mask),
+               (ino, 0, mask, 0, NULL, NULL))
+STATS_WRAPPER (setxattr, GROOTFS_OP_SETXATTR,
+               (fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags),
+               (req, ino, name, value, size, flags),
+               (ino, 0, size, flags, name, NULL))
+STATS_WRAPPER (getxattr, GROOTFS_OP_GETXATTR,
+               (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size),
+               (req, ino, name, size),
+               (ino, 0, size, 0, name, NULL))
+STATS_WRAPPER (listxattr, GROOTFS_OP_LISTXATTR,
+               (fuse_req_t req, fuse_ino_t ino, size_t size),
+               (req, ino, size),
+               (ino, 0, size, 0, NULL, NULL))
+STATS_WRAPPER (removexattr, GROOTFS_OP_REMOVEXATTR,
+               (fuse_req_t req, fuse_ino_t ino, const char *name),
+               (req, ino, name),
+               (ino, 0, 0, 0, name, NULL))
+
+static struct fuse_lowlevel_ops grootfs_stats_oper = {
+  .init = grootfs_init,
+  .destroy = grootfs_destroy,
+  .lookup = grootfs_stats_lookup,
+  .forget = grootfs_stats_forget,
+  .forget_multi = grootfs_stats_forget_multi,
+  .getattr = grootfs_stats_getattr,
+  .setattr = grootfs_stats_setattr,
+  .readlink = grootfs_stats_readlink,
+  .opendir = grootfs_stats_opendir,
+  .readdir = grootfs_stats_readdir,
+  .releasedir = grootfs_stats_releasedir,
+  .mknod = grootfs_stats_mknod,
+  .mkdir = grootfs_stats_mkdir,
+  .symlink = grootfs_stats_symlink,
+  .unlink = grootfs_stats_unlink,
+  .rmdir = grootfs_stats_rmdir,
+  .rename = grootfs_stats_rename,
+  .link = grootfs_stats_link,
+  .create = grootfs_stats_create,
+  .open = grootfs_stats_open,
+  .read = grootfs_stats_read,
+  .write_buf = grootfs_stats_write_buf,
+  .statfs = grootfs_stats_statfs,
+  .release = grootfs_stats_release,
+  .fsync = grootfs_stats_fsync,
+  .access = grootfs_stats_access,
+  .setxattr = grootfs_stats_setxattr,
+  .getxattr = grootfs_stats_getxattr,
+  .listxattr = grootfs_stats_listxattr,
+  .removexattr = grootfs_stats_removexattr,
+};
+
+/* Enables the stats if requested, and returns the ops to use */
+static struct fuse_lowlevel_ops *
+grootfs_get_oper (const GRootFSOptions *options)
+{
+  /* The stats may be enabled later through the control socket, and
+   * until then the wrappers only check that they are not. The trace
+   * is recorded by the same wrappers. */
+  if (!options->stats && options->stats_file == NULL)
+    return options->control_path || options->trace_path ? &grootfs_stats_oper : &grootfs_oper;
+
+  if (!grootfs_stats_enabled)
+    grootfs_stats_enable ();
+
+  return &grootfs_stats_oper;
+}
+
+static bool
+timespec_after (const struct timespec *a,
+                const struct timespec *b)
+{
+  return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+/* Whether the .groot.symlink.* file name was changed after the last
+ * change to the store, e.g. by a run with metadata_store=none, rather
+ * than being left from before it was moved to the store */
+static bool
+symlink_datafile_is_newer (GRootFS *fs,
+                           const char *name,
+                           const struct stat *store_st)
+{
+  struct stat st;
+
+  /* Setting the xattr updates the ctime */
+  return fstatat (fs->basefd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+    timespec_after (&st.st_ctim, &store_st->st_mtim);
+}
+
+/* Move the data of any .groot.symlink.* files into the store, unless
+ * the store has newer data for the symlink. The files are only
+ * removed once the store is synced, so a crash in between at worst
+ * leaves them around to be migrated again, and only if they still
+ * match the store or are older than it, so whatever else writes them
+ * meanwhile is left for the next start. */
+static void
+migrate_symlink_datafiles (GRootFS *fs)
+{
+  DIR *dp;
+  struct dirent *entry;
+  struct stat store_st;
+  int fd;
+  size_t n_migrated = 0, n_stale = 0;
+
+  /* Before any change to the store */
+  if (fstatat (fs->basefd, GROOTFS_STORE_FILE, &store_st, AT_SYMLINK_NOFOLLOW) == -1)
+    return;
+
+  fd = openat (fs->basefd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  dp = fdopendir (fd);
+  if (dp == NULL)
+    {
+      close (fd);
+      return;
+    }
+
+  while ((entry = readdir (dp)) != NULL)
+    {
+      unsigned long dev, ino;
+      GRootFSData data, stored;
+
+      if (sscanf (entry->d_name, ".groot.symlink.%lx_%lx", &dev, &ino) != 2)
+        continue;
+
+      if (grootfs_store_lookup (fs->store, dev, ino, &stored) &&
+          !symlink_datafile_is_newer (fs, entry->d_name, &store_st))
+        {
+          n_stale++;
+          continue;
+        }
+
+      if (get_fake_data (fs->basefd, entry->d_name, FALSE, &data) != 0)
+        continue;
+
+      if (grootfs_store_set (fs->store, dev, ino, &data) != 0)
+        {
+          report ("Failed to migrate %s to %s", entry->d_name, GROOTFS_STORE_FILE);
+          goto out;
+        }
+
+      n_migrated++;
+    }
+
+  if ((n_migrated == 0 && n_stale == 0) || grootfs_store_sync (fs->store) != 0)
+    goto out;
+
+  rewinddir (dp);
+  while ((entry = readdir (dp)) != NULL)
+    {
+      unsigned long dev, ino;
+      GRootFSData data, stored;
+
+      if (sscanf (entry->d_name, ".groot.symlink.%lx_%lx", &dev, &ino) != 2 ||
+          !grootfs_store_lookup (fs->store, dev, ino, &stored))
+        continue;
+
+      if (!symlink_datafile_is_newer (fs, entry->d_name, &store_st) ||
+          (get_fake_data (fs->basefd, entry->d_name, FALSE, &data) == 0 &&
+           memcmp (&data, &stored, sizeof (data)) == 0))
+        unlinkat (fs->basefd, entry->d_name, 0);
+    }
+
+  __debug__ (("Migrated %zu symlink data files to %s, dropped %zu older ones",
+              n_migrated, GROOTFS_STORE_FILE, n_stale));
+
+ out:
+  closedir (dp);
+}
+
+/* Nothing can change the fake data, so it's all read up front, and
+ * the kernel may cache everything for as long as it likes */
+static void
+init_frozen (GRootFS *fs)
+{
+  int n_threads;
+
+  /* The walk is mostly waiting on the disk, so use all the cpus even
+   * if serving with fewer threads */
+  grootfs_parse_threads ("0", &n_threads);
+  fs->snapshot = grootfs_snapshot_load (fs->basefd, fs->store, n_threads);
+  if (fs->snapshot == NULL)
+    report ("Can't snapshot the fake metadata, reading it per file");
+  else
+    {
+      __debug__ (("snapshot of %zu files with fake metadata",
+                  grootfs_snapshot_size (fs->snapshot)));
+
+      /* The snapshot has everything they would */
+      grootfs_store_close (fs->store);
+      fs->store = NULL;
+      if (!fs->cache_shared && fs->cache != NULL)
+        {
+          grootfs_cache_free (fs->cache);
+          fs->cache = NULL;
+          memory_uncharge (fs->options.cache_size);
+        }
+
+      memory_charge (grootfs_snapshot_memory (fs->snapshot));
+      if (memory_over_limit (fs, 1.0))
+        report ("The metadata snapshot alone takes more than max_memory");
+    }
+
+  if (fs->options.attr_timeout < GROOTFS_FROZEN_TIMEOUT)
+    fs->options.attr_timeout = GROOTFS_FROZEN_TIMEOUT;
+  if (fs->options.entry_timeout < GROOTFS_FROZEN_TIMEOUT)
+    fs->options.entry_timeout = GROOTFS_FROZEN_TIMEOUT;
+  if (fs->options.negative_timeout < GROOTFS_FROZEN_TIMEOUT)
+    fs->options.negative_timeout = GROOTFS_FROZEN_TIMEOUT;
+  fs->options.kernel_cache = 1;
+  fs->options.metadata_flush = 0;
+}
+
+/* Leave at least half of the memory budget for the inodes */
+static void
+clamp_cache_size (GRootFSOptions *options)
+{
+  if (options->max_memory > 0 && options->cache_size > options->max_memory / 2)
+    options->cache_size = options->max_memory / 2;
+}
+
+/* If shared_cache is non-NULL it is used instead of creating a new
+ * cache, and must outlive the returned fs */
+static GRootFS *
+new_grootfs (int basefd,
+             long max_uid,
+             long max_gid,
+             const GRootFSOptions *options,
+             GRootFSCache *shared_cache)
+{
+  GRootFS *fs = xcalloc (sizeof (GRootFS));
+  struct stat st;
+
+  fs->basefd = basefd;
+  fs->max_uid = max_uid;
+  fs->max_gid = max_gid;
+  pthread_mutex_init (&fs->inodes_lock, NULL);
+  pthread_mutex_init (&fs->flush_lock, NULL);
+  pthread_cond_init (&fs->flush_cond, NULL);
+  pthread_mutex_init (&fs->reclaim_lock, NULL);
+  pthread_cond_init (&fs->reclaim_cond, NULL);
+  fs->options = *options;
+  clamp_cache_size (&fs->options);
+
+  if (shared_cache != NULL)
+    {
+      fs->cache = shared_cache;
+      fs->cache_shared = TRUE;
+    }
+  else
+    {
+      fs->cache = grootfs_cache_new (fs->options.cache_size);
+      if (fs->cache != NULL)
+        memory_charge (fs->options.cache_size);
+    }
+
+  fs->root.fd = openat (basefd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fs->root.fd == -1 || fstat (fs->root.fd, &st) == -1)
+    die_with_error ("Can't open base directory");
+
+  fs->root.dev = st.st_dev;
+  fs->root.ino = st.st_ino;
+  fs->root.is_dir = TRUE;
+  fs->root.refcount = 1;
+
+  if (options->metadata_store != GROOTFS_STORE_NONE)
+    {
+      /* A frozen mount never writes to the backing tree */
+      if (options->frozen)
+        fs->store = grootfs_store_open_readonly (basefd);
+      else
+        fs->store = grootfs_store_open (basefd);
+
+      if (fs->store == NULL)
+        {
+          int errsv = errno;
+
+          /* Once there is a store the per-symlink files are out of
+           * date, so serving from them would hand out different
+           * metadata than whoever uses the store */
+          if (errsv == EWOULDBLOCK)
+            die ("%s is in use by another grootfs on the same directory", GROOTFS_STORE_FILE);
+          if (errsv != ENOENT &&
+              faccessat (basefd, GROOTFS_STORE_FILE, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+            {
+              errno = errsv;
+              die_with_error ("Can't open %s", GROOTFS_STORE_FILE);
+            }
+          if (!(options->frozen && errsv == ENOENT))
+            report ("Can't use %s, falling back to per-symlink files: %s",
+                    GROOTFS_STORE_FILE, strerror (errsv));
+        }
+      else if (!options->frozen)
+        migrate_symlink_datafiles (fs);
+    }
+
+  if (options->frozen)
+    init_frozen (fs);
+
+  return fs;
+}
+
+static int grootfs_session_loop (struct fuse_session *se,
+                                 struct fuse_chan *ch,
+                                 GRootFS *fs,
+                                 int n_threads);
+
+typedef struct {
+  GRootFSOptions options; /* Must be first, the fuse_opt offsets are relative to it */
+  bool strict;            /* Fail on unknown options rather than keeping them */
+} GRootFSOptionsParser;
+
+enum {
+  KEY_METADATA_CACHE,
+  KEY_MAX_MEMORY,
+  KEY_MAX_WRITE,
+  KEY_MAX_READ,
+  KEY_MAX_READAHEAD,
+};
+
+#define GROOTFS_OPT(t, p, v) { t, offsetof(GRootFSOptions, p), v }
+
+static struct fuse_opt grootfs_fuse_opts[] = {
+  GROOTFS_OPT ("attr_timeout=%lf", attr_timeout, 0),
+  GROOTFS_OPT ("entry_timeout=%lf", entry_timeout, 0),
+  GROOTFS_OPT ("negative_timeout=%lf", negative_timeout, 0),
+  GROOTFS_OPT ("metadata_flush=%lf", metadata_flush, 0),
+  GROOTFS_OPT ("kernel_cache", kernel_cache, 1),
+  GROOTFS_OPT ("nokernel_cache", kernel_cache, 0),
+  GROOTFS_OPT ("splice", splice, 1),
+  GROOTFS_OPT ("nosplice", splice, 0),
+  GROOTFS_OPT ("passthrough", passthrough, 1),
+  GROOTFS_OPT ("readdirplus", readdirplus, 1),
+  GROOTFS_OPT ("noreaddirplus", readdirplus, 0),
+  GROOTFS_OPT ("slow_threads=%d", slow_threads, 0),
+  GROOTFS_OPT ("uring", uring, 1),
+  GROOTFS_OPT ("nouring", uring, 0),
+  GROOTFS_OPT ("frozen", frozen, 1),
+  GROOTFS_OPT ("async_read", async_read, 1),
+  GROOTFS_OPT ("sync_read", async_read, 0),
+  GROOTFS_OPT ("shared_daemon", shared_daemon, 1),
+  GROOTFS_OPT ("noshared_daemon", shared_daemon, 0),
+  GROOTFS_OPT ("stats", stats, 1),
+  GROOTFS_OPT ("nostats", stats, 0),
+  GROOTFS_OPT ("stats_file=%s", stats_file, 0),
+  GROOTFS_OPT ("control=%s", control_path, 0),
+  GROOTFS_OPT ("trace=%s", trace_path, 0),
+  GROOTFS_OPT ("metadata_store=none", metadata_store, GROOTFS_STORE_NONE),
+  GROOTFS_OPT ("metadata_store=symlinks", metadata_store, GROOTFS_STORE_SYMLINKS),
+  GROOTFS_OPT ("metadata_store=all", metadata_store, GROOTFS_STORE_ALL),
+  FUSE_OPT_KEY ("metadata_cache=", KEY_METADATA_CACHE),
+  FUSE_OPT_KEY ("max_memory=", KEY_MAX_MEMORY),
+  FUSE_OPT_KEY ("max_write=", KEY_MAX_WRITE),
+  FUSE_OPT_KEY ("max_read=", KEY_MAX_READ),
+  FUSE_OPT_KEY ("max_readahead=", KEY_MAX_READAHEAD),
+  FUSE_OPT_END
+};
+
+/* Sizes are in bytes, with an optional K, M or G suffix */
+static int
+parse_size (const char *str,
+            size_t *size_out)
+{
+  char *end;
+  unsigned long long size;
+
+  errno = 0;
+  size = strtoull (str, &end, 10);
+  if (*str == 0 || *str == '-' || errno != 0)
+    return -1;
+
+  switch (*end)
+    {
+    case 'G':
+    case 'g':
+      size *= 1024;
+      /* Fall through */
+    case 'M':
+    case 'm':
+      size *= 1024;
+      /* Fall through */
+    case 'K':
+    case 'k':
+      size *= 1024;
+      end++;
+      break;
+    default:
+      break;
+    }
+
+  if (*end != 0)
+    return -1;
+
+  *size_out = size;
+  return 0;
+}
+
+static int
+grootfs_options_opt_proc (void *data,
+                          const char *arg,
+                          int key,
+                          struct fuse_args *outargs)
+{
+  GRootFSOptionsParser *parser = data;
+  size_t *size_field = NULL;
+  size_t max_size = SIZE_MAX;
+
+  switch (key)
+    {
+    case KEY_METADATA_CACHE:
+      size_field = &parser->options.cache_size;
+      break;
+
+    case KEY_MAX_MEMORY:
+      size_field = &parser->options.max_memory;
+      break;
+
+    case KEY_MAX_WRITE:
+      size_field = &parser->options.max_write;
+      max_size = GROOTFS_MAX_WRITE;
+      break;
+
+    case KEY_MAX_READ:
+      size_field = &parser->options.max_read;
+      max_size = UINT_MAX;
+      break;
+
+    case KEY_MAX_READAHEAD:
+      size_field = &parser->options.max_readahead;
+      max_size = UINT_MAX;
+      break;
+
+    case FUSE_OPT_KEY_OPT:
+      if (parser->strict)
+        {
+          report ("Unknown grootfs option %s", arg);
+          return -1;
+        }
+      return 1;
+
+    default:
+      return 1;
+    }
+
+  if (parse_size (strchr (arg, '=') + 1, size_field) != 0 || *size_field > max_size)
+    {
+      report ("Invalid size in option %s", arg);
+      return -1;
+    }
+
+  /* Not passed on with the fuse options, we handle these ourselves */
+  return 0;
+}
+
+/* The daemon may run in another directory, e.g. fuse_daemonize()
+ * changes to / */
+static void
+make_absolute_path (char **path)
+{
+  autofree char *cwd = NULL;
+
+  if (*path == NULL || (*path)[0] == '/')
+    return;
+
+  cwd = get_current_dir_name ();
+  if (cwd == NULL)
+    die_with_error ("Can't get the current directory");
+  *path = xasprintf ("%s/%s", cwd, *path);
+}
+
+static void
+absolute_paths (GRootFSOptions *options)
+{
+  make_absolute_path (&options->control_path);
+  make_absolute_path (&options->trace_path);
+}
+
+/* Parse a comma-separated list of options, as given to -o, into options */
+int
+grootfs_parse_options (const char *str,
+                       GRootFSOptions *options)
+{
+  GRootFSOptionsParser parser = { *options, TRUE };
+  struct fuse_args args = FUSE_ARGS_INIT (0, NULL);
+  int res;
+
+  if (fuse_opt_add_arg (&args, "grootfs") == -1 ||
+      fuse_opt_add_arg (&args, "-o") == -1 ||
+      fuse_opt_add_arg (&args, str) == -1)
+    die_oom ();
+
+  res = fuse_opt_parse (&args, &parser, grootfs_fuse_opts, grootfs_options_opt_proc);
+  fuse_opt_free_args (&args);
+  if (res == -1)
+    return -1;
+
+  if (parser.options.attr_timeout < 0 ||
+      parser.options.entry_timeout < 0 ||
+      parser.options.negative_timeout < 0 ||
+      parser.options.metadata_flush < 0)
+    {
+      report ("Timeouts can't be negative");
+      return -1;
+    }
+
+  if (parser.options.slow_threads < 0 ||
+      parser.options.slow_threads > GROOTFS_MAX_THREADS)
+    {
+      report ("slow_threads must be between 0 and %d", GROOTFS_MAX_THREADS);
+      return -1;
+    }
+
+  absolute_paths (&parser.options);
+
+  *options = parser.options;
+  return 0;
+}
+
+int
+start_grootfs (int argc,
+               char *argv[],
+               int dirfd)
+{
+  struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
+  GRootFSOptionsParser parser = { GROOTFS_OPTIONS_INIT, FALSE };
+  GRootFS *fs;
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  char *mountpoint = NULL;
+  int multithreaded, foreground;
+  int n_threads = 1;
+  int res = -1;
+
+  /* Pick out our options, the rest are for fuse */
+  if (fuse_opt_parse (&args, &parser, grootfs_fuse_opts, grootfs_options_opt_proc) == -1)
+    return 1;
+
+  if (parser.options.passthrough)
+    report ("passthrough is only supported by groot, falling back to splice");
+
+  /* Except max_read, which is a mount option */
+  if (parser.options.max_read)
+    {
+      autofree char *max_read = xasprintf ("-omax_read=%zu", parser.options.max_read);
+      if (fuse_opt_add_arg (&args, max_read) == -1)
+        die_oom ();
+    }
+
+  /* And the mount is read-only when frozen */
+  if (parser.options.frozen && fuse_opt_add_arg (&args, "-oro") == -1)
+    die_oom ();
+
+  absolute_paths (&parser.options);
+
+  if (fuse_parse_cmdline (&args, &mountpoint, &multithreaded, &foreground) == -1)
+    return 1;
+
+  ch = fuse_mount (mountpoint, &args);
+  if (ch == NULL)
+    goto out;
+
+  fs = new_grootfs (dirfd, LONG_MAX, LONG_MAX, &parser.options, NULL);
+  fs->notify_ch = ch;
+  se = fuse_lowlevel_new (&args, grootfs_get_oper (&parser.options), sizeof (grootfs_oper), fs);
+  if (se != NULL)
+    {
+      if (fuse_set_signal_handlers (se) != -1)
+        {
+          fuse_session_add_chan (se, ch);
+
+          fuse_daemonize (foreground);
+
+          if (multithreaded)
+            grootfs_parse_threads ("0", &n_threads);
+
+          /* After daemonizing, which forks */
+          if (grootfs_stats_enabled)
+            grootfs_stats_start_dumper (parser.options.stats_file);
+          if (parser.options.trace_path)
+            grootfs_trace_start (parser.options.trace_path);
+
+          res = grootfs_session_loop (se, ch, fs, n_threads);
+
+          grootfs_trace_stop ();
+          if (parser.options.stats_file)
+            grootfs_stats_dump_file (parser.options.stats_file);
+
+          fuse_remove_signal_handlers (se);
+          fuse_session_remove_chan (ch);
+        }
+      fuse_session_destroy (se);
+    }
+
+  fuse_unmount (mountpoint, ch);
+
+ out:
+  free (mountpoint);
+  fuse_opt_free_args (&args);
+
+  return res == -1 ? 1 : 0;
+}
+
+static int
+dev_fuse_chan_receive (struct fuse_chan **chp,
+                       char *buf,
+                       size_t size)
+{
+  struct fuse_chan *ch = *chp;
+  struct fuse_session *se = fuse_chan_session (ch);
+  ssize_t res;
+  int err;
+
+ restart:
+  res = read (fuse_chan_fd (ch), buf, size);
+  err = errno;
+
+  if (fuse_session_exited (se))
+    return 0;
+
+  if (res == -1)
+    {
+      /* ENOENT means the operation was interrupted, it's safe to restart */
+      if (err == ENOENT)
+        goto restart;
+
+      if (err == ENODEV) /* Happens on unmount */
+        {
+          fuse_session_exit (se);
+          return 0;
+        }
+      if (err != EINTR && err != EAGAIN)
+        report ("reading fuse device");
+      return -err;
+    }
+
+  /* Remember the init request so we can extend the reply, see
+   * dev_fuse_chan_send(). It always arrives before any other request,
+   * and never via splice. */
+  if (res >= sizeof (struct fuse_in_header))
+    {
+      struct fuse_in_header *in = (struct fuse_in_header *) buf;
+      if (in->opcode == FUSE_INIT)
+        {
+          DevFuseChan *chan = fuse_chan_data (ch);
+          struct fuse_init_in *init_in = (struct fuse_init_in *) (in + 1);
+
+          chan->init_unique = in->unique;
+          if (res >= sizeof (*in) + offsetof (struct fuse_init_in, flags2) + sizeof (init_in->flags2) &&
+              (init_in->flags & FUSE_INIT_EXT) != 0 &&
+              (init_in->flags2 & (FUSE_PASSTHROUGH >> 32)) != 0)
+            chan->kernel_passthrough = TRUE;
+        }
+    }
+
+  return res;
+}
+
+/* libfuse 2 doesn't know about FUSE_MAX_PAGES, so the kernel limits
+ * requests to 32 pages whatever max_write we negotiate. It replies
+ * with the 24 byte init_out of protocol 7.19, so we copy that into a
+ * full size one, in zeroed space that was padding or not there in
+ * older versions, and add max_pages ourselves. The kernel accepts the
+ * longer reply at any minor version, and kernels without support
+ * ignore both the flag and the field. The same goes for passthrough
+ * and readdirplus. */
+static void
+extend_init_reply (DevFuseChan *chan,
+                   const struct iovec *iov,
+                   size_t count,
+                   struct iovec *iov_out,
+                   struct fuse_out_header *out_header,
+                   struct fuse_init_out *init_out)
+{
+  size_t len = iov[1].iov_len;
+  long page_size = getpagesize ();
+  /* Not in older headers, but it directly follows flags2 */
+  size_t max_stack_depth_offset = offsetof (struct fuse_init_out, flags2) + sizeof (uint32_t);
+  uint32_t max_stack_depth = 1;
+
+  memcpy (iov_out, iov, count * sizeof (struct iovec));
+
+  if (len < offsetof (struct fuse_init_out, max_write) + sizeof (init_out->max_write) ||
+      len > sizeof (struct fuse_init_out))
+    {
+      if (chan->passthrough)
+        report ("Unexpected fuse init reply, no passthrough");
+      chan->passthrough = FALSE;
+      return;
+    }
+
+  memset (init_out, 0, sizeof (*init_out));
+  memcpy (init_out, iov[1].iov_base, len);
+  init_out->flags |= FUSE_MAX_PAGES;
+
+  if (chan->readdirplus)
+    init_out->flags |= FUSE_DO_READDIRPLUS | FUSE_READDIRPLUS_AUTO;
+  init_out->max_pages = (init_out->max_write + page_size - 1) / page_size;
+
+  if (chan->passthrough && !chan->kernel_passthrough)
+    {
+      report ("Kernel doesn't support fuse passthrough, falling back to splice");
+      chan->passthrough = FALSE;
+    }
+
+  if (chan->passthrough)
+    {
+      init_out->flags |= FUSE_INIT_EXT;
+      init_out->flags2 |= FUSE_PASSTHROUGH >> 32;
+      memcpy ((char *) init_out + max_stack_depth_offset, &max_stack_depth, sizeof (uint32_t));
+    }
+
+  *out_header = *(const struct fuse_out_header *) iov[0].iov_base;
+  out_header->len = sizeof (*out_header) + sizeof (*init_out);
+  iov_out[0].iov_base = out_header;
+  iov_out[0].iov_len = sizeof (*out_header);
+  iov_out[1].iov_base = init_out;
+  iov_out[1].iov_len = sizeof (*init_out);
+}
+
+/* Replies to open and create end with a fuse_open_out. If we
+ * registered a backing file for it, tell the kernel to use it. */
+static void
+extend_open_reply (DevFuseChan *chan,
+                   const struct iovec *iov,
+                   size_t count,
+                   struct iovec *iov_out,
+                   char *reply_out)
+{
+  size_t len = iov[1].iov_len;
+  struct fuse_open_out open_out;
+  uint32_t backing_id = 0;
+
+  if (len != sizeof (struct fuse_open_out) &&
+      len != sizeof (struct fuse_entry_out) + sizeof (struct fuse_open_out))
+    return;
+
+  memcpy (&open_out, (char *) iov[1].iov_base + len - sizeof (open_out), sizeof (open_out));
+
+  pthread_mutex_lock (&chan->backing_lock);
+  if (open_out.fh < chan->n_backing_ids)
+    backing_id = chan->backing_ids[open_out.fh];
+  pthread_mutex_unlock (&chan->backing_lock);
+
+  if (backing_id == 0)
+    return;
+
+  /* Older headers call backing_id padding */
+  open_out.open_flags |= FOPEN_PASSTHROUGH;
+  memcpy (&open_out.padding, &backing_id, sizeof (uint32_t));
+
+  memcpy (iov_out, iov, count * sizeof (struct iovec));
+  memcpy (reply_out, iov[1].iov_base, len - sizeof (open_out));
+  memcpy (reply_out + len - sizeof (open_out), &open_out, sizeof (open_out));
+  iov_out[1].iov_base = reply_out;
+}
+
+static int
+dev_fuse_chan_send (struct fuse_chan *ch,
+                    const struct iovec iov[],
+                    size_t count)
+{
+  DevFuseChan *chan = fuse_chan_data (ch);
+  struct iovec new_iov[2];
+  struct fuse_out_header init_header;
+  struct fuse_init_out init_out;
+  char open_reply[sizeof (struct fuse_entry_out) + sizeof (struct fuse_open_out)];
+
+  if (iov && count == 2 && ((struct fuse_out_header *) iov[0].iov_base)->error == 0)
+    {
+      const struct fuse_out_header *out = iov[0].iov_base;
+
+      if (chan->init_unique != 0 && out->unique == chan->init_unique)
+        {
+          extend_init_reply (chan, iov, count, new_iov, &init_header, &init_out);
+          chan->init_unique = 0;
+          iov = new_iov;
+        }
+      else if (chan->passthrough)
+        {
+          memset (new_iov, 0, sizeof (new_iov));
+          extend_open_reply (chan, iov, count, new_iov, open_reply);
+          if (new_iov[1].iov_base != NULL)
+            iov = new_iov;
+        }
+    }
+
+  if (iov)
+    {
+      ssize_t res = writev (fuse_chan_fd (ch), iov, count);
+      int err = errno;
+
+      if (res == -1)
+        {
+          struct fuse_session *se = fuse_chan_session(ch);
+          if (!fuse_session_exited(se) && err != ENOENT)
+            report ("writing fuse device");
+          return -err;
+        }
+    }
+
+  return 0;
+}
+
+static void
+dev_fuse_chan_destroy (struct fuse_chan *ch)
+{
+  int fd = fuse_chan_fd (ch);
+
+  DevFuseChan *chan = fuse_chan_data (ch);
+
+  if (fd != -1)
+    close (fd);
+
+  pthread_mutex_destroy (&chan->backing_lock);
+  free (chan->backing_ids);
+  free (chan);
+}
+
+#define MIN_BUFSIZE 0x21000
+/* Room for the request headers, same as FUSE_BUFFER_HEADER_SIZE in libfuse */
+#define BUFFER_HEADER_SIZE 0x1000
+
+/* The buffer needs to fit the largest write request, and libfuse
+ * also clamps the max_write it negotiates to the buffer size. */
+struct fuse_chan *
+dev_fuse_chan_new (int fd,
+                   const GRootFSOptions *options)
+{
+  struct fuse_chan_ops op = {
+    .receive = dev_fuse_chan_receive,
+    .send = dev_fuse_chan_send,
+    .destroy = dev_fuse_chan_destroy,
+  };
+  DevFuseChan *chan = xcalloc (sizeof (DevFuseChan));
+
+  chan->fd = fd;
+  chan->passthrough = options->passthrough;
+  chan->readdirplus = options->readdirplus;
+  pthread_mutex_init (&chan->backing_lock, NULL);
+
+  size_t bufsize = options->max_write + BUFFER_HEADER_SIZE;
+  bufsize = bufsize < MIN_BUFSIZE ? MIN_BUFSIZE : bufsize;
+  return fuse_chan_new (&op, fd, bufsize, chan);
+}
+
+
+int
+grootfs_parse_threads (const char *str,
+                       int *n_threads_out)
+{
+  char *end;
+  long n_threads;
+
+  n_threads = strtol (str, &end, 10);
+  if (*str == 0 || *end != 0 || n_threads < 0 || n_threads > GROOTFS_MAX_THREADS)
+    return -1;
+
+  /* Zero means one thread per cpu */
+  if (n_threads == 0)
+    {
+      n_threads = sysconf (_SC_NPROCESSORS_ONLN);
+      if (n_threads < 1)
+        n_threads = 1;
+      if (n_threads > GROOTFS_MAX_THREADS)
+        n_threads = GROOTFS_MAX_THREADS;
+    }
+
+  *n_threads_out = n_threads;
+  return 0;
+}
+
+/* Reads and writes from this size up go to the slow pool */
+#define GROOTFS_SLOW_IO_SIZE (128 * 1024)
+
+/* Most requests a slow pool thread may be behind on, after which the
+ * fuse workers run the slow requests themselves */
+#define GROOTFS_SLOW_MAX_QUEUED 64
+
+/* A request copied out of the worker buffer for the slow pool */
+typedef struct {
+  GRootFS *fs;
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  struct fuse_buf fbuf;
+} GRootFSSlowRequest;
+
+/* Whether the request would change the filesystem. The mount is
+ * read-only when frozen, so the kernel should never send these. */
+static bool
+is_modifying_request (const struct fuse_buf *fbuf)
+{
+  const struct fuse_in_header *in = fbuf->mem;
+
+  switch (in->opcode)
+    {
+    case FUSE_SETATTR:
+    case FUSE_MKNOD:
+    case FUSE_MKDIR:
+    case FUSE_SYMLINK:
+    case FUSE_UNLINK:
+    case FUSE_RMDIR:
+    case FUSE_RENAME:
+    case FUSE_RENAME2:
+    case FUSE_LINK:
+    case FUSE_CREATE:
+    case FUSE_WRITE:
+    case FUSE_SETXATTR:
+    case FUSE_REMOVEXATTR:
+    case FUSE_FALLOCATE:
+    case FUSE_COPY_FILE_RANGE:
+      return TRUE;
+
+    case FUSE_OPEN:
+      return fbuf->size >= sizeof (*in) + sizeof (struct fuse_open_in) &&
+        (((const struct fuse_open_in *) (in + 1))->flags & (O_ACCMODE | O_TRUNC)) != O_RDONLY;
+
+    default:
+      return FALSE;
+    }
+}
+
+/* Handle a request read from ch. The ones libfuse 2 doesn't know
+ * about are handled here, and those are never big enough to be left
+ * in the splice pipe. job is the slow pool job running it, if any. */
+static void
+grootfs_process_request (GRootFS *fs,
+                         struct fuse_session *se,
+                         struct fuse_chan *ch,
+                         const struct fuse_buf *fbuf,
+                         GRootPoolJob *job)
+{
+  if (!(fbuf->flags & FUSE_BUF_IS_FD) &&
+      fbuf->size >= sizeof (struct fuse_in_header))
+    {
+      const struct fuse_in_header *in = fbuf->mem;
+
+      if (fs->options.frozen && is_modifying_request (fbuf))
+        {
+          struct fuse_out_header out = { sizeof (out), -EROFS, in->unique };
+          struct iovec iov = { &out, sizeof (out) };
+
+          fuse_chan_send (ch, &iov, 1);
+          return;
+        }
+
+      if (in->opcode == FUSE_READDIRPLUS &&
+          fbuf->size >= sizeof (*in) + sizeof (struct fuse_read_in))
+        {
+          const struct fuse_read_in *arg = (const struct fuse_read_in *) (in + 1);
+          uint64_t start = grootfs_stats_op_begin ();
+          uint64_t trace_start = grootfs_trace_begin ();
+
+          grootfs_readdirplus (fs, ch, in, arg, job);
+          grootfs_stats_op_end (GROOTFS_OP_READDIRPLUS, start);
+          if (trace_start != 0)
+            grootfs_trace_record (GROOTFS_OP_READDIRPLUS, trace_start, in->nodeid,
+                                  arg->fh, arg->size, arg->offset, NULL, NULL);
+          return;
+        }
+
+      if (in->opcode == FUSE_COPY_FILE_RANGE &&
+          fbuf->size >= sizeof (*in) + sizeof (struct fuse_copy_file_range_in))
+        {
+          const struct fuse_copy_file_range_in *arg = (const struct fuse_copy_file_range_in *) (in + 1);
+          uint64_t start = grootfs_stats_op_begin ();
+          uint64_t trace_start = grootfs_trace_begin ();
+
+          grootfs_copy_file_range (fs, ch, in, arg);
+          grootfs_stats_op_end (GROOTFS_OP_COPY_FILE_RANGE, start);
+          /* The offsets are not recorded */
+          if (trace_start != 0)
+            grootfs_trace_record (GROOTFS_OP_COPY_FILE_RANGE, trace_start, in->nodeid,
+                                  arg->fh_in, arg->len, arg->fh_out, NULL, NULL);
+          return;
+        }
+    }
+
+  fuse_session_process_buf (se, fbuf, ch);
+}
+
+static void
+slow_request_run (GRootPoolJob *job,
+                  void *data)
+{
+  GRootFSSlowRequest *r = data;
+
+  grootfs_process_request (r->fs, r->se, r->ch, &r->fbuf, job);
+  free (r->fbuf.mem);
+  free (r);
+}
+
+/* The request never reached libfuse, so we reply ourselves */
+static void
+slow_request_cancel (GRootPoolJob *job,
+                     void *data)
+{
+  GRootFSSlowRequest *r = data;
+  const struct fuse_in_header *in = r->fbuf.mem;
+  struct fuse_out_header out = { sizeof (out), -EINTR, in->unique };
+  struct iovec iov = { &out, sizeof (out) };
+
+  __debug__ (("cancelled request %llu", (unsigned long long) in->unique));
+
+  fuse_chan_send (r->ch, &iov, 1);
+  free (r->fbuf.mem);
+  free (r);
+}
+
+/* Whether the request may block for long, so it should not hold up
+ * a fuse worker. Requests still in the splice pipe are left alone, as
+ * copying them out would cost more than it saves. */
+static bool
+is_slow_request (const struct fuse_buf *fbuf)
+{
+  const struct fuse_in_header *in = fbuf->mem;
+
+  if ((fbuf->flags & FUSE_BUF_IS_FD) || fbuf->size < sizeof (*in))
+    return FALSE;
+
+  switch (in->opcode)
+    {
+    case FUSE_FSYNC:
+    case FUSE_FSYNCDIR:
+    case FUSE_READDIRPLUS:
+    case FUSE_COPY_FILE_RANGE:
+      return TRUE;
+
+    case FUSE_READ:
+      return fbuf->size >= sizeof (*in) + sizeof (struct fuse_read_in) &&
+        ((const struct fuse_read_in *) (in + 1))->size >= GROOTFS_SLOW_IO_SIZE;
+
+    case FUSE_WRITE:
+      return fbuf->size >= sizeof (*in) + sizeof (struct fuse_write_in) &&
+        ((const struct fuse_write_in *) (in + 1))->size >= GROOTFS_SLOW_IO_SIZE;
+
+    default:
+      return FALSE;
+    }
+}
+
+/* Runs the request, or hands it to the slow pool. An interrupt of a
+ * request still waiting in the pool cancels it there, otherwise it's
+ * passed on to libfuse, which marks the request if it's running. */
+static void
+grootfs_process_buf (GRootFS *fs,
+                     struct fuse_session *se,
+                     struct fuse_chan *ch,
+                     const struct fuse_buf *fbuf)
+{
+  const struct fuse_in_header *in = fbuf->mem;
+  GRootFSSlowRequest *r;
+
+  if (fs->slow_pool == NULL)
+    {
+      grootfs_process_request (fs, se, ch, fbuf, NULL);
+      return;
+    }
+
+  if (!(fbuf->flags & FUSE_BUF_IS_FD) &&
+      fbuf->size >= sizeof (*in) + sizeof (struct fuse_interrupt_in) &&
+      in->opcode == FUSE_INTERRUPT &&
+      grootfs_pool_interrupt (fs->slow_pool, ((const struct fuse_interrupt_in *) (in + 1))->unique))
+    return;
+
+  if (!is_slow_request (fbuf))
+    {
+      grootfs_process_request (fs, se, ch, fbuf, NULL);
+      return;
+    }
+
+  r = xcalloc (sizeof (GRootFSSlowRequest));
+  r->fs = fs;
+  r->se = se;
+  r->ch = ch;
+  r->fbuf = *fbuf;
+  r->fbuf.mem = xmalloc (fbuf->size);
+  memcpy (r->fbuf.mem, fbuf->mem, fbuf->size);
+
+  if (!grootfs_pool_push (fs->slow_pool, in->unique, slow_request_run, slow_request_cancel, r))
+    {
+      free (r->fbuf.mem);
+      free (r);
+      grootfs_process_request (fs, se, ch, fbuf, NULL);
+    }
+}
+
+typedef struct {
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  GRootFS *fs;
+  sem_t finished;
+  int error;
+} GRootFSLoop;
+
+static void *
+grootfs_worker (void *data)
+{
+  GRootFSLoop *loop = data;
+  struct fuse_session *se = loop->se;
+  size_t bufsize = fuse_chan_bufsize (loop->ch);
+  char *buf;
+  int res = 0;
+
+  /* We only allow cancellation while blocking in the receive, so
+   * that we never get cancelled in the middle of a reply. */
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+  buf = xmalloc (bufsize);
+  pthread_cleanup_push (free, buf);
+
+  while (!fuse_session_exited (se))
+    {
+      struct fuse_chan *ch = loop->ch;
+      struct fuse_buf fbuf = {
+        .mem = buf,
+        .size = bufsize,
+      };
+
+      pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+      res = fuse_session_receive_buf (se, &fbuf, &ch);
+      pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+      /* When splicing, fuse returns ENOENT for interrupted requests
+       * instead of retrying, like it does for plain reads */
+      if (res == -EINTR || res == -ENOENT)
+        continue;
+      if (res <= 0)
+        break;
+
+      grootfs_process_buf (loop->fs, se, ch, &fbuf);
+    }
+
+  pthread_cleanup_pop (1);
+
+  if (res < 0)
+    loop->error = TRUE;
+
+  /* Wake up the main thread so it can tear down the others */
+  fuse_session_exit (se);
+  sem_post (&loop->finished);
+
+  return NULL;
+}
+
+/* The mounts served by one daemon process, which share their options
+ * and slow pool */
+typedef struct {
+  GRootFS **fss;
+  int n_fss;
+  GRootControl *control;
+} GRootFSControlTarget;
+
+#define GROOTFS_CONTROL_HELP                                            \
+  "help                 show this\n"                                    \
+  "get                  show the options that can be set\n"            \
+  "set OPT[,OPT...]     set attr_timeout, entry_timeout, negative_timeout,\n" \
+  "                     metadata_cache, metadata_flush, slow_threads\n" \
+  "                     and stats/nostats\n"                            \
+  "flush                write all pending fake metadata\n"              \
+  "drop_caches          empty the fake metadata and name caches\n"      \
+  "stats                dump the stats\n"                              \
+  "memory               show the memory used by inodes and caches\n"
+
+/* Checks new against the current options before anything is changed,
+ * so that a failing set changes nothing */
+static const char *
+control_check_options (GRootFSControlTarget *target,
+                       const GRootFSOptions *new)
+{
+  const GRootFSOptions *old = &target->fss[0]->options;
+
+  if (new->n_threads != old->n_threads ||
+      new->kernel_cache != old->kernel_cache ||
+      new->splice != old->splice ||
+      new->max_write != old->max_write ||
+      new->max_read != old->max_read ||
+      new->max_readahead != old->max_readahead ||
+      new->async_read != old->async_read ||
+      new->passthrough != old->passthrough ||
+      new->readdirplus != old->readdirplus ||
+      new->uring != old->uring ||
+      new->frozen != old->frozen ||
+      new->max_memory != old->max_memory ||
+      new->metadata_store != old->metadata_store ||
+      new->shared_daemon != old->shared_daemon ||
+      new->stats_file != old->stats_file ||
+      new->control_path != old->control_path ||
+      new->trace_path != old->trace_path)
+    return "only the options shown by get can be changed at runtime";
+
+  if (new->cache_size != old->cache_size)
+    {
+      if (new->cache_size == 0)
+        return "the metadata cache can't be disabled at runtime, use drop_caches";
+
+      for (int i = 0; i < target->n_fss; i++)
+        if (target->fss[i]->cache == NULL)
+          return "the metadata cache is disabled";
+
+      if (!grootfs_cache_size_valid (new->cache_size))
+        return "metadata_cache is too small";
+    }
+
+  if (new->slow_threads != old->slow_threads)
+    {
+      if (target->fss[0]->slow_pool == NULL)
+        return "slow requests are not handed off, slow_threads must be set at startup";
+      if (new->slow_threads == 0)
+        return "slow_threads can't be set to 0 at runtime";
+    }
+
+  return NULL;
+}
+
+static const char *
+control_set (GRootFSControlTarget *target,
+             const char *opts)
+{
+  GRootFSOptions new = target->fss[0]->options;
+  const GRootFSOptions *old = &target->fss[0]->options;
+  const char *error;
+
+  /* This reports why it failed on the daemon's stderr */
+  if (grootfs_parse_options (opts, &new) != 0)
+    return "invalid options";
+  clamp_cache_size (&new);
+
+  error = control_check_options (target, &new);
+  if (error)
+    return error;
+
+  /* Can't fail, the size was checked above */
+  if (new.cache_size != old->cache_size)
+    {
+      for (int i = 0; i < target->n_fss; i++)
+        if (!target->fss[i]->cache_shared)
+          {
+            grootfs_cache_resize (target->fss[i]->cache, new.cache_size);
+            memory_uncharge (old->cache_size);
+            memory_charge (new.cache_size);
+          }
+    }
+
+  if (new.slow_threads != old->slow_threads &&
+      grootfs_pool_set_threads (target->fss[0]->slow_pool, new.slow_threads) != 0)
+    return "can't start the slow request threads";
+
+  if (new.stats != old->stats)
+    {
+      if (!new.stats)
+        grootfs_stats_disable ();
+      else if (!grootfs_stats_enabled)
+        grootfs_stats_enable ();
+    }
+
+  for (int i = 0; i < target->n_fss; i++)
+    {
+      GRootFS *fs = target->fss[i];
+
+      fs->options.attr_timeout = new.attr_timeout;
+      fs->options.entry_timeout = new.entry_timeout;
+      fs->options.negative_timeout = new.negative_timeout;
+      fs->options.cache_size = new.cache_size;
+      fs->options.slow_threads = new.slow_threads;
+      fs->options.stats = new.stats;
+
+      /* The flush thread picks up the new interval when woken */
+      pthread_mutex_lock (&fs->flush_lock);
+      fs->options.metadata_flush = new.metadata_flush;
+      pthread_cond_signal (&fs->flush_cond);
+      pthread_mutex_unlock (&fs->flush_lock);
+      if (new.metadata_flush > 0)
+        start_flush_thread (fs);
+    }
+
+  return NULL;
+}
+
+static const char *
+control_flush (GRootFSControlTarget *target)
+{
+  const char *error = NULL;
+
+  for (int i = 0; i < target->n_fss; i++)
+    {
+      GRootFS *fs = target->fss[i];
+
+      pthread_mutex_lock (&fs->flush_lock);
+      flush_dirty_inodes (fs);
+      pthread_mutex_unlock (&fs->flush_lock);
+
+      if (fs->store != NULL && grootfs_store_sync (fs->store) != 0)
+        error = "can't sync " GROOTFS_STORE_FILE;
+    }
 
-  return 0;
+  return error;
 }
 
-static int
-grootfs_setxattr (const char *path, const char *name, const char *value,
-                   size_t size, int flags)
+static const char *
+grootfs_control (const char *command,
+                 FILE *out,
+                 void *user_data)
 {
-  __debug__ (("setxattr %s %s", path, name));
+  GRootFSControlTarget *target = user_data;
+  const GRootFSOptions *options = &target->fss[0]->options;
 
-  autofree char *basename = NULL;
-  autofd int dirfd = open_parent_dirfd (path, &basename);
-  if (dirfd < 0)
-    return dirfd;
+  if (strcmp (command, "help") == 0)
+    fputs (GROOTFS_CONTROL_HELP, out);
+  else if (strcmp (command, "get") == 0)
+    {
+      fprintf (out, "attr_timeout=%g\n", options->attr_timeout);
+      fprintf (out, "entry_timeout=%g\n", options->entry_timeout);
+      fprintf (out, "negative_timeout=%g\n", options->negative_timeout);
+      fprintf (out, "metadata_cache=%zu\n", options->cache_size);
+      fprintf (out, "metadata_flush=%g\n", options->metadata_flush);
+      fprintf (out, "slow_threads=%d\n", target->fss[0]->slow_pool ? options->slow_threads : 0);
+      fprintf (out, "%s\n", grootfs_stats_enabled ? "stats" : "nostats");
+    }
+  else if (strncmp (command, "set ", 4) == 0)
+    return control_set (target, command + 4);
+  else if (strcmp (command, "flush") == 0)
+    return control_flush (target);
+  else if (strcmp (command, "drop_caches") == 0)
+    {
+      for (int i = 0; i < target->n_fss; i++)
+        {
+          if (target->fss[i]->cache != NULL && !target->fss[i]->cache_shared)
+            grootfs_cache_clear (target->fss[i]->cache);
+          grootfs_dentry_clear (target->fss[i]);
+        }
+    }
+  else if (strcmp (command, "memory") == 0)
+    {
+      size_t n_inodes = 0;
 
-  autofree char *proc_file = get_proc_fd_path (dirfd, basename);
-  autofree char *fake_name = xasprintf (GROOT_CUSTOM_XATTR_PREFIX"%s", name);
+      for (int i = 0; i < target->n_fss; i++)
+        {
+          pthread_mutex_lock (&target->fss[i]->inodes_lock);
+          n_inodes += target->fss[i]->n_inodes;
+          pthread_mutex_unlock (&target->fss[i]->inodes_lock);
+        }
 
-  if (lsetxattr (proc_file, fake_name, value, size, flags) != 0)
-    return -errno;
+      fprintf (out, "used=%zu\n", atomic_load_explicit (&memory_used, memory_order_relaxed));
+      fprintf (out, "max_memory=%zu\n", options->max_memory);
+      fprintf (out, "inodes=%zu\n", n_inodes);
+    }
+  else if (strcmp (command, "stats") == 0)
+    {
+      if (!grootfs_stats_enabled)
+        return "stats are not enabled, use set stats";
+      grootfs_stats_dump (out);
+    }
+  else
+    return "unknown command, try help";
 
-  return 0;
+  return NULL;
 }
 
-static int
-grootfs_getxattr (const char *path, const char *name, char *value,
-                   size_t size)
+/* Started once the slow pool exists, and stopped before it's freed */
+static GRootFSControlTarget *
+start_control (GRootFS **fss,
+               int n_fss)
 {
-  __debug__ (("getxattr %s %s", path, name));
+  GRootFSControlTarget *target;
 
-  autofree char *basename = NULL;
-  autofd int dirfd = open_parent_dirfd (path, &basename);
-  ssize_t res;
-  if (dirfd < 0)
-    return dirfd;
+  if (fss[0]->options.control_path == NULL)
+    return NULL;
 
-  autofree char *proc_file = get_proc_fd_path (dirfd, basename);
-  autofree char *fake_name = xasprintf (GROOT_CUSTOM_XATTR_PREFIX"%s", name);
+  target = xmalloc (sizeof (GRootFSControlTarget));
+  target->fss = xmalloc (n_fss * sizeof (GRootFS *));
+  memcpy (target->fss, fss, n_fss * sizeof (GRootFS *));
+  target->n_fss = n_fss;
+  target->control = grootfs_control_start (fss[0]->options.control_path, grootfs_control, target);
+  if (target->control == NULL)
+    {
+      free (target->fss);
+      free (target);
+      return NULL;
+    }
 
-  res = lgetxattr (proc_file, fake_name, value, size);
-  if (res == -1)
-    return -errno;
+  return target;
+}
 
-  return res;
+static void
+stop_control (GRootFSControlTarget *target)
+{
+  if (target == NULL)
+    return;
+
+  grootfs_control_stop (target->control);
+  free (target->fss);
+  free (target);
 }
 
-/*
- * List the supported extended attributes.
- */
+/* Like fuse_session_loop(), but with n_threads threads each reading
+ * requests from the channel and processing them in parallel. */
 static int
-grootfs_listxattr (const char *path, char *list, size_t size)
+grootfs_session_loop (struct fuse_session *se,
+                      struct fuse_chan *ch,
+                      GRootFS *fs,
+                      int n_threads)
 {
-  __debug__ (("listxattr %s", path));
+  GRootFSLoop loop = { se, ch, fs };
+  autofree pthread_t *threads = xcalloc (n_threads * sizeof (pthread_t));
+  GRootFSControlTarget *control;
+  int n_started = 0;
 
-  autofree char *basename = NULL;
-  autofd int dirfd = open_parent_dirfd (path, &basename);
-  if (dirfd < 0)
-    return dirfd;
+  if (sem_init (&loop.finished, 0, 0) != 0)
+    return -1;
 
-  autofree char *proc_file = get_proc_fd_path (dirfd, basename);
-  char buf_data[4096];
-  autofree char *buf_free = NULL;
-  char *buf = buf_data;
-  size_t buf_size = sizeof(buf_data);
-  char *real_list, *real_list_end;
-  ssize_t res;
-  size_t fake_size;
+  if (fs->options.slow_threads > 0)
+    fs->slow_pool = grootfs_pool_new (fs->options.slow_threads, GROOTFS_SLOW_MAX_QUEUED);
+  control = start_control (&fs, 1);
 
-  while (1)
+  for (int i = 0; i < n_threads; i++)
     {
-      res = llistxattr (proc_file, buf, buf_size);
-      if (res < 0)
+      int res = pthread_create (&threads[i], NULL, grootfs_worker, &loop);
+      if (res != 0)
         {
-          int errsv = errno;
-
-          if (errsv == ERANGE)
-            {
-              if (buf_free)
-                free (buf_free);
-              buf_size *= 2;
-              buf_free = xmalloc (buf_size);
-              buf = buf_free;
-              continue;
-            }
-
-          return -errsv;
+          report ("Failed to create fuse worker thread: %s", strerror (res));
+          break;
         }
-
-      break;
+      n_started++;
     }
 
-  fake_size = 0;
-  real_list = buf;
-  real_list_end = real_list + res;
-
-  while (real_list < real_list_end)
+  if (n_started == 0)
+    loop.error = TRUE;
+  else
     {
-      const char *name = real_list;
-      real_list = real_list + strlen (name) + 1;
-
-      if (has_prefix (name, GROOT_CUSTOM_XATTR_PREFIX))
-        {
-          name = name + strlen (GROOT_CUSTOM_XATTR_PREFIX);
-          fake_size += strlen (name) + 1;
-        }
+      /* We get woken by any worker exiting, or by a signal handler
+       * interrupting the wait. */
+      while (!fuse_session_exited (se))
+        sem_wait (&loop.finished);
     }
 
-  if (size == 0)
-    return fake_size;
+  for (int i = 0; i < n_started; i++)
+    pthread_cancel (threads[i]);
 
-  if (size < fake_size)
-    return -ERANGE;
+  for (int i = 0; i < n_started; i++)
+    pthread_join (threads[i], NULL);
 
-  real_list = buf;
-  while (real_list < real_list_end)
-    {
-      const char *name = real_list;
-      real_list = real_list + strlen (name) + 1;
+  stop_control (control);
 
-      if (has_prefix (name, GROOT_CUSTOM_XATTR_PREFIX))
-        {
-          name = name + strlen (GROOT_CUSTOM_XATTR_PREFIX);
-          memcpy (list, name, strlen (name) + 1);
-          list += strlen (name) + 1;
-        }
+  if (fs->slow_pool)
+    {
+      grootfs_pool_free (fs->slow_pool);
+      fs->slow_pool = NULL;
     }
 
-  return fake_size;
-}
-
-/*
- * Remove an extended attribute.
- */
-static int
-grootfs_removexattr (const char *path, const char *name)
-{
-  __debug__ (("removexattr %s %s", path, name));
+  sem_destroy (&loop.finished);
+  fuse_session_reset (se);
 
-  autofree char *basename = NULL;
-  autofd int dirfd = open_parent_dirfd (path, &basename);
-  if (dirfd < 0)
-    return dirfd;
+  return loop.error ? -1 : 0;
+}
 
-  autofree char *proc_file = get_proc_fd_path (dirfd, basename);
-  autofree char *fake_name = xasprintf (GROOT_CUSTOM_XATTR_PREFIX"%s", name);
+typedef struct {
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  GRootFS *fs;
+  const char *mountpoint;
+  bool finished;       /* Protected by the loop lock */
+} GRootFSMount;
 
-  if (lremovexattr (proc_file, fake_name) != 0)
-    return -errno;
+typedef struct {
+  GRootFSMount *mounts;
+  int n_mounts;
+  int n_active;        /* Protected by lock */
+  int epfd;
+  size_t bufsize;
+  pthread_mutex_t lock;
+  sem_t finished;
+  int error;
+} GRootFSMultiLoop;
+
+static bool
+grootfs_multi_loop_done (GRootFSMultiLoop *loop)
+{
+  bool done;
 
-  return 0;
-}
+  pthread_mutex_lock (&loop->lock);
+  done = loop->error || loop->n_active == 0;
+  pthread_mutex_unlock (&loop->lock);
 
-static void *
-grootfs_init (struct fuse_conn_info *conn)
-{
-  struct fuse_context *ctx = fuse_get_context ();
-  GRootFS *fs = ctx->private_data;
+  if (!done)
+    {
+      /* All sessions are exited at once by the signal handler */
+      done = TRUE;
+      for (int i = 0; i < loop->n_mounts; i++)
+        if (!fuse_session_exited (loop->mounts[i].se))
+          done = FALSE;
+    }
 
-  return fs;
+  return done;
 }
 
 static void
-grootfs_destroy (void *private_data)
+grootfs_multi_loop_finish_mount (GRootFSMultiLoop *loop,
+                                 GRootFSMount *mount,
+                                 int error)
 {
-  GRootFS *fs = private_data;
+  pthread_mutex_lock (&loop->lock);
 
-  close (fs->basefd);
-  free (fs);
-}
+  if (!mount->finished)
+    {
+      mount->finished = TRUE;
+      epoll_ctl (loop->epfd, EPOLL_CTL_DEL, fuse_chan_fd (mount->ch), NULL);
+      loop->n_active--;
+      __debug__ (("grootfs for %s finished", mount->mountpoint));
+    }
+  if (error)
+    loop->error = TRUE;
 
-struct fuse_operations grootfs_oper = {
-  .init = grootfs_init,
-  .destroy = grootfs_destroy,
-  .getattr = grootfs_getattr,
-  .fgetattr = grootfs_fgetattr,
-  .readlink = grootfs_readlink,
-  .readdir = grootfs_readdir,
-  .mknod = grootfs_mknod,
-  .mkdir = grootfs_mkdir,
-  .symlink = grootfs_symlink,
-  .unlink = grootfs_unlink,
-  .rmdir = grootfs_rmdir,
-  .rename = grootfs_rename,
-  .link = grootfs_link,
-  .chmod = grootfs_chmod,
-  .chown = grootfs_chown,
-  .truncate = grootfs_truncate,
-  .ftruncate = grootfs_ftruncate,
-  .utimens = grootfs_utimens,
-  .create = grootfs_create,
-  .open = grootfs_open,
-  .read = grootfs_read,
-  .write = grootfs_write,
-  .statfs = grootfs_statfs,
-  .release = grootfs_release,
-  .fsync = grootfs_fsync,
-  .access = grootfs_access,
-  .setxattr = grootfs_setxattr,
-  .getxattr = grootfs_getxattr,
-  .listxattr = grootfs_listxattr,
-  .removexattr = grootfs_removexattr,
-};
+  if (loop->error || loop->n_active == 0)
+    sem_post (&loop->finished);
 
-static GRootFS *
-new_grootfs (int basefd,
-             long max_uid,
-             long max_gid)
-{
-  GRootFS *fs = xmalloc (sizeof (GRootFS));
-  fs->basefd = basefd;
-  fs->max_uid = max_uid;
-  fs->max_gid = max_gid;
-  return fs;
+  pthread_mutex_unlock (&loop->lock);
 }
 
-int
-start_grootfs (int argc,
-               char *argv[],
-               int dirfd)
+/* The channels are only ever in the epoll set with EPOLLONESHOT, so
+ * one worker at a time reads from each, and re-arms it as soon as it
+ * has a request so another worker can pick up the next one. */
+static int
+grootfs_multi_loop_arm (GRootFSMultiLoop *loop,
+                        GRootFSMount *mount,
+                        int op)
 {
-  GRootFS *fs = new_grootfs (dirfd, LONG_MAX, LONG_MAX);
+  struct epoll_event ev = {
+    .events = EPOLLIN | EPOLLONESHOT,
+    .data.ptr = mount,
+  };
 
-  return fuse_main (argc, argv, &grootfs_oper, fs);
+  return epoll_ctl (loop->epfd, op, fuse_chan_fd (mount->ch), &ev);
 }
 
-static int
-dev_fuse_chan_receive (struct fuse_chan **chp,
-                       char *buf,
-                       size_t size)
+static void *
+grootfs_multi_worker (void *data)
 {
-  struct fuse_chan *ch = *chp;
-  struct fuse_session *se = fuse_chan_session (ch);
-  ssize_t res;
-  int err;
+  GRootFSMultiLoop *loop = data;
+  char *buf;
 
- restart:
-  res = read (fuse_chan_fd (ch), buf, size);
-  err = errno;
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
 
-  if (fuse_session_exited (se))
-    return 0;
+  buf = xmalloc (loop->bufsize);
+  pthread_cleanup_push (free, buf);
 
-  if (res == -1)
+  while (TRUE)
     {
-      /* ENOENT means the operation was interrupted, it's safe to restart */
-      if (err == ENOENT)
-        goto restart;
+      struct epoll_event ev;
+      GRootFSMount *mount;
+      struct fuse_chan *ch;
+      struct fuse_buf fbuf = {
+        .mem = buf,
+        .size = loop->bufsize,
+      };
+      int res;
 
-      if (err == ENODEV) /* Happens on unmount */
+      pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+      res = epoll_wait (loop->epfd, &ev, 1, -1);
+      pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+      if (res == -1 && errno != EINTR)
         {
-          fuse_session_exit (se);
-          return 0;
+          report ("epoll_wait failed: %s", strerror (errno));
+          pthread_mutex_lock (&loop->lock);
+          loop->error = TRUE;
+          pthread_mutex_unlock (&loop->lock);
+          sem_post (&loop->finished);
+          break;
         }
-      if (err != EINTR && err != EAGAIN)
-        report ("reading fuse device");
-      return -err;
+
+      if (res <= 0)
+        {
+          if (grootfs_multi_loop_done (loop))
+            {
+              sem_post (&loop->finished);
+              break;
+            }
+          continue;
+        }
+
+      mount = ev.data.ptr;
+      ch = mount->ch;
+      res = fuse_session_receive_buf (mount->se, &fbuf, &ch);
+
+      if (fuse_session_exited (mount->se) || (res < 0 && res != -EINTR &&
+                                              res != -ENOENT && res != -EAGAIN))
+        {
+          grootfs_multi_loop_finish_mount (loop, mount, res < 0);
+          continue;
+        }
+
+      if (grootfs_multi_loop_arm (loop, mount, EPOLL_CTL_MOD) != 0)
+        {
+          report ("Failed to re-arm fuse channel: %s", strerror (errno));
+          grootfs_multi_loop_finish_mount (loop, mount, TRUE);
+        }
+
+      if (res > 0)
+        grootfs_process_buf (mount->fs, mount->se, ch, &fbuf);
     }
 
-  return res;
+  pthread_cleanup_pop (1);
+
+  return NULL;
 }
 
+/* Serve all the sessions from one pool of n_threads threads, waiting
+ * for requests on all the channels with epoll. */
 static int
-dev_fuse_chan_send (struct fuse_chan *ch,
-                    const struct iovec iov[],
-                    size_t count)
+grootfs_multi_session_loop (GRootFSMount *mounts,
+                            int n_mounts,
+                            int n_threads)
 {
-  if (iov)
+  GRootFSMultiLoop loop = { mounts, n_mounts, n_mounts };
+  autofree pthread_t *threads = xcalloc (n_threads * sizeof (pthread_t));
+  GRootPool *slow_pool = NULL;
+  autofree GRootFS **fss = xmalloc (n_mounts * sizeof (GRootFS *));
+  GRootFSControlTarget *control;
+  autofd int epfd = -1;
+  int n_started = 0;
+
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd == -1)
     {
-      ssize_t res = writev (fuse_chan_fd (ch), iov, count);
-      int err = errno;
+      report ("Failed to create epoll fd: %s", strerror (errno));
+      return -1;
+    }
+  loop.epfd = epfd;
 
-      if (res == -1)
+  for (int i = 0; i < n_mounts; i++)
+    {
+      int fd = fuse_chan_fd (mounts[i].ch);
+      size_t bufsize = fuse_chan_bufsize (mounts[i].ch);
+
+      if (bufsize > loop.bufsize)
+        loop.bufsize = bufsize;
+
+      /* Another worker may get to a request first */
+      if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) != 0 ||
+          grootfs_multi_loop_arm (&loop, &mounts[i], EPOLL_CTL_ADD) != 0)
         {
-          struct fuse_session *se = fuse_chan_session(ch);
-          if (!fuse_session_exited(se) && err != ENOENT)
-            report ("writing fuse device");
-          return -err;
+          report ("Failed to watch fuse channel: %s", strerror (errno));
+          return -1;
         }
     }
 
-  return 0;
-}
+  if (sem_init (&loop.finished, 0, 0) != 0)
+    return -1;
+  pthread_mutex_init (&loop.lock, NULL);
 
-static void
-dev_fuse_chan_destroy (struct fuse_chan *ch)
-{
-  int fd = fuse_chan_fd (ch);
+  /* One pool for all the mounts, which share their options */
+  if (mounts[0].fs->options.slow_threads > 0)
+    slow_pool = grootfs_pool_new (mounts[0].fs->options.slow_threads, GROOTFS_SLOW_MAX_QUEUED);
+  for (int i = 0; i < n_mounts; i++)
+    {
+      mounts[i].fs->slow_pool = slow_pool;
+      fss[i] = mounts[i].fs;
+    }
+  control = start_control (fss, n_mounts);
 
-  if (fd != -1)
-    close (fd);
-}
+  for (int i = 0; i < n_threads; i++)
+    {
+      int res = pthread_create (&threads[i], NULL, grootfs_multi_worker, &loop);
+      if (res != 0)
+        {
+          report ("Failed to create fuse worker thread: %s", strerror (res));
+          break;
+        }
+      n_started++;
+    }
 
-#define MIN_BUFSIZE 0x21000
+  if (n_started == 0)
+    loop.error = TRUE;
+  else
+    {
+      /* We get woken by the last session finishing, an error, or by a
+       * signal handler interrupting the wait. */
+      while (!grootfs_multi_loop_done (&loop))
+        sem_wait (&loop.finished);
+    }
 
-struct fuse_chan *
-dev_fuse_chan_new (int fd)
-{
-  struct fuse_chan_ops op = {
-    .receive = dev_fuse_chan_receive,
-    .send = dev_fuse_chan_send,
-    .destroy = dev_fuse_chan_destroy,
-  };
+  for (int i = 0; i < n_started; i++)
+    pthread_cancel (threads[i]);
 
-  size_t bufsize = getpagesize() + 0x1000;
-  bufsize = bufsize < MIN_BUFSIZE ? MIN_BUFSIZE : bufsize;
-  return fuse_chan_new (&op, fd, bufsize, NULL);
-}
+  for (int i = 0; i < n_started; i++)
+    pthread_join (threads[i], NULL);
 
+  stop_control (control);
 
-static struct fuse_session *fuse_instance;
+  if (slow_pool)
+    {
+      grootfs_pool_free (slow_pool);
+      for (int i = 0; i < n_mounts; i++)
+        mounts[i].fs->slow_pool = NULL;
+    }
+
+  pthread_mutex_destroy (&loop.lock);
+  sem_destroy (&loop.finished);
+
+  for (int i = 0; i < n_mounts; i++)
+    fuse_session_reset (mounts[i].se);
+
+  return loop.error ? -1 : 0;
+}
+
+static struct fuse_session **fuse_instances;
+static int n_fuse_instances;
 
 static void
 exit_handler (int sig)
@@ -1251,8 +5044,8 @@ exit_handler (int sig)
   __debug__ (("grootfs got signal %d", sig));
 
   (void) sig;
-  if (fuse_instance)
-    fuse_session_exit (fuse_instance);
+  for (int i = 0; i < n_fuse_instances; i++)
+    fuse_session_exit (fuse_instances[i]);
 }
 
 static void
@@ -1276,14 +5069,17 @@ set_one_signal_handler (int sig,
     die("cannot set signal handler");
 }
 
+/* sessions must stay valid until the process exits */
 static void
-set_signal_handlers (struct fuse_session *se)
+set_signal_handlers (struct fuse_session **sessions,
+                     int n_sessions)
 {
+  fuse_instances = sessions;
+  n_fuse_instances = n_sessions;
   set_one_signal_handler (SIGHUP, exit_handler, 0);
   set_one_signal_handler (SIGINT, exit_handler, 0);
   set_one_signal_handler (SIGTERM, exit_handler, 0);
   set_one_signal_handler (SIGPIPE, SIG_IGN, 0);
-  fuse_instance = se;
 }
 
 int
@@ -1291,10 +5087,30 @@ start_grootfs_lowlevel (int dirfd,
                         int dev_fuse,
                         const char *mountpoint,
                         long max_uid,
-                        long max_gid)
+                        long max_gid,
+                        const GRootFSOptions *options)
+{
+  return start_grootfs_lowlevel_multi (1, &dirfd, &dev_fuse, &mountpoint,
+                                       max_uid, max_gid, options, -1);
+}
+
+/* If fds_socket is not -1, dev_fuse_fds is ignored and the fds are
+ * instead received from fds_socket (see send_fds()) once the
+ * filesystems are set up. That way the setup can happen while the
+ * caller is mounting them. */
+int
+start_grootfs_lowlevel_multi (int n_mounts,
+                              const int *dirfds,
+                              const int *dev_fuse_fds,
+                              const char **mountpoints,
+                              long max_uid,
+                              long max_gid,
+                              const GRootFSOptions *options,
+                              int fds_socket)
 {
-  const char *argv[] = { mountpoint };
-  struct fuse_args args = FUSE_ARGS_INIT(N_ELEMENTS (argv), (char **)argv);
+  GRootFSMount *mounts;
+  struct fuse_session **sessions;
+  int *received_fds = NULL;
   int status_pipes[2];
   char pipe_buf = 'x';
   pid_t pid;
@@ -1318,8 +5134,12 @@ start_grootfs_lowlevel (int dirfd,
       ssize_t s;
 
       close (status_pipes[1]); /* Close write side */
-      close (dirfd); /* Not needed on this side */
-      close (dev_fuse); /* Not needed on this side */
+      for (int i = 0; i < n_mounts; i++)
+        {
+          close (dirfds[i]); /* Not needed on this side */
+          if (fds_socket == -1)
+            close (dev_fuse_fds[i]); /* Not needed on this side */
+        }
 
       /* Wait for child process and report status */
 
@@ -1347,27 +5167,89 @@ start_grootfs_lowlevel (int dirfd,
 
   close (status_pipes[0]); /* Close read side */
 
-  struct fuse_chan *ch = dev_fuse_chan_new (dev_fuse);
-  if (ch == NULL)
-    die ("Unable to create fuse channel");
+  mounts = xcalloc (n_mounts * sizeof (GRootFSMount));
+  sessions = xcalloc (n_mounts * sizeof (struct fuse_session *));
+  for (int i = 0; i < n_mounts; i++)
+    {
+      GRootFSCache *shared_cache = NULL;
+      struct stat st;
 
-  GRootFS *fs = new_grootfs (dirfd, max_uid, max_gid);
-  struct fuse *fuse = fuse_new (ch, &args, &grootfs_oper, sizeof (grootfs_oper), fs);
+      /* The cache is keyed on (dev, ino), so mounts of the same
+       * backing filesystem can share one */
+      if (fstat (dirfds[i], &st) == 0)
+        {
+          for (int j = 0; j < i; j++)
+            if (mounts[j].fs->root.dev == st.st_dev && !mounts[j].fs->cache_shared)
+              shared_cache = mounts[j].fs->cache;
+        }
+
+      mounts[i].mountpoint = mountpoints[i];
+      mounts[i].fs = new_grootfs (dirfds[i], max_uid, max_gid, options, shared_cache);
+    }
+
+  if (fds_socket != -1)
+    {
+      received_fds = xmalloc (n_mounts * sizeof (int));
+      if (recv_fds (fds_socket, received_fds, n_mounts) != 0)
+        die_with_error ("no /dev/fuse fds received");
+      dev_fuse_fds = received_fds;
+    }
+
+  for (int i = 0; i < n_mounts; i++)
+    {
+      GRootFSMount *mount = &mounts[i];
+      const char *argv[] = { mountpoints[i] };
+      struct fuse_args args = FUSE_ARGS_INIT(N_ELEMENTS (argv), (char **)argv);
+
+      mount->ch = dev_fuse_chan_new (dev_fuse_fds[i], options);
+      if (mount->ch == NULL)
+        die ("Unable to create fuse channel");
+
+      mount->fs->chan = fuse_chan_data (mount->ch);
+      mount->fs->notify_ch = mount->ch;
+      mount->se = fuse_lowlevel_new (&args, grootfs_get_oper (options), sizeof (grootfs_oper), mount->fs);
+      if (mount->se == NULL)
+        die ("Unable to create fuse session");
+
+      fuse_session_add_chan (mount->se, mount->ch);
+      sessions[i] = mount->se;
+    }
+  free (received_fds);
 
-  set_signal_handlers (fuse_get_session (fuse));
+  set_signal_handlers (sessions, n_mounts);
+
+  if (grootfs_stats_enabled)
+    grootfs_stats_start_dumper (options->stats_file);
+  if (options->trace_path)
+    grootfs_trace_start (options->trace_path);
 
   if (write (status_pipes[1], &pipe_buf, 1) < 0)
     report ("Failed write to status pipe");
 
-  res = fuse_loop (fuse);
+  if (n_mounts == 1)
+    res = grootfs_session_loop (mounts[0].se, mounts[0].ch, mounts[0].fs, options->n_threads);
+  else
+    {
+      int n_threads = options->n_threads * n_mounts;
+      if (n_threads > GROOTFS_MAX_THREADS)
+        n_threads = GROOTFS_MAX_THREADS;
+      res = grootfs_multi_session_loop (mounts, n_mounts, n_threads);
+    }
+
+  grootfs_trace_stop ();
+  if (options->stats_file)
+    grootfs_stats_dump_file (options->stats_file);
 
   /* Unmount even on failure */
-  fuse_unmount (mountpoint, ch);
+  for (int i = 0; i < n_mounts; i++)
+    fuse_unmount (mounts[i].mountpoint, mounts[i].ch);
 
   if (res == -1)
     die ("Error handling fuse requests");
 
-  fuse_destroy (fuse);
+  /* Destroy the mounts sharing a cache before its owner */
+  for (int i = n_mounts - 1; i >= 0; i--)
+    fuse_session_destroy (mounts[i].se);
 
   __debug__ (("exiting grootfs"));
 
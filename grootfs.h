@@ -19,11 +19,124 @@
  * Boston, MA 02111-1307, USA.
  */
 
-int start_grootfs          (int         argc,
-                            char       *argv[],
-                            int         dirfd);
-int start_grootfs_lowlevel (int         dirfd,
-                            int         dev_fuse,
-                            const char *mountpoint,
-                            long        max_uid,
-                            long        max_gid);
+typedef enum {
+  GROOTFS_STORE_NONE,     /* Symlink data in .groot.symlink.* files */
+  GROOTFS_STORE_SYMLINKS, /* Symlink data in the metadata store */
+  GROOTFS_STORE_ALL,      /* All data in the metadata store */
+} GRootFSStoreMode;
+
+typedef struct {
+  int n_threads;           /* Number of threads serving fuse requests, per mount */
+  int slow_threads;        /* Threads for slow requests, 0 to run them in the above */
+  size_t cache_size;       /* Max bytes used for caching fake metadata, 0 disables */
+  size_t max_memory;       /* Max bytes used by inodes and caches, 0 for no limit */
+  double attr_timeout;     /* Seconds the kernel may cache attributes */
+  double entry_timeout;    /* Seconds the kernel may cache name lookups */
+  double negative_timeout; /* Seconds the kernel may cache failed lookups */
+  int kernel_cache;        /* Keep the page cache of files between opens */
+  int splice;              /* Move file data with splice() when possible */
+  size_t max_write;        /* Largest write request, 0 for the fuse default */
+  size_t max_read;         /* Largest read request, 0 for no limit */
+  size_t max_readahead;    /* Kernel readahead, 0 for the kernel default */
+  int async_read;          /* Allow multiple reads of a file in flight */
+  int passthrough;         /* Let the kernel do file I/O on the backing files */
+  int readdirplus;         /* Return the attributes of entries with readdir */
+  int uring;               /* Batch metadata syscalls with io_uring */
+  int frozen;              /* Read-only, with all fake data read at startup */
+  GRootFSStoreMode metadata_store; /* What fake data to keep in .groot.metadata */
+  double metadata_flush;   /* Seconds fake data changes may be unwritten, 0 for none */
+  int shared_daemon;       /* One process serves all the wrapped dirs */
+  int stats;               /* Collect stats, dumped on SIGUSR1 */
+  char *stats_file;        /* Where to dump the stats, NULL for stderr */
+  char *control_path;      /* Control socket to listen on, NULL for none */
+  char *trace_path;        /* Where to write a trace of the ops, NULL for none */
+} GRootFSOptions;
+
+#define GROOTFS_DEFAULT_CACHE_SIZE (16 * 1024 * 1024)
+#define GROOTFS_DEFAULT_MAX_WRITE (1024 * 1024)
+
+/* The timeouts default to the same as the fuse high-level api */
+#define GROOTFS_OPTIONS_INIT {                  \
+    .n_threads = 1,                             \
+    .slow_threads = 2,                          \
+    .cache_size = GROOTFS_DEFAULT_CACHE_SIZE,   \
+    .max_memory = 0,                            \
+    .attr_timeout = 1.0,                        \
+    .entry_timeout = 1.0,                       \
+    .negative_timeout = 0.0,                    \
+    .kernel_cache = 0,                          \
+    .splice = 1,                                \
+    .max_write = GROOTFS_DEFAULT_MAX_WRITE,     \
+    .max_read = 0,                              \
+    .max_readahead = 0,                         \
+    .async_read = 1,                            \
+    .passthrough = 0,                           \
+    .readdirplus = 1,                           \
+    .uring = 0,                                 \
+    .frozen = 0,                                \
+    .metadata_store = GROOTFS_STORE_SYMLINKS,   \
+    .metadata_flush = 1.0,                      \
+    .shared_daemon = 1,                         \
+    .stats = 0,                                 \
+    .stats_file = NULL,                         \
+    .control_path = NULL,                       \
+    .trace_path = NULL,                         \
+  }
+
+int start_grootfs          (int                   argc,
+                            char                 *argv[],
+                            int                   dirfd);
+int start_grootfs_lowlevel (int                   dirfd,
+                            int                   dev_fuse,
+                            const char           *mountpoint,
+                            long                  max_uid,
+                            long                  max_gid,
+                            const GRootFSOptions *options);
+int start_grootfs_lowlevel_multi (int                   n_mounts,
+                                  const int            *dirfds,
+                                  const int            *dev_fuse_fds,
+                                  const char          **mountpoints,
+                                  long                  max_uid,
+                                  long                  max_gid,
+                                  const GRootFSOptions *options,
+                                  int                   fds_socket);
+int grootfs_parse_threads  (const char           *str,
+                            int                  *n_threads_out);
+int grootfs_parse_options  (const char           *str,
+                            GRootFSOptions       *options);
+
+#define GROOTFS_OPTIONS_HELP                                            \
+  "grootfs options (-o opt,[opt...]):\n"                                \
+  "   attr_timeout=T      cache attributes in the kernel for T seconds\n" \
+  "   entry_timeout=T     cache names in the kernel for T seconds\n"   \
+  "   negative_timeout=T  cache failed lookups in the kernel for T seconds\n" \
+  "   kernel_cache        keep file data cached in the kernel across opens\n" \
+  "   nosplice            copy file data via memory instead of splicing\n" \
+  "   max_write=SIZE      largest write request (default 1M)\n"         \
+  "   max_read=SIZE       largest read request\n"                       \
+  "   max_readahead=SIZE  limit the kernel readahead\n"                 \
+  "   sync_read           only one read of a file at a time\n"          \
+  "   passthrough         do file I/O in the kernel if possible (needs root)\n" \
+  "   noreaddirplus       don't return attributes when listing directories\n" \
+  "   slow_threads=N      threads for fsyncs, big reads and writes and\n" \
+  "                       listings (default 2, 0 to not hand them off)\n" \
+  "   uring               batch the metadata syscalls of listings and\n" \
+  "                       metadata writes with io_uring (Linux 5.19)\n" \
+  "   frozen              mount read-only, with all fake metadata read\n" \
+  "                       at startup and cached long in the kernel\n" \
+  "   metadata_cache=SIZE size of the fake metadata cache (0 disables)\n" \
+  "   max_memory=SIZE     limit the memory of the inodes and caches, by\n" \
+  "                       having the kernel forget unused names\n" \
+  "   metadata_store=WHAT keep the fake metadata of symlinks (default),\n" \
+  "                       all files or none in .groot.metadata\n" \
+  "   metadata_flush=T    write fake metadata changes within T seconds\n" \
+  "                       (default 1, 0 writes them immediately)\n" \
+  "   noshared_daemon     use a separate process for each wrapped dir\n" \
+  "   stats               collect operation stats, dumped on SIGUSR1\n" \
+  "   stats_file=PATH     dump the stats to PATH instead of stderr,\n" \
+  "                       and also on exit (implies stats)\n" \
+  "   control=PATH        listen for commands on a Unix socket at PATH,\n" \
+  "                       send help to it for a list\n" \
+  "   trace=PATH          write a binary trace of the operations to PATH,\n" \
+  "                       for groot-replay\n"
+
@@ -267,9 +267,12 @@ load_file_at (int         dirfd,
 
 }
 
+/* Send n_fds fds in a single message. There is a limit of 253 fds
+ * per message (SCM_MAX_FD) */
 int
-send_fd (int socket,
-         int fd)
+send_fds (int socket,
+          const int *fds,
+          int n_fds)
 {
   struct msghdr msg = { 0 };
   struct cmsghdr *cmsg;
@@ -278,23 +281,26 @@ send_fd (int socket,
     .iov_base = iobuf,
     .iov_len = sizeof(iobuf)
   };
-  char buf[CMSG_ALIGN(CMSG_SPACE(sizeof(int)))];
+  autofree char *buf = xcalloc (CMSG_SPACE(n_fds * sizeof(int)));
 
   msg.msg_iov = &io;
   msg.msg_iovlen = 1;
   msg.msg_control = buf;
-  msg.msg_controllen = sizeof(buf);
+  msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
   cmsg = CMSG_FIRSTHDR(&msg);
   cmsg->cmsg_level = SOL_SOCKET;
   cmsg->cmsg_type = SCM_RIGHTS;
-  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
 
   return sendmsg (socket, &msg, 0);
 }
 
+/* Receive exactly n_fds fds sent by send_fds() */
 int
-recv_fd (int socket)
+recv_fds (int socket,
+          int *fds,
+          int n_fds)
 {
   ssize_t res;
   char iobuf[1];
@@ -302,17 +308,19 @@ recv_fd (int socket)
     .iov_base = iobuf,
     .iov_len = sizeof(iobuf)
   };
-  char buf[CMSG_ALIGN(CMSG_SPACE(sizeof(int)))];
+  autofree char *buf = xcalloc (CMSG_SPACE(n_fds * sizeof(int)));
   struct msghdr msg = {
     .msg_iov = &io,
     .msg_iovlen = 1,
-    .msg_control = &buf,
-    .msg_controllen = sizeof(buf),
+    .msg_control = buf,
+    .msg_controllen = CMSG_SPACE(n_fds * sizeof(int)),
   };
   struct cmsghdr *cmsg;
-  int received_fd = -1;
+  int n_received = 0;
 
-  res = recvmsg (socket, &msg, 0);
+  do
+    res = recvmsg (socket, &msg, MSG_CMSG_CLOEXEC);
+  while (res < 0 && errno == EINTR);
   if (res < 0)
     return -1;
 
@@ -322,16 +330,114 @@ recv_fd (int socket)
     {
       if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
         {
-          memcpy (&received_fd, CMSG_DATA(cmsg), sizeof(int));
+          n_received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+          if (n_received > n_fds)
+            n_received = n_fds;
+          memcpy (fds, CMSG_DATA(cmsg), n_received * sizeof(int));
           break;
         }
     }
 
-  if (received_fd < 0)
+  if (n_received != n_fds || (msg.msg_flags & MSG_CTRUNC) != 0)
     {
+      for (int i = 0; i < n_received; i++)
+        close (fds[i]);
       errno = ENOENT;
       return -1;
     }
 
-  return received_fd;
+  return 0;
+}
+
+int
+send_fd (int socket,
+         int fd)
+{
+  return send_fds (socket, &fd, 1);
+}
+
+int
+recv_fd (int socket)
+{
+  int fd;
+
+  if (recv_fds (socket, &fd, 1) < 0)
+    return -1;
+
+  return fd;
+}
+
+struct _ArenaChunk {
+  ArenaChunk *next;
+  max_align_t data[];
+};
+
+#define ARENA_ALIGN (sizeof (max_align_t))
+
+void *
+arena_alloc (Arena *arena,
+             size_t size)
+{
+  size_t start = (arena->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  ArenaChunk *chunk;
+
+  if (start <= arena->size && size <= arena->size - start)
+    {
+      arena->used = start + size;
+      return arena->buf + start;
+    }
+
+  /* Doesn't fit, fall back to the heap */
+  chunk = xmalloc (sizeof (ArenaChunk) + size);
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+
+  return chunk->data;
+}
+
+char *
+arena_strdup (Arena *arena,
+              const char *str)
+{
+  size_t len = strlen (str) + 1;
+
+  return memcpy (arena_alloc (arena, len), str, len);
+}
+
+char *
+arena_printf (Arena *arena,
+              const char *format,
+              ...)
+{
+  va_list args;
+  char *res;
+  int len;
+
+  va_start (args, format);
+  len = vsnprintf (NULL, 0, format, args);
+  va_end (args);
+
+  if (len < 0)
+    die_oom ();
+
+  res = arena_alloc (arena, len + 1);
+
+  va_start (args, format);
+  vsnprintf (res, len + 1, format, args);
+  va_end (args);
+
+  return res;
+}
+
+void
+arena_clear (Arena *arena)
+{
+  while (arena->chunks)
+    {
+      ArenaChunk *next = arena->chunks->next;
+      free (arena->chunks);
+      arena->chunks = next;
+    }
+
+  arena->used = 0;
 }
@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -72,6 +73,37 @@ char * load_file_at   (int          dirfd,
 int    send_fd        (int          socket,
                        int          fd);
 int    recv_fd        (int          socket);
+int    send_fds       (int          socket,
+                       const int   *fds,
+                       int          n_fds);
+int    recv_fds       (int          socket,
+                       int         *fds,
+                       int          n_fds);
+
+/* A scratch allocator for short-lived allocations, such as the paths
+ * and names needed while handling a single request. Allocations come
+ * from a caller supplied (typically stack) buffer, and only when that
+ * runs out from the heap. Everything is freed at once with
+ * arena_clear(), which auto(Arena) does when going out of scope. */
+typedef struct _ArenaChunk ArenaChunk;
+
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t used;
+  ArenaChunk *chunks;
+} Arena;
+
+#define ARENA_INIT(stack_buf) { (stack_buf), sizeof (stack_buf), 0, NULL }
+
+void * arena_alloc    (Arena       *arena,
+                       size_t       size);
+char * arena_strdup   (Arena       *arena,
+                       const char  *str);
+char * arena_printf   (Arena       *arena,
+                       const char  *format,
+                       ...) __attribute__((format (printf, 2, 3)));
+void   arena_clear    (Arena       *arena);
 
 static inline int
 steal_fd (int *fdp)
@@ -151,3 +183,5 @@ cleanup_freep (void *p)
 
 #define autoptr(TypeName) _CLEANUP(_AUTOPTR_FUNC_NAME(TypeName)) _AUTOPTR_TYPENAME(TypeName)
 #define auto(TypeName) _CLEANUP(_AUTO_FUNC_NAME(TypeName)) TypeName
+
+DEFINE_AUTO_CLEANUP_CLEAR_FUNC(Arena, arena_clear);